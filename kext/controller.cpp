@@ -7,6 +7,10 @@
 #include "driver.h"
 #include "build.h"
 #include "loopctl.h"
+#include "looppool.h"
+
+#include <kern/task.h>
+#include <sys/proc.h>
 
 
 #pragma mark -
@@ -19,7 +23,13 @@ bool org_acme_LoopController::init(OSDictionary* props)
         return false;
     }
     
-    // init code
+    mPools = NULL;
+    mPoolsLock = IOLockAlloc();
+    if (!mPoolsLock) {
+        LOOP_IOLOG("Could not allocate shared pools lock\n");
+        return false;
+    }
+    
     return true;
 }
 
@@ -42,14 +52,113 @@ void org_acme_LoopController::stop(IOService* provider)
 void org_acme_LoopController::free()
 {
     LOOP_TRACE;
+    
+    // Every device holds a controller reference while it holds a pool, nothing can be left here
+    LOOP_ASSERT(!mPools);
+    if (mPoolsLock)     IOLockFree(mPoolsLock);
+    
     IOService::free();
 }
 
 
+LoopSharedPool* org_acme_LoopController::acquireSharedPool(task_t owner, UInt64 size)
+{
+    IOLockLock(mPoolsLock);
+    
+    // Pools of gone helpers have no owner, a task reusing their address never finds them
+    LoopSharedPool* pool;
+    for (pool = mPools; pool; pool = pool->next) {
+        if (pool->owner == owner) {
+            break;
+        }
+    }
+    
+    if (pool) {
+        if (pool->size != size) {
+            LOOP_IOLOG("Helper %d asked for %llu bytes pool, sharing existing %llu bytes pool\n", proc_selfpid(), size, pool->size);
+        }
+        
+        pool->users++;
+        IOLockUnlock(mPoolsLock);
+        return pool;
+    }
+    
+    pool = (LoopSharedPool*) IOMalloc(sizeof(LoopSharedPool));
+    if (pool) {
+        pool->owner = owner;
+        pool->users = 1;
+        pool->size = size;
+        pool->allocator = (LoopPool*) IOMalloc(sizeof(LoopPool));
+        pool->memory = IOBufferMemoryDescriptor::withOptions(kIOMemoryKernelUserShared | kIODirectionOutIn, size, page_size);
+        
+        if (!pool->allocator || !pool->memory) {
+            LOOP_IOLOG("Could not allocate %llu bytes shared buffer pool\n", size);
+            if (pool->allocator)    IOFree(pool->allocator, sizeof(LoopPool));
+            if (pool->memory)       pool->memory->release();
+            IOFree(pool, sizeof(LoopSharedPool));
+            pool = NULL;
+        } else {
+            loop_pool_init(pool->allocator, size, round_page(kLoopMaxBufferSize));
+            pool->next = mPools;
+            mPools = pool;
+        }
+    }
+    
+    IOLockUnlock(mPoolsLock);
+    return pool;
+}
+
+
+bool org_acme_LoopController::ownsSharedPool(LoopSharedPool* pool, task_t task)
+{
+    IOLockLock(mPoolsLock);
+    bool owns = task && (pool->owner == task);
+    IOLockUnlock(mPoolsLock);
+    
+    return owns;
+}
+
+
+void org_acme_LoopController::disownSharedPool(LoopSharedPool* pool)
+{
+    IOLockLock(mPoolsLock);
+    pool->owner = NULL;
+    IOLockUnlock(mPoolsLock);
+}
+
+
+void org_acme_LoopController::releaseSharedPool(LoopSharedPool* pool)
+{
+    IOLockLock(mPoolsLock);
+    
+    if (--pool->users) {
+        IOLockUnlock(mPoolsLock);
+        return;
+    }
+    
+    LoopSharedPool** link = &mPools;
+    while (*link != pool) {
+        link = &(*link)->next;
+    }
+    *link = pool->next;
+    
+    IOLockUnlock(mPoolsLock);
+    
+    pool->memory->release();
+    IOFree(pool->allocator, sizeof(LoopPool));
+    IOFree(pool, sizeof(LoopSharedPool));
+}
+
+
 IOReturn org_acme_LoopController::loopAttach(struct LoopAttachCtl* arg)
 {
     LOOP_TRACE;
 
+    if (arg->blocksize && !loop_block_size_valid(arg->blocksize)) {
+        LOOP_IOLOG("Invalid block size %u\n", arg->blocksize);
+        return kIOReturnBadArgument;
+    }
+
     org_acme_LoopDriver* driver = new org_acme_LoopDriver;
     IOReturn error = kIOReturnSuccess;
     
@@ -58,12 +167,20 @@ IOReturn org_acme_LoopController::loopAttach(struct LoopAttachCtl* arg)
         return kIOReturnNoMemory;
     }
     
-    if (!driver->init(arg->size, arg->readonly, arg->pid)) {
+    if (!driver->init(arg)) {
         LOOP_IOLOG("Could not initialize loop driver instance\n");
         error = kIOReturnInternalError;
         goto ERROR_OUT;
     }
     
+    // Devices of a multi-device helper bounce requests through one pool instead of each pinning its own.
+    // Pool goes by the task we are called from, pid in the request is whatever caller says it is.
+    if (arg->sharedpool && !driver->setSharedPool(this, current_task())) {
+        LOOP_IOLOG("Could not get shared buffer pool for pid %d\n", proc_selfpid());
+        error = kIOReturnNoMemory;
+        goto ERROR_OUT;
+    }
+    
     if (!driver->attach(this)) {
         LOOP_IOLOG("Could not attach new driver instance\n");
         error = kIOReturnNotAttached;
@@ -126,6 +243,11 @@ IOReturn org_acme_LoopControllerClient::sIOCTL(OSObject * target, void * referen
     
     switch (ctlcode) {
     case kLoopCTL_Attach: {
+        // LoopAttachCtl grows over time, a stale helper must not make us read past its input
+        if (arguments->structureInputSize < sizeof(struct LoopAttachCtl)) {
+            return kIOReturnBadArgument;
+        }
+        
         struct LoopAttachCtl* arg = (struct LoopAttachCtl*) arguments->structureInput;
         return controller->loopAttach(arg);
     }
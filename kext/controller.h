@@ -8,6 +8,25 @@
 
 #include <IOKit/IOService.h>
 #include <IOKit/IOUserClient.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+
+
+struct LoopPool;
+
+
+/**
+ * Request buffer pool shared by all devices one helper process serves.
+ * Devices hold a reference for their lifetime, see org_acme_LoopController::acquireSharedPool.
+ */
+struct LoopSharedPool {
+    task_t                      owner;      // Helper task that attached the devices, NULL once it is gone
+    UInt32                      users;      // Devices holding the pool, protected by controller pools lock
+    UInt64                      size;
+    IOBufferMemoryDescriptor*   memory;
+    LoopPool*                   allocator;  // Initialized once, devices allocate from it concurrently
+    LoopSharedPool*             next;
+};
 
 
 /**
@@ -38,6 +57,29 @@ public:
      * IOService destructor.
      */
     void free();
+    
+    /**
+     * Get buffer pool of a helper process, creating it on first use.
+     * @param owner     Helper task attaching the device, never taken from the caller's request.
+     * @param size      Pool size, only used when pool is created.
+     * @return          Pool with a reference taken or NULL on failure.
+     */
+    LoopSharedPool* acquireSharedPool(task_t owner, UInt64 size);
+    
+    /**
+     * Check that pool belongs to a task, pool memory is mapped into its owner only.
+     */
+    bool ownsSharedPool(LoopSharedPool* pool, task_t task);
+    
+    /**
+     * Helper owning the pool is gone. Devices holding the pool keep it until they go away, new devices never get it.
+     */
+    void disownSharedPool(LoopSharedPool* pool);
+    
+    /**
+     * Drop pool reference, pool is freed once last device using it is gone.
+     */
+    void releaseSharedPool(LoopSharedPool* pool);
 	
 
 protected:
@@ -50,6 +92,10 @@ protected:
      */
     IOReturn loopAttach(struct LoopAttachCtl* arg);
     
+private:
+    
+    IOLock*                     mPoolsLock;     // Protects shared pools list and their users counts
+    LoopSharedPool*             mPools;         // Shared pools by helper task
 };
 
 
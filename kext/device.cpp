@@ -9,6 +9,8 @@
 #include "build.h"
 #include "loopctl.h"
 
+#include <IOKit/storage/IOStorageDeviceCharacteristics.h>
+
 
 #define kLoopDeviceVendorString     "ACME, Inc."
 #define kLoopDeviceVersionString	"1.0"
@@ -33,7 +35,7 @@ IOReturn org_acme_LoopDevice::doAsyncReadWrite(IOMemoryDescriptor *buffer,
                                     IOStorageAttributes *attributes,
                                     IOStorageCompletion *completion) 
 {
-    return this->mDriver->createRequest(buffer, block, nblks, completion);
+    return this->mDriver->createRequest(buffer, block, nblks, attributes, completion);
 }
 
 
@@ -46,6 +48,16 @@ bool org_acme_LoopDevice::attach(IOService* provider)
         LOOP_IOLOG("Attach failed\n");
         return false;
     }
+    
+    // Block storage driver only sends unmaps down to devices that ask for them
+    if (!mDriver->isWriteProtected()) {
+        OSDictionary* features = OSDictionary::withCapacity(1);
+        if (features) {
+            features->setObject(kIOStorageFeatureUnmap, kOSBooleanTrue);
+            setProperty(kIOStorageFeaturesKey, features);
+            features->release();
+        }
+    }
 	
     return true;
 }
@@ -63,7 +75,7 @@ IOReturn org_acme_LoopDevice::doEjectMedia(void)
 
 IOReturn org_acme_LoopDevice::doFormatMedia(UInt64 byteCapacity) 
 {
-    if ((mDriver->getSize() * kLoopBlockSize) != byteCapacity) {
+    if ((mDriver->getSize() * mDriver->getBlockSize()) != byteCapacity) {
         LOOP_IOLOG("Invalid capacity %llu\n", byteCapacity);
         return kIOReturnBadArgument;
     }
@@ -75,7 +87,7 @@ IOReturn org_acme_LoopDevice::doFormatMedia(UInt64 byteCapacity)
 UInt32 org_acme_LoopDevice::doGetFormatCapacities(UInt64* capacities, UInt32 capacitiesMaxCount) const
 {
     if ((capacities != NULL) && (capacitiesMaxCount != 0)) {
-        capacities[0] = mDriver->getSize() * kLoopBlockSize;
+        capacities[0] = mDriver->getSize() * mDriver->getBlockSize();
         return 1;
     } else {
         return 0;
@@ -92,7 +104,23 @@ IOReturn org_acme_LoopDevice::doLockUnlockMedia(bool doLock)
 
 IOReturn org_acme_LoopDevice::doSynchronizeCache(void) 
 {
-    return kIOReturnSuccess;
+    return mDriver->synchronizeCache();
+}
+
+
+IOReturn org_acme_LoopDevice::doDiscard(UInt64 block, UInt64 nblks)
+{
+    IOBlockStorageDeviceExtent extent;
+    extent.blockStart = block;
+    extent.blockCount = nblks;
+    
+    return mDriver->unmap(&extent, 1);
+}
+
+
+IOReturn org_acme_LoopDevice::doUnmap(IOBlockStorageDeviceExtent* extents, UInt32 extentsCount, UInt32 options)
+{
+    return mDriver->unmap(extents, extentsCount);
 }
 
 
@@ -126,7 +154,7 @@ char* org_acme_LoopDevice::getAdditionalDeviceInfoString(void)
 
 IOReturn org_acme_LoopDevice::reportBlockSize(UInt64 *blockSize) 
 {
-    *blockSize = kLoopBlockSize;
+    *blockSize = mDriver->getBlockSize();
     return kIOReturnSuccess;
 }
 
@@ -190,13 +218,13 @@ IOReturn org_acme_LoopDevice::reportPollRequirements(bool* pollRequired, bool* p
 
 IOReturn org_acme_LoopDevice::getWriteCacheState(bool* enabled) 
 {
-    return kIOReturnUnsupported;
+    return mDriver->getWriteCacheState(enabled);
 }
 
 
 IOReturn org_acme_LoopDevice::setWriteCacheState(bool enabled) 
 {
-    return kIOReturnUnsupported;
+    return mDriver->setWriteCacheState(enabled);
 }
 
 
@@ -46,6 +46,10 @@ public:
     IOReturn doLockUnlockMedia(bool doLock);
     
     IOReturn doSynchronizeCache(void);
+    
+    IOReturn doDiscard(UInt64 block, UInt64 nblks);
+    
+    IOReturn doUnmap(IOBlockStorageDeviceExtent* extents, UInt32 extentsCount, UInt32 options = 0);
 
     IOReturn doEjectMedia(void);
 	
@@ -5,49 +5,149 @@
 
 #include "build.h"
 #include "driver.h"
+#include "controller.h"
 #include "device.h"
 #include "loopctl.h"
+#include "looppool.h"
+#include "looptags.h"
+#include "loopmerge.h"
+#include "loopstats.h"
 
 #include <IOKit/IOLib.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#include <libkern/OSAtomic.h>
+#include <kern/clock.h>
+#include <kern/thread.h>
 
 
 // IO request context structure
-typedef struct {
+struct LoopIO {
+    UInt32                      tag;            // Request tag, index in request context table
     IOMemoryDescriptor*         buffer;
-    IOBufferMemoryDescriptor*   data;
-    IOMemoryMap*                mapping;
+    IOBufferMemoryDescriptor*   data;           // Dedicated request buffer if pool was exhausted
+    IOMemoryMap*                mapping;        // User mapping of dedicated request buffer or caller buffer
+    UInt64                      poolOffset;     // Request buffer offset in shared pool
+    bool                        pooled;         // Request buffer comes from shared pool
+    bool                        zerocopy;       // Caller buffer is mapped into helper directly
+    bool                        prepared;       // Caller buffer was prepared by us
+    volatile UInt32             posted;         // Request reached helper, whoever clears this completes it
+    LoopIODirection             direction;
+    UInt64                      start;          // Submit time for latency statistics
     IOStorageCompletion         completion;
-} LoopIO;
+};
 
 
-static void complete(IOStorageCompletion* completion, IOReturn result, UInt64 nbytes)
+// Request held in merge window
+struct LoopMergeIO {
+    IOMemoryDescriptor*         buffer;
+    IOStorageCompletion         completion;
+    UInt64                      nbytes;
+    SInt32                      next;           // Next request merged into the same run or -1
+    IOMultiMemoryDescriptor*    merged;         // Merged buffer, set in the first request of a run
+};
+
+
+// Completion of a retired request, run without any driver lock held
+struct LoopCompletion {
+    IOStorageCompletion         completion;
+    IOReturn                    status;
+    UInt64                      nbytes;
+};
+
+
+enum {
+    kLoopCompletionBatch        = 32,           // Completions drained from ring before running them
+};
+
+
+// Flush or discard requests waiter
+struct LoopSyncWait {
+    IOLock*                     lock;
+    IOReturn                    result;         // First error
+    UInt32                      pending;        // Requests not completed yet
+};
+
+
+static UInt64 uptimeNanoseconds()
 {
-    if (completion && completion->action) {
-        completion->action(completion->target, completion->parameter, result, nbytes);
+    uint64_t abstime, ns;
+    clock_get_uptime(&abstime);
+    absolutetime_to_nanoseconds(abstime, &ns);
+    return ns;
+}
+
+
+static void setStat(OSDictionary* stats, const char* key, UInt64 value)
+{
+    OSNumber* number = OSNumber::withNumber(value, 64);
+    if (number) {
+        stats->setObject(key, number);
+        number->release();
+    }
+}
+
+
+// Make a dictionary of per direction latency summary dictionaries, caller releases it
+static OSDictionary* latencyDictionary(const LoopStatSummary* summaries)
+{
+    static const char* const directions[kLoopStatDirections] = { kLoopLatencyReadKey, kLoopLatencyWriteKey, kLoopLatencyFlushKey, kLoopLatencyDiscardKey };
+    
+    OSDictionary* latency = OSDictionary::withCapacity(kLoopStatDirections);
+    if (!latency) {
+        return NULL;
     }
+    
+    for (UInt32 i = 0; i < kLoopStatDirections; ++i) {
+        OSDictionary* summary = OSDictionary::withCapacity(8);
+        if (!summary) {
+            continue;
+        }
+        
+        setStat(summary, "ops", summaries[i].ops);
+        setStat(summary, "bytes", summaries[i].bytes);
+        setStat(summary, "mean", summaries[i].mean);
+        setStat(summary, "p50", summaries[i].p50);
+        setStat(summary, "p90", summaries[i].p90);
+        setStat(summary, "p99", summaries[i].p99);
+        setStat(summary, "p999", summaries[i].p999);
+        setStat(summary, "max", summaries[i].max);
+        
+        latency->setObject(directions[i], summary);
+        summary->release();
+    }
+    
+    return latency;
+}
+
+
+// Spread stat updates from different threads over shards, kexts have no stable access to cpu number
+static UInt32 statShard()
+{
+    uintptr_t thread = (uintptr_t) current_thread();
+    return (UInt32) ((thread >> 4) ^ (thread >> 12));
 }
 
 
-static void releaseRequest(LoopIO* io)
+static void complete(IOStorageCompletion* completion, IOReturn result, UInt64 nbytes)
 {
-    io->mapping->release();
-    io->data->release();
-    IOFree(io, sizeof(*io));
+    if (completion && completion->action) {
+        completion->action(completion->target, completion->parameter, result, nbytes);
+    }
 }
 
 
 #pragma mark -
 #pragma mark Driver
 
-bool org_acme_LoopDriver::init(UInt64 nblocks, bool readonly, int pid)
+bool org_acme_LoopDriver::init(const LoopAttachCtl* arg)
 {
     if (!IOService::init()) {
         return false;
     }
     
     
-    OSNumber* pid_prop = OSNumber::withNumber(pid, sizeof(pid) * 8);
+    OSNumber* pid_prop = OSNumber::withNumber(arg->pid, sizeof(arg->pid) * 8);
     if(!pid_prop) {
         LOOP_IOLOG("Could not create pid property\n");
         return false;
@@ -76,15 +176,227 @@ bool org_acme_LoopDriver::init(UInt64 nblocks, bool readonly, int pid)
     
     client_class->release();
     
-    mTotalBlocks = nblocks;
-    mReadOnly = readonly;
+    mTotalBlocks = arg->size;
+    mBlockSize = arg->blocksize ? arg->blocksize : (UInt32) kLoopBlockSize;
+    if (!loop_block_size_valid(mBlockSize)) {
+        LOOP_IOLOG("Invalid block size %u\n", mBlockSize);
+        return false;
+    }
+    
+    mReadOnly = arg->readonly;
+    mZeroCopy = arg->zerocopy;
     mTask = NULL;
     mPort = NULL;
+    mRingsMemory = NULL;
+    mRings = NULL;
+    mPoolMemory = NULL;
+    mPool = NULL;
+    mSharedPool = NULL;
+    mController = NULL;
+    mZeroCopyRequests = 0;
+    mPooledRequests = 0;
+    mMappedRequests = 0;
+    mCompletions = 0;
+    mCompleteCalls = 0;
+    mTagWaiters = 0;
+    mTagWaits = 0;
+    mInflight = 0;
+    mMaxInflight = 0;
+    mStats = NULL;
+    mStatsLock = NULL;
+    memset(&mHelperStats, 0, sizeof(mHelperStats));
+    mMergeDelay = (arg->mergedelay > 0) ? arg->mergedelay : 0;
+    mWriteCacheCapable = (arg->writecache != 0);
+    mWriteCache = mWriteCacheCapable;
+    mMergeQueue = NULL;
+    mMergeTags = NULL;
+    mMergeIOs = NULL;
+    mMergeLock = NULL;
+    mMergeTimerArmed = false;
+    mWorkLoop = NULL;
+    mMergeTimer = NULL;
+    
+    // Pool must fit at least one request of the max size
+    UInt64 poolsize = arg->poolsize;
+    if (poolsize == 0) {
+        poolsize = kLoopDefaultPoolSize;
+    } else if (poolsize > kLoopMaxPoolSize) {
+        poolsize = kLoopMaxPoolSize;
+    } else if (poolsize < round_page(kLoopMaxBufferSize)) {
+        poolsize = round_page(kLoopMaxBufferSize);
+    }
+    
+    mPoolSize = round_page(poolsize);
+    
+    mSubmitLock = IOLockAlloc();
+    mCompleteLock = IOLockAlloc();
+    if (!mSubmitLock || !mCompleteLock) {
+        LOOP_IOLOG("Could not allocate ring locks\n");
+        return false;
+    }
+    
+    // Request contexts are allocated once for the lifetime of the device
+    mTags = (LoopTagTable*) IOMalloc(sizeof(LoopTagTable));
+    mRequests = (LoopIO*) IOMalloc(sizeof(LoopIO) * kLoopRequestDepth);
+    mTagLock = IOLockAlloc();
+    mSyncLock = IOLockAlloc();
+    mStats = (LoopStats*) IOMallocAligned(sizeof(LoopStats), 64);
+    mStatsLock = IOLockAlloc();
+    if (!mTags || !mRequests || !mTagLock || !mSyncLock || !mStats || !mStatsLock) {
+        LOOP_IOLOG("Could not allocate request tag table\n");
+        return false;
+    }
+    
+    loop_tags_init(mTags, kLoopRequestDepth);
+    loop_stats_init(mStats);
+    
+    // Merge window is optional
+    if (mMergeDelay) {
+        mMergeQueue = (LoopMergeQueue*) IOMalloc(sizeof(LoopMergeQueue));
+        mMergeTags = (LoopTagTable*) IOMalloc(sizeof(LoopTagTable));
+        mMergeIOs = (LoopMergeIO*) IOMalloc(sizeof(LoopMergeIO) * kLoopRequestDepth);
+        mMergeLock = IOLockAlloc();
+        if (!mMergeQueue || !mMergeTags || !mMergeIOs || !mMergeLock) {
+            LOOP_IOLOG("Could not allocate merge window\n");
+            return false;
+        }
+        
+        loop_merge_init(mMergeQueue, kLoopMaxBufferSize / mBlockSize, (UInt64) mMergeDelay * 1000);
+        loop_tags_init(mMergeTags, kLoopRequestDepth);
+        
+        mWorkLoop = IOWorkLoop::workLoop();
+        if (!mWorkLoop) {
+            LOOP_IOLOG("Could not create work loop\n");
+            return false;
+        }
+        
+        mMergeTimer = IOTimerEventSource::timerEventSource(this, sMergeTimeout);
+        if (!mMergeTimer || (kIOReturnSuccess != mWorkLoop->addEventSource(mMergeTimer))) {
+            LOOP_IOLOG("Could not create merge timer\n");
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+
+bool org_acme_LoopDriver::setSharedPool(org_acme_LoopController* controller, task_t owner)
+{
+    LoopSharedPool* pool = controller->acquireSharedPool(owner, mPoolSize);
+    if (!pool) {
+        return false;
+    }
     
+    controller->retain();
+    mController = controller;
+    mSharedPool = pool;
+    mPoolMemory = pool->memory;
+    mPool       = pool->allocator;
+    mPoolSize   = pool->size;
     return true;
 }
 
 
+bool org_acme_LoopDriver::canMapBufferPool(task_t task)
+{
+    return !mSharedPool || mController->ownsSharedPool(mSharedPool, task);
+}
+
+
+void org_acme_LoopDriver::free()
+{
+    if (mRingsMemory)   mRingsMemory->release();
+    
+    if (mSharedPool) {
+        mController->releaseSharedPool(mSharedPool);
+        mController->release();
+    } else {
+        if (mPoolMemory)    mPoolMemory->release();
+        if (mPool)          IOFree(mPool, sizeof(*mPool));
+    }
+    
+    if (mSubmitLock)    IOLockFree(mSubmitLock);
+    if (mCompleteLock)  IOLockFree(mCompleteLock);
+    if (mTags)          IOFree(mTags, sizeof(*mTags));
+    if (mRequests)      IOFree(mRequests, sizeof(LoopIO) * kLoopRequestDepth);
+    if (mTagLock)       IOLockFree(mTagLock);
+    if (mSyncLock)      IOLockFree(mSyncLock);
+    if (mStats)         IOFreeAligned(mStats, sizeof(*mStats));
+    if (mStatsLock)     IOLockFree(mStatsLock);
+    
+    if (mMergeTimer) {
+        mMergeTimer->cancelTimeout();
+        if (mWorkLoop) {
+            mWorkLoop->removeEventSource(mMergeTimer);
+        }
+        mMergeTimer->release();
+    }
+    
+    if (mWorkLoop)      mWorkLoop->release();
+    if (mMergeQueue)    IOFree(mMergeQueue, sizeof(*mMergeQueue));
+    if (mMergeTags)     IOFree(mMergeTags, sizeof(*mMergeTags));
+    if (mMergeIOs)      IOFree(mMergeIOs, sizeof(LoopMergeIO) * kLoopRequestDepth);
+    if (mMergeLock)     IOLockFree(mMergeLock);
+    
+    IOService::free();
+}
+
+
+bool org_acme_LoopDriver::serializeProperties(OSSerialize* s) const
+{
+    // Refresh statistics snapshot right before properties are copied out to whoever is asking
+    OSDictionary* stats = OSDictionary::withCapacity(9);
+    if (stats) {
+        UInt64 completions = mCompletions;
+        UInt64 calls = mCompleteCalls;
+        
+        setStat(stats, kLoopStatZeroCopyKey, mZeroCopyRequests);
+        setStat(stats, kLoopStatPooledKey, mPooledRequests);
+        setStat(stats, kLoopStatMappedKey, mMappedRequests);
+        setStat(stats, kLoopStatCompletionsKey, completions);
+        setStat(stats, kLoopStatCompleteCallsKey, calls);
+        setStat(stats, kLoopStatCompleteBatchKey, (calls ? completions / calls : 0));
+        setStat(stats, kLoopStatTagWaitsKey, mTagWaits);
+        
+        if (mMergeQueue) {
+            setStat(stats, kLoopStatMergeRequestsKey, mMergeQueue->requests);
+            setStat(stats, kLoopStatMergeDispatchesKey, mMergeQueue->dispatches);
+        }
+        
+        setStat(stats, kLoopStatInflightKey, mInflight);
+        setStat(stats, kLoopStatMaxInflightKey, mMaxInflight);
+        
+        const_cast<org_acme_LoopDriver*>(this)->setProperty(kLoopDriverStatsKey, stats);
+        stats->release();
+    }
+    
+    // Latency histograms are summed up into percentiles, helper sends its own already summed up
+    LoopStatSummary summaries[kLoopStatDirections];
+    for (UInt32 i = 0; i < kLoopStatDirections; ++i) {
+        loop_stats_summarize(mStats, i, &summaries[i]);
+    }
+    
+    OSDictionary* latency = latencyDictionary(summaries);
+    if (latency) {
+        const_cast<org_acme_LoopDriver*>(this)->setProperty(kLoopDriverLatencyKey, latency);
+        latency->release();
+    }
+    
+    IOLockLock(mStatsLock);
+    memcpy(summaries, mHelperStats.io, sizeof(summaries));
+    IOLockUnlock(mStatsLock);
+    
+    latency = latencyDictionary(summaries);
+    if (latency) {
+        const_cast<org_acme_LoopDriver*>(this)->setProperty(kLoopDriverHelperLatencyKey, latency);
+        latency->release();
+    }
+    
+    return IOService::serializeProperties(s);
+}
+
+
 bool org_acme_LoopDriver::start(IOService* provider)
 {
     if (!IOService::start(provider)) {
@@ -108,6 +420,51 @@ IOReturn org_acme_LoopDriver::helperProcessAttached(mach_port_t port, task_t tas
         return kIOReturnError;
     }
     
+    // Shared pool carries other devices' data, only the helper that attached them may serve us
+    if (!canMapBufferPool(task)) {
+        LOOP_IOLOG("Shared buffer pool belongs to another helper\n");
+        return kIOReturnNotPermitted;
+    }
+    
+    // Shared rings have to be ready before device nub is published and requests start coming in
+    IOBufferMemoryDescriptor* rings = IOBufferMemoryDescriptor::withOptions(kIOMemoryKernelUserShared | kIODirectionOutIn, sizeof(LoopSharedRings), page_size);
+    if (!rings) {
+        LOOP_IOLOG("Could not allocate shared rings\n");
+        return kIOReturnNoMemory;
+    }
+    
+    if (mRingsMemory) {
+        mRingsMemory->release();
+    }
+    
+    mRingsMemory = rings;
+    mRings = (LoopSharedRings*) rings->getBytesNoCopy();
+    memset(mRings, 0, sizeof(*mRings));
+    loop_ring_init(&mRings->submitRing);
+    loop_ring_init(&mRings->completeRing);
+    
+    // Request buffer pool is mapped into helper once and never unmapped while it is attached.
+    // Shared pool is set up by controller and may be in use by other devices already.
+    if (!mPool) {
+        mPool = (LoopPool*) IOMalloc(sizeof(LoopPool));
+        if (!mPool) {
+            LOOP_IOLOG("Could not allocate buffer pool allocator\n");
+            return kIOReturnNoMemory;
+        }
+    }
+    
+    if (!mPoolMemory) {
+        mPoolMemory = IOBufferMemoryDescriptor::withOptions(kIOMemoryKernelUserShared | kIODirectionOutIn, mPoolSize, page_size);
+        if (!mPoolMemory) {
+            LOOP_IOLOG("Could not allocate %llu bytes buffer pool\n", mPoolSize);
+            return kIOReturnNoMemory;
+        }
+    }
+    
+    if (!mSharedPool) {
+        loop_pool_init(mPool, mPoolSize, round_page(kLoopMaxBufferSize));
+    }
+    
     mPort = port;
     mTask = task;
     
@@ -147,42 +504,538 @@ void org_acme_LoopDriver::helperProcessDetached()
         return;
     }
     
+    IOLockLock(mSubmitLock);
     mTask = NULL;
     mPort = NULL;
+    IOLockUnlock(mSubmitLock);
+    
+    // Helper is gone for good, whoever comes next must not find its pool
+    if (mSharedPool) {
+        mController->disownSharedPool(mSharedPool);
+    }
+    
+    // Requests helper got are never going to complete, fail them so flush and discard waiters do not hang
+    for (UInt32 tag = 0; tag < mTags->depth; ++tag) {
+        LoopIO* io = &mRequests[tag];
+        if (__sync_bool_compare_and_swap(&io->posted, 1, 0)) {
+            IOStorageCompletion completion = io->completion;
+            releaseRequest(io);
+            complete(&completion, kIOReturnNotReady, 0);
+        }
+    }
+    
+    // Nobody is going to complete requests anymore, let tag waiters bail out
+    IOLockLock(mTagLock);
+    IOLockWakeup(mTagLock, mTags, false);
+    IOLockUnlock(mTagLock);
+    
+    // Fail whatever is still held in merge window
+    flushMergeQueue();
     
     mDevice->stop(this);
 }
 
+void org_acme_LoopDriver::setHelperStats(const LoopHelperStatsCtl* stats)
+{
+    IOLockLock(mStatsLock);
+    mHelperStats = *stats;
+    IOLockUnlock(mStatsLock);
+}
+
+
 void org_acme_LoopDriver::completeRequest(UserIORequest* request)
 {
-    LoopIO* io = (LoopIO*) request->priv;
-    LOOP_ASSERT(io);
+    LoopCompletion done;
+    
+    if (retireRequest(request, &done)) {
+        complete(&done.completion, done.status, done.nbytes);
+    }
+}
+
+
+bool org_acme_LoopDriver::retireRequest(const UserIORequest* request, LoopCompletion* done)
+{
+    // Handle comes from user space, do not trust it
+    int32_t tag = loop_tags_lookup(mTags, request->priv);
+    if (tag < 0) {
+        LOOP_IOLOG("Invalid request handle 0x%llx\n", request->priv);
+        return false;
+    }
+    
+    LoopIO* io = &mRequests[tag];
+    
+    // Helper detach may have failed it already
+    if (!__sync_bool_compare_and_swap(&io->posted, 1, 0)) {
+        LOOP_IOLOG("Request 0x%llx is not in flight\n", request->priv);
+        return false;
+    }
+    
+    OSIncrementAtomic64(&mCompletions);
+    UInt64 nbytes = (io->buffer && (request->result == kIOReturnSuccess)) ? io->buffer->getLength() : 0;
+    loop_stats_record(mStats, statShard(), io->direction, nbytes, uptimeNanoseconds() - io->start);
+    
+    done->completion = io->completion;
     
     if (request->result != kIOReturnSuccess) {
-        complete(&io->completion, request->result, 0);
+        done->status = request->result;
+        done->nbytes = 0;
     } else {
         
-        if (io->buffer->getDirection() == kIODirectionIn) {
+        if (!io->buffer) {
+            // flush or discard request, no data
+        } else if (io->zerocopy) {
+            // helper worked on caller pages directly
+        } else if (io->buffer->getDirection() == kIODirectionIn) {
             // read completion
             // decrypt and copy data to original caller buffer
-            io->buffer->writeBytes(0, io->data->getBytesNoCopy(), io->buffer->getLength());
+            io->buffer->writeBytes(0, getRequestData(io), io->buffer->getLength());
         } else {
             // write completion
         }
-        complete(&io->completion, kIOReturnSuccess, request->nblocks * kLoopBlockSize);
+        // Our own request length, helper cannot claim more than was asked for
+        done->status = kIOReturnSuccess;
+        done->nbytes = io->buffer ? io->buffer->getLength() : 0;
     }
     
+    // Tag is free before completion runs, its callback may well wait for one
     releaseRequest(io);
+    return true;
+}
+
+
+void org_acme_LoopDriver::completeRequests(UserIORequest* requests, UInt32 count)
+{
+    for (UInt32 i = 0; i < count; ++i) {
+        completeRequest(&requests[i]);
+    }
+}
+
+
+void org_acme_LoopDriver::drainCompletions()
+{
+    if (!mRings) {
+        LOOP_IOLOG("Shared rings are not allocated\n");
+        return;
+    }
+    
+    LoopRing* ring = &mRings->completeRing;
+    LoopCompletion done[kLoopCompletionBatch];
+    
+    // Completions run with the lock dropped, a callback issuing next request must not hold up the next drain
+    for (;;) {
+        UInt32 count = 0;
+        int rc = 0;
+        
+        IOLockLock(mCompleteLock);
+        loop_ring_consumer_busy(ring);
+        
+        do {
+            uint32_t slot;
+            
+            while ((count < kLoopCompletionBatch) && (0 < (rc = loop_ring_consume_begin(ring, kLoopRingDepth, &slot)))) {
+                // Take a private copy, user space is free to scribble over the shared entry
+                UserIORequest request = mRings->completeQueue[slot];
+                loop_ring_consume_commit(ring);
+                
+                if (retireRequest(&request, &done[count])) {
+                    count++;
+                }
+            }
+            
+            if (rc < 0) {
+                LOOP_IOLOG("Completion ring indexes are corrupted\n");
+                break;
+            }
+            
+        } while ((count < kLoopCompletionBatch) && !loop_ring_consumer_idle(ring));
+        
+        IOLockUnlock(mCompleteLock);
+        
+        for (UInt32 i = 0; i < count; ++i) {
+            complete(&done[i].completion, done[i].status, done[i].nbytes);
+        }
+        
+        // Full batch left the ring marked busy, producer rang no doorbell for the rest so we go on
+        if ((rc < 0) || (count < kLoopCompletionBatch)) {
+            break;
+        }
+    }
+}
+
+
+IOReturn org_acme_LoopDriver::sendNotification(UInt32 msgid, const UserIORequest* data)
+{
+    UserRequestNotification request;
+    memset(&request, 0, sizeof(request));
+    
+    request.header.msgh_bits        = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0); 
+    request.header.msgh_size        = sizeof(UserRequestNotification); 
+    request.header.msgh_remote_port = mPort; 
+    request.header.msgh_local_port  = MACH_PORT_NULL; 
+    request.header.msgh_id          = msgid; 
+    
+    if (data) {
+        request.data = *data;
+    }
+    
+    return mach_msg_send_from_kernel(&request.header, sizeof(UserRequestNotification)); 
+}
+
+
+void* org_acme_LoopDriver::getRequestData(LoopIO* io)
+{
+    if (io->pooled) {
+        return (UInt8*) mPoolMemory->getBytesNoCopy() + io->poolOffset;
+    } else {
+        return io->data->getBytesNoCopy();
+    }
+}
+
+
+bool org_acme_LoopDriver::canMapDirectly(IOMemoryDescriptor* buffer)
+{
+    IOByteCount length = buffer->getLength();
+    IOByteCount offset = 0;
+    
+    // Every segment has to cover whole pages, otherwise we would expose unrelated memory to helper process
+    while (offset < length) {
+        IOByteCount seglen = 0;
+        addr64_t addr = buffer->getPhysicalSegment(offset, &seglen, kIOMemoryMapperNone);
+        
+        if (!addr || !seglen || (addr & PAGE_MASK) || (seglen & PAGE_MASK)) {
+            return false;
+        }
+        
+        offset += seglen;
+    }
+    
+    return true;
+}
+
+
+IOReturn org_acme_LoopDriver::allocRequestBuffer(LoopIO* io, UserIORequest* request)
+{
+    IOByteCount nbytes = io->buffer->getLength();
+    
+    // Small requests are cheaper to copy than to map, do not wire them down for nothing
+    bool direct = mZeroCopy && (nbytes >= kLoopZeroCopyMinSize) && !(nbytes & PAGE_MASK);
+    
+    if (direct && (kIOReturnSuccess == io->buffer->prepare())) {
+        io->prepared = true;
+        
+        if (canMapDirectly(io->buffer)) {
+            IOOptionBits options = kIOMapAnywhere | ((io->buffer->getDirection() == kIODirectionOut) ? kIOMapReadOnly : 0);
+            
+            io->mapping = io->buffer->createMappingInTask(mTask, 0, options);
+            if (io->mapping) {
+                io->zerocopy = true;
+                request->buffer = io->mapping->getVirtualAddress();
+                request->flags |= kLoopIOFlag_Mapped;
+                OSIncrementAtomic64(&mZeroCopyRequests);
+                return kIOReturnSuccess;
+            }
+            
+            LOOP_IOLOG_DEBUG("Could not map caller buffer, falling back to bounce buffer\n");
+        }
+        
+        io->buffer->complete();
+        io->prepared = false;
+    }
+    
+    if (loop_pool_alloc(mPool, nbytes, &io->poolOffset)) {
+        io->pooled = true;
+        request->buffer = io->poolOffset;
+        OSIncrementAtomic64(&mPooledRequests);
+        return kIOReturnSuccess;
+    }
+    
+    // Pool is exhausted, allocate a dedicated buffer and create user mapping
+    LOOP_IOLOG_DEBUG("Buffer pool exhausted, mapping %llu bytes request buffer\n", (UInt64) nbytes);
+    
+    io->data = IOBufferMemoryDescriptor::withOptions(kIOMemoryKernelUserShared | kIODirectionOutIn, nbytes, page_size);
+    if (!io->data) {
+        LOOP_IOLOG("Could not allocate memory buffer\n");
+        return kIOReturnNoMemory;
+    }
+    
+    io->mapping = io->data->createMappingInTask(mTask, NULL, kIOMapAnywhere);
+    if (!io->mapping) {
+        LOOP_IOLOG("Could not map request buffer to user space\n");
+        io->data->release();
+        io->data = NULL;
+        return kIOReturnIPCError;
+    } else {
+        LOOP_IOLOG_DEBUG("Mapped request buffer to user space address %p\n", (void*)io->mapping->getVirtualAddress());
+    }
+    
+    request->buffer = io->mapping->getVirtualAddress();
+    request->flags |= kLoopIOFlag_Mapped;
+    OSIncrementAtomic64(&mMappedRequests);
+    return kIOReturnSuccess;
+}
+
+
+LoopIO* org_acme_LoopDriver::allocRequest()
+{
+    int32_t tag = loop_tags_alloc(mTags);
+    
+    if (tag < 0) {
+        // Table is full, apply back pressure to caller until helper completes something
+        IOLockLock(mTagLock);
+        OSIncrementAtomic(&mTagWaiters);
+        OSIncrementAtomic64(&mTagWaits);
+        
+        while ((tag = loop_tags_alloc(mTags)) < 0) {
+            if (!mPort) {
+                break;
+            }
+            
+            IOLockSleep(mTagLock, mTags, THREAD_UNINT);
+        }
+        
+        OSDecrementAtomic(&mTagWaiters);
+        IOLockUnlock(mTagLock);
+        
+        if (tag < 0) {
+            return NULL;
+        }
+    }
+    
+    LoopIO* io = &mRequests[tag];
+    memset(io, 0, sizeof(*io));
+    io->tag = tag;
+    io->start = uptimeNanoseconds();
+    
+    UInt64 inflight = __sync_add_and_fetch(&mInflight, 1);
+    UInt64 max;
+    while (inflight > (max = mMaxInflight)) {
+        if (__sync_bool_compare_and_swap(&mMaxInflight, max, inflight)) {
+            break;
+        }
+    }
+    
+    return io;
+}
+
+
+void org_acme_LoopDriver::releaseRequest(LoopIO* io)
+{
+    if (io->pooled) {
+        loop_pool_free(mPool, io->poolOffset);
+    }
+    
+    if (io->mapping)    io->mapping->release();
+    if (io->data)       io->data->release();
+    if (io->prepared)   io->buffer->complete();
+    
+    loop_tags_free(mTags, io->tag);
+    __sync_sub_and_fetch(&mInflight, 1);
+    
+    // Waiters registered themselves before their last allocation attempt, so they either saw our tag or will get woken up
+    if (mTagWaiters) {
+        IOLockLock(mTagLock);
+        IOLockWakeup(mTagLock, mTags, true);
+        IOLockUnlock(mTagLock);
+    }
 }
 
 
-IOReturn org_acme_LoopDriver::createRequest(IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks, IOStorageCompletion* completion)
+IOReturn org_acme_LoopDriver::createRequest(IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks, IOStorageAttributes* attributes, IOStorageCompletion* completion)
+{
+    // FUA writes are waited upon, do not hold them
+    bool fua = attributes && (attributes->options & kIOStorageOptionForceUnitAccess);
+    
+    if (!mMergeQueue || fua) {
+        return dispatchRequest(buffer, block, nblks, attributes, completion);
+    }
+    
+    // Merged requests are dispatched later, give caller a chance to handle obvious errors right away
+    if (!mPort) {
+        LOOP_IOLOG("Helper process not attached\n");
+        return kIOReturnNotReady;
+    }
+    
+    if ((block + nblks) > this->getSize()) {
+        LOOP_IOLOG("Request too large\n");
+        return kIOReturnBadArgument;
+    }
+    
+    if ((buffer->getDirection() == kIODirectionOut) && (this->isWriteProtected())) {
+        LOOP_IOLOG("Write request for read only device\n");
+        return kIOReturnBadArgument;
+    }
+    
+    // Too many requests held already, do not hold this one
+    int32_t tag = loop_tags_alloc(mMergeTags);
+    if (tag < 0) {
+        return dispatchRequest(buffer, block, nblks, attributes, completion);
+    }
+    
+    LoopMergeIO* mio = &mMergeIOs[tag];
+    mio->buffer     = buffer;
+    mio->completion = *completion;
+    mio->nbytes     = nblks * mBlockSize;
+    mio->next       = -1;
+    mio->merged     = NULL;
+    
+    LoopIODirection direction = (buffer->getDirection() == kIODirectionOut) ? kLoopIODirection_Write : kLoopIODirection_Read;
+    LoopMergeRun run;
+    
+    IOLockLock(mMergeLock);
+    
+    int dispatch = loop_merge_add(mMergeQueue, direction, block, nblks, tag, uptimeNanoseconds(), &run);
+    
+    bool arm = (mMergeQueue->nruns && !mMergeTimerArmed);
+    if (arm) {
+        mMergeTimerArmed = true;
+    }
+    
+    IOLockUnlock(mMergeLock);
+    
+    if (arm) {
+        mMergeTimer->setTimeoutUS(mMergeDelay);
+    }
+    
+    if (dispatch) {
+        dispatchRun(&run);
+    }
+    
+    return kIOReturnSuccess;
+}
+
+
+void org_acme_LoopDriver::flushMergeQueue()
+{
+    if (!mMergeQueue) {
+        return;
+    }
+    
+    LoopMergeRun run;
+    for (;;) {
+        IOLockLock(mMergeLock);
+        int dispatch = loop_merge_flush(mMergeQueue, &run);
+        IOLockUnlock(mMergeLock);
+        
+        if (!dispatch) {
+            break;
+        }
+        
+        dispatchRun(&run);
+    }
+}
+
+
+void org_acme_LoopDriver::sMergeTimeout(OSObject* owner, IOTimerEventSource* sender)
+{
+    org_acme_LoopDriver* driver = (org_acme_LoopDriver*) owner;
+    LoopMergeRun run;
+    UInt64 now = uptimeNanoseconds();
+    UInt64 deadline;
+    
+    for (;;) {
+        IOLockLock(driver->mMergeLock);
+        int dispatch = loop_merge_expire(driver->mMergeQueue, now, &run);
+        IOLockUnlock(driver->mMergeLock);
+        
+        if (!dispatch) {
+            break;
+        }
+        
+        driver->dispatchRun(&run);
+    }
+    
+    // Rearm for whatever is left in window
+    IOLockLock(driver->mMergeLock);
+    
+    bool arm = loop_merge_next_deadline(driver->mMergeQueue, &deadline);
+    driver->mMergeTimerArmed = arm;
+    
+    IOLockUnlock(driver->mMergeLock);
+    
+    if (arm) {
+        now = uptimeNanoseconds();
+        sender->setTimeoutUS((deadline > now) ? (UInt32) ((deadline - now) / 1000 + 1) : 1);
+    }
+}
+
+
+void org_acme_LoopDriver::dispatchRun(const LoopMergeRun* run)
+{
+    IOMemoryDescriptor* buffers[kLoopMergeMaxParts];
+    IOReturn error;
+    UInt32 i;
+    
+    if (run->nparts > 1) {
+        // Chain requests of the run together for completion
+        for (i = 0; i < run->nparts; ++i) {
+            LoopMergeIO* mio = &mMergeIOs[run->parts[i].cookie];
+            buffers[i] = mio->buffer;
+            mio->next = (i + 1 < run->nparts) ? (SInt32) run->parts[i + 1].cookie : -1;
+        }
+        
+        IOMultiMemoryDescriptor* merged = IOMultiMemoryDescriptor::withDescriptors(buffers, run->nparts, buffers[0]->getDirection(), false);
+        if (merged) {
+            UInt32 first = (UInt32) run->parts[0].cookie;
+            IOStorageCompletion completion;
+            
+            mMergeIOs[first].merged = merged;
+            completion.target       = this;
+            completion.action       = sMergedCompletion;
+            completion.parameter    = (void*) (uintptr_t) first;
+            
+            error = dispatchRequest(merged, run->block, run->nblks, NULL, &completion);
+            if (kIOReturnSuccess != error) {
+                sMergedCompletion(this, completion.parameter, error, 0);
+            }
+            return;
+        }
+        
+        LOOP_IOLOG("Could not create merged buffer, dispatching requests one by one\n");
+    }
+    
+    for (i = 0; i < run->nparts; ++i) {
+        UInt32 tag = (UInt32) run->parts[i].cookie;
+        IOMemoryDescriptor* buffer = mMergeIOs[tag].buffer;
+        IOStorageCompletion completion = mMergeIOs[tag].completion;
+        
+        loop_tags_free(mMergeTags, tag);
+        
+        error = dispatchRequest(buffer, run->parts[i].block, run->parts[i].nblks, NULL, &completion);
+        if (kIOReturnSuccess != error) {
+            complete(&completion, error, 0);
+        }
+    }
+}
+
+
+void org_acme_LoopDriver::sMergedCompletion(void* target, void* parameter, IOReturn status, UInt64 actualByteCount)
+{
+    org_acme_LoopDriver* driver = (org_acme_LoopDriver*) target;
+    SInt32 tag = (SInt32) (uintptr_t) parameter;
+    
+    driver->mMergeIOs[tag].merged->release();
+    
+    // Merged request either completes as a whole or fails as a whole
+    while (tag >= 0) {
+        LoopMergeIO* mio = &driver->mMergeIOs[tag];
+        IOStorageCompletion completion = mio->completion;
+        UInt64 nbytes = mio->nbytes;
+        SInt32 next = mio->next;
+        
+        loop_tags_free(driver->mMergeTags, tag);
+        complete(&completion, status, (kIOReturnSuccess == status) ? nbytes : 0);
+        
+        tag = next;
+    }
+}
+
+
+IOReturn org_acme_LoopDriver::dispatchRequest(IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks, IOStorageAttributes* attributes, IOStorageCompletion* completion)
 {
     IOReturn                    error = kIOReturnSuccess;
-    IOBufferMemoryDescriptor*   sharedBuffer = NULL;
-    IOMemoryMap*                userMapping = NULL;
     LoopIODirection             direction = (buffer->getDirection() == kIODirectionOut) ? kLoopIODirection_Write : kLoopIODirection_Read;
     LoopIO*                     io = NULL;
+    UserIORequest               request;
     
     if (!mPort) {
         LOOP_IOLOG("Helper process not attached\n");
@@ -199,81 +1052,289 @@ IOReturn org_acme_LoopDriver::createRequest(IOMemoryDescriptor *buffer, UInt64 b
         LOOP_IOLOG("Write request for read only device\n");
         return kIOReturnBadArgument;
     }
-
-
-    // Allocate a buffer and create user mapping
-    sharedBuffer = IOBufferMemoryDescriptor::withOptions(kIOMemoryKernelUserShared | kIODirectionOutIn, buffer->getLength(), page_size);
-    if (!sharedBuffer) {
-        LOOP_IOLOG("Could not allocate memory buffer\n");
-        return kIOReturnNoMemory;
+    
+    
+    // Allocate request context and data buffer
+    io = allocRequest();
+    if (!io) {
+        LOOP_IOLOG("Helper process detached while waiting for a request tag\n");
+        return kIOReturnNotReady;
+    }
+    
+    memset(&request, 0, sizeof(request));
+    
+    io->buffer      = buffer;
+    io->direction   = direction;
+    io->completion  = *completion;
+    
+    error = allocRequestBuffer(io, &request);
+    if (kIOReturnSuccess != error) {
+        releaseRequest(io);
+        return error;
     }
     
-    if (buffer->getDirection() == kIODirectionOut) {
+    if ((buffer->getDirection() == kIODirectionOut) && !io->zerocopy) {
         // write request
         // copy caller data to shared buffer and encrypt
-        if (buffer->getLength() != buffer->readBytes(0, sharedBuffer->getBytesNoCopy(), buffer->getLength())) {
+        if (buffer->getLength() != buffer->readBytes(0, getRequestData(io), buffer->getLength())) {
             error = kIOReturnIOError;
             goto ERROR_OUT;
         }
     }
     
-    userMapping = sharedBuffer->createMappingInTask(mTask, NULL, kIOMapAnywhere);
-    if (!userMapping) {
-        LOOP_IOLOG("Could not map request buffer to user space\n");
-        error = kIOReturnIPCError;
+    
+    // Notify user process
+    request.offset      = block; 
+    request.nblocks     = nblks;
+    request.direction   = direction;
+    request.priv        = loop_tags_handle(mTags, io->tag);
+    
+    if ((direction == kLoopIODirection_Write) && mWriteCacheCapable && !mWriteCache) {
+        request.flags |= kLoopIOFlag_WriteThrough;
+    }
+    
+    if ((direction == kLoopIODirection_Write) && attributes && (attributes->options & kIOStorageOptionForceUnitAccess)) {
+        request.flags |= kLoopIOFlag_FUA;
+    }
+    
+    error = postRequest(io, &request);
+    if (kIOReturnSuccess != error) {
+        LOOP_IOLOG("Could not enqueue new request\n");
         goto ERROR_OUT;
+    }
+
+    return kIOReturnSuccess;
+    
+    
+ERROR_OUT:
+    
+    releaseRequest(io);
+    return error;
+}
+
+IOReturn org_acme_LoopDriver::postRequest(LoopIO* io, const UserIORequest* request)
+{
+    IOReturn error = kIOReturnSuccess;
+    
+    // Post request into submission ring and ring the doorbell if helper is idle.
+    // Ring full means helper is busy, send the request inline instead of waiting for a free slot.
+    IOLockLock(mSubmitLock);
+    
+    if (!mPort) {
+        LOOP_IOLOG("Helper process detached\n");
+        error = kIOReturnNotReady;
     } else {
-        LOOP_IOLOG_DEBUG("Mapped request buffer to user space address %p\n", (void*)userMapping->getVirtualAddress());
+        uint32_t slot;
+        
+        // Helper may complete request before we return
+        io->posted = 1;
+        
+        if (loop_ring_produce_begin(&mRings->submitRing, kLoopRingDepth, &slot)) {
+            mRings->submitQueue[slot] = *request;
+            if (loop_ring_produce_commit(&mRings->submitRing)) {
+                if (kIOReturnSuccess != sendNotification(kLoopUserRingNotification, NULL)) {
+                    LOOP_IOLOG("Could not ring submission doorbell\n");
+                }
+            }
+        } else {
+            error = sendNotification(kLoopUserIONotification, request);
+            if (kIOReturnSuccess != error) {
+                io->posted = 0;
+            }
+        }
     }
     
+    IOLockUnlock(mSubmitLock);
+    return error;
+}
+
+
+// Wakes up synchronizeCache or unmap caller once its last request completes
+static void syncCompletion(void* target, void* parameter, IOReturn status, UInt64 actualByteCount)
+{
+    LoopSyncWait* wait = (LoopSyncWait*) parameter;
+    
+    IOLockLock(wait->lock);
+    if (kIOReturnSuccess == wait->result) {
+        wait->result = status;
+    }
+    if (0 == --wait->pending) {
+        IOLockWakeup(wait->lock, wait, true);
+    }
+    IOLockUnlock(wait->lock);
+}
+
+
+IOReturn org_acme_LoopDriver::synchronizeCache()
+{
+    LoopSyncWait wait;
+    UserIORequest request;
+    
+    if (!mPort) {
+        LOOP_IOLOG("Helper process not attached\n");
+        return kIOReturnNotReady;
+    }
+    
+    // Whatever is held for merging has to reach helper before the flush does
+    flushMergeQueue();
     
-    // Store request context and notify user process
-    io = (LoopIO*) IOMalloc(sizeof(LoopIO));
+    LoopIO* io = allocRequest();
     if (!io) {
-        LOOP_IOLOG("Could not allocate io request structure\n");
-        error = kIOReturnNoMemory;
-        goto ERROR_OUT;
+        return kIOReturnNotReady;
     }
     
-    memset(io, 0, sizeof(*io));
+    wait.lock       = mSyncLock;
+    wait.result     = kIOReturnSuccess;
+    wait.pending    = 1;
+    
+    io->direction               = kLoopIODirection_Flush;
+    io->completion.target       = this;
+    io->completion.action       = syncCompletion;
+    io->completion.parameter    = &wait;
     
-    io->buffer      = buffer;
-    io->completion  = *completion;
-    io->mapping     = userMapping;
-    io->data        = sharedBuffer;
-
-    UserRequestNotification request;
     memset(&request, 0, sizeof(request));
+    request.direction   = kLoopIODirection_Flush;
+    request.priv        = loop_tags_handle(mTags, io->tag);
     
-    request.header.msgh_bits        = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0); 
-    request.header.msgh_size        = sizeof(UserRequestNotification); 
-    request.header.msgh_remote_port = mPort; 
-    request.header.msgh_local_port  = MACH_PORT_NULL; 
-    request.header.msgh_id          = kLoopUserIONotification; 
+    IOReturn error = postRequest(io, &request);
+    if (kIOReturnSuccess != error) {
+        LOOP_IOLOG("Could not enqueue flush request\n");
+        releaseRequest(io);
+        return error;
+    }
     
-    request.data.offset             = block; 
-    request.data.nblocks            = nblks;
-    request.data.direction          = direction;
-    request.data.buffer             = userMapping->getVirtualAddress();
-    request.data.priv               = (uint64_t) io;
+    IOLockLock(mSyncLock);
+    while (wait.pending) {
+        IOLockSleep(mSyncLock, &wait, THREAD_UNINT);
+    }
+    IOLockUnlock(mSyncLock);
+    
+    return wait.result;
+}
+
+
+IOReturn org_acme_LoopDriver::postDiscard(UInt64 block, UInt64 nblks, LoopSyncWait* wait)
+{
+    UserIORequest request;
+    
+    LoopIO* io = allocRequest();
+    if (!io) {
+        return kIOReturnNotReady;
+    }
+    
+    io->direction               = kLoopIODirection_Discard;
+    io->completion.target       = this;
+    io->completion.action       = syncCompletion;
+    io->completion.parameter    = wait;
+    
+    memset(&request, 0, sizeof(request));
+    request.offset      = block;
+    request.nblocks     = nblks;
+    request.direction   = kLoopIODirection_Discard;
+    request.priv        = loop_tags_handle(mTags, io->tag);
+    
+    IOLockLock(mSyncLock);
+    wait->pending++;
+    IOLockUnlock(mSyncLock);
     
-    error = mach_msg_send_from_kernel(&request.header, sizeof(UserRequestNotification)); 
+    IOReturn error = postRequest(io, &request);
     if (kIOReturnSuccess != error) {
-        LOOP_IOLOG("Could not enqueue new request\n");
-        goto ERROR_OUT;
+        LOOP_IOLOG("Could not enqueue discard request\n");
+        releaseRequest(io);
+        
+        IOLockLock(mSyncLock);
+        wait->pending--;
+        IOLockUnlock(mSyncLock);
     }
+    
+    return error;
+}
 
+
+IOReturn org_acme_LoopDriver::unmap(const IOBlockStorageDeviceExtent* extents, UInt32 count)
+{
+    LoopSyncWait wait;
+    IOReturn error = kIOReturnSuccess;
+    UInt64 maxBlocks = kLoopMaxDiscardSize / mBlockSize;
+    UInt32 i = 0;
+    
+    if (!mPort) {
+        LOOP_IOLOG("Helper process not attached\n");
+        return kIOReturnNotReady;
+    }
+    
+    if (this->isWriteProtected()) {
+        LOOP_IOLOG("Unmap request for read only device\n");
+        return kIOReturnNotWritable;
+    }
+    
+    // Writes held for merging may cover unmapped blocks, they must not land in file after the discard
+    flushMergeQueue();
+    
+    // Our own reference keeps completions from waking us up before everything is posted
+    wait.lock       = mSyncLock;
+    wait.result     = kIOReturnSuccess;
+    wait.pending    = 1;
+    
+    while ((i < count) && (kIOReturnSuccess == error)) {
+        UInt64 block = extents[i].blockStart;
+        UInt64 nblks = extents[i].blockCount;
+        
+        // Filesystems hand out freed extents sorted, adjacent ones become a single hole
+        for (++i; (i < count) && (extents[i].blockStart == block + nblks); ++i) {
+            nblks += extents[i].blockCount;
+        }
+        
+        if ((block > this->getSize()) || (nblks > this->getSize() - block)) {
+            LOOP_IOLOG("Unmap extent out of range\n");
+            error = kIOReturnBadArgument;
+            break;
+        }
+        
+        while (nblks && (kIOReturnSuccess == error)) {
+            UInt64 n = (nblks < maxBlocks) ? nblks : maxBlocks;
+            error = postDiscard(block, n, &wait);
+            block += n;
+            nblks -= n;
+        }
+    }
+    
+    IOLockLock(mSyncLock);
+    wait.pending--;
+    while (wait.pending) {
+        IOLockSleep(mSyncLock, &wait, THREAD_UNINT);
+    }
+    IOLockUnlock(mSyncLock);
+    
+    return (kIOReturnSuccess != error) ? error : wait.result;
+}
+
+
+IOReturn org_acme_LoopDriver::getWriteCacheState(bool* enabled)
+{
+    *enabled = mWriteCache;
     return kIOReturnSuccess;
+}
+
+
+IOReturn org_acme_LoopDriver::setWriteCacheState(bool enabled)
+{
+    if (!mWriteCacheCapable) {
+        return enabled ? kIOReturnUnsupported : kIOReturnSuccess;
+    }
     
+    bool wasEnabled = mWriteCache;
+    mWriteCache = enabled;
     
-ERROR_OUT:
+    // Data cached so far has to be made durable as if write cache has never been there
+    if (wasEnabled && !enabled) {
+        return synchronizeCache();
+    }
     
-    if (io)             IOFree(io, sizeof(*io));
-    if (userMapping)    userMapping->release();
-    if (sharedBuffer)   sharedBuffer->release();
-    return error;
+    return kIOReturnSuccess;
 }
 
+
 bool org_acme_LoopDriver::terminate(IOOptionBits options)
 {
     if (mPort) {
@@ -282,17 +1343,8 @@ bool org_acme_LoopDriver::terminate(IOOptionBits options)
         // User can also be notified with standard service interest notifications 
         // but it is generally easier to handle this on the same port that receives io notifications
         
-        UserRequestNotification request;
-        memset(&request, 0, sizeof(request));
-    
-        request.header.msgh_bits        = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0); 
-        request.header.msgh_size        = sizeof(UserRequestNotification); 
-        request.header.msgh_remote_port = mPort; 
-        request.header.msgh_local_port  = MACH_PORT_NULL; 
-        request.header.msgh_id          = kLoopUserTerminateNotification; 
-    
         // Ignore the error because client might be already dead
-        (void) mach_msg_send_from_kernel(&request.header, sizeof(UserRequestNotification)); 
+        (void) sendNotification(kLoopUserTerminateNotification, NULL);
     }
     
     return IOService::terminate(options);
@@ -363,6 +1415,46 @@ IOReturn org_acme_LoopDriverClient::externalMethod(uint32_t selector, IOExternal
 }
 
 
+IOReturn org_acme_LoopDriverClient::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory)
+{
+    switch (type) {
+    case kLoopDriverMemory_Rings: {
+        IOBufferMemoryDescriptor* rings = mDriver->getSharedRings();
+        if (!rings) {
+            return kIOReturnNotReady;
+        }
+        
+        // Caller consumes a reference
+        rings->retain();
+        *memory = rings;
+        *options = 0;
+        return kIOReturnSuccess;
+    }
+            
+    case kLoopDriverMemory_Pool: {
+        IOBufferMemoryDescriptor* pool = mDriver->getBufferPool();
+        if (!pool) {
+            return kIOReturnNotReady;
+        }
+        
+        if (!mDriver->canMapBufferPool(mTask)) {
+            return kIOReturnNotPermitted;
+        }
+        
+        pool->retain();
+        *memory = pool;
+        *options = 0;
+        return kIOReturnSuccess;
+    }
+            
+    default: {
+        return kIOReturnBadArgument;
+    }
+            
+    };
+}
+
+
 IOReturn org_acme_LoopDriverClient::sIOCTL(OSObject * target, void * reference, IOExternalMethodArguments * arguments)
 {
     uint64_t ctlcode = *arguments->scalarInput;
@@ -370,10 +1462,43 @@ IOReturn org_acme_LoopDriverClient::sIOCTL(OSObject * target, void * reference,
     
     switch (ctlcode) {
     case kLoopDriverCTL_Complete: {
+        if (arguments->structureInputSize < sizeof(struct UserIORequest)) {
+            return kIOReturnBadArgument;
+        }
+        
         struct UserIORequest* arg = (struct UserIORequest*) arguments->structureInput;
+        OSIncrementAtomic64(&driver->mCompleteCalls);
         driver->completeRequest(arg);
         return kIOReturnSuccess;
     }
+        
+    case kLoopDriverCTL_Doorbell: {
+        OSIncrementAtomic64(&driver->mCompleteCalls);
+        driver->drainCompletions();
+        return kIOReturnSuccess;
+    }
+        
+    case kLoopDriverCTL_CompleteBatch: {
+        UInt32 size = arguments->structureInputSize;
+        UInt32 count = size / sizeof(struct UserIORequest);
+        if (!count || (count > kLoopMaxCompleteBatch) || (size % sizeof(struct UserIORequest))) {
+            return kIOReturnBadArgument;
+        }
+        
+        struct UserIORequest* arg = (struct UserIORequest*) arguments->structureInput;
+        OSIncrementAtomic64(&driver->mCompleteCalls);
+        driver->completeRequests(arg, count);
+        return kIOReturnSuccess;
+    }
+        
+    case kLoopDriverCTL_Stats: {
+        if (arguments->structureInputSize != sizeof(struct LoopHelperStatsCtl)) {
+            return kIOReturnBadArgument;
+        }
+        
+        driver->setHelperStats((const struct LoopHelperStatsCtl*) arguments->structureInput);
+        return kIOReturnSuccess;
+    }
             
     default: {
         LOOP_ASSERT(0 && "Unknown ioctl");
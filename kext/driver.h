@@ -8,11 +8,28 @@
 
 #include <IOKit/IOService.h>
 #include <IOKit/IOUserClient.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOTimerEventSource.h>
 #include <IOKit/storage/IOStorage.h>
+#include <IOKit/storage/IOBlockStorageDevice.h>
 
 
 struct UserIORequest;
+struct LoopAttachCtl;
+struct LoopSharedRings;
+struct LoopPool;
+struct LoopTagTable;
+struct LoopMergeQueue;
+struct LoopMergeRun;
+struct LoopMergeIO;
+struct LoopIO;
+struct LoopSharedPool;
+struct LoopSyncWait;
+struct LoopCompletion;
 class org_acme_LoopDevice;
+class org_acme_LoopController;
 
 
 /**
@@ -22,7 +39,8 @@ class org_acme_LoopDevice;
  * Implements actual IO request processing.
  *
  * Request processing is accomplished with a user space daemon which does file io.
- * Communication with the user space deamon is done through a mach port.
+ * Requests and completions are exchanged with the user space daemon through shared memory rings,
+ * mach port and user client ioctls are used as doorbells and as a fallback when rings are full.
  */
 class org_acme_LoopDriver : public IOService {
 OSDeclareDefaultStructors(org_acme_LoopDriver);
@@ -30,8 +48,17 @@ public:
     
     /**
      * Init driver instance.
+     * @param arg       Device parameters as sent by helper process.
      */
-    virtual bool init(UInt64 nblocks, bool readonly, int pid);
+    virtual bool init(const LoopAttachCtl* arg);
+    
+    /**
+     * Use buffer pool shared with other devices of the same helper process instead of a pool of our own.
+     * Has to be called right after init.
+     * @param controller    Controller owning shared pools, retained until driver is freed.
+     * @param pid           Helper process the pool belongs to.
+     */
+    bool setSharedPool(org_acme_LoopController* controller, task_t owner);
     
     /**
      * Registers the driver with the IORegistry.
@@ -39,6 +66,11 @@ public:
      * Instead we need to wait for the user client to open us first.
      */
     virtual bool start(IOService* provider);
+
+    /**
+     * Refreshes request statistics property before registry properties are serialized.
+     */
+    virtual bool serializeProperties(OSSerialize* s) const;
         
     /**
      * Terminate handler called by eject.
@@ -46,10 +78,44 @@ public:
      */
     virtual bool terminate(IOOptionBits options = 0);
 
+    /**
+     * Release driver resources.
+     */
+    virtual void free();
+
     /**
      * Create new async IO request.
+     * If merging is enabled request is held in merge window for a while, otherwise it is dispatched to helper right away.
+     */
+    IOReturn createRequest(IOMemoryDescriptor* buffer, UInt64 block, UInt64 nblks, IOStorageAttributes* attributes, IOStorageCompletion* completion);
+
+    /**
+     * Dispatch all requests held in merge window.
+     */
+    void flushMergeQueue();
+
+    /**
+     * Send flush request to helper and wait for it to complete.
+     * Helper writes back its write cache and flushes backing file.
+     */
+    IOReturn synchronizeCache();
+
+    /**
+     * Send discard requests for unmapped extents to helper and wait for them to complete.
+     * Adjacent extents are coalesced into a single request.
+     */
+    IOReturn unmap(const IOBlockStorageDeviceExtent* extents, UInt32 count);
+
+    /**
+     * Get helper write cache state.
+     */
+    IOReturn getWriteCacheState(bool* enabled);
+
+    /**
+     * Enable or disable helper write cache.
+     * When disabled writes are marked write through and cached data is flushed.
      */
-    IOReturn createRequest(IOMemoryDescriptor* buffer, UInt64 block, UInt64 nblks, IOStorageCompletion* completion);
+    IOReturn setWriteCacheState(bool enabled);
 		
     /**
      * Eject disk.
@@ -63,6 +129,13 @@ public:
     UInt64 getSize() {
         return mTotalBlocks;
     }
+
+    /**
+     * Get device block size in bytes.
+     */
+    UInt32 getBlockSize() {
+        return mBlockSize;
+    }
 		
 	/**
      * Get device write protection status
@@ -86,6 +159,7 @@ protected:
      * Called by user client when our helper process closes or terminates for some reason.
      * We will stop all processing but helper process should try and make sure to complete all requests before detaching (at least with error)
      * Otherwise data may be lost and we have no way to account for it.
+     * Requests still in flight are failed with kIOReturnNotReady.
      */
     void helperProcessDetached();
         
@@ -93,14 +167,163 @@ protected:
      * Called by user daemon through user client instance when previously dispatched reqeust completes.
      */
     void completeRequest(UserIORequest* request);
+
+    /**
+     * Called by user daemon through user client instance to complete a batch of requests in one call.
+     */
+    void completeRequests(UserIORequest* requests, UInt32 count);
+
+    /**
+     * Called by user daemon through user client instance to publish its own statistics.
+     */
+    void setHelperStats(const LoopHelperStatsCtl* stats);
+
+    /**
+     * Called by user daemon through user client instance when it has produced completions into completion ring
+     * and found us idle. Completes everything found in the ring.
+     */
+    void drainCompletions();
+
+    /**
+     * Get shared rings memory to be mapped into helper process.
+     */
+    IOBufferMemoryDescriptor* getSharedRings() {
+        return mRingsMemory;
+    }
+
+    /**
+     * Check that a task may map request buffer pool, shared pool is mapped into the helper that owns it only.
+     */
+    bool canMapBufferPool(task_t task);
     
+    /**
+     * Get shared request buffer pool memory to be mapped into helper process.
+     */
+    IOBufferMemoryDescriptor* getBufferPool() {
+        return mPoolMemory;
+    }
+
 private:
-    
-    org_acme_LoopDevice*    mDevice;
-    UInt64                  mTotalBlocks;
-    bool                    mReadOnly;
-    mach_port_t             mPort;
-    task_t                  mTask;
+
+    /**
+     * Send request to helper process.
+     * @param attributes    Request attributes or NULL.
+     */
+    IOReturn dispatchRequest(IOMemoryDescriptor* buffer, UInt64 block, UInt64 nblks, IOStorageAttributes* attributes, IOStorageCompletion* completion);
+
+    /**
+     * Account completed request and free its tag, caller runs completion it got back.
+     * Completion callbacks may issue new requests and wait for a tag, so they run only after the tag is freed.
+     * @return          false if request handle is invalid or request is not in flight.
+     */
+    bool retireRequest(const UserIORequest* request, LoopCompletion* done);
+
+    /**
+     * Post request to helper through submission ring or inline notification.
+     * Once posted, request is completed by helper or failed when helper detaches.
+     */
+    IOReturn postRequest(LoopIO* io, const UserIORequest* request);
+
+    /**
+     * Post discard request for a block range, its completion is accounted in wait.
+     */
+    IOReturn postDiscard(UInt64 block, UInt64 nblks, LoopSyncWait* wait);
+
+    /**
+     * Dispatch run that left merge window as a single request and fan out its completion.
+     */
+    void dispatchRun(const LoopMergeRun* run);
+
+    /**
+     * Merge window timer handler, dispatches expired runs.
+     */
+    static void sMergeTimeout(OSObject* owner, IOTimerEventSource* sender);
+
+    /**
+     * Merged request completion, completes every original request.
+     */
+    static void sMergedCompletion(void* target, void* parameter, IOReturn status, UInt64 actualByteCount);
+
+    /**
+     * Send a message to the user process port.
+     * @param msgid     kLoopUserXXXNotification message id.
+     * @param data      Message data or NULL.
+     */
+    IOReturn sendNotification(UInt32 msgid, const UserIORequest* data);
+
+    /**
+     * Check if every segment of caller buffer covers whole pages, so it can be mapped into helper process directly.
+     * Buffer has to be prepared and its length a multiple of page size.
+     */
+    bool canMapDirectly(IOMemoryDescriptor* buffer);
+
+    /**
+     * Get request data buffer for helper process.
+     * In zero copy mode caller buffer is mapped directly if possible, otherwise we take a bounce buffer
+     * from the shared pool or map a dedicated one if pool is exhausted.
+     * Fills in request buffer and flags.
+     */
+    IOReturn allocRequestBuffer(LoopIO* io, UserIORequest* request);
+
+    /**
+     * Get kernel address of request data buffer.
+     */
+    void* getRequestData(LoopIO* io);
+
+    /**
+     * Allocate request context from tag table.
+     * Waits for a request to complete if all tags are taken.
+     * @return      Cleared request context or NULL if helper detached while we were waiting.
+     */
+    LoopIO* allocRequest();
+
+    /**
+     * Release request data buffer and context.
+     */
+    void releaseRequest(LoopIO* io);
+
+    org_acme_LoopDevice*        mDevice;
+    UInt64                      mTotalBlocks;
+    UInt32                      mBlockSize;     // Logical block size negotiated with helper
+    bool                        mReadOnly;
+    bool                        mZeroCopy;      // Map caller buffers into helper directly when possible
+    bool                        mWriteCacheCapable; // Helper has a write cache
+    bool                        mWriteCache;    // Helper write cache is enabled
+    mach_port_t                 mPort;
+    task_t                      mTask;
+    IOBufferMemoryDescriptor*   mRingsMemory;   // Shared rings memory, allocated when helper attaches
+    LoopSharedRings*            mRings;         // Kernel mapping of shared rings
+    IOBufferMemoryDescriptor*   mPoolMemory;    // Shared request buffer pool memory
+    LoopPool*                   mPool;          // Shared request buffer pool allocator
+    UInt64                      mPoolSize;      // Shared request buffer pool size
+    LoopSharedPool*             mSharedPool;    // Pool memory and allocator belong to this pool if set
+    org_acme_LoopController*    mController;    // Owner of shared pool
+    IOLock*                     mSubmitLock;    // Serializes submission ring producers
+    IOLock*                     mCompleteLock;  // Serializes completion ring consumers
+    LoopTagTable*               mTags;          // Request tag allocator
+    LoopIO*                     mRequests;      // Request contexts indexed by tag
+    IOLock*                     mTagLock;       // Request tag waiters sleep on this
+    volatile SInt32             mTagWaiters;    // Number of threads waiting for a free tag
+    IOLock*                     mSyncLock;      // Flush and discard request waiters sleep on this
+    UInt32                      mMergeDelay;    // Max usec requests are held in merge window, 0 if merging is disabled
+    LoopMergeQueue*             mMergeQueue;    // Merge window
+    LoopTagTable*               mMergeTags;     // Allocator of held request slots
+    LoopMergeIO*                mMergeIOs;      // Held requests indexed by tag
+    IOLock*                     mMergeLock;     // Protects merge window
+    bool                        mMergeTimerArmed;
+    IOWorkLoop*                 mWorkLoop;      // Runs merge timer
+    IOTimerEventSource*         mMergeTimer;    // Dispatches expired runs
+    volatile SInt64             mZeroCopyRequests;  // Requests served from caller buffer mapped directly
+    volatile SInt64             mPooledRequests;    // Requests bounced through shared pool
+    volatile SInt64             mMappedRequests;    // Requests bounced through dedicated mapped buffer
+    volatile SInt64             mCompletions;       // Requests completed by helper
+    volatile SInt64             mCompleteCalls;     // Helper calls that completed requests
+    volatile SInt64             mTagWaits;          // Requests that waited for a free tag
+    volatile UInt64             mInflight;          // Requests holding a tag
+    volatile UInt64             mMaxInflight;       // Most requests ever holding a tag at once
+    LoopStats*                  mStats;             // Submit to complete latency by direction
+    LoopHelperStatsCtl          mHelperStats;       // Last statistics reported by helper
+    IOLock*                     mStatsLock;         // Protects helper statistics
 };
 
 
@@ -123,6 +346,8 @@ public:
     virtual IOReturn registerNotificationPort(mach_port_t port, UInt32 type, io_user_reference_t refCon);
     
     virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments* arguments, IOExternalMethodDispatch* dispatch = 0, OSObject* target = 0, void* reference = 0);
+
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory);
 	
 	
 protected:
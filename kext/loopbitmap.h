@@ -0,0 +1,103 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Lock-free allocation bitmap.
+//  Any number of threads may allocate and free bits concurrently, set bit means allocated.
+//  Bitmap words are owned by the user so bitmaps can be embedded into larger structures.
+//
+//  This header has no kernel or framework dependencies and is compiled into both the kext and user space code.
+//
+
+#ifndef LOOP_KEXT_BITMAP_H
+#define LOOP_KEXT_BITMAP_H
+
+#include <stdint.h>
+
+
+typedef unsigned long loop_bitmap_word_t;
+
+#define LOOP_BITMAP_WORD_BITS           (sizeof(loop_bitmap_word_t) * 8)
+#define LOOP_BITMAP_WORDS(nbits)        (((nbits) + LOOP_BITMAP_WORD_BITS - 1) / LOOP_BITMAP_WORD_BITS)
+
+
+struct LoopBitmap {
+    volatile loop_bitmap_word_t*    words;      // LOOP_BITMAP_WORDS(nbits) words provided by the user
+    uint32_t                        nbits;      // Number of usable bits
+    uint32_t                        nwords;     // Number of words
+    volatile uint32_t               hint;       // Word to start the next search from
+};
+
+
+/**
+ * Init bitmap with all bits free.
+ * Tail bits of the last word are marked allocated so they are never handed out.
+ */
+static inline void loop_bitmap_init(struct LoopBitmap* map, volatile loop_bitmap_word_t* words, uint32_t nbits)
+{
+    uint32_t i;
+
+    map->words  = words;
+    map->nbits  = nbits;
+    map->nwords = (uint32_t) LOOP_BITMAP_WORDS(nbits);
+    map->hint   = 0;
+
+    for (i = 0; i < map->nwords; ++i) {
+        words[i] = 0;
+    }
+
+    if (nbits % LOOP_BITMAP_WORD_BITS) {
+        words[map->nwords - 1] = ~(loop_bitmap_word_t)0 << (nbits % LOOP_BITMAP_WORD_BITS);
+    }
+
+    __sync_synchronize();
+}
+
+
+/**
+ * Allocate a free bit.
+ * @return      Allocated bit index or -1 if all bits are taken.
+ */
+static inline int32_t loop_bitmap_alloc(struct LoopBitmap* map)
+{
+    uint32_t start = map->hint;
+    uint32_t i;
+
+    for (i = 0; i < map->nwords; ++i) {
+        uint32_t idx = (start + i) % map->nwords;
+        loop_bitmap_word_t word = map->words[idx];
+
+        while (word != ~(loop_bitmap_word_t)0) {
+            uint32_t bit = (uint32_t) __builtin_ctzl(~word);
+            if (__sync_bool_compare_and_swap(&map->words[idx], word, word | ((loop_bitmap_word_t)1 << bit))) {
+                // Racy hint update is fine, it only spreads searching threads
+                map->hint = idx;
+                return (int32_t) (idx * LOOP_BITMAP_WORD_BITS + bit);
+            }
+
+            word = map->words[idx];
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ * Release previously allocated bit.
+ */
+static inline void loop_bitmap_free(struct LoopBitmap* map, uint32_t bit)
+{
+    __sync_fetch_and_and(&map->words[bit / LOOP_BITMAP_WORD_BITS], ~((loop_bitmap_word_t)1 << (bit % LOOP_BITMAP_WORD_BITS)));
+}
+
+
+/**
+ * Check if bit is allocated.
+ */
+static inline int loop_bitmap_test(const struct LoopBitmap* map, uint32_t bit)
+{
+    return (bit < map->nbits) && (map->words[bit / LOOP_BITMAP_WORD_BITS] & ((loop_bitmap_word_t)1 << (bit % LOOP_BITMAP_WORD_BITS)));
+}
+
+
+#endif
@@ -10,23 +10,84 @@
 #define LOOP_KEXT_CTL_H
 
 #include <stdint.h>
-#include <mach/mach_types.h>
+
+#ifdef __APPLE__
+#  include <mach/mach_types.h>
+#  ifndef KERNEL
+#    include <IOKit/IOReturn.h>
+#  endif
+#else
+// Portable helper code is also built on other systems against simulated drivers, see loopbench
+typedef int                 IOReturn;
+#  define kIOReturnSuccess      0
+#  define kIOReturnError        ((IOReturn) 0xe00002bc)
+#  define kIOReturnNoMemory     ((IOReturn) 0xe00002bd)
+#  define kIOReturnBadArgument  ((IOReturn) 0xe00002c2)
+#  define kIOReturnUnsupported  ((IOReturn) 0xe00002c7)
+#  define kIOReturnIOError      ((IOReturn) 0xe00002ca)
+#  define kIOReturnNotReady     ((IOReturn) 0xe00002d8)
+#  define kIOReturnNotAttached  ((IOReturn) 0xe00002d9)
+#endif
+
+#include "loopring.h"
+#include "loopstats.h"
 
 
 #define kLoopControllerMatchKey		"org_acme_LoopController"   // Loop controller IORegistry match key
 #define kLoopDriverMatchKey         "org_acme_LoopDriver"       // Loop driver IORegistry match key
 #define kLoopDriverPIDKey           "pid"                       // Loop driver pid property key
+#define kLoopDriverStatsKey         "stats"                     // Loop driver request statistics dictionary property key
+
+#define kLoopStatZeroCopyKey        "zerocopy"                  // Requests served from caller buffer mapped into helper
+#define kLoopStatPooledKey          "pooled"                    // Requests bounced through shared buffer pool
+#define kLoopStatMappedKey          "mapped"                    // Requests bounced through a dedicated mapped buffer
+#define kLoopStatCompletionsKey     "completions"               // Requests completed by helper
+#define kLoopStatCompleteCallsKey   "completecalls"             // Helper calls that completed requests: complete, batch complete and doorbell
+#define kLoopStatCompleteBatchKey   "completebatch"             // Average number of requests completed per helper call
+#define kLoopStatTagWaitsKey        "tagwaits"                  // Requests that had to wait for a free request tag
+#define kLoopStatMergeRequestsKey   "mergerequests"             // Requests that went through merge window
+#define kLoopStatMergeDispatchesKey "mergedispatches"           // Helper requests they were merged into
+#define kLoopStatInflightKey        "inflight"                  // Requests currently handed to helper
+#define kLoopStatMaxInflightKey     "maxinflight"               // Most requests ever handed to helper at once
+
+#define kLoopDriverLatencyKey       "latency"                   // Driver submit to complete latency dictionary property key
+#define kLoopDriverHelperLatencyKey "helperlatency"             // Helper io latency dictionary property key, as reported by helper
+#define kLoopLatencyReadKey         "read"                      // Latency dictionaries hold a LoopStatSummary per direction, keyed by field names, in nsec
+#define kLoopLatencyWriteKey        "write"
+#define kLoopLatencyFlushKey        "flush"
+#define kLoopLatencyDiscardKey      "discard"
+
+
+enum {
+    kLoopBlockSize      = 512,                      // Default loop device block size
+    kLoopMinBlockSize   = 512,                      // Smallest block size device may be attached with
+    kLoopMaxBlockSize   = 64 * 1024,                // Largest block size device may be attached with
+    kLoopMaxBufferSize  = kLoopBlockSize * 20480,   // Max request buffer size, multiple of any valid block size
+    kLoopMaxDiscardSize = 1024 * 1024 * 1024,       // Larger unmapped ranges are sent to helper in several discard requests
+};
+
+
+/**
+ * Check that block size is a power of two in [kLoopMinBlockSize, kLoopMaxBlockSize] range.
+ */
+static inline int loop_block_size_valid(uint32_t blocksize)
+{
+    return (blocksize >= kLoopMinBlockSize) && (blocksize <= kLoopMaxBlockSize) && !(blocksize & (blocksize - 1));
+}
 
 
 enum {
-    kLoopBlockSize      = 512,                      // Size of the loop block size
-    kLoopMaxBufferSize  = kLoopBlockSize * 20480,   // Max request buffer size
+    kLoopZeroCopyMinSize    = 64 * 1024,            // Smaller requests are always bounced even in zero copy mode
+    kLoopDefaultPoolSize    = 64 * 1024 * 1024,     // Default shared buffer pool size
+    kLoopMaxPoolSize        = 1024 * 1024 * 1024,   // Largest shared buffer pool helper may ask for
 };
 
 
 enum {
     kLoopIODirection_Read   = 0,            // Read from file
     kLoopIODirection_Write  = 1,            // Write to file
+    kLoopIODirection_Flush  = 2,            // Make all completed writes durable, no data
+    kLoopIODirection_Discard = 3,           // Blocks are no longer in use, helper may deallocate them in file, no data
 };
 typedef uint32_t LoopIODirection;
 
@@ -44,13 +105,31 @@ enum {
     kLoopCTL_Magic          = 0x1243,       // Magic code for all our ioctls
     kLoopCTL_Attach         = 0x01,         // LoopController ioctl to attach a new loop device
     kLoopDriverCTL_Complete = 0x02,         // LoopDriver ioctl to complete io request from user space
+    kLoopDriverCTL_Doorbell = 0x03,         // LoopDriver ioctl to notify that completion ring has new entries, no data
+    kLoopDriverCTL_CompleteBatch = 0x04,    // LoopDriver ioctl to complete an array of up to kLoopMaxCompleteBatch io requests
+    kLoopDriverCTL_Stats    = 0x05,         // LoopDriver ioctl to publish helper statistics, LoopHelperStatsCtl as data
+};
+
+enum {
+    kLoopMaxCompleteBatch   = 64,           // Max requests in kLoopDriverCTL_CompleteBatch, keeps structure input inline
 };
 
 
 struct LoopAttachCtl {
-    uint64_t    size;
+    uint64_t    size;       // Device size in blocks
     int         readonly;
     int         pid;
+    uint64_t    poolsize;   // Shared buffer pool size in bytes, 0 for kLoopDefaultPoolSize
+    int         zerocopy;   // Map caller buffers into helper directly instead of copying when possible
+    int         mergedelay; // Max usec requests are held to merge adjacent ones, 0 disables merging
+    uint64_t    writecache; // Helper write-back cache dirty limit in bytes, 0 if helper does not cache writes
+    uint32_t    blocksize;  // Logical block size in bytes, 0 for kLoopBlockSize, see loop_block_size_valid
+    int         sharedpool; // Share buffer pool with other devices of the same helper pid, first device sets pool size
+};
+
+
+struct LoopHelperStatsCtl {
+    struct LoopStatSummary  io[kLoopStatDirections];    // Helper io latency by kLoopIODirection_XXX
 };
 
 
@@ -66,23 +145,72 @@ struct LoopAttachCtl {
 enum {
     kLoopUserIONotification = 0,            // New IO request, LoopIONotification as data
     kLoopUserTerminateNotification = 1,     // Notifying device is about to be ejected, user space needs to close the connection, no data
+    kLoopUserRingNotification = 2,          // Submission ring has new entries, no data
+};
+
+enum {
+    kLoopIOFlag_Mapped          = 0x1,  // Request buffer is a pointer into task address space instead of a buffer pool offset
+    kLoopIOFlag_WriteThrough    = 0x2,  // Write cache is disabled, write must reach backing file before it completes
+    kLoopIOFlag_FUA             = 0x4,  // Force unit access, write must be durable before it completes
 };
 
 // User process io request description send through a mach port
 struct UserIORequest {
-    uint64_t            offset;     // File block offset
-    uint64_t            nblocks;    // Total blocks to process
-    uint64_t            buffer;     // Pointer to the kernel data buffer mapped into task virtual address space
+    uint64_t            offset;     // File block offset, in device blocks
+    uint64_t            nblocks;    // Total device blocks to process
+    uint64_t            buffer;     // Data buffer offset in the shared buffer pool, or a pointer with kLoopIOFlag_Mapped
     uint32_t            direction;  // Read or write as in kLoopIODirection_XXX
     uint32_t            result;     // kIOReturnXXX code, set by user once request is completed
-    uint64_t            priv;       // Private request handle
+    uint64_t            priv;       // Opaque request handle, see looptags.h
+    uint32_t            flags;      // kLoopIOFlag_XXX
+    uint32_t            reserved;
 };
 
 
+#ifdef __APPLE__
 // Enclosing mach message request structure
 struct UserRequestNotification {
     mach_msg_header_t       header;     // Standard message header
     struct UserIORequest    data;
 };
+#endif
+
+
+
+/******************************************************************************
+ *
+ * Shared memory
+ * Request rings and buffer pool mapped into user space through IOConnectMapMemory
+ *
+ ******************************************************************************/
+
+
+enum {
+    kLoopDriverMemory_Rings = 0,            // LoopSharedRings memory type for IOConnectMapMemory
+    kLoopDriverMemory_Pool  = 1,            // Shared buffer pool memory type for IOConnectMapMemory
+};
+
+enum {
+    kLoopRingDepth          = 256,          // Number of entries in each ring, power of 2
+    kLoopRequestDepth       = 2 * kLoopRingDepth,   // Max requests in flight per device, others wait for a free tag
+};
+
+// Requests are produced by the driver into submission ring and consumed by the user process.
+// Completed requests travel back the same way in completion ring.
+// Whoever produces into a ring rings a doorbell only if ring consumer is idle:
+// kLoopUserRingNotification for submissions, kLoopDriverCTL_Doorbell for completions.
+// If submission ring is full driver falls back to sending request inline with kLoopUserIONotification.
+// If completion ring is full user falls back to kLoopDriverCTL_CompleteBatch or kLoopDriverCTL_Complete.
+struct LoopSharedRings {
+    struct LoopRing         submitRing;
+    struct UserIORequest    submitQueue[kLoopRingDepth];
+    struct LoopRing         completeRing;
+    struct UserIORequest    completeQueue[kLoopRingDepth];
+};
+
+// Request data buffers are allocated by the driver from a pool of memory mapped into user process once
+// and handed out as offsets into it, see looppool.h.
+// If the pool is exhausted driver falls back to mapping a separate buffer for the request and sets kLoopIOFlag_Mapped.
+// In zero copy mode suitably aligned caller buffers are mapped into user process as is, also with kLoopIOFlag_Mapped.
 
 #endif
@@ -0,0 +1,243 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Request merging window.
+//
+//  Requests are held in a small window of pending runs for a bounded amount of time. A run is a sequence of
+//  contiguous requests in the same direction which will be dispatched to helper as a single request.
+//  New requests are appended or prepended to a run they are adjacent to, otherwise they start a new run.
+//
+//  A run leaves the window when:
+//      - it reaches max size or max number of parts and cannot grow anymore,
+//      - its deadline expires,
+//      - window is full and room is needed for a new run, oldest run is evicted then,
+//      - window is flushed by the user.
+//
+//  Merge queue does no locking and does not know what requests are, it only tracks block ranges and opaque cookies.
+//  Time is in whatever monotonic units user passes in.
+//
+//  This header has no kernel or framework dependencies and is compiled into both the kext and user space code.
+//
+
+#ifndef LOOP_KEXT_MERGE_H
+#define LOOP_KEXT_MERGE_H
+
+#include <stdint.h>
+
+
+enum {
+    kLoopMergeMaxParts      = 16,           // Max requests merged into one run
+    kLoopMergeMaxRuns       = 8,            // Max pending runs in window
+};
+
+
+struct LoopMergePart {
+    uint64_t                block;          // First block
+    uint64_t                nblks;          // Number of blocks
+    uint64_t                cookie;         // User request handle
+};
+
+
+// Parts are kept sorted by block
+struct LoopMergeRun {
+    uint32_t                direction;      // Direction shared by all parts
+    uint32_t                nparts;         // Number of parts
+    uint64_t                block;          // First block of the run
+    uint64_t                nblks;          // Total run size
+    uint64_t                deadline;       // When run has to be dispatched
+    struct LoopMergePart    parts[kLoopMergeMaxParts];
+};
+
+
+struct LoopMergeQueue {
+    uint64_t                maxBlocks;      // Max run size
+    uint64_t                delay;          // Max time a request is held in window
+    uint32_t                nruns;          // Pending runs
+    struct LoopMergeRun     runs[kLoopMergeMaxRuns];
+    uint64_t                requests;       // Requests that went through window
+    uint64_t                dispatches;     // Runs that left window
+};
+
+
+/**
+ * Init empty merge window.
+ * @param maxBlocks     Max size of a merged run in blocks.
+ * @param delay         Max time request may wait in window.
+ */
+static inline void loop_merge_init(struct LoopMergeQueue* q, uint64_t maxBlocks, uint64_t delay)
+{
+    q->maxBlocks    = maxBlocks;
+    q->delay        = delay;
+    q->nruns        = 0;
+    q->requests     = 0;
+    q->dispatches   = 0;
+}
+
+
+// Take run out of window into out
+static inline void loop_merge_remove(struct LoopMergeQueue* q, uint32_t idx, struct LoopMergeRun* out)
+{
+    *out = q->runs[idx];
+    q->runs[idx] = q->runs[--q->nruns];
+    q->dispatches++;
+}
+
+
+static inline int loop_merge_run_full(const struct LoopMergeQueue* q, const struct LoopMergeRun* run)
+{
+    return (run->nparts == kLoopMergeMaxParts) || (run->nblks >= q->maxBlocks);
+}
+
+
+/**
+ * Add new request to merge window.
+ * @param now       Current time.
+ * @param out       Receives a run that has to be dispatched now.
+ * @return          Non zero if out was filled.
+ */
+static inline int loop_merge_add(struct LoopMergeQueue* q, uint32_t direction, uint64_t block, uint64_t nblks, uint64_t cookie,
+                                 uint64_t now, struct LoopMergeRun* out)
+{
+    struct LoopMergeRun* run;
+    uint32_t i;
+
+    q->requests++;
+
+    for (i = 0; i < q->nruns; ++i) {
+        run = &q->runs[i];
+
+        if ((run->direction != direction) || (run->nblks + nblks > q->maxBlocks) || (run->nparts == kLoopMergeMaxParts)) {
+            continue;
+        }
+
+        if (run->block + run->nblks == block) {
+            // Back merge
+            run->parts[run->nparts].block   = block;
+            run->parts[run->nparts].nblks   = nblks;
+            run->parts[run->nparts].cookie  = cookie;
+        } else if (block + nblks == run->block) {
+            // Front merge
+            uint32_t j;
+            for (j = run->nparts; j > 0; --j) {
+                run->parts[j] = run->parts[j - 1];
+            }
+
+            run->parts[0].block     = block;
+            run->parts[0].nblks     = nblks;
+            run->parts[0].cookie    = cookie;
+            run->block              = block;
+        } else {
+            continue;
+        }
+
+        run->nparts++;
+        run->nblks += nblks;
+
+        if (loop_merge_run_full(q, run)) {
+            loop_merge_remove(q, i, out);
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // Request can not grow any further, no point holding it
+    if (nblks >= q->maxBlocks) {
+        out->direction          = direction;
+        out->nparts             = 1;
+        out->block              = block;
+        out->nblks              = nblks;
+        out->deadline           = now;
+        out->parts[0].block     = block;
+        out->parts[0].nblks     = nblks;
+        out->parts[0].cookie    = cookie;
+        q->dispatches++;
+        return 1;
+    }
+
+    // Start a new run, evicting the oldest one if window is full
+    int evicted = 0;
+    if (q->nruns == kLoopMergeMaxRuns) {
+        uint32_t oldest = 0;
+        for (i = 1; i < q->nruns; ++i) {
+            if (q->runs[i].deadline < q->runs[oldest].deadline) {
+                oldest = i;
+            }
+        }
+
+        loop_merge_remove(q, oldest, out);
+        evicted = 1;
+    }
+
+    run = &q->runs[q->nruns++];
+    run->direction          = direction;
+    run->nparts             = 1;
+    run->block              = block;
+    run->nblks              = nblks;
+    run->deadline           = now + q->delay;
+    run->parts[0].block     = block;
+    run->parts[0].nblks     = nblks;
+    run->parts[0].cookie    = cookie;
+
+    return evicted;
+}
+
+
+/**
+ * Take out one run whose deadline has expired.
+ * @return          Non zero if out was filled.
+ */
+static inline int loop_merge_expire(struct LoopMergeQueue* q, uint64_t now, struct LoopMergeRun* out)
+{
+    uint32_t i;
+
+    for (i = 0; i < q->nruns; ++i) {
+        if (q->runs[i].deadline <= now) {
+            loop_merge_remove(q, i, out);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Take out any pending run regardless of its deadline.
+ * @return          Non zero if out was filled.
+ */
+static inline int loop_merge_flush(struct LoopMergeQueue* q, struct LoopMergeRun* out)
+{
+    if (!q->nruns) {
+        return 0;
+    }
+
+    loop_merge_remove(q, 0, out);
+    return 1;
+}
+
+
+/**
+ * Get the earliest deadline of pending runs.
+ * @return          Non zero if window is not empty.
+ */
+static inline int loop_merge_next_deadline(const struct LoopMergeQueue* q, uint64_t* deadline)
+{
+    uint32_t i;
+
+    if (!q->nruns) {
+        return 0;
+    }
+
+    *deadline = q->runs[0].deadline;
+    for (i = 1; i < q->nruns; ++i) {
+        if (q->runs[i].deadline < *deadline) {
+            *deadline = q->runs[i].deadline;
+        }
+    }
+
+    return 1;
+}
+
+
+#endif
@@ -0,0 +1,140 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Size classed chunk allocator for the shared request buffer pool.
+//
+//  Pool memory is carved up once at init time: every size class gets an equal share of the pool
+//  which is then cut into fixed size chunks. Size classes go up by a factor of 4 starting from a page
+//  and the last one is exactly the maximum request size. Allocation takes a chunk from the smallest class
+//  that fits, moving up to larger classes when it is exhausted.
+//
+//  Allocator only deals with offsets into the pool, it never touches pool memory itself.
+//  Allocations and frees are lock-free and may be called concurrently.
+//
+//  This header has no kernel or framework dependencies and is compiled into both the kext and user space code.
+//
+
+#ifndef LOOP_KEXT_POOL_H
+#define LOOP_KEXT_POOL_H
+
+#include <stdint.h>
+
+#include "loopbitmap.h"
+
+
+enum {
+    kLoopPoolClasses        = 6,            // Number of size classes
+    kLoopPoolMaxChunks      = 4096,         // Max chunks in one size class
+    kLoopPoolMinChunkSize   = 4096,         // Smallest chunk size
+};
+
+
+struct LoopPoolClass {
+    uint64_t                chunkSize;      // Chunk size for this class, 0 if class is not used
+    uint64_t                base;           // Offset of the first chunk in the pool
+    uint32_t                count;          // Number of chunks
+    struct LoopBitmap       map;            // Chunk allocation map
+    loop_bitmap_word_t      words[LOOP_BITMAP_WORDS(kLoopPoolMaxChunks)];
+};
+
+
+struct LoopPool {
+    uint64_t                size;           // Total pool size in bytes
+    uint64_t                maxChunkSize;   // Largest allocation we can satisfy
+    struct LoopPoolClass    classes[kLoopPoolClasses];
+};
+
+
+/**
+ * Carve up pool memory into size classes.
+ * @param size          Pool size in bytes.
+ * @param maxChunkSize  Size of the largest class, multiple of kLoopPoolMinChunkSize.
+ */
+static inline void loop_pool_init(struct LoopPool* pool, uint64_t size, uint64_t maxChunkSize)
+{
+    // Smaller classes share what is left after one max sized chunk, the last class gets the rest
+    uint64_t share = ((size > maxChunkSize) ? (size - maxChunkSize) : 0) / (kLoopPoolClasses - 1);
+    uint64_t base = 0;
+    uint64_t chunkSize = kLoopPoolMinChunkSize;
+    int i;
+
+    pool->size = size;
+    pool->maxChunkSize = 0;
+
+    for (i = 0; i < kLoopPoolClasses; ++i) {
+        struct LoopPoolClass* cls = &pool->classes[i];
+        uint64_t count;
+
+        if ((i == kLoopPoolClasses - 1) || (chunkSize > maxChunkSize)) {
+            chunkSize = maxChunkSize;
+        }
+
+        // Last class takes whatever is left, which is at least one max sized chunk if the pool is that large
+        count = ((i == kLoopPoolClasses - 1) ? (size - base) : share) / chunkSize;
+        if (count > kLoopPoolMaxChunks) {
+            count = kLoopPoolMaxChunks;
+        }
+
+        cls->chunkSize  = count ? chunkSize : 0;
+        cls->base       = base;
+        cls->count      = (uint32_t) count;
+        loop_bitmap_init(&cls->map, cls->words, cls->count);
+
+        if (count) {
+            pool->maxChunkSize = chunkSize;
+        }
+
+        base += count * chunkSize;
+        chunkSize *= 4;
+    }
+}
+
+
+/**
+ * Allocate a chunk.
+ * @param nbytes    Requested size.
+ * @param offset    Receives chunk offset in the pool.
+ * @return          Non zero on success, 0 if request is too large or pool is exhausted.
+ */
+static inline int loop_pool_alloc(struct LoopPool* pool, uint64_t nbytes, uint64_t* offset)
+{
+    int i;
+
+    for (i = 0; i < kLoopPoolClasses; ++i) {
+        struct LoopPoolClass* cls = &pool->classes[i];
+        int32_t chunk;
+
+        if (cls->chunkSize < nbytes) {
+            continue;
+        }
+
+        chunk = loop_bitmap_alloc(&cls->map);
+        if (chunk >= 0) {
+            *offset = cls->base + (uint64_t) chunk * cls->chunkSize;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Release chunk allocated with loop_pool_alloc.
+ */
+static inline void loop_pool_free(struct LoopPool* pool, uint64_t offset)
+{
+    int i;
+
+    for (i = 0; i < kLoopPoolClasses; ++i) {
+        struct LoopPoolClass* cls = &pool->classes[i];
+
+        if (cls->count && (offset >= cls->base) && (offset < cls->base + cls->count * cls->chunkSize)) {
+            loop_bitmap_free(&cls->map, (uint32_t) ((offset - cls->base) / cls->chunkSize));
+            return;
+        }
+    }
+}
+
+
+#endif
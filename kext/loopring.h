@@ -0,0 +1,161 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Single producer / single consumer ring used to pass io requests and completions
+//  through memory shared between the loop driver and its user space helper.
+//
+//  The ring header only holds indexes and a wakeup flag, entries are stored by the user in an array of
+//  the same depth which follows the header. Ring depth is never read from shared memory, both sides pass
+//  their own copy so a misbehaving peer can not make us index out of bounds.
+//
+//  This header has no kernel or framework dependencies and is compiled into both the kext and user space code.
+//
+
+#ifndef LOOP_KEXT_RING_H
+#define LOOP_KEXT_RING_H
+
+#include <stdint.h>
+
+
+enum {
+    kLoopRingFlag_NeedWakeup    = 0x1,      // Consumer has no more work and waits for a doorbell
+};
+
+
+struct LoopRing {
+    volatile uint32_t   head;               // Index of the next entry to consume, written by consumer only
+    uint32_t            pad0[15];
+    volatile uint32_t   tail;               // Index of the next entry to produce, written by producer only
+    uint32_t            pad1[15];
+    volatile uint32_t   flags;              // kLoopRingFlag_XXX, written by consumer only
+    uint32_t            pad2[15];
+};
+
+
+// Full memory barrier.
+// Stronger than we need for an SPSC ring but available in every compiler we build with, kernel or not.
+#define loop_ring_barrier()     __sync_synchronize()
+
+
+/**
+ * Reset ring to an empty state with consumer waiting for a doorbell.
+ */
+static inline void loop_ring_init(struct LoopRing* ring)
+{
+    ring->head  = 0;
+    ring->tail  = 0;
+    ring->flags = kLoopRingFlag_NeedWakeup;
+    loop_ring_barrier();
+}
+
+
+/**
+ * Number of entries ready to be consumed.
+ * Returns a value larger than depth if ring indexes were corrupted by the peer.
+ */
+static inline uint32_t loop_ring_count(const struct LoopRing* ring)
+{
+    return ring->tail - ring->head;
+}
+
+
+/**
+ * Get slot index for the next produced entry.
+ * @param depth     Ring depth, power of 2.
+ * @param slot      Receives entry slot index on success.
+ * @return          Non zero if slot is available, 0 if ring is full.
+ */
+static inline int loop_ring_produce_begin(struct LoopRing* ring, uint32_t depth, uint32_t* slot)
+{
+    uint32_t tail = ring->tail;
+    loop_ring_barrier();
+
+    if ((tail - ring->head) >= depth) {
+        return 0;
+    }
+
+    *slot = tail & (depth - 1);
+    return 1;
+}
+
+
+/**
+ * Publish entry previously reserved with loop_ring_produce_begin.
+ * @return          Non zero if consumer is idle and needs a doorbell.
+ */
+static inline int loop_ring_produce_commit(struct LoopRing* ring)
+{
+    // Entry contents must be visible before the new tail
+    loop_ring_barrier();
+    ring->tail = ring->tail + 1;
+
+    // New tail must be visible before we look at the wakeup flag, pairs with loop_ring_consumer_idle
+    loop_ring_barrier();
+    return (ring->flags & kLoopRingFlag_NeedWakeup) != 0;
+}
+
+
+/**
+ * Get slot index of the next entry to consume.
+ * @param depth     Ring depth, power of 2.
+ * @param slot      Receives entry slot index on success.
+ * @return          1 if entry is available, 0 if ring is empty, -1 if ring indexes are corrupted.
+ */
+static inline int loop_ring_consume_begin(struct LoopRing* ring, uint32_t depth, uint32_t* slot)
+{
+    uint32_t head = ring->head;
+    uint32_t count = ring->tail - head;
+
+    if (count == 0) {
+        return 0;
+    } else if (count > depth) {
+        return -1;
+    }
+
+    // Entry contents can be read only after we have seen the tail
+    loop_ring_barrier();
+    *slot = head & (depth - 1);
+    return 1;
+}
+
+
+/**
+ * Release entry previously returned by loop_ring_consume_begin back to producer.
+ */
+static inline void loop_ring_consume_commit(struct LoopRing* ring)
+{
+    // We must be done reading entry contents before producer can reuse it
+    loop_ring_barrier();
+    ring->head = ring->head + 1;
+}
+
+
+/**
+ * Consumer is actively processing entries, producer does not need to ring a doorbell.
+ */
+static inline void loop_ring_consumer_busy(struct LoopRing* ring)
+{
+    ring->flags &= ~kLoopRingFlag_NeedWakeup;
+}
+
+
+/**
+ * Consumer ran out of entries and is about to wait for a doorbell.
+ * @return          Non zero if consumer may sleep, 0 if new entries raced in and consumer should keep going.
+ */
+static inline int loop_ring_consumer_idle(struct LoopRing* ring)
+{
+    ring->flags |= kLoopRingFlag_NeedWakeup;
+
+    // Flag must be visible before we check the tail, pairs with loop_ring_produce_commit
+    loop_ring_barrier();
+    if (loop_ring_count(ring) != 0) {
+        ring->flags &= ~kLoopRingFlag_NeedWakeup;
+        return 0;
+    }
+
+    return 1;
+}
+
+
+#endif
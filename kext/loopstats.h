@@ -0,0 +1,193 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Request counters and latency histograms.
+//
+//  Counters are sharded so that threads on different cpus update different cache lines. Every shard is updated
+//  with plain atomic adds and nobody ever takes a lock, readers sum all shards up into a snapshot whenever they want.
+//  Users pick a shard by cpu number or anything that spreads their threads, it only has to be stable for a while.
+//
+//  Latencies are kept in log-linear histograms: every power of two range is split into kLoopHistSubBuckets linear
+//  buckets, so percentiles are precise to 1/kLoopHistSubBuckets of the value at any scale from nanoseconds to minutes.
+//
+//  This header has no kernel or framework dependencies and is compiled into both the kext and user space code.
+//
+
+#ifndef LOOP_KEXT_STATS_H
+#define LOOP_KEXT_STATS_H
+
+#include <stdint.h>
+
+
+enum {
+    kLoopStatShards         = 8,                    // Counter shards, power of 2
+    kLoopStatDirections     = 4,                    // Read, write, flush and discard as in kLoopIODirection_XXX
+    kLoopHistSubBits        = 3,
+    kLoopHistSubBuckets     = 1 << kLoopHistSubBits,    // Linear buckets per power of two
+    kLoopHistMaxBits        = 36,                   // Largest tracked value is 2^36 ns, about 68 seconds, larger ones are clamped
+    kLoopHistBuckets        = (kLoopHistMaxBits - kLoopHistSubBits + 1) * kLoopHistSubBuckets,
+};
+
+
+struct LoopStatCounters {
+    volatile uint64_t       ops;                    // Requests completed
+    volatile uint64_t       bytes;                  // Bytes transferred
+    volatile uint64_t       latency;                // Sum of request latencies
+    volatile uint64_t       maxLatency;             // Worst latency seen
+    volatile uint64_t       hist[kLoopHistBuckets]; // Latency histogram
+};
+
+
+struct LoopStatShard {
+    struct LoopStatCounters dirs[kLoopStatDirections];
+} __attribute__((aligned(64)));
+
+
+struct LoopStats {
+    struct LoopStatShard    shards[kLoopStatShards];
+};
+
+
+// Summary of one direction, latencies in nanoseconds
+struct LoopStatSummary {
+    uint64_t                ops;
+    uint64_t                bytes;
+    uint64_t                mean;
+    uint64_t                p50;
+    uint64_t                p90;
+    uint64_t                p99;
+    uint64_t                p999;
+    uint64_t                max;
+};
+
+
+/**
+ * Clear all counters.
+ */
+static inline void loop_stats_init(struct LoopStats* stats)
+{
+    uint8_t* p = (uint8_t*) stats;
+    uint32_t i;
+
+    for (i = 0; i < sizeof(*stats); ++i) {
+        p[i] = 0;
+    }
+
+    __sync_synchronize();
+}
+
+
+/**
+ * Map value to histogram bucket.
+ */
+static inline uint32_t loop_hist_bucket(uint64_t value)
+{
+    if (value < kLoopHistSubBuckets) {
+        return (uint32_t) value;
+    }
+
+    uint32_t msb = 63 - (uint32_t) __builtin_clzll(value);
+    if (msb >= kLoopHistMaxBits) {
+        return kLoopHistBuckets - 1;
+    }
+
+    // Top kLoopHistSubBits bits below msb pick a linear bucket inside power of two range
+    uint32_t sub = (uint32_t) (value >> (msb - kLoopHistSubBits)) & (kLoopHistSubBuckets - 1);
+    return (msb - kLoopHistSubBits + 1) * kLoopHistSubBuckets + sub;
+}
+
+
+/**
+ * Get the largest value that maps to a histogram bucket.
+ */
+static inline uint64_t loop_hist_bucket_max(uint32_t bucket)
+{
+    if (bucket < kLoopHistSubBuckets) {
+        return bucket;
+    }
+
+    uint32_t shift = bucket / kLoopHistSubBuckets - 1;
+    uint64_t sub = bucket % kLoopHistSubBuckets;
+    return ((kLoopHistSubBuckets + sub + 1) << shift) - 1;
+}
+
+
+/**
+ * Record completed request.
+ * @param shard     Shard hint, any number, callers on the same cpu should pass the same one.
+ * @param latency   Request latency in nanoseconds.
+ */
+static inline void loop_stats_record(struct LoopStats* stats, uint32_t shard, uint32_t direction, uint64_t bytes, uint64_t latency)
+{
+    struct LoopStatCounters* c = &stats->shards[shard & (kLoopStatShards - 1)].dirs[direction];
+    uint64_t max;
+
+    __sync_fetch_and_add(&c->ops, 1);
+    __sync_fetch_and_add(&c->bytes, bytes);
+    __sync_fetch_and_add(&c->latency, latency);
+    __sync_fetch_and_add(&c->hist[loop_hist_bucket(latency)], 1);
+
+    while (latency > (max = c->maxLatency)) {
+        if (__sync_bool_compare_and_swap(&c->maxLatency, max, latency)) {
+            break;
+        }
+    }
+}
+
+
+/**
+ * Sum all shards up into a summary.
+ * Requests recorded while this runs may or may not be accounted for.
+ */
+static inline void loop_stats_summarize(const struct LoopStats* stats, uint32_t direction, struct LoopStatSummary* out)
+{
+    uint64_t latency = 0;
+    uint64_t total = 0;
+    uint32_t i, j;
+
+    out->ops = 0;
+    out->bytes = 0;
+    out->max = 0;
+
+    for (i = 0; i < kLoopStatShards; ++i) {
+        const struct LoopStatCounters* c = &stats->shards[i].dirs[direction];
+
+        out->ops += c->ops;
+        out->bytes += c->bytes;
+        latency += c->latency;
+        if (c->maxLatency > out->max) {
+            out->max = c->maxLatency;
+        }
+
+        for (j = 0; j < kLoopHistBuckets; ++j) {
+            total += c->hist[j];
+        }
+    }
+
+    out->mean = out->ops ? latency / out->ops : 0;
+
+    // Percentiles are upper bounds of buckets where running count crosses them, never above the real max.
+    // Buckets are summed over shards on the fly, histogram copy is too large for a kernel stack.
+    uint64_t* targets[] = { &out->p50, &out->p90, &out->p99, &out->p999 };
+    static const uint32_t permyriad[] = { 5000, 9000, 9900, 9990 };
+    uint64_t seen = 0;
+    uint32_t t;
+
+    for (t = 0; t < 4; ++t) {
+        *targets[t] = 0;
+    }
+
+    for (j = 0, t = 0; (j < kLoopHistBuckets) && (t < 4) && total; ++j) {
+        for (i = 0; i < kLoopStatShards; ++i) {
+            seen += stats->shards[i].dirs[direction].hist[j];
+        }
+
+        while ((t < 4) && (seen * 10000 >= total * permyriad[t])) {
+            uint64_t value = loop_hist_bucket_max(j);
+            *targets[t++] = (value < out->max) ? value : out->max;
+        }
+    }
+}
+
+
+#endif
@@ -0,0 +1,101 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Request tag table.
+//
+//  Every request in flight is identified by a small integer tag which indexes a preallocated request context array.
+//  Tags are handed out by a lock-free bitmap allocator. Every tag slot keeps a generation counter which is bumped
+//  when the tag is released, so handles given out to user space go stale once request completes and cannot be
+//  used to complete somebody else's request later on.
+//
+//  This header has no kernel or framework dependencies and is compiled into both the kext and user space code.
+//
+
+#ifndef LOOP_KEXT_TAGS_H
+#define LOOP_KEXT_TAGS_H
+
+#include <stdint.h>
+
+#include "loopbitmap.h"
+
+
+enum {
+    kLoopMaxTags            = 1024,         // Max tag table depth
+};
+
+
+struct LoopTagTable {
+    uint32_t                depth;          // Number of usable tags
+    struct LoopBitmap       map;            // Tag allocation map
+    loop_bitmap_word_t      words[LOOP_BITMAP_WORDS(kLoopMaxTags)];
+    volatile uint32_t       generations[kLoopMaxTags];
+};
+
+
+/**
+ * Init tag table with all tags free.
+ * @param depth     Number of tags, up to kLoopMaxTags.
+ */
+static inline void loop_tags_init(struct LoopTagTable* tags, uint32_t depth)
+{
+    uint32_t i;
+
+    if (depth > kLoopMaxTags) {
+        depth = kLoopMaxTags;
+    }
+
+    tags->depth = depth;
+    for (i = 0; i < kLoopMaxTags; ++i) {
+        tags->generations[i] = 0;
+    }
+
+    loop_bitmap_init(&tags->map, tags->words, depth);
+}
+
+
+/**
+ * Allocate a tag.
+ * @return      Tag or -1 if table is full.
+ */
+static inline int32_t loop_tags_alloc(struct LoopTagTable* tags)
+{
+    return loop_bitmap_alloc(&tags->map);
+}
+
+
+/**
+ * Release tag. Any handles created for it become invalid.
+ */
+static inline void loop_tags_free(struct LoopTagTable* tags, uint32_t tag)
+{
+    __sync_fetch_and_add(&tags->generations[tag], 1);
+    loop_bitmap_free(&tags->map, tag);
+}
+
+
+/**
+ * Get opaque handle for allocated tag, safe to give out to user space.
+ */
+static inline uint64_t loop_tags_handle(const struct LoopTagTable* tags, uint32_t tag)
+{
+    return ((uint64_t) tags->generations[tag] << 32) | tag;
+}
+
+
+/**
+ * Check handle and get its tag.
+ * @return      Tag or -1 if handle does not refer to a currently allocated tag.
+ */
+static inline int32_t loop_tags_lookup(const struct LoopTagTable* tags, uint64_t handle)
+{
+    uint32_t tag = (uint32_t) handle;
+
+    if ((tag >= tags->depth) || !loop_bitmap_test(&tags->map, tag) || (tags->generations[tag] != (uint32_t) (handle >> 32))) {
+        return -1;
+    }
+
+    return (int32_t) tag;
+}
+
+
+#endif
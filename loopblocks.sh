@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Device block size check, Linux only.
+# For every block size writes a device with loopsim verify pattern through loophelper -B, reads it back through
+# devices of every other block size, runs verified random reads and writes of single blocks and checks that every
+# request reaching the backing file in the helper trace is block aligned. Fails on wrong data or a misaligned request.
+#
+# usage: loopblocks.sh [seconds] [extra loophelper options]
+# LOOPSIM and LOOPHELPER point at the binaries, default is the current directory.
+# BLOCKSIZES lists block sizes, default "512 4096 65536".
+#
+
+LOOPSIM=${LOOPSIM:-./loopsim}
+LOOPHELPER=${LOOPHELPER:-./loophelper}
+BLOCKSIZES=${BLOCKSIZES:-512 4096 65536}
+DURATION=${1:-1}
+[ $# -gt 0 ] && shift
+DIR=`mktemp -d /tmp/loopblocks.XXXXXX`
+SOCK=$DIR/sim.sock
+IMG=$DIR/dev.img
+SIZE=$((32 * 1024 * 1024))
+
+trap 'rm -rf $DIR' EXIT
+
+# Run loopsim workload against loophelper with a block size and check its trace, fails the script if anything went wrong
+# usage: run blocksize label loopsim options...
+run()
+{
+    BLOCKSIZE=$1
+    LABEL=$2
+    shift 2
+    $LOOPSIM "$@" $SOCK > $DIR/sim.out 2>&1 &
+    SIM=$!
+    while [ ! -S $SOCK ]; do
+        sleep 0.1
+    done
+
+    $LOOPHELPER -B $BLOCKSIZE -T $DIR/trace $HELPER_OPTS $SOCK $IMG > /dev/null 2>&1
+    if ! wait $SIM; then
+        echo "loopsim failed with $BLOCKSIZE bytes blocks:"
+        cat $DIR/sim.out
+        exit 1
+    fi
+
+    # Records after 24 bytes header, 32 bytes each: time, offset, nbytes, latency, op and flags, error
+    read RECORDS MISALIGNED <<EOF
+`od -A n -v -t u4 -w32 -j 24 $DIR/trace | awk -v b=$BLOCKSIZE '($3 % b) || ($5 % b) { n++ } END { print NR, n + 0 }'`
+EOF
+
+    printf "%10u %10s %10u %10u\n" $BLOCKSIZE $LABEL $RECORDS $MISALIGNED
+    if [ $MISALIGNED -ne 0 ]; then
+        echo "Helper sent misaligned requests with $BLOCKSIZE bytes blocks"
+        exit 1
+    fi
+}
+
+HELPER_OPTS="$*"
+
+printf "%10s %10s %10s %10s\n" blocksize run requests misaligned
+
+for B in $BLOCKSIZES; do
+    rm -f $IMG
+    truncate -s $SIZE $IMG
+
+    # Requests of several blocks lay the pattern down
+    run $B write -V -p seq -r 0 -s $((B * 8)) -q 32 -n $((SIZE / B / 8))
+
+    # Pattern depends on offsets only, every block size has to read back the same
+    for R in $BLOCKSIZES; do
+        run $R read/$B -V -p seq -r 100 -s $R -q 32 -n $((SIZE / R))
+    done
+
+    # Single blocks at random, mixed reads and writes
+    run $B rand -V -p rand -r 50 -s $B -q 32 -d $DURATION
+done
+
+exit 0
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Checks of the components kext shares with user space, Linux only.
+# Runs contending checks with 1, 2, 4 ... threads, ring check between threads and between processes and merge check
+# once, fails on the first wrong answer.
+#
+# usage: loopcheck.sh [seconds] [checks]
+# LOOPCHECK points at the binary, default is the current directory. THREADS lists thread counts, default "1 2 4 8".
+# TRACE is a trace recorded with -T that merge check replays too.
+#
+
+LOOPCHECK=${LOOPCHECK:-./loopcheck}
+THREADS=${THREADS:-"1 2 4 8"}
+DURATION=${1:-1}
+[ $# -gt 0 ] && shift
+CHECKS=${*:-"ring pool tags merge stats"}
+
+printf "%-8s %-12s %14s  %s\n" check mode rate details
+
+for CHECK in $CHECKS; do
+    case $CHECK in
+    ring)
+        RUNS="- -P"
+        ;;
+    merge)
+        RUNS=${TRACE:+-f$TRACE}
+        RUNS=${RUNS:--}
+        ;;
+    *)
+        RUNS=
+        for T in $THREADS; do
+            RUNS="$RUNS -t$T"
+        done
+        ;;
+    esac
+
+    for RUN in $RUNS; do
+        [ "$RUN" = "-" ] && RUN=
+        if ! $LOOPCHECK -d $DURATION $RUN $CHECK; then
+            echo "$CHECK check failed"
+            exit 1
+        fi
+    done
+done
+
+exit 0
@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Overlay image overhead benchmark, Linux only.
+# Runs loopbench random reads and writes against a raw image, a fresh overlay of it, where first writes copy clusters
+# from base, and an overlay that has all of its clusters copied already.
+#
+# usage: loopcow.sh [size in MB] [seconds] [extra loopbench options]
+# LOOPBENCH and LOOPIMG point at the binaries, default is the current directory.
+#
+
+LOOPBENCH=${LOOPBENCH:-./loopbench}
+LOOPIMG=${LOOPIMG:-./loopimg}
+SIZE=${1:-256}
+DURATION=${2:-5}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+DIR=`mktemp -d /tmp/loopcow.XXXXXX`
+BASE=$DIR/base.img
+
+trap 'rm -rf $DIR' EXIT
+
+dd if=/dev/urandom of=$BASE bs=1M count=$SIZE status=none
+
+printf "%10s %8s %12s %10s %10s %10s %10s\n" image readpct iops mbps mean_us p50_us p99_us
+
+for READPCT in 100 50 0; do
+    for IMAGE in raw fresh full; do
+        FILE=$DIR/$IMAGE.img
+        rm -f $FILE
+        case $IMAGE in
+        raw)
+            cp $BASE $FILE
+            ;;
+        fresh)
+            $LOOPIMG create $BASE $FILE || exit 1
+            ;;
+        full)
+            $LOOPIMG create $BASE $FILE || exit 1
+            $LOOPBENCH -p seq -r 0 -s 1048576 -n $SIZE $FILE > /dev/null 2>&1
+            ;;
+        esac
+
+        # {... "all":{"ops":1,"bytes":2,"iops":3.0,"mbps":4.00,"lat_mean_us":5.00,"lat_p50_us":6.00,...
+        $LOOPBENCH -p rand -r $READPCT -d $DURATION "$@" $FILE > $DIR/bench.out 2> /dev/null
+        OUT=`tail -n 1 $DIR/bench.out`
+        if [ -z "$OUT" ]; then
+            echo "loopbench failed on $IMAGE image"
+            exit 1
+        fi
+
+        echo "$OUT" | sed 's/.*"all":{\([^}]*\)}.*/\1/' | tr ',' '\n' | awk -F: -v image=$IMAGE -v pct=$READPCT '
+            { v[$1] = $2 }
+            END { printf "%10s %8u %12.0f %10.1f %10.2f %10.2f %10.2f\n", image, pct, v["\"iops\""], v["\"mbps\""],
+                  v["\"lat_mean_us\""], v["\"lat_p50_us\""], v["\"lat_p99_us\""] }'
+    done
+done
+
+exit 0
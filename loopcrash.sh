@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# Helper crash consistency check, Linux only.
+# Writes a device sequentially with loopsim verify pattern and cache flushes through loophelper with a write-back
+# cache, kills the helper once some flushes completed and reads everything the last completed flush covered back
+# through a fresh helper without cache. Fails unless all of it is there.
+#
+# Helper is killed, host keeps running, so this checks that flush completes only after cached writes reached the
+# backing file, not what survives a power loss.
+#
+# usage: loopcrash.sh [flushes] [cache megabytes] [extra loophelper options]
+# LOOPSIM and LOOPHELPER point at the binaries, default is the current directory.
+#
+
+LOOPSIM=${LOOPSIM:-./loopsim}
+LOOPHELPER=${LOOPHELPER:-./loophelper}
+FLUSHES=${1:-4}
+CACHE=${2:-16}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+DIR=`mktemp -d /tmp/loopcrash.XXXXXX`
+SOCK=$DIR/sim.sock
+IMG=$DIR/dev.img
+SIZE=65536
+
+trap 'rm -rf $DIR' EXIT
+
+truncate -s 256M $IMG
+
+# Helper is going to die, loopsim is the one to judge
+$LOOPSIM -V -p seq -r 0 -s $SIZE -q 32 -F 256 -K $FLUSHES -d 60 $SOCK > $DIR/sim.out 2>&1 &
+SIM=$!
+while [ ! -S $SOCK ]; do
+    sleep 0.1
+done
+
+$LOOPHELPER -c $CACHE "$@" $SOCK $IMG > /dev/null 2>&1
+if ! wait $SIM; then
+    echo "loopsim failed writing:"
+    cat $DIR/sim.out
+    exit 1
+fi
+
+# Killed helper pid 123 after 4 flushes, 16777216 bytes flushed
+FLUSHED=`grep '^Killed helper' $DIR/sim.out | sed 's/.*, \([0-9]*\) bytes flushed/\1/'`
+if [ -z "$FLUSHED" ] || [ "$FLUSHED" -eq 0 ]; then
+    echo "Helper was not killed after a completed flush:"
+    cat $DIR/sim.out
+    exit 1
+fi
+
+$LOOPSIM -V -p seq -r 100 -s $SIZE -q 32 -n $((FLUSHED / SIZE)) $SOCK > $DIR/sim.out 2>&1 &
+SIM=$!
+while [ ! -S $SOCK ]; do
+    sleep 0.1
+done
+
+$LOOPHELPER "$@" $SOCK $IMG > /dev/null 2>&1
+if ! wait $SIM; then
+    echo "Flushed data did not survive helper crash:"
+    cat $DIR/sim.out
+    exit 1
+fi
+
+printf "%8s %10s %14s %s\n" flushes cache_mb flushed_bytes result
+printf "%8u %10u %14u %s\n" $FLUSHES $CACHE $FLUSHED verified
+
+exit 0
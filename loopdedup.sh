@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# Deduplicated image benchmark, Linux only.
+# Builds a base image of executables and copies of it with a few percent of their chunks changed, like VM images
+# cloned from one golden image, and imports them all into one chunk store. Reports ingest throughput and dedup
+# ratio, then runs loopbench random 4K and sequential 1M reads against a raw copy and a deduplicated image.
+#
+# usage: loopdedup.sh [size in MB] [images] [changed percent] [seconds] [extra loopbench options]
+# LOOPBENCH and LOOPIMG point at the binaries, default is the current directory.
+#
+
+LOOPBENCH=${LOOPBENCH:-./loopbench}
+LOOPIMG=${LOOPIMG:-./loopimg}
+SIZE=${1:-256}
+IMAGES=${2:-8}
+CHANGED=${3:-5}
+DURATION=${4:-5}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+DIR=`mktemp -d /tmp/loopdedup.XXXXXX`
+BASE=$DIR/base.raw
+STORE=$DIR/store.lds
+BYTES=$((SIZE * 1024 * 1024))
+CHUNKS=$((SIZE * 16))
+
+trap 'rm -rf $DIR' EXIT
+
+: > $BASE
+while [ `stat -c %s $BASE` -lt $BYTES ]; do
+    cat /usr/bin/* 2> /dev/null | head -c $((BYTES - `stat -c %s $BASE`)) >> $BASE
+done
+
+# Room for every image to be all different
+$LOOPIMG store -s $((SIZE * (IMAGES + 1))) $STORE || exit 1
+
+TOTAL=0
+for I in `seq 1 $IMAGES`; do
+    RAW=$DIR/image$I.raw
+    cp $BASE $RAW
+    awk -v n=$((CHUNKS * CHANGED / 100)) -v chunks=$CHUNKS -v seed=$I 'BEGIN { srand(seed); for (i = 0; i < n; i++) print int(rand() * chunks) }' |
+    while read CHUNK; do
+        dd if=/dev/urandom of=$RAW bs=64k seek=$CHUNK count=1 conv=notrunc status=none
+    done
+
+    START=`date +%s%N`
+    $LOOPIMG dedup $STORE $DIR/image$I.img $RAW > /dev/null || exit 1
+    END=`date +%s%N`
+    TOTAL=$((TOTAL + END - START))
+
+    [ $I -gt 1 ] && rm -f $RAW
+done
+
+STORED=`$LOOPIMG info $STORE | awk '/^used:/ { print $2 }'`
+RATIO=`$LOOPIMG info $STORE | awk '/^ratio:/ { print $2 }'`
+awk -v bytes=$((BYTES * IMAGES)) -v ns=$TOTAL -v stored=$STORED -v ratio=$RATIO 'BEGIN {
+    printf "ingest %.1f MB/s, %u MB in, %u MB stored, dedup ratio %s\n", bytes / 1048576 / (ns / 1e9), bytes / 1048576, stored / 16, ratio }'
+
+printf "%8s %8s %8s %12s %10s %10s %10s %10s\n" image pattern size iops mbps mean_us p50_us p99_us
+
+for PATTERN in rand seq; do
+    [ $PATTERN = seq ] && BS=1048576 || BS=4096
+
+    for IMAGE in raw dedup; do
+        [ $IMAGE = raw ] && FILE=$DIR/image1.raw || FILE=$DIR/image1.img
+
+        # {... "all":{"ops":1,"bytes":2,"iops":3.0,"mbps":4.00,"lat_mean_us":5.00,"lat_p50_us":6.00,...
+        $LOOPBENCH -p $PATTERN -s $BS -d $DURATION "$@" $FILE > $DIR/bench.out 2> /dev/null
+        OUT=`tail -n 1 $DIR/bench.out`
+        if [ -z "$OUT" ]; then
+            echo "loopbench failed on $IMAGE image"
+            exit 1
+        fi
+
+        echo "$OUT" | sed 's/.*"all":{\([^}]*\)}.*/\1/' | tr ',' '\n' | awk -F: -v image=$IMAGE -v pattern=$PATTERN -v bs=$BS '
+            { v[$1] = $2 }
+            END { printf "%8s %8s %8u %12.0f %10.1f %10.2f %10.2f %10.2f\n", image, pattern, bs, v["\"iops\""], v["\"mbps\""],
+                  v["\"lat_mean_us\""], v["\"lat_p50_us\""], v["\"lat_p99_us\""] }'
+    done
+done
+
+exit 0
@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Discard check, Linux only.
+# Fills a backing file through loophelper, discards all of it and checks file system deallocated its blocks.
+#
+# usage: loopdiscard.sh [size in MB] [extra loophelper options]
+# LOOPSIM and LOOPHELPER point at the binaries, default is the current directory.
+#
+
+LOOPSIM=${LOOPSIM:-./loopsim}
+LOOPHELPER=${LOOPHELPER:-./loophelper}
+SIZE=${1:-64}
+[ $# -gt 0 ] && shift
+DIR=`mktemp -d /tmp/loopdiscard.XXXXXX`
+SOCK=$DIR/sim.sock
+FILE=$DIR/dev.img
+NOPS=$((SIZE * 16))
+
+trap 'rm -rf $DIR' EXIT
+
+# Writes or discards every 64K block of the file once, in order
+run() {
+    $LOOPSIM -p seq -r 0 -s 65536 -n $NOPS "$@" $SOCK > $DIR/sim.out 2>&1 &
+    SIM=$!
+    while [ ! -S $SOCK ]; do
+        sleep 0.1
+    done
+
+    $LOOPHELPER $HELPER_OPTIONS $SOCK $FILE > $DIR/helper.out 2>&1
+    if ! wait $SIM; then
+        echo "loopsim failed:"
+        cat $DIR/sim.out $DIR/helper.out
+        exit 1
+    fi
+    rm -f $SOCK
+}
+
+HELPER_OPTIONS="$*"
+truncate -s ${SIZE}M $FILE
+
+run
+sync $FILE
+WRITTEN=`stat -c %b $FILE`
+
+run -u 100
+sync $FILE
+DISCARDED=`stat -c %b $FILE`
+
+printf "%12s %16s %16s\n" size_mb blocks_written blocks_discarded
+printf "%12u %16u %16u\n" $SIZE $WRITTEN $DISCARDED
+
+if [ $DISCARDED -ge $WRITTEN ]; then
+    echo "Discards did not deallocate any blocks:"
+    cat $DIR/helper.out
+    exit 1
+fi
+
+exit 0
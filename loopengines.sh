@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Backing store engine comparison on a cached file.
+# Runs loopbench 4K random reads against the same file with each engine after reading the file into page cache.
+#
+# usage: loopengines.sh [file] [seconds] [extra loopbench options]
+# Without a file a 256M scratch file is made in /tmp. LOOPBENCH points at the binary, default is the current directory,
+# ENGINES lists engines to run, default "posix mmap".
+#
+
+LOOPBENCH=${LOOPBENCH:-./loopbench}
+ENGINES=${ENGINES:-posix mmap}
+FILE=$1
+DURATION=${2:-5}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+
+if [ -z "$FILE" ]; then
+    DIR=`mktemp -d /tmp/loopengines.XXXXXX`
+    trap 'rm -rf $DIR' EXIT
+    FILE=$DIR/cached.img
+    # Real data, holes would be served from the zero page by mmap and skew the comparison
+    head -c 256M /dev/urandom > $FILE
+fi
+
+printf "%8s %12s %10s %10s %10s %10s\n" engine iops mean_us p50_us p99_us p999_us
+
+for ENGINE in $ENGINES; do
+    # {... "all":{"ops":1,"bytes":2,"iops":3.0,"mbps":4.00,"lat_mean_us":5.00,"lat_p50_us":6.00,...
+    OUT=`$LOOPBENCH -W -p rand -s 4096 -d $DURATION -e $ENGINE "$@" $FILE 2> /dev/null | tail -n 1`
+    if [ -z "$OUT" ]; then
+        echo "loopbench failed with engine $ENGINE"
+        exit 1
+    fi
+
+    echo "$OUT" | sed 's/.*"all":{\([^}]*\)}.*/\1/' | tr ',' '\n' | awk -F: -v engine=$ENGINE '
+        { v[$1] = $2 }
+        END { printf "%8s %12.0f %10.2f %10.2f %10.2f %10.2f\n", engine, v["\"iops\""], v["\"lat_mean_us\""],
+              v["\"lat_p50_us\""], v["\"lat_p99_us\""], v["\"lat_p999_us\""] }'
+done
+
+exit 0
@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Fio style backing store engine comparison, Linux only.
+# Runs the usual fio jobs through loopbench with each engine against the same file with direct io:
+# 4K random reads and writes at depth 32 and 128K sequential reads and writes at depth 8.
+#
+# usage: loopfio.sh [file] [seconds] [extra loopbench options]
+# Without a file a 256M scratch file is made in /tmp, the file has to be on a file system taking O_DIRECT.
+# LOOPBENCH points at the binary, default is the current directory, ENGINES lists engines to run, default "posix uring".
+#
+
+LOOPBENCH=${LOOPBENCH:-./loopbench}
+ENGINES=${ENGINES:-posix uring}
+FILE=$1
+DURATION=${2:-5}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+
+if [ -z "$FILE" ]; then
+    DIR=`mktemp -d /tmp/loopfio.XXXXXX`
+    trap 'rm -rf $DIR' EXIT
+    FILE=$DIR/fio.img
+    # Real data, reads of holes never reach the disk
+    head -c 256M /dev/urandom > $FILE
+fi
+
+# name:pattern:readpct:size:depth, what fio calls rw, bs and iodepth
+JOBS="randread:rand:100:4096:32 randwrite:rand:0:4096:32 read:seq:100:131072:8 write:seq:0:131072:8"
+
+printf "%-10s %8s %10s %10s %10s %10s %10s\n" job engine iops MB/s mean_us p99_us p999_us
+
+for JOB in $JOBS; do
+    set -- `echo $JOB | tr ':' ' '` "$@"
+    NAME=$1
+    PATTERN=$2
+    READPCT=$3
+    SIZE=$4
+    DEPTH=$5
+    shift 5
+
+    for ENGINE in $ENGINES; do
+        # {... "all":{"ops":1,"bytes":2,"iops":3.0,"mbps":4.00,"lat_mean_us":5.00,"lat_p50_us":6.00,...
+        OUT=`$LOOPBENCH -D -p $PATTERN -r $READPCT -s $SIZE -q $DEPTH -d $DURATION -e $ENGINE "$@" $FILE 2> /dev/null | tail -n 1`
+        if [ -z "$OUT" ]; then
+            echo "loopbench failed running $NAME with engine $ENGINE"
+            exit 1
+        fi
+
+        echo "$OUT" | sed 's/.*"all":{\([^}]*\)}.*/\1/' | tr ',' '\n' | awk -F: -v job=$NAME -v engine=$ENGINE '
+            { v[$1] = $2 }
+            END { printf "%-10s %8s %10.0f %10.1f %10.2f %10.2f %10.2f\n", job, engine, v["\"iops\""], v["\"mbps\""],
+                  v["\"lat_mean_us\""], v["\"lat_p99_us\""], v["\"lat_p999_us\""] }'
+    done
+done
+
+exit 0
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# FUA write group commit check.
+# Runs loopbench 4K random FUA writes at several queue depths with a backing store flush for every write and with
+# group commit, and reports iops and writes sharing a flush of each.
+#
+# usage: loopfua.sh [file] [seconds] [extra loopbench options]
+# Without a file a 64M scratch file is made in /tmp. LOOPBENCH points at the binary, default is the current directory,
+# DEPTHS lists queue depths, default "1 4 16 64".
+#
+
+LOOPBENCH=${LOOPBENCH:-./loopbench}
+DEPTHS=${DEPTHS:-1 4 16 64}
+FILE=$1
+DURATION=${2:-3}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+
+DIR=`mktemp -d /tmp/loopfua.XXXXXX`
+trap 'rm -rf $DIR' EXIT
+if [ -z "$FILE" ]; then
+    FILE=$DIR/fua.img
+    # Allocated blocks, writes into holes would pay for allocation on every flush
+    head -c 64M /dev/zero > $FILE
+fi
+
+# Run FUA writes, sets IOPS and PER_FLUSH
+# usage: run depth group loopbench options...
+run()
+{
+    DEPTH=$1
+    GROUP=$2
+    shift 2
+    if ! $LOOPBENCH -f -G $GROUP -r 0 -s 4096 -q $DEPTH -d $DURATION "$@" $FILE > $DIR/bench.out 2> /dev/null; then
+        echo "loopbench failed at depth $DEPTH with group $GROUP"
+        exit 1
+    fi
+
+    # {... "all":{"ops":1,"bytes":2,"iops":3.0,...
+    IOPS=`tail -n 1 $DIR/bench.out | sed 's/.*"all":{[^}]*"iops":\([0-9.]*\).*/\1/'`
+    # Group commit: 100 durable writes in 10 flushes, 10.0 writes per flush on average
+    PER_FLUSH=`grep '^Group commit:' $DIR/bench.out | sed 's/.* flushes, \([0-9.]*\) writes per flush.*/\1/'`
+}
+
+printf "%8s %12s %10s %12s %10s %8s\n" depth flush_iops per_flush group_iops per_flush gain
+
+for DEPTH in $DEPTHS; do
+    run $DEPTH 1 "$@"
+    SINGLE=$IOPS
+    SINGLE_PER_FLUSH=$PER_FLUSH
+
+    run $DEPTH 0 "$@"
+    printf "%8u %12.0f %10.1f %12.0f %10.1f %8.2f\n" $DEPTH $SINGLE $SINGLE_PER_FLUSH $IOPS $PER_FLUSH \
+        `echo "$IOPS $SINGLE" | awk '{ print $1 / $2 }'`
+done
+
+exit 0
@@ -0,0 +1,119 @@
+#!/bin/sh
+#
+# Overlay image tests, Linux only.
+# Runs loopsim workloads through loophelper against overlay images of a random base image and checks what
+# loopimg export reads back, with every engine given on the command line.
+#
+# usage: loopoverlay.sh [size in MB] [engine...]
+# LOOPSIM, LOOPHELPER and LOOPIMG point at the binaries, default is the current directory.
+#
+
+LOOPSIM=${LOOPSIM:-./loopsim}
+LOOPHELPER=${LOOPHELPER:-./loophelper}
+LOOPIMG=${LOOPIMG:-./loopimg}
+SIZE=${1:-64}
+[ $# -gt 0 ] && shift
+ENGINES=${*:-posix}
+DIR=`mktemp -d /tmp/loopoverlay.XXXXXX`
+SOCK=$DIR/sim.sock
+BASE=$DIR/base.img
+FAILED=0
+
+trap 'rm -rf $DIR' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+# run image helper_options loopsim_options...
+run() {
+    IMAGE=$1
+    OPTIONS=$2
+    shift 2
+    $LOOPSIM "$@" $SOCK > $DIR/sim.out 2>&1 &
+    SIM=$!
+    while [ ! -S $SOCK ]; do
+        sleep 0.1
+    done
+
+    $LOOPHELPER $OPTIONS $SOCK $IMAGE > $DIR/helper.out 2>&1
+    if ! wait $SIM; then
+        echo "loopsim failed:"
+        cat $DIR/sim.out $DIR/helper.out
+        exit 1
+    fi
+    rm -f $SOCK
+}
+
+# Device overlay image makes, read back by loopimg
+export_image() {
+    rm -f $DIR/export.raw
+    if ! $LOOPIMG export $1 $DIR/export.raw > /dev/null; then
+        fail "could not export $1"
+        return 1
+    fi
+}
+
+# Every byte that differs from base has to be written junk, or zero where loopsim discarded
+check_junk() {
+    cmp -l $BASE $DIR/export.raw | awk '$3 != 245 && $3 != 0 { bad++ } END { exit bad > 0 }'
+}
+
+dd if=/dev/urandom of=$BASE bs=1M count=$SIZE status=none
+BASESUM=`cksum < $BASE`
+
+# Junk loopsim writes
+head -c 8388608 /dev/zero | tr '\000' '\245' > $DIR/junk
+
+
+for ENGINE in $ENGINES; do
+    for CLUSTER in 4 64 2048; do
+        NAME="$ENGINE ${CLUSTER}K"
+        IMAGE=$DIR/overlay.img
+
+        # Fresh overlay reads base
+        rm -f $IMAGE
+        $LOOPIMG create -c $CLUSTER $BASE $IMAGE || exit 1
+        export_image $IMAGE && { cmp -s $BASE $DIR/export.raw || fail "$NAME: fresh overlay does not read base"; }
+
+        # Sequential partial cluster writes of the first 8M
+        run $IMAGE "-e $ENGINE" -p seq -r 0 -s 4096 -n 2048
+        cp $BASE $DIR/expected.raw
+        dd if=$DIR/junk of=$DIR/expected.raw conv=notrunc status=none
+        export_image $IMAGE && { cmp -s $DIR/expected.raw $DIR/export.raw || fail "$NAME: sequential writes read back wrong"; }
+        [ `$LOOPIMG info $IMAGE | awk '$1 == "allocated:" { print $2 }'` -eq $((8192 / CLUSTER)) ] ||
+            fail "$NAME: sequential writes allocated wrong number of clusters"
+
+        # Random reads, writes and discards all over, then read only attach
+        run $IMAGE "-e $ENGINE -t 8" -p rand -r 40 -u 10 -s 16384 -q 32 -n 20000
+        run $IMAGE "-e $ENGINE -r" -p rand -r 100 -s 65536 -n 2000
+        export_image $IMAGE && { check_junk || fail "$NAME: random workload left foreign data"; }
+
+        # Whole device discarded reads zeroes, clusters stay for reuse
+        run $IMAGE "-e $ENGINE" -p seq -r 0 -u 100 -s 2097152 -n $((SIZE / 2))
+        export_image $IMAGE && { cmp -s -n $((SIZE * 1048576)) $DIR/export.raw /dev/zero || fail "$NAME: discarded device does not read zeroes"; }
+        run $IMAGE "-e $ENGINE" -p seq -r 0 -s 4096 -n 2048
+        dd if=/dev/zero of=$DIR/expected.raw bs=1M count=$SIZE status=none
+        dd if=$DIR/junk of=$DIR/expected.raw conv=notrunc status=none
+        export_image $IMAGE && { cmp -s $DIR/expected.raw $DIR/export.raw || fail "$NAME: writes over discarded clusters read back wrong"; }
+
+        [ "`cksum < $BASE`" = "$BASESUM" ] || fail "$NAME: base image changed"
+        echo "$NAME: done"
+    done
+done
+
+
+# Attach does not depend on device size
+truncate -s 1T $DIR/huge.img
+$LOOPIMG create $DIR/huge.img $DIR/huge.cow || exit 1
+BYTES=`stat -c %s $DIR/huge.cow`
+[ $BYTES -le 1048576 ] || fail "1T overlay takes $BYTES bytes"
+START=`date +%s%N`
+run $DIR/huge.cow "" -p rand -r 50 -s 4096 -n 1000
+END=`date +%s%N`
+echo "1T overlay: $BYTES bytes, attach with 1000 random ios $(((END - START) / 1000000)) ms"
+
+
+[ $FAILED -eq 0 ] && echo "All overlay tests passed"
+exit $FAILED
@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Compressed image benchmark, Linux only.
+# Packs a raw image of executables, which compress about like a system disk, then runs loopbench sequential and
+# random reads against the raw image and the packed one. Packed image rows add decompressed chunk cache hit rate
+# and how many chunks were decompressed ahead of reads, from the stats helper prints when the device goes away.
+#
+# usage: looppack.sh [size in MB] [seconds] [chunk in KB] [extra loopbench options]
+# LOOPBENCH and LOOPIMG point at the binaries, default is the current directory.
+#
+
+LOOPBENCH=${LOOPBENCH:-./loopbench}
+LOOPIMG=${LOOPIMG:-./loopimg}
+SIZE=${1:-256}
+DURATION=${2:-5}
+CHUNK=${3:-64}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+DIR=`mktemp -d /tmp/looppack.XXXXXX`
+RAW=$DIR/raw.img
+PACKED=$DIR/packed.img
+BYTES=$((SIZE * 1024 * 1024))
+
+trap 'rm -rf $DIR' EXIT
+
+: > $RAW
+while [ `stat -c %s $RAW` -lt $BYTES ]; do
+    cat /usr/bin/* 2> /dev/null | head -c $((BYTES - `stat -c %s $RAW`)) >> $RAW
+done
+
+$LOOPIMG pack -c $CHUNK $RAW $PACKED || exit 1
+
+printf "%8s %8s %8s %12s %10s %10s %10s %10s %10s\n" image pattern size iops mbps mean_us p99_us hit_pct ahead
+
+for PATTERN in seq rand; do
+    [ $PATTERN = seq ] && BS=1048576 || BS=4096
+
+    for IMAGE in raw packed; do
+        FILE=$DIR/$IMAGE.img
+
+        # Packed image: 1 chunks decompressed, 2 of them ahead of reads, 3 hits, 4 read ahead hits, 5 misses, 6% hit rate, ...
+        # {... "all":{"ops":1,"bytes":2,"iops":3.0,"mbps":4.00,"lat_mean_us":5.00,"lat_p50_us":6.00,...
+        $LOOPBENCH -p $PATTERN -s $BS -d $DURATION "$@" $FILE > $DIR/bench.out 2> /dev/null
+        OUT=`tail -n 1 $DIR/bench.out`
+        if [ -z "$OUT" ]; then
+            echo "loopbench failed on $IMAGE image"
+            exit 1
+        fi
+
+        STATS=`grep "^Packed image:" $DIR/bench.out | tr -d ',%' | awk '{ print $20, $6 }'`
+
+        echo "$OUT" | sed 's/.*"all":{\([^}]*\)}.*/\1/' | tr ',' '\n' | awk -F: -v image=$IMAGE -v pattern=$PATTERN \
+                -v bs=$BS -v stats="$STATS" '
+            { v[$1] = $2 }
+            END { split(stats, s, " ")
+                  printf "%8s %8s %8u %12.0f %10.1f %10.2f %10.2f %10s %10s\n", image, pattern, bs, v["\"iops\""], v["\"mbps\""],
+                  v["\"lat_mean_us\""], v["\"lat_p99_us\""], (stats == "") ? "-" : s[1], (stats == "") ? "-" : s[2] }'
+    done
+done
+
+exit 0
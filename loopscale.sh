@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Multi-device helper scaling check, Linux only.
+# Serves 1, 2, 4 ... devices from one loophelper against loopsim and reports helper resident memory, threads and open
+# files. Fails if a device added to the first one costs more threads or open files than allowed.
+#
+# usage: loopscale.sh [max devices] [seconds] [extra loophelper options]
+# LOOPSIM and LOOPHELPER point at the binaries, default is the current directory.
+# MAX_THREADS_PER_DEVICE and MAX_FILES_PER_DEVICE set the bounds, default 2 and 4: a committer thread, backing file,
+# connection and shared rings per device, plus a completion thread and ring with io_uring.
+#
+
+LOOPSIM=${LOOPSIM:-./loopsim}
+LOOPHELPER=${LOOPHELPER:-./loophelper}
+MAX_THREADS_PER_DEVICE=${MAX_THREADS_PER_DEVICE:-2}
+MAX_FILES_PER_DEVICE=${MAX_FILES_PER_DEVICE:-4}
+MAX=${1:-16}
+DURATION=${2:-2}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+DIR=`mktemp -d /tmp/loopscale.XXXXXX`
+SOCK=$DIR/sim.sock
+
+trap 'rm -rf $DIR' EXIT
+
+printf "%8s %12s %12s %8s %8s %14s %14s %14s\n" devices rss_kb peak_kb threads files kb_per_device threads_per_dev files_per_dev
+
+BASE_RSS=
+BASE_THREADS=
+BASE_FILES=
+N=1
+while [ $N -le $MAX ]; do
+    FILES=
+    i=0
+    while [ $i -lt $N ]; do
+        truncate -s 64M $DIR/dev$i.img
+        FILES="$FILES $DIR/dev$i.img"
+        i=$((i + 1))
+    done
+
+    $LOOPSIM -N $N -d $DURATION -r 70 $SOCK > $DIR/sim.out 2>&1 &
+    SIM=$!
+    while [ ! -S $SOCK ]; do
+        sleep 0.1
+    done
+
+    $LOOPHELPER "$@" $SOCK $FILES > /dev/null 2>&1
+    if ! wait $SIM; then
+        echo "loopsim failed with $N devices:"
+        cat $DIR/sim.out
+        exit 1
+    fi
+
+    # Helper pid 123 serving 4 devices: 1000 kB resident, 1200 kB peak, 7 threads, 15 open files
+    read RSS PEAK THREADS FILES <<EOF
+`grep '^Helper pid.*serving' $DIR/sim.out | sed 's/.*: \([0-9]*\) kB resident, \([0-9]*\) kB peak, \([0-9]*\) threads, \([0-9]*\) open files/\1 \2 \3 \4/'`
+EOF
+
+    # Growth over a single device, divided among added devices
+    if [ -z "$BASE_RSS" ]; then
+        BASE_RSS=$RSS
+        BASE_THREADS=$THREADS
+        BASE_FILES=$FILES
+        printf "%8u %12u %12u %8u %8u %14s %14s %14s\n" $N $RSS $PEAK $THREADS $FILES - - -
+    else
+        printf "%8u %12u %12u %8u %8u %14u %14.1f %14.1f\n" $N $RSS $PEAK $THREADS $FILES $(((RSS - BASE_RSS) / (N - 1))) \
+            `echo "$THREADS $BASE_THREADS $N" | awk '{ print ($1 - $2) / ($3 - 1) }'` \
+            `echo "$FILES $BASE_FILES $N" | awk '{ print ($1 - $2) / ($3 - 1) }'`
+
+        # Whole numbers, every added device has to stay within bounds, not just on average
+        if [ $((THREADS - BASE_THREADS)) -gt $((MAX_THREADS_PER_DEVICE * (N - 1))) ]; then
+            echo "$N devices use $THREADS threads, more than $MAX_THREADS_PER_DEVICE for every device added to the first"
+            exit 1
+        fi
+
+        if [ $((FILES - BASE_FILES)) -gt $((MAX_FILES_PER_DEVICE * (N - 1))) ]; then
+            echo "$N devices keep $FILES files open, more than $MAX_FILES_PER_DEVICE for every device added to the first"
+            exit 1
+        fi
+    fi
+
+    rm -f $DIR/dev*.img
+    N=$((N * 2))
+done
+
+exit 0
@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Sparse image read benchmark, Linux only.
+# Runs loopbench random reads against a mostly empty image with holes served from extent map and then read from file.
+#
+# usage: loopsparse.sh [size in GB] [seconds] [extra loopbench options]
+# Image gets 1M of data every 64M, the rest are holes. LOOPBENCH points at the binary, default is the current directory.
+# Fails if the extent map is not serving reads of holes.
+#
+
+LOOPBENCH=${LOOPBENCH:-./loopbench}
+SIZE=${1:-16}
+DURATION=${2:-5}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+DIR=`mktemp -d /tmp/loopsparse.XXXXXX`
+FILE=$DIR/sparse.img
+
+trap 'rm -rf $DIR' EXIT
+
+truncate -s ${SIZE}G $FILE
+N=0
+while [ $N -lt $((SIZE * 16)) ]; do
+    dd if=/dev/urandom of=$FILE bs=1M count=1 seek=$((N * 64)) conv=notrunc status=none
+    N=$((N + 1))
+done
+
+printf "%8s %12s %10s %10s %10s %10s\n" holes iops mbps mean_us p50_us p99_us
+
+for MODE in map read; do
+    OPTIONS=
+    [ $MODE = read ] && OPTIONS=-H
+
+    # {... "all":{"ops":1,"bytes":2,"iops":3.0,"mbps":4.00,"lat_mean_us":5.00,"lat_p50_us":6.00,...
+    $LOOPBENCH -p rand -s 65536 -d $DURATION $OPTIONS "$@" $FILE > $DIR/bench.out 2> /dev/null
+    OUT=`tail -n 1 $DIR/bench.out`
+    if [ -z "$OUT" ]; then
+        echo "loopbench failed with holes $MODE"
+        exit 1
+    fi
+
+    echo "$OUT" | sed 's/.*"all":{\([^}]*\)}.*/\1/' | tr ',' '\n' | awk -F: -v mode=$MODE '
+        { v[$1] = $2 }
+        END { printf "%8s %12.0f %10.1f %10.2f %10.2f %10.2f\n", mode, v["\"iops\""], v["\"mbps\""],
+              v["\"lat_mean_us\""], v["\"lat_p50_us\""], v["\"lat_p99_us\""] }'
+    grep '^Hole map' $DIR/bench.out
+
+    # Hole map: 256 data extents, built 1 times, 1234 reads zero filled, ...
+    ZEROFILLED=`sed -n 's/^Hole map: [0-9]* data extents, .* \([0-9]*\) reads zero filled.*/\1/p' $DIR/bench.out`
+    if [ $MODE = map ] && [ "${ZEROFILLED:-0}" -eq 0 ]; then
+        echo "Hole map served no reads, extent map is not active"
+        exit 1
+    fi
+done
+
+exit 0
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Large request split benchmark.
+# Runs loopbench 10MB sequential reads and writes without splitting and split into chunks of several sizes running in
+# parallel on helper workers, and reports throughput and gain over the unsplit run.
+#
+# usage: loopsplit.sh [file] [seconds] [extra loopbench options]
+# Without a file a 512M scratch file is made in /tmp. LOOPBENCH points at the binary, default is the current directory,
+# CHUNKS lists chunk sizes in kilobytes, 0 for no splitting, default "0 256 1024 4096".
+#
+
+LOOPBENCH=${LOOPBENCH:-./loopbench}
+CHUNKS=${CHUNKS:-0 256 1024 4096}
+FILE=$1
+DURATION=${2:-3}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+
+if [ -z "$FILE" ]; then
+    DIR=`mktemp -d /tmp/loopsplit.XXXXXX`
+    trap 'rm -rf $DIR' EXIT
+    FILE=$DIR/split.img
+    # Real data, reads of holes are zero filled without reaching the file
+    head -c 512M /dev/urandom > $FILE
+fi
+
+printf "%6s %8s %10s %10s %10s %8s\n" op chunk_kb MB/s mean_ms p99_ms gain
+
+for OP in read write; do
+    READPCT=100
+    [ $OP = write ] && READPCT=0
+    BASE=
+
+    for CHUNK in $CHUNKS; do
+        # {... "all":{"ops":1,"bytes":2,"iops":3.0,"mbps":4.00,"lat_mean_us":5.00,"lat_p50_us":6.00,...
+        OUT=`$LOOPBENCH -p seq -r $READPCT -s 10485760 -q 4 -k $CHUNK -d $DURATION "$@" $FILE 2> /dev/null | tail -n 1`
+        if [ -z "$OUT" ]; then
+            echo "loopbench failed running $OP with $CHUNK KB chunks"
+            exit 1
+        fi
+
+        STATS=`echo "$OUT" | sed 's/.*"all":{\([^}]*\)}.*/\1/' | tr ',' '\n' | awk -F: '
+            { v[$1] = $2 }
+            END { print v["\"mbps\""], v["\"lat_mean_us\""] / 1000, v["\"lat_p99_us\""] / 1000 }'`
+        read MBPS MEAN P99 <<EOF
+$STATS
+EOF
+
+        BASE=${BASE:-$MBPS}
+        printf "%6s %8u %10.1f %10.2f %10.2f %8.2f\n" $OP $CHUNK $MBPS $MEAN $P99 `echo "$MBPS $BASE" | awk '{ print $1 / $2 }'`
+    done
+done
+
+exit 0
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Helper worker pool check, Linux only.
+# Fills a device with loopsim verify pattern, then runs random reads and writes that check the pattern against
+# loophelper with 1, 2, 4 ... worker threads and reports how requests per second scale with threads.
+# Fails if any read returns wrong data or any request fails.
+#
+# usage: loopworkers.sh [max threads] [seconds] [extra loophelper options]
+# LOOPSIM and LOOPHELPER point at the binaries, default is the current directory.
+#
+
+LOOPSIM=${LOOPSIM:-./loopsim}
+LOOPHELPER=${LOOPHELPER:-./loophelper}
+MAX=${1:-8}
+DURATION=${2:-2}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+DIR=`mktemp -d /tmp/loopworkers.XXXXXX`
+SOCK=$DIR/sim.sock
+IMG=$DIR/dev.img
+
+trap 'rm -rf $DIR' EXIT
+
+# Run loopsim workload against loophelper, fails the script if anything went wrong
+# usage: run threads loopsim options...
+run()
+{
+    THREADS=$1
+    shift
+    $LOOPSIM "$@" $SOCK > $DIR/sim.out 2>&1 &
+    SIM=$!
+    while [ ! -S $SOCK ]; do
+        sleep 0.1
+    done
+
+    $LOOPHELPER -t $THREADS $HELPER_OPTS $SOCK $IMG > $DIR/helper.out 2>&1
+    if ! wait $SIM; then
+        echo "loopsim failed with $THREADS threads:"
+        cat $DIR/sim.out
+        exit 1
+    fi
+}
+
+# Driver read: 1000 requests, 500 requests/sec, ...
+rate()
+{
+    RATE=`grep "^Driver $1:" $DIR/sim.out | sed 's/.* requests, \([0-9.]*\) requests\/sec.*/\1/'`
+    echo ${RATE:-0}
+}
+
+HELPER_OPTS="$*"
+truncate -s 64M $IMG
+
+printf "%8s %12s %12s %12s %8s\n" threads reads/sec writes/sec total/sec speedup
+
+BASE=
+T=1
+while [ $T -le $MAX ]; do
+    run $T -V -p seq -r 0 -s 1048576 -q 8 -n 64
+    run $T -V -p rand -r 50 -q 32 -d $DURATION
+
+    READS=`rate read`
+    WRITES=`rate write`
+    TOTAL=`echo "$READS $WRITES" | awk '{ print $1 + $2 }'`
+    BASE=${BASE:-$TOTAL}
+    printf "%8u %12.0f %12.0f %12.0f %8.2f\n" $T $READS $WRITES $TOTAL `echo "$TOTAL $BASE" | awk '{ print $1 / $2 }'`
+
+    rm -f $IMG
+    truncate -s 64M $IMG
+    T=$((T * 2))
+done
+
+exit 0
@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Zero write check, Linux only.
+# Writes zeroes over a new backing file, then junk, then zeroes again through loophelper and checks file stays sparse:
+# zeroes over holes must not allocate anything, zeroes over data must give its blocks back.
+#
+# usage: loopzeros.sh [size in MB] [extra loophelper options]
+# LOOPSIM and LOOPHELPER point at the binaries, default is the current directory.
+#
+
+LOOPSIM=${LOOPSIM:-./loopsim}
+LOOPHELPER=${LOOPHELPER:-./loophelper}
+SIZE=${1:-64}
+[ $# -gt 0 ] && shift
+DIR=`mktemp -d /tmp/loopzeros.XXXXXX`
+SOCK=$DIR/sim.sock
+FILE=$DIR/dev.img
+NOPS=$((SIZE * 16))
+
+trap 'rm -rf $DIR' EXIT
+
+# Writes every 64K block of the file once, in order
+run() {
+    $LOOPSIM -p seq -r 0 -s 65536 -n $NOPS "$@" $SOCK > $DIR/sim.out 2>&1 &
+    SIM=$!
+    while [ ! -S $SOCK ]; do
+        sleep 0.1
+    done
+
+    $LOOPHELPER $HELPER_OPTIONS $SOCK $FILE > $DIR/helper.out 2>&1
+    if ! wait $SIM; then
+        echo "loopsim failed:"
+        cat $DIR/sim.out $DIR/helper.out
+        exit 1
+    fi
+    rm -f $SOCK
+    sync $FILE
+}
+
+HELPER_OPTIONS="$*"
+truncate -s ${SIZE}M $FILE
+
+run -z
+ZEROES=`stat -c %b $FILE`
+
+run
+WRITTEN=`stat -c %b $FILE`
+
+run -z
+ZEROED=`stat -c %b $FILE`
+
+printf "%12s %16s %16s %16s\n" size_mb blocks_zeroes blocks_written blocks_zeroed
+printf "%12u %16u %16u %16u\n" $SIZE $ZEROES $WRITTEN $ZEROED
+
+# Anything left allocated has to be well below what junk took
+if [ $((ZEROES * 10)) -ge $WRITTEN ] || [ $((ZEROED * 10)) -ge $WRITTEN ]; then
+    echo "Zero writes allocated blocks:"
+    cat $DIR/helper.out
+    exit 1
+fi
+
+exit 0
@@ -0,0 +1,37 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Monotonic clock for latency measurements and traces.
+//
+
+#ifndef LOOP_CLOCK_H
+#define LOOP_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+
+/**
+ * Get monotonic time in nanoseconds.
+ */
+static inline uint64_t loop_clock_ns(void)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (!timebase.denom) {
+        mach_timebase_info(&timebase);
+    }
+    
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+#endif
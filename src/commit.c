@@ -0,0 +1,148 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "commit.h"
+
+
+struct LoopCommitter {
+    struct LoopEngine*      engine;
+    unsigned                maxGroup;   // Most ios one flush completes, 0 for no limit
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;       // Wakes up committer thread
+    struct LoopEngineIO*    head;       // Ios waiting for the next flush
+    struct LoopEngineIO*    tail;
+    int                     stop;
+    pthread_t               thread;
+    uint64_t                commits;    // Flushes issued
+    uint64_t                committed;  // Ios completed by them
+};
+
+
+static void* committerThread(void* arg)
+{
+    struct LoopCommitter* c = (struct LoopCommitter*) arg;
+    
+    pthread_mutex_lock(&c->lock);
+    
+    for (;;) {
+        while (!c->head && !c->stop) {
+            pthread_cond_wait(&c->cond, &c->lock);
+        }
+        
+        if (!c->head) {
+            break;
+        }
+        
+        // Whatever arrives while we flush goes into the next group, so does whatever does not fit into this one
+        struct LoopEngineIO* group = c->head;
+        struct LoopEngineIO* last = group;
+        unsigned n = 1;
+        
+        while (last->next && (!c->maxGroup || (n < c->maxGroup))) {
+            last = last->next;
+            n++;
+        }
+        
+        c->head = last->next;
+        last->next = NULL;
+        if (!c->head) {
+            c->tail = NULL;
+        }
+        
+        pthread_mutex_unlock(&c->lock);
+        
+        struct LoopEngineIO flush;
+        memset(&flush, 0, sizeof(flush));
+        flush.op = kLoopEngineOp_Flush;
+        
+        int error = engine_rw(c->engine, &flush);
+        uint64_t count = 0;
+        
+        while (group) {
+            struct LoopEngineIO* io = group;
+            group = io->next;
+            
+            io->next = NULL;
+            io->error = error;
+            io->done(io);
+            count++;
+        }
+        
+        pthread_mutex_lock(&c->lock);
+        c->commits++;
+        c->committed += count;
+    }
+    
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+
+struct LoopCommitter* commit_create(struct LoopEngine* engine, unsigned maxGroup)
+{
+    struct LoopCommitter* c = (struct LoopCommitter*) calloc(1, sizeof(*c));
+    if (!c) {
+        return NULL;
+    }
+    
+    c->engine = engine;
+    c->maxGroup = maxGroup;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    
+    int error = pthread_create(&c->thread, NULL, committerThread, c);
+    if (error) {
+        pthread_cond_destroy(&c->cond);
+        pthread_mutex_destroy(&c->lock);
+        free(c);
+        errno = error;
+        return NULL;
+    }
+    
+    return c;
+}
+
+
+void commit_destroy(struct LoopCommitter* c)
+{
+    pthread_mutex_lock(&c->lock);
+    c->stop = 1;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    
+    pthread_join(c->thread, NULL);
+    
+    if (c->commits) {
+        printf("Group commit: %llu durable writes in %llu flushes, %.1f writes per flush on average\n",
+               (unsigned long long) c->committed, (unsigned long long) c->commits, (double) c->committed / c->commits);
+    }
+    
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+
+void commit_add(struct LoopCommitter* c, struct LoopEngineIO* io)
+{
+    io->next = NULL;
+    
+    pthread_mutex_lock(&c->lock);
+    
+    if (c->tail) {
+        c->tail->next = io;
+    } else {
+        c->head = io;
+        pthread_cond_signal(&c->cond);
+    }
+    c->tail = io;
+    
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,41 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Group commit for durable writes.
+//
+//  Writes that have to be durable are completed by the engine first and then handed over to committer.
+//  Committer thread flushes backing store once for everything that has been handed over since the previous flush
+//  started and completes all of it, so concurrent durable writes share a single fdatasync.
+//  Group size may be capped, a cap of 1 flushes for every write like there was no committer.
+//
+
+#ifndef LOOP_COMMIT_H
+#define LOOP_COMMIT_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+struct LoopCommitter;
+
+
+/**
+ * Start committer for a backing store engine.
+ * @param maxGroup  Most ios one flush completes, 0 for no limit.
+ * @return          New committer or NULL with errno set.
+ */
+struct LoopCommitter* commit_create(struct LoopEngine* engine, unsigned maxGroup);
+
+/**
+ * Stop committer. Everything added so far is flushed and completed.
+ */
+void commit_destroy(struct LoopCommitter* committer);
+
+/**
+ * Complete io once backing store has been flushed. Flush error, if any, is stored in io error.
+ * Io has to be completed by the engine successfully already.
+ */
+void commit_add(struct LoopCommitter* committer, struct LoopEngineIO* io);
+
+#endif
@@ -0,0 +1,1255 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "dedup.h"
+#include "zero.h"
+
+
+#define kDedupPrime1    0x9e3779b185ebca87ull
+#define kDedupPrime2    0xc2b2ae3d27d4eb4full
+#define kDedupPrime3    0x165667b19e3779f9ull
+
+enum {
+    kDedupAlign             = 4096,             // Metadata and chunk buffer alignment, for direct io
+    kDedupPage              = 4096,             // Index and map are written in pages
+    kDedupLocks             = 256,              // Chunk lock stripes
+    kDedupGroup             = 64,               // Chunks sharing a stripe, reads take up to a group at once under one lock
+};
+
+
+// Chunk store, shared by the images that name it
+struct DedupStore {
+    struct DedupStore*      next;           // Open stores
+    dev_t                   dev;
+    ino_t                   ino;
+    unsigned                users;          // Images using store
+    int                     writable;
+    int                     fd;
+    uint32_t                chunkBits;
+    uint64_t                chunkSize;
+    uint32_t                nslots;
+    uint64_t                tableOffset;
+    uint64_t                dataOffset;
+
+    pthread_mutex_t         flushLock;      // One index write at a time
+    pthread_mutex_t         lock;           // Protects everything below
+    struct LoopDedupEntry*  entries;        // Index, hashes are current, reference counts are what was last written
+    uint32_t*               refs;           // References by chunk, including ones held for a moment
+    uint32_t*               drops;          // References dropped by images whose maps are not on disk yet
+    uint8_t*                dirty;          // Index pages changed since they were last written
+    uint32_t                npages;
+    uint32_t*               lookup;         // Hash table of slot + 1, 0 for empty, linear probing
+    uint64_t                lookupMask;
+    uint32_t*               freeSlots;      // Stack of free slots, lowest on top
+    uint32_t                nfree;
+
+    uint64_t                stored;         // Chunks written to free slots
+    uint64_t                shared;         // Chunk writes that found their chunk stored already
+    uint64_t                collisions;     // Hash matches with different contents
+};
+
+
+struct Dedup {
+    struct DedupStore*      store;
+    uint64_t                size;           // Device size
+    uint32_t                chunkBits;
+    uint64_t                chunkSize;
+    uint64_t                nchunks;
+    uint64_t                mapOffset;
+    uint64_t                mapBytes;       // Map size in the file, whole pages
+    pthread_rwlock_t        locks[kDedupLocks]; // Chunk group stripes, reads hold them shared from map lookup to data read
+
+    pthread_mutex_t         flushLock;      // One flush at a time
+    pthread_mutex_t         lock;           // Protects everything below
+    uint32_t*               map;            // Whole map stays in memory
+    uint8_t*                dirty;          // Map pages changed since they were last written
+    uint32_t                npages;
+    uint32_t*               dropped;        // Slots map stopped pointing to since last flush
+    uint32_t                ndropped;
+    uint32_t                droppedCapacity;
+
+    uint64_t                written;        // Chunks written
+    uint64_t                zeroed;         // Chunks written or discarded as zeroes
+};
+
+
+static pthread_mutex_t gDedupStoresLock = PTHREAD_MUTEX_INITIALIZER;
+static struct DedupStore* gDedupStores;
+
+
+static int imageIO(struct LoopEngine* engine, uint32_t op, void* buffer, uint64_t nbytes, uint64_t offset)
+{
+    struct LoopEngineIO io;
+    
+    memset(&io, 0, sizeof(io));
+    io.op       = op;
+    io.buffer   = buffer;
+    io.nbytes   = nbytes;
+    io.offset   = offset;
+    
+    // Already on a worker thread, see dedup_open
+    return engine->lower->ops->rw(engine->lower, &io);
+}
+
+
+static uint64_t rotl64(uint64_t v, unsigned bits)
+{
+    return (v << bits) | (v >> (64 - bits));
+}
+
+
+// xxHash64 rounds on four lanes, chunks are whole 32 byte stripes. Shared chunks are compared anyway,
+// hash only has to spread and be fast.
+static uint64_t hashChunk(const uint8_t* p, uint64_t nbytes)
+{
+    uint64_t v[4] = { kDedupPrime1 + kDedupPrime2, kDedupPrime2, 0, 0 - kDedupPrime1 };
+    uint64_t i;
+    unsigned lane;
+    
+    for (i = 0; i < nbytes; i += 32) {
+        for (lane = 0; lane < 4; ++lane) {
+            uint64_t word;
+            memcpy(&word, p + i + lane * 8, sizeof(word));
+            v[lane] = rotl64(v[lane] + word * kDedupPrime2, 31) * kDedupPrime1;
+        }
+    }
+    
+    uint64_t h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18) + nbytes;
+    h ^= h >> 33;
+    h *= kDedupPrime2;
+    h ^= h >> 29;
+    h *= kDedupPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+// Store lock is held
+static int lookupFind(const struct DedupStore* st, uint64_t hash, uint32_t* slot)
+{
+    uint64_t i;
+    
+    for (i = hash & st->lookupMask; st->lookup[i]; i = (i + 1) & st->lookupMask) {
+        if (st->entries[st->lookup[i] - 1].hash == hash) {
+            *slot = st->lookup[i] - 1;
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+
+static void lookupInsert(struct DedupStore* st, uint32_t slot)
+{
+    uint64_t i = st->entries[slot].hash & st->lookupMask;
+    
+    while (st->lookup[i]) {
+        i = (i + 1) & st->lookupMask;
+    }
+    
+    st->lookup[i] = slot + 1;
+}
+
+
+// Later entries of the probe run move back into the hole unless it would put them before their home
+static void lookupRemove(struct DedupStore* st, uint32_t slot)
+{
+    uint64_t i, j;
+    
+    for (i = st->entries[slot].hash & st->lookupMask; st->lookup[i] != slot + 1; i = (i + 1) & st->lookupMask) {
+        // Chunks that collided were never entered
+        if (!st->lookup[i]) {
+            return;
+        }
+    }
+    
+    for (j = (i + 1) & st->lookupMask; st->lookup[j]; j = (j + 1) & st->lookupMask) {
+        uint64_t home = st->entries[st->lookup[j] - 1].hash & st->lookupMask;
+        int stays = (i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j));
+        if (!stays) {
+            st->lookup[i] = st->lookup[j];
+            i = j;
+        }
+    }
+    
+    st->lookup[i] = 0;
+}
+
+
+// Store lock is held
+static void markEntry(struct DedupStore* st, uint32_t slot)
+{
+    st->dirty[slot / (kDedupPage / sizeof(struct LoopDedupEntry))] = 1;
+}
+
+
+// Slot no image refers to, or is about to, is free for another chunk. Store lock is held.
+static void putSlot(struct DedupStore* st, uint32_t slot)
+{
+    if (!st->refs[slot] && !st->drops[slot]) {
+        lookupRemove(st, slot);
+        st->freeSlots[st->nfree++] = slot;
+    }
+    
+    markEntry(st, slot);
+}
+
+
+// Find chunk in store or store it, taking a reference
+// @param scratch   Chunk size buffer to compare contents in.
+// @param id        Set to slot + 1.
+static int storeInsert(struct DedupStore* st, const uint8_t* data, uint8_t* scratch, uint32_t* id)
+{
+    uint64_t hash = hashChunk(data, st->chunkSize);
+    uint32_t slot;
+    int error;
+    
+    pthread_mutex_lock(&st->lock);
+    int found = lookupFind(st, hash, &slot);
+    if (found) {
+        st->refs[slot]++;
+        markEntry(st, slot);
+    }
+    pthread_mutex_unlock(&st->lock);
+    
+    // Reference held keeps slot from being reused while it is compared
+    if (found) {
+        error = engine_pread(st->fd, scratch, st->chunkSize, st->dataOffset + ((uint64_t) slot << st->chunkBits));
+        int same = !error && !memcmp(scratch, data, st->chunkSize);
+    
+        pthread_mutex_lock(&st->lock);
+        if (same) {
+            st->shared++;
+        } else {
+            st->refs[slot]--;
+            putSlot(st, slot);
+            st->collisions += error ? 0 : 1;
+        }
+        pthread_mutex_unlock(&st->lock);
+    
+        if (same) {
+            *id = slot + 1;
+            return 0;
+        }
+    
+        if (error) {
+            return error;
+        }
+    }
+    
+    pthread_mutex_lock(&st->lock);
+    if (!st->nfree) {
+        pthread_mutex_unlock(&st->lock);
+        return ENOSPC;
+    }
+    
+    slot = st->freeSlots[--st->nfree];
+    st->refs[slot] = 1;
+    st->entries[slot].hash = hash;
+    markEntry(st, slot);
+    st->stored++;
+    pthread_mutex_unlock(&st->lock);
+    
+    error = engine_pwrite(st->fd, data, st->chunkSize, st->dataOffset + ((uint64_t) slot << st->chunkBits));
+    
+    // Other writers find it once it is there. Chunk that collided stays out, lookup keeps the first one.
+    pthread_mutex_lock(&st->lock);
+    if (error) {
+        st->refs[slot]--;
+        putSlot(st, slot);
+    } else if (!found) {
+        lookupInsert(st, slot);
+    }
+    pthread_mutex_unlock(&st->lock);
+    
+    *id = slot + 1;
+    return error;
+}
+
+
+// Data first, then index entries that count references to it
+static int storeFlush(struct DedupStore* st)
+{
+    uint32_t perPage = kDedupPage / sizeof(struct LoopDedupEntry);
+    uint32_t page, slot;
+    int written = 0;
+    
+    pthread_mutex_lock(&st->flushLock);
+    
+    int error = engine_fdatasync(st->fd);
+    
+    pthread_mutex_lock(&st->lock);
+    
+    for (page = 0; !error && (page < st->npages); ++page) {
+        if (!st->dirty[page]) {
+            continue;
+        }
+    
+        // References dropped by maps not on disk yet still count there
+        for (slot = page * perPage; (slot < (page + 1) * perPage) && (slot < st->nslots); ++slot) {
+            st->entries[slot].refs = st->refs[slot] + st->drops[slot];
+        }
+    
+        error = engine_pwrite(st->fd, (uint8_t*) st->entries + (uint64_t) page * kDedupPage, kDedupPage,
+                              st->tableOffset + (uint64_t) page * kDedupPage);
+        st->dirty[page] = error ? 1 : 0;
+        written = 1;
+    }
+    
+    pthread_mutex_unlock(&st->lock);
+    
+    if (!error && written) {
+        error = engine_fdatasync(st->fd);
+    }
+    
+    pthread_mutex_unlock(&st->flushLock);
+    return error;
+}
+
+
+static void storeFree(struct DedupStore* st)
+{
+    if (st->fd >= 0) {
+        close(st->fd);
+    }
+    
+    pthread_mutex_destroy(&st->lock);
+    pthread_mutex_destroy(&st->flushLock);
+    free(st->freeSlots);
+    free(st->lookup);
+    free(st->dirty);
+    free(st->drops);
+    free(st->refs);
+    free(st->entries);
+    free(st);
+}
+
+
+// Check store header read from the start of a file
+// @return          1 for valid store header, 0 for other files, -1 with errno set for broken one.
+static int parseStoreHeader(const uint8_t* buffer, uint64_t nbytes, uint64_t fileSize, struct LoopDedupStoreHeader* header)
+{
+    if (nbytes < sizeof(*header)) {
+        return 0;
+    }
+    
+    memcpy(header, buffer, sizeof(*header));
+    if (header->magic != kLoopDedupStoreMagic) {
+        return 0;
+    }
+    
+    uint64_t chunkSize = (uint64_t) 1 << header->chunkBits;
+    uint64_t tableBytes = ((uint64_t) header->nslots * sizeof(struct LoopDedupEntry) + kDedupPage - 1) & ~(uint64_t) (kDedupPage - 1);
+    
+    if ((header->version != kLoopDedupVersion) ||
+        (header->chunkBits < kLoopDedupMinChunkBits) || (header->chunkBits > kLoopDedupMaxChunkBits) ||
+        !header->nslots || (header->nslots > kLoopDedupMaxSlots) || (header->tableOffset != kLoopDedupHeaderBytes) ||
+        (header->dataOffset < header->tableOffset + tableBytes) || (header->dataOffset & (chunkSize - 1)) ||
+        (header->tableOffset + tableBytes > fileSize)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    return 1;
+}
+
+
+static int readStoreHeader(int fd, struct LoopDedupStoreHeader* header)
+{
+    uint8_t buffer[sizeof(*header)];
+    struct stat st;
+    
+    if (0 != fstat(fd, &st)) {
+        return errno;
+    }
+    
+    ssize_t rc = pread(fd, buffer, sizeof(buffer), 0);
+    if (rc < 0) {
+        return errno;
+    }
+    
+    return (1 == parseStoreHeader(buffer, (uint64_t) rc, (uint64_t) st.st_size, header)) ? 0 : EINVAL;
+}
+
+
+static int storeLoad(struct DedupStore* st)
+{
+    struct LoopDedupStoreHeader header;
+    uint32_t slot;
+    uint64_t lookupSize;
+    
+    int error = readStoreHeader(st->fd, &header);
+    if (error) {
+        return error;
+    }
+    
+    st->chunkBits   = header.chunkBits;
+    st->chunkSize   = (uint64_t) 1 << header.chunkBits;
+    st->nslots      = header.nslots;
+    st->tableOffset = header.tableOffset;
+    st->dataOffset  = header.dataOffset;
+    st->npages      = (uint32_t) (((uint64_t) st->nslots * sizeof(struct LoopDedupEntry) + kDedupPage - 1) / kDedupPage);
+    
+    // Lookup at most half full keeps probe runs short
+    lookupSize = 1;
+    while (lookupSize < 2 * (uint64_t) st->nslots) {
+        lookupSize <<= 1;
+    }
+    
+    st->lookupMask = lookupSize - 1;
+    st->refs = (uint32_t*) calloc(st->nslots, sizeof(*st->refs));
+    st->drops = (uint32_t*) calloc(st->nslots, sizeof(*st->drops));
+    st->dirty = (uint8_t*) calloc(st->npages, 1);
+    st->lookup = (uint32_t*) calloc(lookupSize, sizeof(*st->lookup));
+    st->freeSlots = (uint32_t*) malloc(st->nslots * sizeof(*st->freeSlots));
+    if (!st->refs || !st->drops || !st->dirty || !st->lookup || !st->freeSlots ||
+        posix_memalign((void**) &st->entries, kDedupAlign, (uint64_t) st->npages * kDedupPage)) {
+        return ENOMEM;
+    }
+    
+    error = engine_pread(st->fd, st->entries, (uint64_t) st->npages * kDedupPage, st->tableOffset);
+    if (error) {
+        return error;
+    }
+    
+    for (slot = st->nslots; slot-- > 0; ) {
+        st->refs[slot] = st->entries[slot].refs;
+        if (st->refs[slot]) {
+            lookupInsert(st, slot);
+        } else {
+            st->freeSlots[st->nfree++] = slot;
+        }
+    }
+    
+    return 0;
+}
+
+
+// Images attached by one process share the store, flock keeps other processes out
+static struct DedupStore* storeOpen(const char* path, int writable, int* error)
+{
+    struct DedupStore* st;
+    struct stat sb;
+    
+    if (0 != stat(path, &sb)) {
+        *error = errno;
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&gDedupStoresLock);
+    
+    for (st = gDedupStores; st; st = st->next) {
+        if ((st->dev == sb.st_dev) && (st->ino == sb.st_ino)) {
+            break;
+        }
+    }
+    
+    if (st) {
+        *error = (writable && !st->writable) ? EROFS : 0;
+        st->users += *error ? 0 : 1;
+        pthread_mutex_unlock(&gDedupStoresLock);
+        return *error ? NULL : st;
+    }
+    
+    st = (struct DedupStore*) calloc(1, sizeof(*st));
+    if (!st) {
+        pthread_mutex_unlock(&gDedupStoresLock);
+        *error = ENOMEM;
+        return NULL;
+    }
+    
+    pthread_mutex_init(&st->flushLock, NULL);
+    pthread_mutex_init(&st->lock, NULL);
+    st->dev = sb.st_dev;
+    st->ino = sb.st_ino;
+    st->writable = writable;
+    
+    st->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if ((st->fd < 0) || (0 != flock(st->fd, (writable ? LOCK_EX : LOCK_SH) | LOCK_NB))) {
+        *error = (errno == EWOULDBLOCK) ? EBUSY : errno;
+    } else {
+        *error = storeLoad(st);
+    }
+    
+    if (*error) {
+        pthread_mutex_unlock(&gDedupStoresLock);
+        storeFree(st);
+        return NULL;
+    }
+    
+    st->users = 1;
+    st->next = gDedupStores;
+    gDedupStores = st;
+    pthread_mutex_unlock(&gDedupStoresLock);
+    return st;
+}
+
+
+static void storeClose(struct DedupStore* st)
+{
+    struct DedupStore** link;
+    
+    pthread_mutex_lock(&gDedupStoresLock);
+    
+    if (--st->users) {
+        pthread_mutex_unlock(&gDedupStoresLock);
+        return;
+    }
+    
+    link = &gDedupStores;
+    while (*link != st) {
+        link = &(*link)->next;
+    }
+    
+    *link = st->next;
+    pthread_mutex_unlock(&gDedupStoresLock);
+    
+    // References dropped by the last flushes of its images
+    if (st->writable) {
+        int error = storeFlush(st);
+        if (error) {
+            fprintf(stderr, "Could not write chunk store index: %s\n", strerror(error));
+        }
+    }
+    
+    uint64_t references = 0;
+    uint32_t slot;
+    for (slot = 0; slot < st->nslots; ++slot) {
+        references += st->refs[slot];
+    }
+    
+    printf("Chunk store: %u of %u slots used, %llu references, %.2f dedup ratio, "
+           "%llu chunks stored, %llu shared, %llu hash collisions\n",
+           st->nslots - st->nfree, st->nslots, (unsigned long long) references,
+           ((st->nslots > st->nfree) ? (double) references / (st->nslots - st->nfree) : 0.0),
+           (unsigned long long) st->stored, (unsigned long long) st->shared, (unsigned long long) st->collisions);
+    
+    storeFree(st);
+}
+
+
+static pthread_rwlock_t* chunkLock(struct Dedup* dd, uint64_t chunk)
+{
+    return &dd->locks[(chunk / kDedupGroup) % kDedupLocks];
+}
+
+
+static int dedupRead(struct Dedup* dd, struct LoopEngineIO* io)
+{
+    struct DedupStore* st = dd->store;
+    uint8_t* buffer = (uint8_t*) io->buffer;
+    uint64_t offset = io->offset;
+    uint64_t end = io->offset + io->nbytes;
+    int error = 0;
+    
+    while (!error && (offset < end)) {
+        uint64_t first = offset >> dd->chunkBits;
+        uint64_t chunk;
+        uint64_t to;
+    
+        // Chunks of a group stored one after another, or zero chunks, are read at once
+        pthread_rwlock_rdlock(chunkLock(dd, first));
+        uint32_t id = dd->map[first];
+    
+        for (chunk = first + 1; (chunk << dd->chunkBits < end) && (chunk / kDedupGroup == first / kDedupGroup); ++chunk) {
+            if (dd->map[chunk] != (id ? id + (uint32_t) (chunk - first) : 0)) {
+                break;
+            }
+        }
+    
+        to = (chunk << dd->chunkBits < end) ? chunk << dd->chunkBits : end;
+        uint8_t* p = buffer + (offset - io->offset);
+    
+        if (id) {
+            error = engine_pread(st->fd, p, to - offset, st->dataOffset + ((uint64_t) (id - 1) << dd->chunkBits) +
+                                 (offset & (dd->chunkSize - 1)));
+        } else {
+            memset(p, 0, to - offset);
+        }
+    
+        pthread_rwlock_unlock(chunkLock(dd, first));
+    
+        offset = to;
+    }
+    
+    return error;
+}
+
+
+// Point map entry to another chunk, reference to the one it pointed to is dropped once the map is on disk
+static int setChunk(struct Dedup* dd, uint64_t chunk, uint32_t id)
+{
+    struct DedupStore* st = dd->store;
+    int error = 0;
+    
+    pthread_mutex_lock(&dd->lock);
+    
+    uint32_t old = dd->map[chunk];
+    if (old && (dd->ndropped == dd->droppedCapacity)) {
+        uint32_t capacity = dd->droppedCapacity ? 2 * dd->droppedCapacity : 1024;
+        uint32_t* dropped = (uint32_t*) realloc(dd->dropped, capacity * sizeof(*dropped));
+        if (dropped) {
+            dd->dropped = dropped;
+            dd->droppedCapacity = capacity;
+        } else {
+            error = ENOMEM;
+        }
+    }
+    
+    if (!error) {
+        dd->map[chunk] = id;
+        dd->dirty[(chunk * sizeof(*dd->map)) / kDedupPage] = 1;
+        if (old) {
+            dd->dropped[dd->ndropped++] = old - 1;
+        }
+    }
+    
+    pthread_mutex_unlock(&dd->lock);
+    
+    if (!error && old) {
+        pthread_mutex_lock(&st->lock);
+        st->refs[old - 1]--;
+        st->drops[old - 1]++;
+        pthread_mutex_unlock(&st->lock);
+    }
+    
+    return error;
+}
+
+
+// Write part or all of a chunk. Whole chunks are looked up in store before taking the chunk lock,
+// parts of chunks merge with the chunk they replace under it.
+static int writeChunk(struct Dedup* dd, uint64_t chunk, const uint8_t* data, uint64_t offset, uint64_t nbytes, uint8_t* copy, uint8_t* scratch)
+{
+    struct DedupStore* st = dd->store;
+    int partial = (nbytes < dd->chunkSize);
+    uint32_t id = 0;
+    int error = 0;
+    
+    // Zero chunks take no slot, discards pass no data
+    if (!partial && data && !zero_check(data, dd->chunkSize)) {
+        error = storeInsert(st, data, scratch, &id);
+        if (error) {
+            return error;
+        }
+    }
+    
+    pthread_rwlock_wrlock(chunkLock(dd, chunk));
+    
+    if (partial) {
+        uint32_t old = dd->map[chunk];
+        if (old) {
+            error = engine_pread(st->fd, copy, dd->chunkSize, st->dataOffset + ((uint64_t) (old - 1) << dd->chunkBits));
+        } else {
+            memset(copy, 0, dd->chunkSize);
+        }
+    
+        if (data) {
+            memcpy(copy + offset, data, nbytes);
+        } else {
+            memset(copy + offset, 0, nbytes);
+        }
+    
+        if (!error && !zero_check(copy, dd->chunkSize)) {
+            error = storeInsert(st, copy, scratch, &id);
+        }
+    }
+    
+    if (!error) {
+        error = setChunk(dd, chunk, id);
+    }
+    
+    pthread_rwlock_unlock(chunkLock(dd, chunk));
+    
+    if (error && id) {
+        pthread_mutex_lock(&st->lock);
+        st->refs[id - 1]--;
+        putSlot(st, id - 1);
+        pthread_mutex_unlock(&st->lock);
+    }
+    
+    pthread_mutex_lock(&dd->lock);
+    dd->written++;
+    dd->zeroed += (!error && !id) ? 1 : 0;
+    pthread_mutex_unlock(&dd->lock);
+    
+    return error;
+}
+
+
+// Discards pass no data, whole discarded chunks drop their chunk, parts of chunks are zeroed
+static int dedupWrite(struct Dedup* dd, struct LoopEngineIO* io, const uint8_t* buffer)
+{
+    uint8_t* copy = NULL;
+    uint8_t* scratch = NULL;
+    uint64_t offset = io->offset;
+    uint64_t end = io->offset + io->nbytes;
+    int error = 0;
+    
+    if (posix_memalign((void**) &copy, kDedupAlign, dd->chunkSize) || posix_memalign((void**) &scratch, kDedupAlign, dd->chunkSize)) {
+        free(copy);
+        return ENOMEM;
+    }
+    
+    while (!error && (offset < end)) {
+        uint64_t chunk = offset >> dd->chunkBits;
+        uint64_t start = chunk << dd->chunkBits;
+        uint64_t to = (start + dd->chunkSize < end) ? start + dd->chunkSize : end;
+    
+        error = writeChunk(dd, chunk, buffer ? buffer + (offset - io->offset) : NULL, offset - start, to - offset, copy, scratch);
+        offset = to;
+    }
+    
+    free(scratch);
+    free(copy);
+    return error;
+}
+
+
+// Chunk data and references new map entries take go to disk first, then map pages,
+// and only then references to chunks map stopped pointing to are dropped
+static int dedupFlush(struct LoopEngine* engine, struct Dedup* dd)
+{
+    struct DedupStore* st = dd->store;
+    uint8_t* pages = NULL;
+    uint32_t* numbers = NULL;
+    uint32_t* dropped;
+    uint32_t ndropped;
+    uint32_t npages = 0;
+    uint32_t i;
+    int error = 0;
+    
+    pthread_mutex_lock(&dd->flushLock);
+    pthread_mutex_lock(&dd->lock);
+    
+    for (i = 0; i < dd->npages; ++i) {
+        npages += dd->dirty[i];
+    }
+    
+    if (npages && (posix_memalign((void**) &pages, kDedupAlign, (uint64_t) npages * kDedupPage) ||
+                   !(numbers = (uint32_t*) malloc(npages * sizeof(*numbers))))) {
+        pthread_mutex_unlock(&dd->lock);
+        pthread_mutex_unlock(&dd->flushLock);
+        free(pages);
+        return ENOMEM;
+    }
+    
+    // Map as it is now, every chunk it points to has its reference taken already
+    for (i = 0, npages = 0; i < dd->npages; ++i) {
+        if (dd->dirty[i]) {
+            memcpy(pages + (uint64_t) npages * kDedupPage, (uint8_t*) dd->map + (uint64_t) i * kDedupPage, kDedupPage);
+            numbers[npages++] = i;
+            dd->dirty[i] = 0;
+        }
+    }
+    
+    dropped = dd->dropped;
+    ndropped = dd->ndropped;
+    dd->dropped = NULL;
+    dd->ndropped = 0;
+    dd->droppedCapacity = 0;
+    
+    pthread_mutex_unlock(&dd->lock);
+    
+    error = storeFlush(st);
+    
+    for (i = 0; !error && (i < npages); ++i) {
+        error = imageIO(engine, kLoopEngineOp_Write, pages + (uint64_t) i * kDedupPage, kDedupPage,
+                        dd->mapOffset + (uint64_t) numbers[i] * kDedupPage);
+    }
+    
+    if (!error && npages) {
+        error = imageIO(engine, kLoopEngineOp_Flush, NULL, 0, 0);
+    }
+    
+    if (error) {
+        // Try again next time, references stay dropped until then
+        pthread_mutex_lock(&dd->lock);
+        for (i = 0; i < npages; ++i) {
+            dd->dirty[numbers[i]] = 1;
+        }
+    
+        uint32_t* merged = dd->ndropped ? (uint32_t*) realloc(dropped, (ndropped + dd->ndropped) * sizeof(*merged)) : dropped;
+        if (merged) {
+            if (dd->ndropped) {
+                memcpy(merged + ndropped, dd->dropped, dd->ndropped * sizeof(*merged));
+            }
+            free(dd->dropped);
+            dd->dropped = merged;
+            dd->ndropped += ndropped;
+            dd->droppedCapacity = dd->ndropped;
+            dropped = NULL;
+        }
+        pthread_mutex_unlock(&dd->lock);
+    
+        // Without memory to keep them the references leak, which never lets a slot be reused too early
+        ndropped = 0;
+    }
+    
+    pthread_mutex_lock(&st->lock);
+    for (i = 0; i < ndropped; ++i) {
+        st->drops[dropped[i]]--;
+        putSlot(st, dropped[i]);
+    }
+    pthread_mutex_unlock(&st->lock);
+    
+    pthread_mutex_unlock(&dd->flushLock);
+    free(dropped);
+    free(numbers);
+    free(pages);
+    return error;
+}
+
+
+static int dedupRW(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    struct Dedup* dd = (struct Dedup*) engine->priv;
+    
+    if ((io->op != kLoopEngineOp_Flush) && ((io->offset > dd->size) || (io->nbytes > dd->size - io->offset))) {
+        return EINVAL;
+    }
+    
+    if ((io->op != kLoopEngineOp_Read) && (engine->flags & kLoopEngineFlag_ReadOnly)) {
+        return (io->op == kLoopEngineOp_Flush) ? 0 : EROFS;
+    }
+    
+    switch (io->op) {
+    case kLoopEngineOp_Read:
+        return dedupRead(dd, io);
+    
+    case kLoopEngineOp_Write:
+        return dedupWrite(dd, io, (const uint8_t*) io->buffer);
+    
+    case kLoopEngineOp_Flush:
+        return dedupFlush(engine, dd);
+    
+    case kLoopEngineOp_Discard:
+        return dedupWrite(dd, io, NULL);
+    
+    default:
+        return EINVAL;
+    }
+}
+
+
+// Check image header read from the start of a file
+// @return          1 for valid image header, 0 for other files, -1 with errno set for broken one.
+static int parseImageHeader(const uint8_t* buffer, uint64_t nbytes, uint64_t fileSize, struct LoopDedupImageHeader* header)
+{
+    if (nbytes < sizeof(*header)) {
+        return 0;
+    }
+    
+    memcpy(header, buffer, sizeof(*header));
+    if (header->magic != kLoopDedupImageMagic) {
+        return 0;
+    }
+    
+    uint64_t chunkSize = (uint64_t) 1 << header->chunkBits;
+    uint64_t nchunks = (header->size + chunkSize - 1) >> header->chunkBits;
+    
+    if ((header->version != kLoopDedupVersion) ||
+        (header->chunkBits < kLoopDedupMinChunkBits) || (header->chunkBits > kLoopDedupMaxChunkBits) ||
+        !header->size || (nchunks > UINT32_MAX) ||
+        (header->storeLength >= kLoopDedupHeaderBytes - sizeof(*header)) || (header->storeLength >= PATH_MAX) ||
+        (header->storeLength > nbytes - sizeof(*header)) || (header->mapOffset != kLoopDedupHeaderBytes) ||
+        (header->mapOffset + nchunks * sizeof(uint32_t) > fileSize)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    return 1;
+}
+
+
+static void infoFromHeader(const struct LoopDedupImageHeader* header, const uint8_t* buffer, struct LoopDedupInfo* info)
+{
+    info->size = header->size;
+    info->chunkSize = (uint32_t) 1 << header->chunkBits;
+    memcpy(info->store, buffer + sizeof(*header), header->storeLength);
+    info->store[header->storeLength] = 0;
+}
+
+
+// Relative store path is relative to the directory image is in
+static void resolveStore(const char* file, const char* store, char* path)
+{
+    const char* slash = strrchr(file, '/');
+    
+    if ((store[0] == '/') || !slash) {
+        snprintf(path, PATH_MAX, "%s", store);
+    } else {
+        snprintf(path, PATH_MAX, "%.*s/%s", (int) (slash - file), file, store);
+    }
+}
+
+
+static void dedupFree(struct Dedup* dd)
+{
+    unsigned i;
+    
+    for (i = 0; i < kDedupLocks; ++i) {
+        pthread_rwlock_destroy(&dd->locks[i]);
+    }
+    
+    if (dd->store) {
+        storeClose(dd->store);
+    }
+    
+    pthread_mutex_destroy(&dd->lock);
+    pthread_mutex_destroy(&dd->flushLock);
+    free(dd->dropped);
+    free(dd->dirty);
+    free(dd->map);
+    free(dd);
+}
+
+
+static int dedupOpen(struct LoopEngine* engine)
+{
+    struct LoopEngine* lower = engine->lower;
+    struct LoopDedupImageHeader header;
+    struct LoopDedupInfo info;
+    char path[PATH_MAX];
+    uint8_t* buffer = NULL;
+    uint64_t i;
+    unsigned n;
+    int error;
+    
+    struct Dedup* dd = (struct Dedup*) calloc(1, sizeof(*dd));
+    if (!dd) {
+        return ENOMEM;
+    }
+    
+    pthread_mutex_init(&dd->flushLock, NULL);
+    pthread_mutex_init(&dd->lock, NULL);
+    for (n = 0; n < kDedupLocks; ++n) {
+        pthread_rwlock_init(&dd->locks[n], NULL);
+    }
+    
+    if (posix_memalign((void**) &buffer, kDedupAlign, kLoopDedupHeaderBytes)) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    error = (lower->size < kLoopDedupHeaderBytes) ? EINVAL : imageIO(engine, kLoopEngineOp_Read, buffer, kLoopDedupHeaderBytes, 0);
+    if (error) {
+        goto ERROR_OUT;
+    }
+    
+    if (1 != parseImageHeader(buffer, kLoopDedupHeaderBytes, lower->size, &header)) {
+        error = EINVAL;
+        goto ERROR_OUT;
+    }
+    
+    infoFromHeader(&header, buffer, &info);
+    
+    dd->size        = header.size;
+    dd->chunkBits   = header.chunkBits;
+    dd->chunkSize   = (uint64_t) 1 << header.chunkBits;
+    dd->nchunks     = (header.size + dd->chunkSize - 1) >> header.chunkBits;
+    dd->mapOffset   = header.mapOffset;
+    dd->mapBytes    = (dd->nchunks * sizeof(*dd->map) + kDedupPage - 1) & ~(uint64_t) (kDedupPage - 1);
+    dd->npages      = (uint32_t) (dd->mapBytes / kDedupPage);
+    
+    // Map is zero past the file end, created images leave it a hole
+    if (dd->mapOffset + dd->mapBytes > lower->size) {
+        error = EINVAL;
+        goto ERROR_OUT;
+    }
+    
+    resolveStore(engine->file, info.store, path);
+    dd->store = storeOpen(path, !(engine->flags & kLoopEngineFlag_ReadOnly), &error);
+    if (!dd->store) {
+        goto ERROR_OUT;
+    }
+    
+    if (dd->store->chunkBits != dd->chunkBits) {
+        error = EINVAL;
+        goto ERROR_OUT;
+    }
+    
+    dd->dirty = (uint8_t*) calloc(dd->npages, 1);
+    if (!dd->dirty || posix_memalign((void**) &dd->map, kDedupAlign, dd->mapBytes)) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    error = imageIO(engine, kLoopEngineOp_Read, dd->map, dd->mapBytes, dd->mapOffset);
+    if (error) {
+        goto ERROR_OUT;
+    }
+    
+    // Map pointing to a free slot would share it with whatever gets stored there next
+    pthread_mutex_lock(&dd->store->lock);
+    for (i = 0; !error && (i < dd->mapBytes / sizeof(*dd->map)); ++i) {
+        uint32_t id = dd->map[i];
+        if ((id && ((id > dd->store->nslots) || (i >= dd->nchunks) || !dd->store->refs[id - 1]))) {
+            error = EINVAL;
+        }
+    }
+    pthread_mutex_unlock(&dd->store->lock);
+    
+    if (error) {
+        goto ERROR_OUT;
+    }
+    
+    free(buffer);
+    engine->size = dd->size;
+    engine->priv = dd;
+    return 0;
+    
+ERROR_OUT:
+    
+    dedupFree(dd);
+    free(buffer);
+    return error;
+}
+
+
+static void dedupClose(struct LoopEngine* engine)
+{
+    struct Dedup* dd = (struct Dedup*) engine->priv;
+    
+    if (!(engine->flags & kLoopEngineFlag_ReadOnly)) {
+        int error = dedupFlush(engine, dd);
+        if (error) {
+            fprintf(stderr, "Could not write dedup image map: %s\n", strerror(error));
+        }
+    }
+    
+    printf("Dedup image: %llu chunks written, %llu of them zero\n",
+           (unsigned long long) dd->written, (unsigned long long) dd->zeroed);
+    
+    dedupFree(dd);
+}
+
+
+static const struct LoopEngineOps gDedupEngineOps = {
+    .name       = "dedup",
+    .open       = dedupOpen,
+    .close      = dedupClose,
+    .rw         = dedupRW,
+};
+
+
+struct LoopEngine* dedup_open(struct LoopEngine* lower, struct LoopWorkQueue* workers, unsigned depth)
+{
+    return workers ? engine_stack_shared(&gDedupEngineOps, lower, workers, depth, NULL) :
+                     engine_stack(&gDedupEngineOps, lower, 1, depth, NULL);
+}
+
+
+int dedup_probe(const char* file, struct LoopDedupInfo* info)
+{
+    struct LoopDedupImageHeader header;
+    uint8_t buffer[kLoopDedupHeaderBytes];
+    struct stat st;
+    
+    int fd = open(file, O_RDONLY);
+    if ((fd < 0) || (0 != fstat(fd, &st))) {
+        int error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        errno = error;
+        return -1;
+    }
+    
+    ssize_t rc = pread(fd, buffer, sizeof(buffer), 0);
+    int error = errno;
+    close(fd);
+    
+    if (rc < 0) {
+        errno = error;
+        return -1;
+    }
+    
+    int found = parseImageHeader(buffer, (uint64_t) rc, (uint64_t) st.st_size, &header);
+    if ((found == 1) && info) {
+        infoFromHeader(&header, buffer, info);
+    }
+    
+    return found;
+}
+
+
+int dedup_create(const char* file, const char* store, uint64_t size)
+{
+    struct LoopDedupImageHeader header;
+    struct LoopDedupStoreHeader storeHeader;
+    char path[PATH_MAX];
+    uint8_t* buffer;
+    int error = 0;
+    
+    size_t storeLength = strlen(store);
+    if (!size || (storeLength >= kLoopDedupHeaderBytes - sizeof(header)) || (storeLength >= PATH_MAX)) {
+        return EINVAL;
+    }
+    
+    // Store has to be found from where image is, chunk size comes from it
+    resolveStore(file, store, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno;
+    }
+    
+    error = readStoreHeader(fd, &storeHeader);
+    close(fd);
+    if (error) {
+        return error;
+    }
+    
+    uint64_t chunkSize = (uint64_t) 1 << storeHeader.chunkBits;
+    uint64_t nchunks = (size + chunkSize - 1) >> storeHeader.chunkBits;
+    if (nchunks > UINT32_MAX) {
+        return EINVAL;
+    }
+    
+    memset(&header, 0, sizeof(header));
+    header.magic        = kLoopDedupImageMagic;
+    header.version      = kLoopDedupVersion;
+    header.chunkBits    = storeHeader.chunkBits;
+    header.size         = size;
+    header.mapOffset    = kLoopDedupHeaderBytes;
+    header.storeLength  = (uint32_t) storeLength;
+    
+    uint64_t mapBytes = (nchunks * sizeof(uint32_t) + kDedupPage - 1) & ~(uint64_t) (kDedupPage - 1);
+    
+    buffer = (uint8_t*) calloc(1, kLoopDedupHeaderBytes);
+    if (!buffer) {
+        return ENOMEM;
+    }
+    
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), store, storeLength);
+    
+    fd = open(file, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        free(buffer);
+        return errno;
+    }
+    
+    // Empty map is a hole
+    error = engine_pwrite(fd, buffer, kLoopDedupHeaderBytes, 0);
+    if (!error && (0 != ftruncate(fd, (off_t) (header.mapOffset + mapBytes)))) {
+        error = errno;
+    }
+    if (!error) {
+        error = engine_fdatasync(fd);
+    }
+    
+    close(fd);
+    free(buffer);
+    
+    if (error) {
+        unlink(file);
+    }
+    
+    return error;
+}
+
+
+int dedup_store_probe(const char* file, struct LoopDedupStoreInfo* info)
+{
+    struct LoopDedupStoreHeader header;
+    struct LoopDedupEntry* entries = NULL;
+    uint8_t buffer[sizeof(header)];
+    struct stat st;
+    uint32_t slot;
+    
+    int fd = open(file, O_RDONLY);
+    if ((fd < 0) || (0 != fstat(fd, &st))) {
+        int error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        errno = error;
+        return -1;
+    }
+    
+    ssize_t rc = pread(fd, buffer, sizeof(buffer), 0);
+    int found = (rc < 0) ? -1 : parseStoreHeader(buffer, (uint64_t) rc, (uint64_t) st.st_size, &header);
+    int error = (found < 0) ? errno : 0;
+    
+    if ((found == 1) && info) {
+        info->chunkSize = (uint32_t) 1 << header.chunkBits;
+        info->nslots = header.nslots;
+        info->used = 0;
+        info->references = 0;
+    
+        entries = (struct LoopDedupEntry*) malloc((uint64_t) header.nslots * sizeof(*entries));
+        error = entries ? engine_pread(fd, entries, (uint64_t) header.nslots * sizeof(*entries), header.tableOffset) : ENOMEM;
+        for (slot = 0; !error && (slot < header.nslots); ++slot) {
+            info->used += entries[slot].refs ? 1 : 0;
+            info->references += entries[slot].refs;
+        }
+    
+        found = error ? -1 : 1;
+    }
+    
+    close(fd);
+    free(entries);
+    errno = error;
+    return found;
+}
+
+
+int dedup_store_create(const char* file, uint32_t chunkBits, uint32_t nslots)
+{
+    struct LoopDedupStoreHeader header;
+    uint8_t buffer[kLoopDedupHeaderBytes];
+    int error = 0;
+    
+    if ((chunkBits < kLoopDedupMinChunkBits) || (chunkBits > kLoopDedupMaxChunkBits) || !nslots || (nslots > kLoopDedupMaxSlots)) {
+        return EINVAL;
+    }
+    
+    uint64_t chunkSize = (uint64_t) 1 << chunkBits;
+    uint64_t tableBytes = ((uint64_t) nslots * sizeof(struct LoopDedupEntry) + kDedupPage - 1) & ~(uint64_t) (kDedupPage - 1);
+    
+    memset(&header, 0, sizeof(header));
+    header.magic        = kLoopDedupStoreMagic;
+    header.version      = kLoopDedupVersion;
+    header.chunkBits    = chunkBits;
+    header.nslots       = nslots;
+    header.tableOffset  = kLoopDedupHeaderBytes;
+    header.dataOffset   = (header.tableOffset + tableBytes + chunkSize - 1) & ~(chunkSize - 1);
+    
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, &header, sizeof(header));
+    
+    int fd = open(file, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return errno;
+    }
+    
+    // Empty index is a hole, chunk data grows as slots get used
+    error = engine_pwrite(fd, buffer, sizeof(buffer), 0);
+    if (!error && (0 != ftruncate(fd, (off_t) header.dataOffset))) {
+        error = errno;
+    }
+    if (!error) {
+        error = engine_fdatasync(fd);
+    }
+    
+    close(fd);
+    
+    if (error) {
+        unlink(file);
+    }
+    
+    return error;
+}
@@ -0,0 +1,137 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Deduplicated images on a shared content addressed chunk store.
+//
+//  Chunk store keeps fixed size chunks, every distinct one once, found by a hash of its contents. Deduplicated
+//  image is a thin map of chunk ids, one per chunk of the device, 0 for chunks that read zeroes. Writing a chunk
+//  looks its contents up in the store and stores it only if it is not there yet. Chunks are reference counted,
+//  a chunk that gets overwritten loses a reference and its slot is reused once nothing refers to it any more.
+//  Hash matches are compared byte by byte before a chunk is shared. Images attached by one helper share one open
+//  store, which other processes cannot open at the same time.
+//
+//  Store on disk, in host byte order:
+//      0               LoopDedupStoreHeader
+//      tableOffset     nslots LoopDedupEntry records, the index: contents hash and reference count of every slot
+//      dataOffset      nslots chunks, slot i at dataOffset + i * chunk size, holes where slots were never used
+//
+//  Image on disk:
+//      0               LoopDedupImageHeader, then store path, relative ones are relative to the image
+//      mapOffset       uint32_t chunk id per device chunk, slot + 1, or 0 for zero chunks
+//
+//  Lookup hash table is built from the index at open. Flush writes chunk data, then index entries counting the
+//  references new map entries take, then the map, and drops references of chunks the map stopped pointing to only
+//  once the map is on disk. A crash may leak chunks, it never leaves a map pointing to a slot that got reused.
+//
+
+#ifndef LOOP_DEDUP_H
+#define LOOP_DEDUP_H
+
+#include <stdint.h>
+#include <limits.h>
+
+#include "engine.h"
+
+
+#define kLoopDedupStoreMagic    0x31534444504f4f4cull   // "LOOPDDS1"
+#define kLoopDedupImageMagic    0x31494444504f4f4cull   // "LOOPDDI1"
+
+enum {
+    kLoopDedupVersion           = 1,
+    kLoopDedupMinChunkBits      = 12,           // 4K
+    kLoopDedupMaxChunkBits      = 20,           // 1M
+    kLoopDedupDefaultChunkBits  = 16,           // 64K
+    kLoopDedupMaxSlots          = 1 << 26,
+    kLoopDedupHeaderBytes       = 4096,         // Header and store path, index and map start past it
+};
+
+
+struct LoopDedupStoreHeader {
+    uint64_t            magic;          // kLoopDedupStoreMagic
+    uint32_t            version;        // kLoopDedupVersion
+    uint32_t            chunkBits;      // log2 of chunk size
+    uint32_t            nslots;         // Store capacity in chunks
+    uint32_t            reserved0;
+    uint64_t            tableOffset;    // Index position
+    uint64_t            dataOffset;     // Slot 0 position, chunk aligned
+    uint64_t            reserved[3];
+};
+
+
+// Index entry, slot is free when nothing refers to it
+struct LoopDedupEntry {
+    uint64_t            hash;           // Contents hash
+    uint32_t            refs;           // Image map entries pointing to the slot
+    uint32_t            reserved;
+};
+
+
+struct LoopDedupImageHeader {
+    uint64_t            magic;          // kLoopDedupImageMagic
+    uint32_t            version;        // kLoopDedupVersion
+    uint32_t            chunkBits;      // Same as store
+    uint64_t            size;           // Device size in bytes
+    uint64_t            mapOffset;      // Map position
+    uint32_t            storeLength;    // Length of store path following header, no terminating zero
+    uint32_t            reserved0;
+    uint64_t            reserved[3];
+};
+
+
+// What dedup_probe finds out about an image
+struct LoopDedupInfo {
+    uint64_t            size;           // Device size in bytes
+    uint32_t            chunkSize;
+    char                store[PATH_MAX]; // Store path as stored in header
+};
+
+
+// What dedup_store_probe finds out about a store
+struct LoopDedupStoreInfo {
+    uint32_t            chunkSize;
+    uint32_t            nslots;
+    uint32_t            used;           // Slots holding a chunk
+    uint64_t            references;     // Image chunks pointing to them
+};
+
+
+/**
+ * Create an empty chunk store.
+ * @param chunkBits log2 of chunk size, kLoopDedupMinChunkBits to kLoopDedupMaxChunkBits.
+ * @param nslots    Number of distinct chunks store can hold, up to kLoopDedupMaxSlots. Chunk data is sparse.
+ * @return          0 or errno. Existing file is not overwritten.
+ */
+int dedup_store_create(const char* file, uint32_t chunkBits, uint32_t nslots);
+
+/**
+ * Check if file is a chunk store and count its chunks. Store must not be in use.
+ * @param info      Filled in for stores, may be NULL.
+ * @return          1 for store, 0 for any other file, -1 with errno set if file cannot be read or is broken.
+ */
+int dedup_store_probe(const char* file, struct LoopDedupStoreInfo* info);
+
+/**
+ * Create a deduplicated image reading zeroes on a chunk store.
+ * @param store     Store path, relative ones are relative to the image.
+ * @param size      Device size in bytes.
+ * @return          0 or errno. Existing file is not overwritten.
+ */
+int dedup_create(const char* file, const char* store, uint64_t size);
+
+/**
+ * Check if file is a deduplicated image.
+ * @param info      Filled in for deduplicated images, may be NULL.
+ * @return          1 for deduplicated image, 0 for any other file, -1 with errno set if file cannot be read or header is bad.
+ */
+int dedup_probe(const char* file, struct LoopDedupInfo* info);
+
+/**
+ * Stack deduplication on top of the engine of an image file, opening the store it names or sharing it with
+ * images open already. Image file ios run synchronously on dedup engine workers, lower engine needs no workers of its own.
+ * @param lower     Engine of image file, owned by dedup engine from now on.
+ * @param workers   Shared worker pool, or NULL for a worker thread of its own.
+ * @return          Dedup engine sized like the device, or NULL with errno set, lower engine is left open on failure.
+ */
+struct LoopEngine* dedup_open(struct LoopEngine* lower, struct LoopWorkQueue* workers, unsigned depth);
+
+#endif
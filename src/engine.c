@@ -0,0 +1,480 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+// fallocate, O_DIRECT and statx on Linux
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
+#include "engine.h"
+#include "workq.h"
+
+
+extern const struct LoopEngineOps gPosixEngineOps;
+extern const struct LoopEngineOps gMmapEngineOps;
+#ifdef __linux__
+extern const struct LoopEngineOps gUringEngineOps;
+#endif
+
+// First one is the default
+static const struct LoopEngineOps* gEngines[] = {
+    &gPosixEngineOps,
+    &gMmapEngineOps,
+#ifdef __linux__
+    &gUringEngineOps,
+#endif
+    NULL
+};
+
+
+// Worker queue item, queues may be shared by several engines
+struct EngineWork {
+    struct LoopEngine*      engine;
+    struct LoopEngineIO*    io;
+};
+
+
+// Runs on engine worker threads
+static void engineWorker(void* item, void* arg)
+{
+    struct EngineWork* work = (struct EngineWork*) item;
+    struct LoopEngine* engine = work->engine;
+    struct LoopEngineIO* io = work->io;
+    
+    io->error = engine->ops->rw(engine, io);
+    io->done(io);
+}
+
+
+// Allocate engine instance and open it
+// @param workers   Shared worker pool or NULL to start nthreads workers of its own.
+static struct LoopEngine* engineCreate(const struct LoopEngineOps* ops, const char* file, unsigned flags, unsigned nthreads,
+                                       struct LoopWorkQueue* workers, unsigned depth, struct LoopEngine* lower, void* priv)
+{
+    struct LoopEngine* engine = (struct LoopEngine*) calloc(1, sizeof(*engine));
+    if (!engine) {
+        return NULL;
+    }
+    
+    engine->ops     = ops;
+    engine->file    = file;
+    engine->flags   = flags;
+    engine->depth   = depth;
+    engine->lower   = lower;
+    engine->priv    = priv;
+    
+    if (!ops->submit && workers) {
+        engine->workq = workers;
+        engine->sharedWorkers = 1;
+    } else if (!ops->submit) {
+        engine->workq = engine_workers_create(nthreads, depth);
+        if (!engine->workq) {
+            free(engine);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    
+    int error = ops->open(engine);
+    if (error) {
+        if (engine->workq && !engine->sharedWorkers) {
+            workq_destroy(engine->workq);
+        }
+        free(engine);
+        errno = error;
+        return NULL;
+    }
+    
+    return engine;
+}
+
+
+static const struct LoopEngineOps* findEngine(const char* name)
+{
+    const struct LoopEngineOps* ops = gEngines[0];
+    int i;
+    
+    if (name) {
+        for (i = 0, ops = NULL; gEngines[i]; ++i) {
+            if (!strcmp(gEngines[i]->name, name)) {
+                ops = gEngines[i];
+                break;
+            }
+        }
+        
+        if (!ops) {
+            errno = ENOENT;
+        }
+    }
+    
+    return ops;
+}
+
+
+struct LoopEngine* engine_open(const char* name, const char* file, unsigned flags, unsigned nthreads, unsigned depth)
+{
+    const struct LoopEngineOps* ops = findEngine(name);
+    return ops ? engineCreate(ops, file, flags, nthreads, NULL, depth, NULL, NULL) : NULL;
+}
+
+
+struct LoopEngine* engine_open_shared(const char* name, const char* file, unsigned flags, struct LoopWorkQueue* workers, unsigned depth)
+{
+    const struct LoopEngineOps* ops = findEngine(name);
+    return ops ? engineCreate(ops, file, flags, 0, workers, depth, NULL, NULL) : NULL;
+}
+
+
+struct LoopEngine* engine_stack(const struct LoopEngineOps* ops, struct LoopEngine* lower, unsigned nthreads, unsigned depth, void* priv)
+{
+    return engineCreate(ops, lower->file, lower->flags, nthreads, NULL, depth, lower, priv);
+}
+
+
+struct LoopEngine* engine_stack_shared(const struct LoopEngineOps* ops, struct LoopEngine* lower, struct LoopWorkQueue* workers, unsigned depth, void* priv)
+{
+    return engineCreate(ops, lower->file, lower->flags, 0, workers, depth, lower, priv);
+}
+
+
+struct LoopWorkQueue* engine_workers_create(unsigned nthreads, unsigned depth)
+{
+    return workq_create(nthreads, depth, sizeof(struct EngineWork), engineWorker, NULL);
+}
+
+
+void engine_close(struct LoopEngine* engine)
+{
+    if (engine->workq && !engine->sharedWorkers) {
+        workq_destroy(engine->workq);
+    }
+    
+    engine->ops->close(engine);
+    
+    if (engine->lower) {
+        engine_close(engine->lower);
+    }
+    
+    free(engine);
+}
+
+
+void engine_submit(struct LoopEngine* engine, struct LoopEngineIO** ios, unsigned count)
+{
+    unsigned i;
+    
+    if (engine->ops->submit) {
+        engine->ops->submit(engine, ios, count);
+        return;
+    }
+    
+    for (i = 0; i < count; ++i) {
+        struct EngineWork work = { engine, ios[i] };
+        if (0 != workq_submit(engine->workq, &work)) {
+            ios[i]->error = ESHUTDOWN;
+            ios[i]->done(ios[i]);
+        }
+    }
+}
+
+
+struct SyncWait {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    int                 done;
+};
+
+static void syncDone(struct LoopEngineIO* io)
+{
+    struct SyncWait* wait = (struct SyncWait*) io->priv;
+    
+    pthread_mutex_lock(&wait->lock);
+    wait->done = 1;
+    pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->lock);
+}
+
+
+int engine_rw(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    if (!engine->ops->submit) {
+        io->error = engine->ops->rw(engine, io);
+        return io->error;
+    }
+    
+    // Engine is asynchronous, borrow io completion to wait for it
+    void (*done)(struct LoopEngineIO*) = io->done;
+    void* priv = io->priv;
+    struct SyncWait wait;
+    
+    pthread_mutex_init(&wait.lock, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+    wait.done = 0;
+    
+    io->done = syncDone;
+    io->priv = &wait;
+    engine->ops->submit(engine, &io, 1);
+    
+    pthread_mutex_lock(&wait.lock);
+    while (!wait.done) {
+        pthread_cond_wait(&wait.cond, &wait.lock);
+    }
+    pthread_mutex_unlock(&wait.lock);
+    
+    pthread_cond_destroy(&wait.cond);
+    pthread_mutex_destroy(&wait.lock);
+    
+    io->done = done;
+    io->priv = priv;
+    return io->error;
+}
+
+
+int engine_register_memory(struct LoopEngine* engine, void* base, uint64_t size)
+{
+    if (!engine->ops->register_memory) {
+        return 0;
+    }
+    
+    return engine->ops->register_memory(engine, base, size);
+}
+
+
+const char* engine_names(void)
+{
+    static char names[256];
+    int i;
+    
+    if (!names[0]) {
+        for (i = 0; gEngines[i]; ++i) {
+            if (i) {
+                strncat(names, ", ", sizeof(names) - strlen(names) - 1);
+            }
+            strncat(names, gEngines[i]->name, sizeof(names) - strlen(names) - 1);
+        }
+    }
+    
+    return names;
+}
+
+
+int engine_pread(int fd, void* buffer, uint64_t nbytes, uint64_t offset)
+{
+    uint8_t* p = (uint8_t*) buffer;
+    
+    while (nbytes) {
+        ssize_t rc = pread(fd, p, (size_t) nbytes, (off_t) offset);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        } else if (rc == 0) {
+            // Reading past the end of backing store
+            return EIO;
+        }
+        
+        p += rc;
+        offset += rc;
+        nbytes -= rc;
+    }
+    
+    return 0;
+}
+
+
+int engine_pwrite(int fd, const void* buffer, uint64_t nbytes, uint64_t offset)
+{
+    const uint8_t* p = (const uint8_t*) buffer;
+    
+    while (nbytes) {
+        ssize_t rc = pwrite(fd, p, (size_t) nbytes, (off_t) offset);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        
+        p += rc;
+        offset += rc;
+        nbytes -= rc;
+    }
+    
+    return 0;
+}
+
+
+int engine_fdatasync(int fd)
+{
+#ifdef __APPLE__
+    // fsync on darwin does not flush drive cache
+    if (0 != fcntl(fd, F_FULLFSYNC)) {
+        return errno;
+    }
+#else
+    if (0 != fdatasync(fd)) {
+        return errno;
+    }
+#endif
+    
+    return 0;
+}
+
+
+#ifdef __APPLE__
+static const uint8_t sZeroes[64 * 1024];
+
+// Write zeroes over a range F_PUNCHHOLE could not take
+static int zeroRange(int fd, uint64_t offset, uint64_t nbytes)
+{
+    while (nbytes) {
+        uint64_t chunk = (nbytes < sizeof(sZeroes)) ? nbytes : sizeof(sZeroes);
+        int error = engine_pwrite(fd, sZeroes, chunk, offset);
+        if (error) {
+            return error;
+        }
+        
+        offset += chunk;
+        nbytes -= chunk;
+    }
+    
+    return 0;
+}
+#endif
+
+
+int engine_discard(int fd, uint64_t offset, uint64_t nbytes)
+{
+#if defined(__APPLE__) && defined(F_PUNCHHOLE)
+    // Only whole filesystem blocks are freed, partial blocks at range ends are zeroed by hand
+    struct stat st;
+    if (0 != fstat(fd, &st)) {
+        return errno;
+    }
+    
+    uint64_t align = st.st_blksize ? (uint64_t) st.st_blksize : 4096;
+    uint64_t end = offset + nbytes;
+    uint64_t holeStart = (offset + align - 1) / align * align;
+    uint64_t holeEnd = end / align * align;
+    
+    if (holeStart < holeEnd) {
+        struct fpunchhole hole;
+        memset(&hole, 0, sizeof(hole));
+        hole.fp_offset = (off_t) holeStart;
+        hole.fp_length = (off_t) (holeEnd - holeStart);
+        
+        if (0 != fcntl(fd, F_PUNCHHOLE, &hole)) {
+            return errno;
+        }
+    } else {
+        holeStart = holeEnd = end;
+    }
+    
+    int error = zeroRange(fd, offset, holeStart - offset);
+    return error ? error : zeroRange(fd, holeEnd, end - holeEnd);
+#elif defined(FALLOC_FL_PUNCH_HOLE)
+    if (0 != fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) offset, (off_t) nbytes)) {
+        return errno;
+    }
+    
+    return 0;
+#else
+    return ENOTSUP;
+#endif
+}
+
+
+#ifdef __linux__
+// Direct io alignment filesystem asks for, falling back to preferred io size which is never smaller
+static uint32_t directAlignment(int fd, const struct stat* st)
+{
+    uint32_t align = (uint32_t) st->st_blksize;
+    
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if ((0 == statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx)) && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align) {
+        align = (stx.stx_dio_mem_align > stx.stx_dio_offset_align) ? stx.stx_dio_mem_align : stx.stx_dio_offset_align;
+    }
+#endif
+    
+    return (align < 512) ? 512 : align;
+}
+#endif
+
+
+int engine_file_open(struct LoopEngine* engine, struct LoopEngineFile* file)
+{
+    int mode = (engine->flags & kLoopEngineFlag_ReadOnly) ? O_RDONLY : O_RDWR;
+    struct stat st;
+    int error;
+    
+    file->cachedFd = -1;
+    file->align = 0;
+    
+    file->fd = open(engine->file, mode);
+    if (file->fd < 0) {
+        return errno;
+    }
+    
+    if (0 != fstat(file->fd, &st)) {
+        error = errno;
+        goto ERROR_OUT;
+    }
+    
+    if (engine->flags & kLoopEngineFlag_Direct) {
+#ifdef __APPLE__
+        // Unaligned ios are fine, kernel only goes through cache for partial pages
+        if (0 != fcntl(file->fd, F_NOCACHE, 1)) {
+            error = errno;
+            goto ERROR_OUT;
+        }
+#elif defined(O_DIRECT)
+        // Descriptor opened first stays cached for the ios direct one would refuse
+        file->cachedFd = file->fd;
+        file->fd = open(engine->file, mode | O_DIRECT);
+        if (file->fd < 0) {
+            error = errno;
+            file->fd = file->cachedFd;
+            file->cachedFd = -1;
+            goto ERROR_OUT;
+        }
+        
+        file->align = directAlignment(file->fd, &st);
+#else
+        error = ENOTSUP;
+        goto ERROR_OUT;
+#endif
+    }
+    
+    engine->size = st.st_size;
+    return 0;
+    
+ERROR_OUT:
+    
+    engine_file_close(file);
+    return error;
+}
+
+
+void engine_file_close(struct LoopEngineFile* file)
+{
+    if (file->cachedFd >= 0) {
+        close(file->cachedFd);
+    }
+    
+    close(file->fd);
+}
@@ -0,0 +1,213 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Backing store engines.
+//
+//  Engine hides how helper gets to the backing file. Every engine implements a synchronous rw operation
+//  which generic code runs on a pool of worker threads. Engines that can do asynchronous io natively
+//  also implement submit and complete ios themselves.
+//
+//  Engines are portable, platform specific ones are compiled only where they make sense.
+//
+
+#ifndef LOOP_ENGINE_H
+#define LOOP_ENGINE_H
+
+#include <stdint.h>
+
+
+enum {
+    kLoopEngineOp_Read      = 0,        // Read nbytes at offset into buffer
+    kLoopEngineOp_Write     = 1,        // Write nbytes at offset from buffer
+    kLoopEngineOp_Flush     = 2,        // Make all completed writes durable, no data
+    kLoopEngineOp_Discard   = 3,        // Deallocate nbytes at offset, no data, see engine_discard
+};
+
+enum {
+    kLoopEngineFlag_ReadOnly    = 0x1,  // Open backing store read only
+    kLoopEngineFlag_SQPoll      = 0x2,  // io_uring: let kernel thread poll submission queue
+    kLoopEngineFlag_Direct      = 0x4,  // Bypass host page cache, O_DIRECT on Linux and F_NOCACHE on darwin
+};
+
+enum {
+    kLoopEngineIOFlag_WriteThrough  = 0x1,  // Write has to reach backing store before io completes, caches must not hold it
+    kLoopEngineIOFlag_FUA           = 0x2,  // Write has to be durable before io completes, see commit.h
+};
+
+
+// Single io request for an engine
+struct LoopEngineIO {
+    uint32_t            op;             // kLoopEngineOp_XXX
+    uint32_t            flags;          // kLoopEngineIOFlag_XXX
+    int                 error;          // 0 or errno, set by engine before calling done
+    void*               buffer;         // Data buffer
+    uint64_t            nbytes;         // Data size
+    uint64_t            offset;         // Byte offset in backing store
+    void                (*done)(struct LoopEngineIO* io);   // Called once io completes, on any thread
+    void*               priv;           // Owner data
+    struct LoopEngineIO* next;          // List link for whoever holds io at the moment
+};
+
+
+struct LoopEngine;
+
+struct LoopEngineOps {
+    const char*     name;
+
+    /**
+     * Open backing store. Engine file and flags are already set.
+     * @return      0 or errno.
+     */
+    int             (*open)(struct LoopEngine* engine);
+
+    /**
+     * Close backing store, no ios are in flight.
+     */
+    void            (*close)(struct LoopEngine* engine);
+
+    /**
+     * Execute single io synchronously on calling thread.
+     * @return      0 or errno.
+     */
+    int             (*rw)(struct LoopEngine* engine, struct LoopEngineIO* io);
+
+    /**
+     * Optional. Start a batch of ios and call their done callbacks once they complete.
+     */
+    void            (*submit)(struct LoopEngine* engine, struct LoopEngineIO** ios, unsigned count);
+
+    /**
+     * Optional. Tell engine that ios will mostly use buffers from this memory range.
+     * @return      0 or errno.
+     */
+    int             (*register_memory)(struct LoopEngine* engine, void* base, uint64_t size);
+};
+
+
+struct LoopEngine {
+    const struct LoopEngineOps* ops;
+    const char*                 file;       // Backing store path
+    unsigned                    flags;      // kLoopEngineFlag_XXX
+    unsigned                    depth;      // Max ios in flight
+    uint64_t                    size;       // Backing store size in bytes, set by open
+    struct LoopWorkQueue*       workq;      // Worker threads for engines without native submit
+    int                         sharedWorkers;  // Workq belongs to somebody else, see engine_workers_create
+    struct LoopEngine*          lower;      // Engine this one is stacked on or NULL
+    void*                       priv;       // Engine private data
+};
+
+
+/**
+ * Open backing store with a named engine.
+ * @param name      Engine name, NULL for default engine.
+ * @param nthreads  Number of worker threads for engines that need them.
+ * @param depth     Max number of ios in flight.
+ * @return          New engine instance or NULL with errno set.
+ */
+struct LoopEngine* engine_open(const char* name, const char* file, unsigned flags, unsigned nthreads, unsigned depth);
+
+/**
+ * Open backing store running synchronous ios on a worker pool shared with other engines.
+ * Engines with native submit do not use workers at all.
+ * @param workers   Pool from engine_workers_create, has to outlive the engine.
+ */
+struct LoopEngine* engine_open_shared(const char* name, const char* file, unsigned flags, struct LoopWorkQueue* workers, unsigned depth);
+
+/**
+ * Create engine stacked on top of another one, like a cache.
+ * Stacked engine owns lower engine and closes it when it is closed itself.
+ * @param priv      Engine private data passed to ops open.
+ * @return          New engine instance or NULL with errno set, lower engine is left open on failure.
+ */
+struct LoopEngine* engine_stack(const struct LoopEngineOps* ops, struct LoopEngine* lower, unsigned nthreads, unsigned depth, void* priv);
+
+/**
+ * Same as engine_stack, running synchronous ios on a shared worker pool.
+ * Stacked engine must not wait for lower engine ios on the same pool, workers could all end up waiting.
+ */
+struct LoopEngine* engine_stack_shared(const struct LoopEngineOps* ops, struct LoopEngine* lower, struct LoopWorkQueue* workers, unsigned depth, void* priv);
+
+/**
+ * Create worker pool several engines can share instead of starting threads of their own.
+ * Destroy it with workq_destroy once all engines using it are closed.
+ * @param depth     Max number of queued ios over all engines.
+ * @return          Worker pool or NULL on failure.
+ */
+struct LoopWorkQueue* engine_workers_create(unsigned nthreads, unsigned depth);
+
+/**
+ * Close engine. All submitted ios must be completed.
+ */
+void engine_close(struct LoopEngine* engine);
+
+/**
+ * Start a batch of ios. Done callbacks may be called before this returns.
+ */
+void engine_submit(struct LoopEngine* engine, struct LoopEngineIO** ios, unsigned count);
+
+/**
+ * Execute single io and wait for it to complete.
+ * @return          0 or errno.
+ */
+int engine_rw(struct LoopEngine* engine, struct LoopEngineIO* io);
+
+/**
+ * Register memory ios will use as buffers, if engine can make use of it.
+ * @return          0 or errno.
+ */
+int engine_register_memory(struct LoopEngine* engine, void* base, uint64_t size);
+
+/**
+ * Get comma separated list of available engine names.
+ */
+const char* engine_names(void);
+
+
+// Helpers for engines working with file descriptors
+int engine_pread(int fd, void* buffer, uint64_t nbytes, uint64_t offset);
+int engine_pwrite(int fd, const void* buffer, uint64_t nbytes, uint64_t offset);
+int engine_fdatasync(int fd);
+
+/**
+ * Punch a hole into file, range reads back as zeroes afterwards and its blocks are freed.
+ * @return          0, ENOTSUP if filesystem cannot punch holes, or errno.
+ */
+int engine_discard(int fd, uint64_t offset, uint64_t nbytes);
+
+
+// Backing file of an engine doing io on file descriptors.
+// With kLoopEngineFlag_Direct ios go around host page cache, so that image blocks are cached only once
+// by the filesystem mounted on the loop device. Linux direct io needs buffer, offset and size aligned,
+// ios that are not take a second descriptor through page cache. Kernel keeps the two coherent.
+struct LoopEngineFile {
+    int                 fd;             // Backing file, uncached with kLoopEngineFlag_Direct
+    int                 cachedFd;       // Same file through page cache for unaligned ios, or -1
+    uint32_t            align;          // Direct io alignment, 0 if every io can use fd
+};
+
+/**
+ * Open engine backing file according to engine flags and set engine size.
+ * @return          0 or errno.
+ */
+int engine_file_open(struct LoopEngine* engine, struct LoopEngineFile* file);
+
+/**
+ * Close descriptors opened by engine_file_open.
+ */
+void engine_file_close(struct LoopEngineFile* file);
+
+/**
+ * Pick descriptor for an io.
+ */
+static inline int engine_file_fd(const struct LoopEngineFile* file, const struct LoopEngineIO* io)
+{
+    uint64_t mask = file->align - 1;
+    
+    if (file->align && ((((uint64_t) (uintptr_t) io->buffer) | io->offset | io->nbytes) & mask)) {
+        return file->cachedFd;
+    }
+    
+    return file->fd;
+}
+
+#endif
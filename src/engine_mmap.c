@@ -0,0 +1,161 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Engine serving ios by copying between request buffers and a shared mapping of the backing file.
+//
+//  Meant for read-mostly images that fit in page cache: a cached read is a memcpy on the worker thread,
+//  no system call at all. Mapping is prefaulted on Linux so requests do not take minor faults either,
+//  elsewhere kernel is only told we are going to need it. Writes dirty mapped pages, flush msyncs them.
+//
+//  Device size is fixed, ios past the end of the mapping fail like reads past the end of file do for posix engine.
+//  Backing file must not be truncated under us, touching a page past its end raises SIGBUS.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "engine.h"
+
+
+struct MmapEngine {
+    int                     fd;
+    uint8_t*                base;           // File mapping, NULL for an empty file
+    uint64_t                size;           // Mapped bytes
+};
+
+
+static int mmapOpen(struct LoopEngine* engine)
+{
+    int readonly = (engine->flags & kLoopEngineFlag_ReadOnly) != 0;
+    struct stat st;
+    
+    // Mapping is page cache, there is nothing to bypass it with
+    if (engine->flags & kLoopEngineFlag_Direct) {
+        return EINVAL;
+    }
+    
+    struct MmapEngine* mm = (struct MmapEngine*) calloc(1, sizeof(*mm));
+    if (!mm) {
+        return ENOMEM;
+    }
+    
+    mm->fd = open(engine->file, readonly ? O_RDONLY : O_RDWR);
+    if (mm->fd < 0) {
+        int error = errno;
+        free(mm);
+        return error;
+    }
+    
+    if (0 != fstat(mm->fd, &st)) {
+        int error = errno;
+        close(mm->fd);
+        free(mm);
+        return error;
+    }
+    
+    mm->size = (uint64_t) st.st_size;
+    if (mm->size != (uint64_t) (size_t) mm->size) {
+        close(mm->fd);
+        free(mm);
+        return EFBIG;
+    }
+    
+    if (mm->size) {
+        int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        // Read the whole file in and set up page tables now rather than faulting on requests
+        flags |= MAP_POPULATE;
+#endif
+        void* p = mmap(NULL, (size_t) mm->size, PROT_READ | (readonly ? 0 : PROT_WRITE), flags, mm->fd, 0);
+        if (p == MAP_FAILED) {
+            int error = errno;
+            close(mm->fd);
+            free(mm);
+            return error;
+        }
+    
+        mm->base = (uint8_t*) p;
+    
+        // Only a hint, kernel starts reading ahead asynchronously where mapping was not populated
+        posix_madvise(mm->base, (size_t) mm->size, POSIX_MADV_WILLNEED);
+    }
+    
+    engine->size = mm->size;
+    engine->priv = mm;
+    return 0;
+}
+
+
+static void mmapClose(struct LoopEngine* engine)
+{
+    struct MmapEngine* mm = (struct MmapEngine*) engine->priv;
+    
+    // Unmapping does not lose dirty pages, they are written back like any other page cache pages
+    if (mm->base) {
+        munmap(mm->base, (size_t) mm->size);
+    }
+    
+    close(mm->fd);
+    free(mm);
+}
+
+
+static int mmapFlush(struct MmapEngine* mm)
+{
+    if (mm->base && (0 != msync(mm->base, (size_t) mm->size, MS_SYNC))) {
+        return errno;
+    }
+    
+    // msync does not flush drive cache on darwin either
+    return engine_fdatasync(mm->fd);
+}
+
+
+static int mmapRW(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    struct MmapEngine* mm = (struct MmapEngine*) engine->priv;
+    
+    if (io->op == kLoopEngineOp_Flush) {
+        return mmapFlush(mm);
+    }
+    
+    if ((io->offset > mm->size) || (io->nbytes > mm->size - io->offset)) {
+        return EIO;
+    }
+    
+    switch (io->op) {
+    case kLoopEngineOp_Read:
+        memcpy(io->buffer, mm->base + io->offset, (size_t) io->nbytes);
+        return 0;
+    
+    case kLoopEngineOp_Write:
+        if (engine->flags & kLoopEngineFlag_ReadOnly) {
+            return EROFS;
+        }
+        memcpy(mm->base + io->offset, io->buffer, (size_t) io->nbytes);
+        return 0;
+    
+    case kLoopEngineOp_Discard:
+        if (engine->flags & kLoopEngineFlag_ReadOnly) {
+            return EROFS;
+        }
+        // Kernel drops punched pages from the mapping as well
+        return engine_discard(mm->fd, io->offset, io->nbytes);
+    
+    default:
+        return EINVAL;
+    }
+}
+
+
+const struct LoopEngineOps gMmapEngineOps = {
+    .name       = "mmap",
+    .open       = mmapOpen,
+    .close      = mmapClose,
+    .rw         = mmapRW,
+};
@@ -0,0 +1,69 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Portable engine doing blocking pread/pwrite on worker threads.
+//  Works with direct io, see LoopEngineFile.
+//
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "engine.h"
+
+
+static int posixOpen(struct LoopEngine* engine)
+{
+    struct LoopEngineFile* file = (struct LoopEngineFile*) malloc(sizeof(*file));
+    if (!file) {
+        return ENOMEM;
+    }
+    
+    int error = engine_file_open(engine, file);
+    if (error) {
+        free(file);
+        return error;
+    }
+    
+    engine->priv = file;
+    return 0;
+}
+
+
+static void posixClose(struct LoopEngine* engine)
+{
+    struct LoopEngineFile* file = (struct LoopEngineFile*) engine->priv;
+    
+    engine_file_close(file);
+    free(file);
+}
+
+
+static int posixRW(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    int fd = engine_file_fd((struct LoopEngineFile*) engine->priv, io);
+    
+    switch (io->op) {
+    case kLoopEngineOp_Read:
+        return engine_pread(fd, io->buffer, io->nbytes, io->offset);
+        
+    case kLoopEngineOp_Write:
+        return engine_pwrite(fd, io->buffer, io->nbytes, io->offset);
+        
+    case kLoopEngineOp_Flush:
+        return engine_fdatasync(fd);
+        
+    case kLoopEngineOp_Discard:
+        return engine_discard(fd, io->offset, io->nbytes);
+        
+    default:
+        return EINVAL;
+    }
+}
+
+
+const struct LoopEngineOps gPosixEngineOps = {
+    .name       = "posix",
+    .open       = posixOpen,
+    .close      = posixClose,
+    .rw         = posixRW,
+};
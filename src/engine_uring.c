@@ -0,0 +1,469 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Linux io_uring engine.
+//
+//  Ios are batched into the submission queue and submitted with a single io_uring_enter per batch.
+//  A reaper thread waits for completions and calls io done callbacks.
+//  Backing file is registered with the ring, and so is the shared request buffer pool once helper
+//  registers it, which saves the kernel from pinning and resolving pages on every io.
+//  With kLoopEngineFlag_SQPoll kernel polls submission queue and we do not even have to enter.
+//
+//  We talk to the kernel directly and do not depend on liburing.
+//
+
+#ifdef __linux__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/falloc.h>
+
+#include "engine.h"
+
+
+struct UringEngine {
+    struct LoopEngineFile   file;           // Backing file
+    int                     ringfd;
+    
+    // Submission queue
+    unsigned*               sqHead;
+    unsigned*               sqTail;
+    unsigned*               sqMask;
+    unsigned*               sqFlags;
+    unsigned*               sqArray;
+    unsigned                sqEntries;
+    struct io_uring_sqe*    sqes;
+    unsigned                sqLocalTail;    // Entries prepared but not yet published
+    
+    // Completion queue
+    unsigned*               cqHead;
+    unsigned*               cqTail;
+    unsigned*               cqMask;
+    struct io_uring_cqe*    cqes;
+    
+    void*                   sqMap;
+    size_t                  sqMapSize;
+    void*                   cqMap;
+    size_t                  cqMapSize;
+    size_t                  sqesSize;
+    
+    int                     fixedFile;      // Backing file is registered at index 0
+    uint8_t*                fixedBase;      // Registered buffer at index 0
+    uint64_t                fixedSize;
+    int                     sqpoll;
+    
+    pthread_mutex_t         lock;           // Serializes submitters
+    pthread_cond_t          notFull;
+    unsigned                inflight;       // Ios submitted but not reaped, never above sqEntries
+    pthread_t               reaper;
+};
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nargs)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+
+// Publish prepared entries and let the kernel know about them. Called with lock held.
+static void uringFlush(struct UringEngine* u)
+{
+    unsigned pending = u->sqLocalTail - *u->sqTail;
+    if (!pending) {
+        return;
+    }
+    
+    __atomic_store_n(u->sqTail, u->sqLocalTail, __ATOMIC_RELEASE);
+    
+    if (u->sqpoll) {
+        // Kernel thread picks up new entries by itself unless it went to sleep
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(u->sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+            sys_io_uring_enter(u->ringfd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        return;
+    }
+    
+    while (pending) {
+        int rc = sys_io_uring_enter(u->ringfd, pending, 0, 0);
+        if (rc < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            abort();
+        }
+        pending -= rc;
+    }
+}
+
+
+// Prepare submission entry for io. Called with lock held, ring has space.
+static void uringPrepare(struct UringEngine* u, struct LoopEngineIO* io)
+{
+    unsigned index = u->sqLocalTail & *u->sqMask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+    uint8_t* buffer = (uint8_t*) io->buffer;
+    int fd = engine_file_fd(&u->file, io);
+    
+    memset(sqe, 0, sizeof(*sqe));
+    
+    // Only direct descriptor is registered, unaligned ios go to the cached one
+    if (u->fixedFile && (fd == u->file.fd)) {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+    sqe->user_data = (uint64_t) (uintptr_t) io;
+    
+    switch (io->op) {
+    case kLoopEngineOp_Read:
+    case kLoopEngineOp_Write:
+        sqe->addr = (uint64_t) (uintptr_t) buffer;
+        sqe->len = (uint32_t) io->nbytes;
+        sqe->off = io->offset;
+        
+        if (u->fixedBase && (buffer >= u->fixedBase) && (buffer + io->nbytes <= u->fixedBase + u->fixedSize)) {
+            sqe->opcode = (io->op == kLoopEngineOp_Read) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+            sqe->buf_index = 0;
+        } else {
+            sqe->opcode = (io->op == kLoopEngineOp_Read) ? IORING_OP_READ : IORING_OP_WRITE;
+        }
+        break;
+        
+    case kLoopEngineOp_Flush:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+        
+#ifdef FALLOC_FL_PUNCH_HOLE
+    case kLoopEngineOp_Discard:
+        // Length goes in addr and fallocate mode in len
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->off = io->offset;
+        sqe->addr = io->nbytes;
+        sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        break;
+#endif
+        
+    default:
+        // Reaper reports it back as EINVAL
+        sqe->opcode = IORING_OP_NOP;
+        sqe->user_data |= 1;
+        break;
+    }
+    
+    u->sqArray[index] = index;
+    u->sqLocalTail++;
+}
+
+
+static void uringSubmit(struct LoopEngine* engine, struct LoopEngineIO** ios, unsigned count)
+{
+    struct UringEngine* u = (struct UringEngine*) engine->priv;
+    unsigned i;
+    
+    pthread_mutex_lock(&u->lock);
+    
+    for (i = 0; i < count; ++i) {
+        if (u->inflight == u->sqEntries) {
+            // Let the kernel have what we have so far before waiting for completions
+            uringFlush(u);
+            while (u->inflight == u->sqEntries) {
+                pthread_cond_wait(&u->notFull, &u->lock);
+            }
+        }
+        
+        uringPrepare(u, ios[i]);
+        u->inflight++;
+    }
+    
+    uringFlush(u);
+    pthread_mutex_unlock(&u->lock);
+}
+
+
+static void* uringReaper(void* arg)
+{
+    struct UringEngine* u = (struct UringEngine*) arg;
+    struct LoopEngineIO* done[64];
+    
+    for (;;) {
+        unsigned head = *u->cqHead;
+        unsigned tail = __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE);
+        unsigned ndone = 0;
+        int stop = 0;
+        
+        if (head == tail) {
+            int rc = sys_io_uring_enter(u->ringfd, 0, 1, IORING_ENTER_GETEVENTS);
+            if ((rc < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+                abort();
+            }
+            continue;
+        }
+        
+        while ((head != tail) && (ndone < sizeof(done) / sizeof(done[0]))) {
+            struct io_uring_cqe* cqe = &u->cqes[head & *u->cqMask];
+            uintptr_t data = (uintptr_t) cqe->user_data;
+            struct LoopEngineIO* io = (struct LoopEngineIO*) (data & ~(uintptr_t) 1);
+            
+            head++;
+            
+            if (!io) {
+                // Wakeup from uringClose
+                stop = 1;
+                continue;
+            }
+            
+            if (data & 1) {
+                io->error = EINVAL;
+            } else if (cqe->res < 0) {
+                io->error = -cqe->res;
+            } else if (((io->op == kLoopEngineOp_Read) || (io->op == kLoopEngineOp_Write)) && ((uint64_t) cqe->res != io->nbytes)) {
+                io->error = EIO;
+            } else {
+                io->error = 0;
+            }
+            
+            done[ndone++] = io;
+        }
+        
+        __atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+        
+        // Free up ring space before callbacks run, they may want to submit more
+        pthread_mutex_lock(&u->lock);
+        u->inflight -= ndone + stop;
+        pthread_cond_broadcast(&u->notFull);
+        pthread_mutex_unlock(&u->lock);
+        
+        unsigned i;
+        for (i = 0; i < ndone; ++i) {
+            done[i]->done(done[i]);
+        }
+        
+        if (stop) {
+            break;
+        }
+    }
+    
+    return NULL;
+}
+
+
+static void uringUnmap(struct UringEngine* u)
+{
+    if (u->sqes)                            munmap(u->sqes, u->sqesSize);
+    if (u->cqMap && (u->cqMap != u->sqMap)) munmap(u->cqMap, u->cqMapSize);
+    if (u->sqMap)                           munmap(u->sqMap, u->sqMapSize);
+}
+
+
+static int uringOpen(struct LoopEngine* engine)
+{
+    struct io_uring_params params;
+    int error;
+    
+    struct UringEngine* u = (struct UringEngine*) calloc(1, sizeof(*u));
+    if (!u) {
+        return ENOMEM;
+    }
+    
+    error = engine_file_open(engine, &u->file);
+    if (error) {
+        free(u);
+        return error;
+    }
+    
+    memset(&params, 0, sizeof(params));
+    if (engine->flags & kLoopEngineFlag_SQPoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000;
+        u->sqpoll = 1;
+    }
+    
+    u->ringfd = sys_io_uring_setup(engine->depth ? engine->depth : 128, &params);
+    if (u->ringfd < 0) {
+        error = errno;
+        goto ERROR_OUT;
+    }
+    
+    // Map queues
+    u->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cqMapSize > u->sqMapSize) {
+            u->sqMapSize = u->cqMapSize;
+        }
+        u->cqMapSize = u->sqMapSize;
+    }
+    
+    u->sqMap = mmap(NULL, u->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ringfd, IORING_OFF_SQ_RING);
+    if (u->sqMap == MAP_FAILED) {
+        u->sqMap = NULL;
+        error = errno;
+        goto ERROR_OUT;
+    }
+    
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cqMap = u->sqMap;
+    } else {
+        u->cqMap = mmap(NULL, u->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ringfd, IORING_OFF_CQ_RING);
+        if (u->cqMap == MAP_FAILED) {
+            u->cqMap = NULL;
+            error = errno;
+            goto ERROR_OUT;
+        }
+    }
+    
+    u->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*) mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ringfd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        error = errno;
+        goto ERROR_OUT;
+    }
+    
+    u->sqHead       = (unsigned*) ((uint8_t*) u->sqMap + params.sq_off.head);
+    u->sqTail       = (unsigned*) ((uint8_t*) u->sqMap + params.sq_off.tail);
+    u->sqMask       = (unsigned*) ((uint8_t*) u->sqMap + params.sq_off.ring_mask);
+    u->sqFlags      = (unsigned*) ((uint8_t*) u->sqMap + params.sq_off.flags);
+    u->sqArray      = (unsigned*) ((uint8_t*) u->sqMap + params.sq_off.array);
+    u->sqEntries    = params.sq_entries;
+    u->sqLocalTail  = *u->sqTail;
+    u->cqHead       = (unsigned*) ((uint8_t*) u->cqMap + params.cq_off.head);
+    u->cqTail       = (unsigned*) ((uint8_t*) u->cqMap + params.cq_off.tail);
+    u->cqMask       = (unsigned*) ((uint8_t*) u->cqMap + params.cq_off.ring_mask);
+    u->cqes         = (struct io_uring_cqe*) ((uint8_t*) u->cqMap + params.cq_off.cqes);
+    
+    // Registered file is an optimization unless we are polling
+    if (0 == sys_io_uring_register(u->ringfd, IORING_REGISTER_FILES, &u->file.fd, 1)) {
+        u->fixedFile = 1;
+    } else if (u->sqpoll) {
+        error = errno;
+        goto ERROR_OUT;
+    }
+    
+    pthread_mutex_init(&u->lock, NULL);
+    pthread_cond_init(&u->notFull, NULL);
+    
+    if (0 != pthread_create(&u->reaper, NULL, uringReaper, u)) {
+        error = errno;
+        pthread_cond_destroy(&u->notFull);
+        pthread_mutex_destroy(&u->lock);
+        goto ERROR_OUT;
+    }
+    
+    engine->priv = u;
+    return 0;
+    
+ERROR_OUT:
+    
+    uringUnmap(u);
+    if (u->ringfd > 0) close(u->ringfd);
+    engine_file_close(&u->file);
+    free(u);
+    return error;
+}
+
+
+static void uringClose(struct LoopEngine* engine)
+{
+    struct UringEngine* u = (struct UringEngine*) engine->priv;
+    
+    // Wake reaper with a null nop, nothing else can be in flight
+    pthread_mutex_lock(&u->lock);
+    struct io_uring_sqe* sqe = &u->sqes[u->sqLocalTail & *u->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+    u->sqArray[u->sqLocalTail & *u->sqMask] = u->sqLocalTail & *u->sqMask;
+    u->sqLocalTail++;
+    u->inflight++;
+    uringFlush(u);
+    pthread_mutex_unlock(&u->lock);
+    
+    pthread_join(u->reaper, NULL);
+    
+    pthread_cond_destroy(&u->notFull);
+    pthread_mutex_destroy(&u->lock);
+    uringUnmap(u);
+    close(u->ringfd);
+    engine_file_close(&u->file);
+    free(u);
+}
+
+
+static int uringRW(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    struct UringEngine* u = (struct UringEngine*) engine->priv;
+    int fd = engine_file_fd(&u->file, io);
+    
+    switch (io->op) {
+    case kLoopEngineOp_Read:
+        return engine_pread(fd, io->buffer, io->nbytes, io->offset);
+        
+    case kLoopEngineOp_Write:
+        return engine_pwrite(fd, io->buffer, io->nbytes, io->offset);
+        
+    case kLoopEngineOp_Flush:
+        return engine_fdatasync(fd);
+        
+    case kLoopEngineOp_Discard:
+        return engine_discard(fd, io->offset, io->nbytes);
+        
+    default:
+        return EINVAL;
+    }
+}
+
+
+static int uringRegisterMemory(struct LoopEngine* engine, void* base, uint64_t size)
+{
+    struct UringEngine* u = (struct UringEngine*) engine->priv;
+    struct iovec iov;
+    
+    iov.iov_base = base;
+    iov.iov_len = (size_t) size;
+    
+    // Only one range is supported, registering has to happen before any io is submitted
+    if (u->fixedBase || (0 != sys_io_uring_register(u->ringfd, IORING_REGISTER_BUFFERS, &iov, 1))) {
+        return u->fixedBase ? EBUSY : errno;
+    }
+    
+    u->fixedBase = (uint8_t*) base;
+    u->fixedSize = size;
+    return 0;
+}
+
+
+const struct LoopEngineOps gUringEngineOps = {
+    .name               = "uring",
+    .open               = uringOpen,
+    .close              = uringClose,
+    .rw                 = uringRW,
+    .submit             = uringSubmit,
+    .register_memory    = uringRegisterMemory,
+};
+
+#endif
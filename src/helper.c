@@ -0,0 +1,845 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+// sched_getcpu on Linux
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "helper.h"
+#include "engine.h"
+#include "wcache.h"
+#include "commit.h"
+#include "split.h"
+#include "sparse.h"
+#include "overlay.h"
+#include "packed.h"
+#include "dedup.h"
+#include "workq.h"
+#include "clock.h"
+#include "trace.h"
+
+
+// Resources shared by all devices one helper process serves
+struct LoopHelperGroup {
+    struct LoopWorkQueue*   workers;        // Engine worker pool
+
+    // Helpers with a started batch, in deadline order since all of them use the same batch delay
+    pthread_mutex_t         flushLock;
+    pthread_cond_t          flushCond;      // Wakes up flusher when a batch is armed
+    pthread_cond_t          flushedCond;    // Signalled once flusher is done with a helper
+    struct LoopHelper*      armedHead;
+    struct LoopHelper*      armedTail;
+    struct LoopHelper*      flushing;       // Helper flusher is working on without flushLock
+    pthread_t               flusher;        // Flushes batches on delay expiration
+    int                     stopFlusher;
+};
+
+
+struct LoopHelper {
+    struct LoopHelperGroup* group;
+    const char*             file;
+    int                     readonly;
+    int                     quiet;          // Do not log every request
+    uint32_t                blockSize;      // Device block size, request offsets and sizes are in these units
+    loop_helper_ctl_fn      ctl;            // Driver ioctl transport
+    void*                   driver;         // Driver handle for ctl
+    struct LoopSharedRings* rings;
+    uint8_t*                pool;
+    uint64_t                poolSize;
+    struct LoopEngine*      engine;         // Backing store, maybe with cache on top
+    struct LoopEngine*      backing;        // Backing store without cache
+    struct LoopCommitter*   committer;      // Flushes backing store for FUA writes
+    pthread_mutex_t         completeLock;   // Serializes producers into completion ring and protects batch
+
+    // Finished requests are batched up before handing them to driver.
+    // Batch is flushed once it is full, once there are no more requests in flight or once its delay expires.
+    struct UserIORequest    batch[kLoopMaxCompleteBatch];
+    unsigned                batchCount;     // Requests in batch
+    unsigned                batchSize;      // Flush threshold
+    unsigned                batchDelay;     // Max usec first request in batch waits for a flush
+    struct timespec         batchDeadline;  // When batch has to be flushed
+    struct LoopHelper*      armedNext;      // Group flusher queue link, protected by flushLock
+    struct timespec         armedDeadline;  // Batch deadline when queued, protected by flushLock
+    int                     armed;          // Queued on group flusher
+    volatile uint32_t       inflight;       // Requests handed to engine and not completed yet
+    uint64_t                batches;        // Batches flushed
+    uint64_t                batched;        // Requests completed in batches
+    uint64_t                discardsMerged; // Discards submitted to engine as part of an adjacent one
+    int                     discardWarned;  // Told user file system ignores discards
+    struct LoopStats*       stats;          // Io latency as seen by helper, published by driver
+    struct LoopTracer*      tracer;         // Request trace or NULL
+};
+
+
+// Request in flight
+struct LoopRequest {
+    struct LoopEngineIO     io;
+    struct UserIORequest    data;
+    struct LoopHelper*      context;
+    uint64_t                start;      // Arrival time
+    struct LoopRequest*     merged;     // Adjacent discards completing along with this one
+};
+
+
+// Threads running on the same cpu should share a stats shard
+static uint32_t statShard(void)
+{
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0) {
+        return (uint32_t) cpu;
+    }
+#endif
+    uintptr_t thread = (uintptr_t) pthread_self();
+    return (uint32_t) ((thread >> 4) ^ (thread >> 12));
+}
+
+
+static void driver_ctl(struct LoopHelper* context, uint64_t ctl, const void* data, size_t size)
+{
+    context->ctl(context->driver, ctl, data, size);
+}
+
+
+// Move batched completions into completion ring, called with completeLock held.
+// Whatever does not fit is copied to overflow.
+// @return      Number of overflow requests.
+static unsigned flushCompletionsLocked(struct LoopHelper* context, struct UserIORequest* overflow, int* doorbell)
+{
+    struct LoopRing* ring = &context->rings->completeRing;
+    unsigned count = context->batchCount;
+    unsigned i;
+    
+    *doorbell = 0;
+    if (!count) {
+        return 0;
+    }
+    
+    // Requests complete in whatever order workers finish them, driver matches them by priv handle
+    for (i = 0; i < count; ++i) {
+        uint32_t slot;
+        if (!loop_ring_produce_begin(ring, kLoopRingDepth, &slot)) {
+            break;
+        }
+        
+        context->rings->completeQueue[slot] = context->batch[i];
+        *doorbell |= loop_ring_produce_commit(ring);
+    }
+    
+    // Driver is not keeping up with completions, rest will be handed over directly
+    memcpy(overflow, &context->batch[i], (count - i) * sizeof(*overflow));
+    
+    context->batchCount = 0;
+    context->batches++;
+    context->batched += count;
+    
+    return count - i;
+}
+
+
+// Notify driver about flushed completions, called without completeLock.
+static void sendCompletions(struct LoopHelper* context, const struct UserIORequest* overflow, unsigned count, int doorbell)
+{
+    if (count == 1) {
+        driver_ctl(context, kLoopDriverCTL_Complete, overflow, sizeof(*overflow));
+    } else if (count) {
+        driver_ctl(context, kLoopDriverCTL_CompleteBatch, overflow, count * sizeof(*overflow));
+    }
+    
+    if (doorbell) {
+        driver_ctl(context, kLoopDriverCTL_Doorbell, NULL, 0);
+    }
+}
+
+
+// Queue helper on group flusher unless it is queued already, called with completeLock held
+static void armFlusher(struct LoopHelper* context)
+{
+    struct LoopHelperGroup* group = context->group;
+    
+    pthread_mutex_lock(&group->flushLock);
+    
+    if (!context->armed) {
+        context->armed = 1;
+        context->armedDeadline = context->batchDeadline;
+        context->armedNext = NULL;
+        if (group->armedTail) {
+            group->armedTail->armedNext = context;
+        } else {
+            group->armedHead = context;
+            pthread_cond_signal(&group->flushCond);
+        }
+        group->armedTail = context;
+    }
+    
+    pthread_mutex_unlock(&group->flushLock);
+}
+
+
+static int deadlinePassed(const struct timespec* deadline)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    
+    return (now.tv_sec > deadline->tv_sec) ||
+           ((now.tv_sec == deadline->tv_sec) && ((long) now.tv_usec * 1000 >= deadline->tv_nsec));
+}
+
+
+static void completeRequest(struct LoopHelper* context, const struct UserIORequest* request)
+{
+    struct UserIORequest overflow[kLoopMaxCompleteBatch];
+    unsigned count = 0;
+    int doorbell = 0;
+    
+    pthread_mutex_lock(&context->completeLock);
+    
+    context->batch[context->batchCount++] = *request;
+    
+    // Nobody is going to add to this batch if we were the last one in flight, do not make driver wait
+    uint32_t inflight = __sync_sub_and_fetch(&context->inflight, 1);
+    if ((context->batchCount >= context->batchSize) || (inflight == 0)) {
+        count = flushCompletionsLocked(context, overflow, &doorbell);
+    } else if (context->batchCount == 1) {
+        // Started a new batch, arm flusher
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        
+        uint64_t nsec = (uint64_t) now.tv_usec * 1000 + (uint64_t) context->batchDelay * 1000;
+        context->batchDeadline.tv_sec = now.tv_sec + (time_t) (nsec / 1000000000);
+        context->batchDeadline.tv_nsec = (long) (nsec % 1000000000);
+        armFlusher(context);
+    }
+    
+    pthread_mutex_unlock(&context->completeLock);
+    
+    sendCompletions(context, overflow, count, doorbell);
+}
+
+
+// Flushes batches nobody filled up in time, one thread for all helpers in the group
+static void* flusherThread(void* arg)
+{
+    struct LoopHelperGroup* group = (struct LoopHelperGroup*) arg;
+    struct UserIORequest overflow[kLoopMaxCompleteBatch];
+    
+    pthread_mutex_lock(&group->flushLock);
+    
+    while (!group->stopFlusher) {
+        struct LoopHelper* context = group->armedHead;
+        if (!context) {
+            pthread_cond_wait(&group->flushCond, &group->flushLock);
+            continue;
+        }
+    
+        // Batch may have been flushed and restarted since, which only moves its deadline later
+        struct timespec deadline = context->armedDeadline;
+        if (!deadlinePassed(&deadline)) {
+            pthread_cond_timedwait(&group->flushCond, &group->flushLock, &deadline);
+            continue;
+        }
+    
+        group->armedHead = context->armedNext;
+        if (!group->armedHead) {
+            group->armedTail = NULL;
+        }
+        context->armed = 0;
+        group->flushing = context;
+        pthread_mutex_unlock(&group->flushLock);
+    
+        int doorbell = 0;
+        unsigned count = 0;
+    
+        pthread_mutex_lock(&context->completeLock);
+        if (context->batchCount && deadlinePassed(&context->batchDeadline)) {
+            count = flushCompletionsLocked(context, overflow, &doorbell);
+        } else if (context->batchCount) {
+            // Batch was flushed and restarted meanwhile, wait for its own deadline
+            armFlusher(context);
+        }
+        pthread_mutex_unlock(&context->completeLock);
+    
+        sendCompletions(context, overflow, count, doorbell);
+    
+        pthread_mutex_lock(&group->flushLock);
+        group->flushing = NULL;
+        pthread_cond_broadcast(&group->flushedCond);
+    }
+    
+    pthread_mutex_unlock(&group->flushLock);
+    return NULL;
+}
+
+
+static void* requestBuffer(struct LoopHelper* context, const struct UserIORequest* request, size_t nbytes)
+{
+    if (request->flags & kLoopIOFlag_Mapped) {
+        return (void*) (uintptr_t) request->buffer;
+    }
+    
+    if ((request->buffer > context->poolSize) || (nbytes > context->poolSize - request->buffer)) {
+        DIE("Request buffer offset %llu is outside of the buffer pool\n", (unsigned long long) request->buffer);
+    }
+    
+    return context->pool + request->buffer;
+}
+
+
+// Called by engine once request io is done, on any thread
+static void requestDone(struct LoopEngineIO* io)
+{
+    struct LoopRequest* req = (struct LoopRequest*) io->priv;
+    struct LoopHelper* context = req->context;
+    
+    // Durable writes complete only once a backing store flush started after them is done, committer calls us again
+    if (!io->error && (io->flags & kLoopEngineIOFlag_FUA)) {
+        io->flags &= ~kLoopEngineIOFlag_FUA;
+        commit_add(context->committer, io);
+        return;
+    }
+    
+    // Discard is only a hint, blocks just keep their data if file system cannot deallocate them
+    if ((io->op == kLoopEngineOp_Discard) && ((io->error == ENOTSUP) || (io->error == EOPNOTSUPP))) {
+        if (!context->discardWarned) {
+            context->discardWarned = 1;
+            fprintf(stderr, "File system of %s cannot punch holes, discards are ignored\n", context->file);
+        }
+        io->error = 0;
+    }
+    
+    if (io->error) {
+        static const char* const ops[] = { "read", "write", "flush", "discard" };
+        fprintf(stderr, "Could not %s %llu bytes from file %s at offset %llu: %s\n", 
+                ops[io->op], (unsigned long long) io->nbytes, context->file, (unsigned long long) io->offset, strerror(io->error));
+    }
+    
+    uint64_t now = loop_clock_ns();
+    
+    // Every merged request is completed and accounted for on its own, engine io covers all of them.
+    // io goes away along with the first one.
+    struct LoopEngineIO done = *io;
+    while (req) {
+        struct LoopRequest* next = req->merged;
+        uint64_t offset = done.offset;
+        uint64_t nbytes = done.nbytes;
+        if (done.op == kLoopEngineOp_Discard) {
+            offset = (uint64_t) req->data.offset * context->blockSize;
+            nbytes = (uint64_t) req->data.nblocks * context->blockSize;
+        }
+    
+        req->data.result = done.error ? kIOReturnIOError : kIOReturnSuccess;
+        loop_stats_record(context->stats, statShard(), req->data.direction, (done.error ? 0 : nbytes), now - req->start);
+    
+        if (context->tracer) {
+            trace_record(context->tracer, (uint16_t) done.op, (uint16_t) req->data.flags, offset, (uint32_t) nbytes, done.error, req->start, now);
+        }
+    
+        // Send result to driver
+        completeRequest(context, &req->data);
+        free(req);
+        req = next;
+    }
+}
+
+
+static struct LoopEngineIO* prepareRequest(struct LoopHelper* context, const struct UserIORequest* data)
+{
+    struct LoopRequest* req = (struct LoopRequest*) malloc(sizeof(*req));
+    if (!req) {
+        DIE("Could not allocate request\n");
+    }
+    
+    req->data       = *data;
+    req->context    = context;
+    req->start      = loop_clock_ns();
+    req->merged     = NULL;
+    
+    __sync_add_and_fetch(&context->inflight, 1);
+    
+    memset(&req->io, 0, sizeof(req->io));
+    req->io.done    = requestDone;
+    req->io.priv    = req;
+    
+    if (data->direction == kLoopIODirection_Flush) {
+        if (!context->quiet) {
+            printf("New flush request arrived: file %s\n", context->file);
+        }
+        req->io.op = kLoopEngineOp_Flush;
+        return &req->io;
+    }
+    
+    if (data->direction == kLoopIODirection_Discard) {
+        assert(!context->readonly);
+        req->io.op      = kLoopEngineOp_Discard;
+        req->io.nbytes  = (uint64_t) data->nblocks * context->blockSize;
+        req->io.offset  = (uint64_t) data->offset * context->blockSize;
+        if (!context->quiet) {
+            printf("New discard request arrived: file %s, offset %llu, size %llu\n", context->file, (unsigned long long) req->io.offset, (unsigned long long) req->io.nbytes);
+        }
+        return &req->io;
+    }
+    
+    size_t nbytes       = (size_t) data->nblocks * context->blockSize;
+    off_t offset        = (off_t) data->offset * context->blockSize;
+    void* buffer        = requestBuffer(context, data, nbytes);
+
+    if (!context->quiet) {
+        printf("New %s request arrived: file %s, offset %llu, size %lu, buffer %p\n", 
+               (data->direction == kLoopIODirection_Read ? "read" : "write"),
+               context->file, (unsigned long long) offset, nbytes, buffer);
+    }
+    
+    assert((data->direction == kLoopIODirection_Read) || !context->readonly);
+    
+    req->io.op      = (data->direction == kLoopIODirection_Read) ? kLoopEngineOp_Read : kLoopEngineOp_Write;
+    req->io.flags   = (data->flags & kLoopIOFlag_WriteThrough) ? kLoopEngineIOFlag_WriteThrough : 0;
+    
+    // Cache must not hold durable writes, they are written through and then flushed with group commit
+    if ((data->direction == kLoopIODirection_Write) && (data->flags & kLoopIOFlag_FUA)) {
+        req->io.flags |= kLoopEngineIOFlag_FUA | kLoopEngineIOFlag_WriteThrough;
+    }
+    req->io.buffer  = buffer;
+    req->io.nbytes  = nbytes;
+    req->io.offset  = offset;
+    
+    return &req->io;
+}
+
+
+// Fold discard io into previous one in batch when it continues its range, one hole punch instead of several.
+// @return      Nonzero if io was merged and must not be submitted.
+static int mergeDiscard(struct LoopHelper* context, struct LoopEngineIO* prev, struct LoopEngineIO* io)
+{
+    if ((prev->op != kLoopEngineOp_Discard) || (io->op != kLoopEngineOp_Discard) || (prev->offset + prev->nbytes != io->offset)) {
+        return 0;
+    }
+    
+    struct LoopRequest* head = (struct LoopRequest*) prev->priv;
+    struct LoopRequest* req = (struct LoopRequest*) io->priv;
+    
+    prev->nbytes += io->nbytes;
+    req->merged = head->merged;
+    head->merged = req;
+    context->discardsMerged++;
+    return 1;
+}
+
+
+static void drainSubmissions(struct LoopHelper* context)
+{
+    struct LoopRing* ring = &context->rings->submitRing;
+    struct LoopEngineIO* batch[kLoopSubmitBatch];
+    loop_ring_consumer_busy(ring);
+    
+    do {
+        uint32_t slot;
+        unsigned count = 0;
+        int rc;
+        
+        while (0 < (rc = loop_ring_consume_begin(ring, kLoopRingDepth, &slot))) {
+            struct UserIORequest request = context->rings->submitQueue[slot];
+            loop_ring_consume_commit(ring);
+            
+            struct LoopEngineIO* io = prepareRequest(context, &request);
+            if (count && mergeDiscard(context, batch[count - 1], io)) {
+                continue;
+            }
+            
+            // Engine blocks us when its queue is full
+            batch[count++] = io;
+            if (count == kLoopSubmitBatch) {
+                engine_submit(context->engine, batch, count);
+                count = 0;
+            }
+        }
+        
+        if (count) {
+            engine_submit(context->engine, batch, count);
+        }
+        
+        if (rc < 0) {
+            DIE("Submission ring indexes are corrupted\n");
+        }
+        
+    } while (!loop_ring_consumer_idle(ring));
+}
+
+
+static void printStats(struct LoopHelper* context)
+{
+    static const char* const directions[kLoopStatDirections] = { "Read", "Write", "Flush", "Discard" };
+    struct LoopStatSummary summary;
+    uint32_t i;
+    
+    for (i = 0; i < kLoopStatDirections; ++i) {
+        loop_stats_summarize(context->stats, i, &summary);
+        if (!summary.ops) {
+            continue;
+        }
+        
+        printf("%s: %llu requests, %llu bytes, latency usec mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+               directions[i], (unsigned long long) summary.ops, (unsigned long long) summary.bytes, summary.mean / 1000.0, summary.p50 / 1000.0, summary.p90 / 1000.0,
+               summary.p99 / 1000.0, summary.p999 / 1000.0, summary.max / 1000.0);
+    }
+}
+
+
+void helper_default_options(struct LoopHelperOptions* options)
+{
+    memset(options, 0, sizeof(*options));
+    options->nthreads   = kLoopDefaultThreads;
+    options->depth      = kLoopDefaultQueueDepth;
+    options->batchSize  = kLoopDefaultCompleteBatch;
+    options->batchDelay = kLoopDefaultCompleteDelay;
+    options->blockSize  = kLoopBlockSize;
+    options->chunkSize  = kLoopDefaultChunkSize;
+    options->sparse     = 1;
+}
+
+
+int helper_device_size(const char* file, uint64_t* size)
+{
+    struct LoopOverlayInfo info;
+    struct LoopPackedInfo packedInfo;
+    struct LoopDedupInfo dedupInfo;
+    struct stat st;
+    
+    int overlay = overlay_probe(file, &info);
+    if (overlay < 0) {
+        return errno;
+    }
+    
+    if (overlay) {
+        *size = info.size;
+        return 0;
+    }
+    
+    int packed = packed_probe(file, &packedInfo);
+    if (packed < 0) {
+        return errno;
+    }
+    
+    if (packed) {
+        *size = packedInfo.size;
+        return 0;
+    }
+    
+    int dedup = dedup_probe(file, &dedupInfo);
+    if (dedup < 0) {
+        return errno;
+    }
+    
+    if (dedup) {
+        *size = dedupInfo.size;
+        return 0;
+    }
+    
+    if (0 != stat(file, &st)) {
+        return errno;
+    }
+    
+    *size = (uint64_t) st.st_size;
+    return 0;
+}
+
+
+struct LoopHelperGroup* helper_group_create(const struct LoopHelperOptions* options, unsigned ndevices)
+{
+    struct LoopHelperGroup* group = (struct LoopHelperGroup*) malloc(sizeof(struct LoopHelperGroup));
+    if (!group) {
+        DIE("Could not allocate helper group\n");
+    }
+    
+    // Queue has room for every device to have its full depth queued, threads are shared regardless of device count
+    group->workers = engine_workers_create(options->nthreads, options->depth * (ndevices ? ndevices : 1));
+    if (!group->workers) {
+        DIE("Could not start %u worker threads\n", options->nthreads);
+    }
+    
+    group->armedHead    = NULL;
+    group->armedTail    = NULL;
+    group->flushing     = NULL;
+    group->stopFlusher  = 0;
+    
+    pthread_mutex_init(&group->flushLock, NULL);
+    pthread_cond_init(&group->flushCond, NULL);
+    pthread_cond_init(&group->flushedCond, NULL);
+    
+    if (pthread_create(&group->flusher, NULL, flusherThread, group)) {
+        DIE("Could not start completion flusher thread\n");
+    }
+    
+    return group;
+}
+
+
+void helper_group_destroy(struct LoopHelperGroup* group)
+{
+    pthread_mutex_lock(&group->flushLock);
+    group->stopFlusher = 1;
+    pthread_cond_signal(&group->flushCond);
+    pthread_mutex_unlock(&group->flushLock);
+    pthread_join(group->flusher, NULL);
+    
+    workq_destroy(group->workers);
+    
+    pthread_cond_destroy(&group->flushedCond);
+    pthread_cond_destroy(&group->flushCond);
+    pthread_mutex_destroy(&group->flushLock);
+    free(group);
+}
+
+
+struct LoopHelper* helper_create(struct LoopHelperGroup* group, const char* file, const struct LoopHelperOptions* options,
+                                 loop_helper_ctl_fn ctl, void* driver)
+{
+    struct LoopHelper* ctx = (struct LoopHelper*) malloc(sizeof(struct LoopHelper));
+    if (!ctx) {
+        DIE("Could not allocate helper structure\n");
+    }
+    
+    unsigned flags = options->engineFlags | (options->readonly ? kLoopEngineFlag_ReadOnly : 0);
+    int cached = (options->cacheSize && !options->readonly);
+    struct LoopEngine* engine = cached ? engine_open(options->engine, file, flags, 1, options->depth) :
+                                         engine_open_shared(options->engine, file, flags, group->workers, options->depth);
+    if (!engine) {
+        DIE("Could not open file with %s engine: %s\n", (options->engine ? options->engine : "default"), strerror(errno));
+    }
+    
+    // Overlay image is read through its cluster tables, everything above sees the device and flushes go through them
+    int overlay = overlay_probe(file, NULL);
+    if (overlay < 0) {
+        DIE("Could not read file \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    if (overlay) {
+        struct LoopEngine* cow = overlay_open(engine, (cached ? NULL : group->workers), options->depth);
+        if (!cow) {
+            DIE("Could not open overlay image: %s\n", strerror(errno));
+        }
+        
+        engine = cow;
+    }
+    
+    // Packed image is decompressed on group workers, which read the image file synchronously
+    int packed = overlay ? 0 : packed_probe(file, NULL);
+    if (packed < 0) {
+        DIE("Could not read file \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    if (packed) {
+        if (!options->readonly) {
+            DIE("Compressed image \"%s\" can only be attached read only\n", file);
+        }
+        
+        struct LoopEngine* unpacked = packed_open(engine, group->workers, workq_threads(group->workers), options->depth);
+        if (!unpacked) {
+            DIE("Could not open compressed image: %s\n", strerror(errno));
+        }
+        
+        engine = unpacked;
+    }
+    
+    // Deduplicated image maps device chunks to a chunk store that images attached by this helper share
+    int dedup = (overlay || packed) ? 0 : dedup_probe(file, NULL);
+    if (dedup < 0) {
+        DIE("Could not read file \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    if (dedup) {
+        struct LoopEngine* mapped = dedup_open(engine, (cached ? NULL : group->workers), options->depth);
+        if (!mapped) {
+            DIE("Could not open deduplicated image: %s\n", strerror(errno));
+        }
+        
+        engine = mapped;
+    }
+    
+    struct LoopCommitter* committer = commit_create(engine, options->commitGroup);
+    if (!committer) {
+        DIE("Could not start group commit thread: %s\n", strerror(errno));
+    }
+    
+    ctx->backing = engine;
+    ctx->committer = committer;
+    
+    // Below cache, map has to hear about writes as they go to the file. Image formats know their holes themselves.
+    if (options->sparse && !overlay && !packed && !dedup) {
+        struct LoopEngine* sparse = sparse_open(engine);
+        if (!sparse) {
+            DIE("Could not map holes of backing file: %s\n", strerror(errno));
+        }
+        
+        engine = sparse;
+    }
+    
+    // Cache runs requests on group workers and calls backing engine synchronously, which therefore keeps a thread of its own
+    if (cached) {
+        struct LoopEngine* cache = wcache_open_shared(engine, options->cacheSize, group->workers, options->depth);
+        if (!cache) {
+            DIE("Could not create %llu bytes write cache: %s\n", (unsigned long long) options->cacheSize, strerror(errno));
+        }
+        
+        engine = cache;
+    }
+    
+    // Large requests are split on top of everything so chunks spread over cache or engine workers
+    if (options->chunkSize) {
+        struct LoopEngine* split = split_open(engine, options->chunkSize);
+        if (!split) {
+            DIE("Could not create request splitter: %s\n", strerror(errno));
+        }
+        
+        engine = split;
+    }
+    
+    ctx->group      = group;
+    ctx->file       = file;
+    ctx->engine     = engine;
+    ctx->readonly   = options->readonly;
+    ctx->quiet      = options->quiet;
+    ctx->blockSize  = options->blockSize;
+    ctx->ctl        = ctl;
+    ctx->driver     = driver;
+    ctx->rings      = NULL;
+    ctx->pool       = NULL;
+    ctx->poolSize   = 0;
+    
+    ctx->batchCount = 0;
+    ctx->batchSize  = options->batchSize;
+    ctx->batchDelay = options->batchDelay;
+    ctx->armedNext  = NULL;
+    ctx->armed      = 0;
+    ctx->inflight   = 0;
+    ctx->batches    = 0;
+    ctx->batched    = 0;
+    ctx->discardsMerged = 0;
+    ctx->discardWarned  = 0;
+    
+    if (posix_memalign((void**) &ctx->stats, 64, sizeof(*ctx->stats))) {
+        DIE("Could not allocate statistics\n");
+    }
+    loop_stats_init(ctx->stats);
+    
+    ctx->tracer = NULL;
+    if (options->traceFile) {
+        ctx->tracer = trace_open(options->traceFile, kLoopTraceDefaultDepth, options->blockSize, loop_clock_ns());
+        if (!ctx->tracer) {
+            DIE("Could not create trace file %s: %s\n", options->traceFile, strerror(errno));
+        }
+    }
+    
+    pthread_mutex_init(&ctx->completeLock, NULL);
+    
+    return ctx;
+}
+
+
+void helper_set_memory(struct LoopHelper* helper, struct LoopSharedRings* rings, void* pool, uint64_t poolSize)
+{
+    helper->rings       = rings;
+    helper->pool        = (uint8_t*) pool;
+    helper->poolSize    = poolSize;
+    
+    // Most request buffers live in the pool, engines may pin it down once instead of on every io
+    int error = engine_register_memory(helper->engine, helper->pool, helper->poolSize);
+    if (error) {
+        fprintf(stderr, "Warning: could not register buffer pool with engine: %s\n", strerror(error));
+    }
+}
+
+
+void helper_drain_submissions(struct LoopHelper* helper)
+{
+    drainSubmissions(helper);
+}
+
+
+void helper_submit(struct LoopHelper* helper, const struct UserIORequest* request)
+{
+    struct LoopEngineIO* io = prepareRequest(helper, request);
+    engine_submit(helper->engine, &io, 1);
+}
+
+
+void helper_get_stats(struct LoopHelper* helper, struct LoopHelperStatsCtl* stats)
+{
+    uint32_t i;
+    
+    for (i = 0; i < kLoopStatDirections; ++i) {
+        loop_stats_summarize(helper->stats, i, &stats->io[i]);
+    }
+}
+
+
+void helper_destroy(struct LoopHelper* ctx)
+{
+    // Let everything in flight complete before shared memory goes away, durable writes may be waiting for a flush
+    while (ctx->inflight) {
+        usleep(1000);
+    }
+    
+    commit_destroy(ctx->committer);
+    engine_close(ctx->engine);
+    
+    if (ctx->tracer) {
+        trace_close(ctx->tracer);
+    }
+    
+    // Nothing completes any more, but group flusher may still have us queued or be looking at us
+    struct LoopHelperGroup* group = ctx->group;
+    pthread_mutex_lock(&group->flushLock);
+    
+    if (ctx->armed) {
+        struct LoopHelper** link = &group->armedHead;
+        struct LoopHelper* prev = NULL;
+        while (*link != ctx) {
+            prev = *link;
+            link = &prev->armedNext;
+        }
+    
+        *link = ctx->armedNext;
+        if (group->armedTail == ctx) {
+            group->armedTail = prev;
+        }
+        ctx->armed = 0;
+    }
+    
+    while (group->flushing == ctx) {
+        pthread_cond_wait(&group->flushedCond, &group->flushLock);
+    }
+    
+    pthread_mutex_unlock(&group->flushLock);
+    
+    if (ctx->batches) {
+        printf("Completed %llu requests in %llu batches, %.1f requests per batch on average\n", 
+               (unsigned long long) ctx->batched, (unsigned long long) ctx->batches, (double) ctx->batched / ctx->batches);
+    }
+    
+    if (ctx->discardsMerged) {
+        printf("Merged %llu discards into adjacent ones\n", (unsigned long long) ctx->discardsMerged);
+    }
+    
+    printStats(ctx);
+    
+    pthread_mutex_destroy(&ctx->completeLock);
+    
+    free(ctx->stats);
+    free(ctx);
+}
@@ -0,0 +1,132 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Helper request processing core.
+//
+//  Takes requests driver posts into shared submission ring or sends inline, runs them on the backing store engine
+//  stack and hands completions back through completion ring in batches. Core knows nothing about how it talks to
+//  the driver: whoever hosts it maps shared memory, forwards doorbells and carries driver ioctls for it,
+//  which is IOKit and CoreFoundation in losetup and plain function calls in simulated drivers.
+//
+//  Backing files are raw images or copy-on-write overlays of raw images, see overlay.h.
+//
+//  One process may serve several devices, one helper each. Helpers of a group share engine worker threads and
+//  completion flusher, so the thread count does not grow with the number of devices.
+//
+
+#ifndef LOOP_HELPER_H
+#define LOOP_HELPER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "kext/loopctl.h"
+
+
+#define DIE(msg, args...) { fprintf(stderr, msg, ## args); exit(EXIT_FAILURE); }
+
+
+enum {
+    kLoopDefaultThreads     = 4,                // Default number of request worker threads
+    kLoopDefaultQueueDepth  = kLoopRingDepth,   // Default worker queue depth
+    kLoopSubmitBatch        = 32,               // Max requests handed to engine at once
+    kLoopDefaultCompleteBatch = kLoopMaxCompleteBatch,  // Default completion batch flush threshold
+    kLoopDefaultCompleteDelay = 50,             // Default usec a completion may wait for its batch to fill up
+    kLoopDefaultChunkSize   = 1024 * 1024,      // Default size of chunks large requests are split into
+};
+
+
+struct LoopHelperOptions {
+    int             readonly;
+    unsigned        nthreads;       // Engine worker threads, shared by all devices
+    unsigned        depth;          // Engine queue depth per device
+    const char*     engine;         // Engine name or NULL for default
+    unsigned        engineFlags;    // kLoopEngineFlag_XXX
+    unsigned        batchSize;      // Completion batch flush threshold
+    unsigned        batchDelay;     // Max usec a completion waits in batch
+    uint64_t        cacheSize;      // Write cache dirty limit in bytes, 0 for no write cache
+    uint32_t        blockSize;      // Loop device logical block size
+    uint64_t        chunkSize;      // Larger requests are split into chunks running in parallel, 0 disables splitting
+    unsigned        commitGroup;    // Most FUA writes sharing one backing store flush, 0 for no limit, 1 disables group commit
+    int             sparse;         // Answer reads of backing file holes from its extent map, see sparse.h
+    const char*     traceFile;      // Record completed requests into this file or NULL
+    int             quiet;          // Do not log every request
+};
+
+
+/**
+ * Issue driver ioctl, kLoopDriverCTL_XXX. Called on any helper thread.
+ * @param driver    Driver handle as passed to helper_create.
+ */
+typedef void (*loop_helper_ctl_fn)(void* driver, uint64_t ctl, const void* data, size_t size);
+
+
+struct LoopHelper;
+struct LoopHelperGroup;
+
+
+/**
+ * Fill in default options.
+ */
+void helper_default_options(struct LoopHelperOptions* options);
+
+/**
+ * Get size of the device a backing file makes, which is file size for raw images.
+ * @param size      Set to device size in bytes.
+ * @return          0 or errno.
+ */
+int helper_device_size(const char* file, uint64_t* size);
+
+/**
+ * Create resources shared by helpers of all devices served by this process:
+ * engine worker threads and completion flusher. Buffer pool is shared by the driver, see LoopAttachCtl.
+ * @param options   Worker thread count and per device queue depth.
+ * @param ndevices  Number of devices that are going to be served, sizes worker queue.
+ * @return          New group, dies on failure.
+ */
+struct LoopHelperGroup* helper_group_create(const struct LoopHelperOptions* options, unsigned ndevices);
+
+/**
+ * Stop shared threads. All helpers in the group must be destroyed first.
+ */
+void helper_group_destroy(struct LoopHelperGroup* group);
+
+/**
+ * Open backing file engine stack for one device.
+ * @param group     Shared resources, running requests on its workers.
+ * @param ctl       Driver ioctl transport.
+ * @param driver    Driver handle for ctl.
+ * @return          New helper, dies on failure.
+ */
+struct LoopHelper* helper_create(struct LoopHelperGroup* group, const char* file, const struct LoopHelperOptions* options,
+                                 loop_helper_ctl_fn ctl, void* driver);
+
+/**
+ * Set shared memory mapped from driver. Has to be done before any requests are posted.
+ */
+void helper_set_memory(struct LoopHelper* helper, struct LoopSharedRings* rings, void* pool, uint64_t poolSize);
+
+/**
+ * Submission ring doorbell, takes every request found in the ring.
+ */
+void helper_drain_submissions(struct LoopHelper* helper);
+
+/**
+ * Take a request driver sent inline because submission ring was full.
+ */
+void helper_submit(struct LoopHelper* helper, const struct UserIORequest* request);
+
+/**
+ * Get io latency summaries for kLoopDriverCTL_Stats.
+ */
+void helper_get_stats(struct LoopHelper* helper, struct LoopHelperStatsCtl* stats);
+
+/**
+ * Wait for requests in flight, close backing store and print statistics.
+ * Shared memory may be unmapped once this returns.
+ */
+void helper_destroy(struct LoopHelper* helper);
+
+#endif
@@ -0,0 +1,613 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Benchmark helper request processing against a backing file without the kext
+//  loopbench [-p pattern] [-r readpct] [-s size] [-q depth] [-d seconds] [-n ops] [-e engine] [-t threads] [-c cache] [-B blocksize] [-k chunk] [-G writes] [-f] [-H] [-W] [-D] file
+//
+//  A simulated driver in this process plays org_acme_LoopDriver: it hands out request tags, posts UserIORequests into
+//  the shared submission ring with doorbells or inline when the ring is full, and takes completions from the completion
+//  ring and driver ioctls, all through the same helper core losetup runs. Only mach messages and IOKit calls are
+//  replaced with function calls and a helper event thread, so it runs anywhere the engines do.
+//
+//  Queue depth requests are kept in flight. Results go to stdout as a single JSON object on the last line of output.
+//  Writes put junk into the file, point it at a scratch file unless running reads only.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "kext/loopctl.h"
+#include "kext/looptags.h"
+#include "helper.h"
+#include "engine.h"
+#include "clock.h"
+
+
+enum {
+    kBenchDefaultSize       = 4096,         // Default request size in bytes
+    kBenchDefaultDepth      = 32,           // Default requests in flight
+    kBenchDefaultSeconds    = 10,           // Default run time
+    kBenchBufferAlign       = 4096,         // Request buffer alignment in pool
+    kBenchWarmChunk         = 1024 * 1024,  // Read size used to pull file into page cache
+};
+
+
+// Helper event, what a mach message to helper port is for losetup
+struct BenchEvent {
+    int                     msgid;          // kLoopUserXXXNotification
+    struct UserIORequest    data;           // Inline request for kLoopUserIONotification
+    struct BenchEvent*      next;
+};
+
+
+// Simulated driver and workload state
+struct BenchDriver {
+    struct LoopHelper*      helper;
+    struct LoopSharedRings* rings;
+    uint8_t*                pool;
+    uint64_t                poolSize;
+    uint32_t                blockSize;
+
+    // Request tags, every tag owns a fixed request buffer in the pool
+    struct LoopTagTable     tags;
+    uint64_t*               starts;         // Submit time by tag
+    uint32_t*               directions;     // Request direction by tag
+    uint64_t                slotSize;       // Pool bytes per tag
+
+    pthread_mutex_t         submitLock;     // Serializes producers into submission ring, like mSubmitLock
+    pthread_mutex_t         completeLock;   // Serializes completion ring consumers, like mCompleteLock
+
+    pthread_mutex_t         inflightLock;   // Protects inflight and wakes submitter
+    pthread_cond_t          inflightCond;
+    unsigned                inflight;
+
+    // Helper event queue drained by the event thread, stands in for mach port and CFRunLoop
+    pthread_mutex_t         eventLock;
+    pthread_cond_t          eventCond;
+    struct BenchEvent*      eventHead;
+    struct BenchEvent*      eventTail;
+    pthread_t               eventThread;
+
+    uint64_t                inlined;        // Requests sent inline because submission ring was full
+    uint64_t                doorbells;      // Submission doorbells rung
+    volatile uint64_t       errors;         // Requests helper failed
+    volatile uint64_t       stale;          // Completions with unknown request handles
+    volatile uint64_t       lastComplete;   // Time of last completion
+    struct LoopStats*       stats;          // Submit to complete latency by direction
+    struct LoopStats*       total;          // Same for all requests, kept in read direction
+};
+
+
+static void postEvent(struct BenchDriver* driver, int msgid, const struct UserIORequest* data)
+{
+    struct BenchEvent* event = (struct BenchEvent*) malloc(sizeof(*event));
+    if (!event) {
+        DIE("Could not allocate helper event\n");
+    }
+    
+    event->msgid = msgid;
+    event->next = NULL;
+    if (data) {
+        event->data = *data;
+    }
+    
+    pthread_mutex_lock(&driver->eventLock);
+    if (driver->eventTail) {
+        driver->eventTail->next = event;
+    } else {
+        driver->eventHead = event;
+    }
+    driver->eventTail = event;
+    pthread_cond_signal(&driver->eventCond);
+    pthread_mutex_unlock(&driver->eventLock);
+}
+
+
+// Helper side, what requestPortCallback does in losetup
+static void* eventThread(void* arg)
+{
+    struct BenchDriver* driver = (struct BenchDriver*) arg;
+    
+    for (;;) {
+        pthread_mutex_lock(&driver->eventLock);
+        while (!driver->eventHead) {
+            pthread_cond_wait(&driver->eventCond, &driver->eventLock);
+        }
+    
+        struct BenchEvent* event = driver->eventHead;
+        driver->eventHead = event->next;
+        if (!driver->eventHead) {
+            driver->eventTail = NULL;
+        }
+        pthread_mutex_unlock(&driver->eventLock);
+    
+        int msgid = event->msgid;
+        if (msgid == kLoopUserRingNotification) {
+            helper_drain_submissions(driver->helper);
+        } else if (msgid == kLoopUserIONotification) {
+            helper_submit(driver->helper, &event->data);
+        }
+    
+        free(event);
+    
+        if (msgid == kLoopUserTerminateNotification) {
+            break;
+        }
+    }
+    
+    return NULL;
+}
+
+
+// Driver side, what org_acme_LoopDriver::postRequest does
+static void postRequest(struct BenchDriver* driver, const struct UserIORequest* request)
+{
+    uint32_t slot;
+    
+    pthread_mutex_lock(&driver->submitLock);
+    
+    if (loop_ring_produce_begin(&driver->rings->submitRing, kLoopRingDepth, &slot)) {
+        driver->rings->submitQueue[slot] = *request;
+        if (loop_ring_produce_commit(&driver->rings->submitRing)) {
+            driver->doorbells++;
+            postEvent(driver, kLoopUserRingNotification, NULL);
+        }
+    } else {
+        driver->inlined++;
+        postEvent(driver, kLoopUserIONotification, request);
+    }
+    
+    pthread_mutex_unlock(&driver->submitLock);
+}
+
+
+static void completeRequest(struct BenchDriver* driver, const struct UserIORequest* request)
+{
+    int32_t tag = loop_tags_lookup(&driver->tags, request->priv);
+    if (tag < 0) {
+        __sync_fetch_and_add(&driver->stale, 1);
+        return;
+    }
+    
+    uint64_t now = loop_clock_ns();
+    uint64_t latency = now - driver->starts[tag];
+    uint64_t bytes = request->nblocks * driver->blockSize;
+    
+    if (request->result != kIOReturnSuccess) {
+        __sync_fetch_and_add(&driver->errors, 1);
+        bytes = 0;
+    }
+    
+    loop_stats_record(driver->stats, (uint32_t) tag, driver->directions[tag], bytes, latency);
+    loop_stats_record(driver->total, (uint32_t) tag, kLoopIODirection_Read, bytes, latency);
+    driver->lastComplete = now;
+    
+    loop_tags_free(&driver->tags, (uint32_t) tag);
+    
+    pthread_mutex_lock(&driver->inflightLock);
+    driver->inflight--;
+    pthread_cond_signal(&driver->inflightCond);
+    pthread_mutex_unlock(&driver->inflightLock);
+}
+
+
+static void drainCompletions(struct BenchDriver* driver)
+{
+    struct LoopRing* ring = &driver->rings->completeRing;
+    
+    pthread_mutex_lock(&driver->completeLock);
+    loop_ring_consumer_busy(ring);
+    
+    do {
+        uint32_t slot;
+        int rc;
+    
+        while (0 < (rc = loop_ring_consume_begin(ring, kLoopRingDepth, &slot))) {
+            struct UserIORequest request = driver->rings->completeQueue[slot];
+            loop_ring_consume_commit(ring);
+    
+            completeRequest(driver, &request);
+        }
+    
+        if (rc < 0) {
+            DIE("Completion ring indexes are corrupted\n");
+        }
+    
+    } while (!loop_ring_consumer_idle(ring));
+    
+    pthread_mutex_unlock(&driver->completeLock);
+}
+
+
+// Driver ioctls from helper, called on any helper thread
+static void driverCtl(void* arg, uint64_t ctl, const void* data, size_t size)
+{
+    struct BenchDriver* driver = (struct BenchDriver*) arg;
+    const struct UserIORequest* requests = (const struct UserIORequest*) data;
+    size_t i;
+    
+    switch (ctl) {
+    case kLoopDriverCTL_Complete:
+    case kLoopDriverCTL_CompleteBatch:
+        if (!size || (size % sizeof(*requests)) || (size / sizeof(*requests) > kLoopMaxCompleteBatch)) {
+            DIE("Invalid completion ioctl size %zu\n", size);
+        }
+    
+        for (i = 0; i < size / sizeof(*requests); ++i) {
+            completeRequest(driver, &requests[i]);
+        }
+        break;
+    
+    case kLoopDriverCTL_Doorbell:
+        drainCompletions(driver);
+        break;
+    
+    case kLoopDriverCTL_Stats:
+        break;
+    
+    default:
+        DIE("Unknown driver ioctl 0x%llx\n", (unsigned long long) ctl);
+    }
+}
+
+
+// xorshift64*, plenty for picking offsets
+static uint64_t nextRandom(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+
+// Read the whole file once so that the run measures cached io
+static void warmFile(const char* file)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        DIE("Could not open file \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    void* buffer = malloc(kBenchWarmChunk);
+    if (!buffer) {
+        DIE("Could not allocate warm up buffer\n");
+    }
+    
+    ssize_t rc;
+    while (0 != (rc = read(fd, buffer, kBenchWarmChunk))) {
+        if ((rc < 0) && (errno != EINTR)) {
+            DIE("Could not read file \"%s\": %s\n", file, strerror(errno));
+        }
+    }
+    
+    free(buffer);
+    close(fd);
+}
+
+
+static void printLatency(const char* name, const struct LoopStats* stats, uint32_t direction, double seconds, int last)
+{
+    struct LoopStatSummary s;
+    loop_stats_summarize(stats, direction, &s);
+    
+    printf("\"%s\":{\"ops\":%llu,\"bytes\":%llu,\"iops\":%.1f,\"mbps\":%.2f,"
+           "\"lat_mean_us\":%.2f,\"lat_p50_us\":%.2f,\"lat_p90_us\":%.2f,\"lat_p99_us\":%.2f,\"lat_p999_us\":%.2f,\"lat_max_us\":%.2f}%s",
+           name, (unsigned long long) s.ops, (unsigned long long) s.bytes,
+           (seconds > 0 ? s.ops / seconds : 0.0), (seconds > 0 ? s.bytes / seconds / 1e6 : 0.0),
+           s.mean / 1000.0, s.p50 / 1000.0, s.p90 / 1000.0, s.p99 / 1000.0, s.p999 / 1000.0, s.max / 1000.0,
+           (last ? "" : ","));
+}
+
+
+static void usage(void)
+{
+    printf("Usage: loopbench [-p pattern] [-r readpct] [-s size] [-q depth] [-d seconds] [-n ops] [-e engine] [-t threads] [-c cache] [-B blocksize] [-k chunk] [-G writes] [-f] [-H] [-W] [-D] file\n");
+    printf("    -p pattern  seq or rand, default rand\n");
+    printf("    -r readpct  Percentage of reads, rest are writes, default 100\n");
+    printf("    -s size     Request size in bytes, multiple of block size, default %u\n", kBenchDefaultSize);
+    printf("    -q depth    Requests kept in flight, 1 to %u, default %u\n", kLoopMaxTags, kBenchDefaultDepth);
+    printf("    -d seconds  Run time, default %u\n", kBenchDefaultSeconds);
+    printf("    -n ops      Stop after this many requests instead\n");
+    printf("    -e engine   Backing store engine: %s\n", engine_names());
+    printf("    -t threads  Number of helper worker threads, default %u\n", kLoopDefaultThreads);
+    printf("    -c cache    Helper write-back cache dirty limit in megabytes, default 0 (no cache)\n");
+    printf("    -B size     Device logical block size in bytes, default %u\n", kLoopBlockSize);
+    printf("    -k chunk    Helper split chunk in kilobytes, default %u, 0 disables\n", kLoopDefaultChunkSize / 1024);
+    printf("    -G writes   Most FUA writes sharing one helper flush, default 0 (no limit), 1 disables group commit\n");
+    printf("    -f          Send writes with FUA, each completes only once it is durable\n");
+    printf("    -H          Read backing file holes too instead of zero filling them from its extent map\n");
+    printf("    -W          Read the file once before the run to measure page cache hits\n");
+    printf("    -D          Direct io, keep backing file out of host page cache\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    struct LoopHelperOptions options;
+    int random = 1;
+    unsigned readPct = 100;
+    uint64_t size = kBenchDefaultSize;
+    unsigned depth = kBenchDefaultDepth;
+    unsigned seconds = kBenchDefaultSeconds;
+    uint64_t maxOps = 0;
+    int warm = 0;
+    int fua = 0;
+    int opt;
+    
+    helper_default_options(&options);
+    options.quiet = 1;
+    
+    while (-1 != (opt = getopt(argc, argv, "p:r:s:q:d:n:e:t:c:B:k:G:fHWD"))) {
+        switch (opt) {
+        case 'p':
+            if (!strcmp(optarg, "seq")) {
+                random = 0;
+            } else if (!strcmp(optarg, "rand")) {
+                random = 1;
+            } else {
+                DIE("Invalid pattern %s\n", optarg);
+            }
+            break;
+    
+        case 'r':
+            readPct = (unsigned) strtoul(optarg, NULL, 10);
+            if (readPct > 100) {
+                DIE("Invalid read percentage\n");
+            }
+            break;
+    
+        case 's':
+            size = strtoull(optarg, NULL, 10);
+            break;
+    
+        case 'q':
+            depth = (unsigned) strtoul(optarg, NULL, 10);
+            if (!depth || (depth > kLoopMaxTags)) {
+                DIE("Invalid queue depth\n");
+            }
+            break;
+    
+        case 'd':
+            seconds = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+    
+        case 'n':
+            maxOps = strtoull(optarg, NULL, 10);
+            break;
+    
+        case 'e':
+            options.engine = optarg;
+            break;
+    
+        case 't':
+            options.nthreads = (unsigned) strtoul(optarg, NULL, 10);
+            if (!options.nthreads) {
+                DIE("Invalid number of threads\n");
+            }
+            break;
+    
+        case 'c':
+            options.cacheSize = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+    
+        case 'B':
+            options.blockSize = (uint32_t) strtoul(optarg, NULL, 10);
+            if (!loop_block_size_valid(options.blockSize)) {
+                DIE("Invalid block size, must be a power of two from %u to %u\n", kLoopMinBlockSize, kLoopMaxBlockSize);
+            }
+            break;
+    
+        case 'k':
+            options.chunkSize = strtoull(optarg, NULL, 10) * 1024;
+            break;
+    
+        case 'G':
+            options.commitGroup = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+    
+        case 'f':
+            fua = 1;
+            break;
+    
+        case 'H':
+            options.sparse = 0;
+            break;
+    
+        case 'W':
+            warm = 1;
+            break;
+    
+        case 'D':
+            options.engineFlags |= kLoopEngineFlag_Direct;
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    if (!size || (size % options.blockSize) || (size > kLoopMaxBufferSize)) {
+        DIE("Request size must be a multiple of block size up to %u\n", kLoopMaxBufferSize);
+    }
+    
+    if (options.chunkSize % options.blockSize) {
+        DIE("Chunk size must be a multiple of block size\n");
+    }
+    
+    if (argc - optind != 1) {
+        usage();
+        DIE("Please specify file name\n");
+    }
+    
+    const char* file = argv[optind];
+    options.readonly = (readPct == 100);
+    
+    uint64_t fileSize;
+    int error = helper_device_size(file, &fileSize);
+    if (error) {
+        DIE("Could not get size of file \"%s\": %s\n", file, strerror(error));
+    }
+    
+    uint64_t nrequests = fileSize / size;
+    if (!nrequests) {
+        DIE("File \"%s\" is smaller than one request\n", file);
+    }
+    
+    if (warm) {
+        warmFile(file);
+    }
+    
+    
+    // Simulated driver: shared rings, buffer pool and tags
+    struct BenchDriver* driver = NULL;
+    if (posix_memalign((void**) &driver, 64, sizeof(*driver))) {
+        DIE("Could not allocate driver\n");
+    }
+    memset(driver, 0, sizeof(*driver));
+    
+    driver->blockSize   = options.blockSize;
+    driver->slotSize    = (size + kBenchBufferAlign - 1) & ~((uint64_t) kBenchBufferAlign - 1);
+    driver->poolSize    = driver->slotSize * depth;
+    driver->starts      = (uint64_t*) calloc(kLoopMaxTags, sizeof(*driver->starts));
+    driver->directions  = (uint32_t*) calloc(kLoopMaxTags, sizeof(*driver->directions));
+    
+    if (posix_memalign((void**) &driver->rings, kBenchBufferAlign, sizeof(*driver->rings)) ||
+        posix_memalign((void**) &driver->pool, kBenchBufferAlign, driver->poolSize) ||
+        posix_memalign((void**) &driver->stats, 64, sizeof(*driver->stats)) ||
+        posix_memalign((void**) &driver->total, 64, sizeof(*driver->total)) ||
+        !driver->starts || !driver->directions) {
+        DIE("Could not allocate driver memory\n");
+    }
+    
+    memset(driver->rings, 0, sizeof(*driver->rings));
+    loop_ring_init(&driver->rings->submitRing);
+    loop_ring_init(&driver->rings->completeRing);
+    memset(driver->pool, 0xa5, driver->poolSize);
+    loop_tags_init(&driver->tags, depth);
+    loop_stats_init(driver->stats);
+    loop_stats_init(driver->total);
+    
+    pthread_mutex_init(&driver->submitLock, NULL);
+    pthread_mutex_init(&driver->completeLock, NULL);
+    pthread_mutex_init(&driver->inflightLock, NULL);
+    pthread_cond_init(&driver->inflightCond, NULL);
+    pthread_mutex_init(&driver->eventLock, NULL);
+    pthread_cond_init(&driver->eventCond, NULL);
+    
+    
+    // Attach helper to it
+    struct LoopHelperGroup* group = helper_group_create(&options, 1);
+    driver->helper = helper_create(group, file, &options, driverCtl, driver);
+    helper_set_memory(driver->helper, driver->rings, driver->pool, driver->poolSize);
+    
+    if (pthread_create(&driver->eventThread, NULL, eventThread, driver)) {
+        DIE("Could not start helper event thread\n");
+    }
+    
+    
+    // Keep depth requests in flight until time or request budget runs out
+    uint64_t state = 0x9e3779b97f4a7c15ull ^ (uint64_t) getpid();
+    uint64_t next = 0;
+    uint64_t issued = 0;
+    uint64_t start = loop_clock_ns();
+    uint64_t deadline = start + (uint64_t) seconds * 1000000000ull;
+    
+    for (;;) {
+        if (maxOps ? (issued >= maxOps) : (loop_clock_ns() >= deadline)) {
+            break;
+        }
+    
+        pthread_mutex_lock(&driver->inflightLock);
+        while (driver->inflight >= depth) {
+            pthread_cond_wait(&driver->inflightCond, &driver->inflightLock);
+        }
+        driver->inflight++;
+        pthread_mutex_unlock(&driver->inflightLock);
+    
+        int32_t tag = loop_tags_alloc(&driver->tags);
+        if (tag < 0) {
+            DIE("Out of request tags with %u in flight\n", driver->inflight);
+        }
+    
+        uint64_t index = random ? nextRandom(&state) % nrequests : next++ % nrequests;
+        uint32_t direction = (nextRandom(&state) % 100 < readPct) ? kLoopIODirection_Read : kLoopIODirection_Write;
+    
+        struct UserIORequest request;
+        memset(&request, 0, sizeof(request));
+        request.offset      = index * size / options.blockSize;
+        request.nblocks     = size / options.blockSize;
+        request.buffer      = (uint64_t) tag * driver->slotSize;
+        request.direction   = direction;
+        request.flags       = (fua && (direction == kLoopIODirection_Write)) ? kLoopIOFlag_FUA : 0;
+        request.priv        = loop_tags_handle(&driver->tags, (uint32_t) tag);
+    
+        driver->starts[tag] = loop_clock_ns();
+        driver->directions[tag] = direction;
+    
+        postRequest(driver, &request);
+        issued++;
+    }
+    
+    pthread_mutex_lock(&driver->inflightLock);
+    while (driver->inflight) {
+        pthread_cond_wait(&driver->inflightCond, &driver->inflightLock);
+    }
+    pthread_mutex_unlock(&driver->inflightLock);
+    
+    double elapsed = (driver->lastComplete > start) ? (driver->lastComplete - start) / 1e9 : 0.0;
+    
+    
+    // Detach helper, it prints its own statistics
+    postEvent(driver, kLoopUserTerminateNotification, NULL);
+    pthread_join(driver->eventThread, NULL);
+    helper_destroy(driver->helper);
+    helper_group_destroy(group);
+    
+    printf("{\"file\":\"%s\",\"engine\":\"%s\",\"threads\":%u,\"pattern\":\"%s\",\"readpct\":%u,\"size\":%llu,\"depth\":%u,"
+           "\"blocksize\":%u,\"chunk\":%llu,\"cache\":%llu,\"fua\":%d,\"group\":%u,\"warm\":%d,\"direct\":%d,\"sparse\":%d,\"seconds\":%.3f,\"errors\":%llu,\"inlined\":%llu,\"doorbells\":%llu,",
+           file, (options.engine ? options.engine : "default"), options.nthreads, (random ? "rand" : "seq"), readPct,
+           (unsigned long long) size, depth, options.blockSize, (unsigned long long) options.chunkSize,
+           (unsigned long long) options.cacheSize, fua, options.commitGroup, warm,
+           (options.engineFlags & kLoopEngineFlag_Direct) != 0, options.sparse, elapsed, (unsigned long long) driver->errors,
+           (unsigned long long) driver->inlined, (unsigned long long) driver->doorbells);
+    printLatency("all", driver->total, kLoopIODirection_Read, elapsed, 0);
+    printLatency("read", driver->stats, kLoopIODirection_Read, elapsed, 0);
+    printLatency("write", driver->stats, kLoopIODirection_Write, elapsed, 1);
+    printf("}\n");
+    
+    if (driver->stale) {
+        fprintf(stderr, "Warning: %llu completions had stale request handles\n", (unsigned long long) driver->stale);
+    }
+    
+    pthread_cond_destroy(&driver->eventCond);
+    pthread_mutex_destroy(&driver->eventLock);
+    pthread_cond_destroy(&driver->inflightCond);
+    pthread_mutex_destroy(&driver->inflightLock);
+    pthread_mutex_destroy(&driver->completeLock);
+    pthread_mutex_destroy(&driver->submitLock);
+    
+    int rc = driver->errors ? EXIT_FAILURE : EXIT_SUCCESS;
+    
+    free(driver->total);
+    free(driver->stats);
+    free(driver->pool);
+    free(driver->rings);
+    free(driver->directions);
+    free(driver->starts);
+    free(driver);
+    
+    return rc;
+}
@@ -0,0 +1,1274 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Check and benchmark the components kext shares with user space
+//  loopcheck [-d seconds] [-t threads] [-P] [-m usec] [-f trace] check...
+//
+//  Every check runs the very header kext compiles in against a workload whose right answers are known, dies on the
+//  first wrong one and reports how fast it went as one line: check, mode, operations per second and details.
+//
+//      ring    Requests go to a consumer through the submission ring and come back through the completion ring with
+//              doorbells rung only for an idle consumer, between two threads or two processes with -P. Every entry
+//              has to arrive once, in order and intact. Rate is request round trips.
+//
+//      pool    Pools of several sizes are carved up, exhausted one size class after another and given back, then
+//              threads allocate and free random sizes at once while claiming every page of their chunks, so that
+//              two chunks handed out over the same memory are caught. Rate is allocation and free pairs.
+//
+//      tags    Tag tables of several depths are filled up, handles are looked up while held and after release, then
+//              threads allocate and free tags at once while claiming them, so that a tag handed out twice or a handle
+//              outliving its request is caught. Rate is allocation and free pairs.
+//
+//      merge   Request streams go through the merge window the way driver feeds it, with a timer expiring runs at
+//              their deadlines: sequential, reverse, two interleaved, reads and writes over the same blocks, random,
+//              too slow to merge, and a trace recorded with -T given with -f. Every request has to leave the window
+//              once, within the delay, in a run of one direction and contiguous sorted parts. Rate is requests
+//              through the window, details tell how many requests a dispatched run got on average.
+//
+//      stats   Every histogram bucket has to hold the values mapped to it within 1/8 of their size, percentiles of
+//              a known distribution have to come out right, then threads record at once into shards of their own
+//              and into one shared shard, and totals have to add up exactly. Rate is records, details tell what
+//              one record costs.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "kext/loopctl.h"
+#include "kext/loopring.h"
+#include "kext/looppool.h"
+#include "kext/looptags.h"
+#include "kext/loopmerge.h"
+#include "kext/loopstats.h"
+#include "engine.h"
+#include "clock.h"
+#include "trace.h"
+
+
+#define DIE(msg, args...) { fprintf(stderr, msg, ## args); exit(EXIT_FAILURE); }
+
+
+enum {
+    kCheckDefaultSeconds    = 2,            // Default run time per check
+    kCheckDefaultThreads    = 4,            // Default threads for checks that contend
+    kCheckMaxThreads        = 64,           // Most threads a check runs
+    kPoolHeld               = 8,            // Chunks each pool check thread holds at once
+    kTagsHeld               = 8,            // Tags each tags check thread holds at once
+    kCheckDefaultMergeDelay = 100,          // Default merge window usec
+    kMergeRequests          = 200000,       // Requests in a synthetic stream
+    kMergeBlockSize         = kLoopBlockSize,
+    kMergeDeviceBlocks      = 2 * 1024 * 1024,  // Synthetic streams run over a 1GB device
+    kMergeGap               = 2000,         // Nsec between synthetic requests, a busy device
+};
+
+#define kRingCookie         0x5a5a5a5a00000000ull   // Mixed into priv so that a stale entry cannot pass for a new one
+
+
+struct CheckOptions {
+    double                  seconds;
+    unsigned                threads;
+    int                     processes;      // Run ring peers in separate processes
+    unsigned                mergeDelay;     // Merge window usec
+    const char*             traceFile;      // Trace merge check replays or NULL
+};
+
+
+// Ring peers, in shared memory when they are processes
+struct RingCheck {
+    struct LoopSharedRings  rings;
+    int                     submitBell[2];  // Doorbell pipes, what mach notification and doorbell ioctl are for the kext
+    int                     completeBell[2];
+    uint64_t                submitDoorbells;
+    uint64_t                completeDoorbells;
+};
+
+
+static void ringDoorbell(int fd)
+{
+    char c = 0;
+    while ((1 != write(fd, &c, 1)) && (errno == EINTR)) {
+        continue;
+    }
+}
+
+
+// Several doorbells may have piled up, one wakeup is enough for all of them
+static void ringWait(int fd)
+{
+    char buffer[64];
+    if ((read(fd, buffer, sizeof(buffer)) <= 0) && (errno != EINTR)) {
+        DIE("Ring peer went away\n");
+    }
+}
+
+
+// Helper side: consume requests in order and complete every one right away, until the stop request
+static void ringHelper(struct RingCheck* check)
+{
+    struct LoopSharedRings* rings = &check->rings;
+    uint64_t expected = 0;
+    int stop = 0;
+    
+    loop_ring_consumer_busy(&rings->submitRing);
+    
+    while (!stop) {
+        uint32_t slot;
+        int rc;
+    
+        while (!stop && (0 < (rc = loop_ring_consume_begin(&rings->submitRing, kLoopRingDepth, &slot)))) {
+            struct UserIORequest request = rings->submitQueue[slot];
+            loop_ring_consume_commit(&rings->submitRing);
+    
+            if ((request.offset != expected) || (request.priv != (expected ^ kRingCookie))) {
+                DIE("Ring delivered request %llu, expected %llu\n", (unsigned long long) request.offset, (unsigned long long) expected);
+            }
+    
+            expected++;
+            stop = (request.direction == kLoopIODirection_Flush);
+            request.result = (IOReturn) (request.offset & 0x7fffffff);
+    
+            // Driver never has more requests in flight than the ring holds
+            if (!loop_ring_produce_begin(&rings->completeRing, kLoopRingDepth, &slot)) {
+                DIE("Completion ring overflowed\n");
+            }
+    
+            rings->completeQueue[slot] = request;
+            if (loop_ring_produce_commit(&rings->completeRing)) {
+                check->completeDoorbells++;
+                ringDoorbell(check->completeBell[1]);
+            }
+        }
+    
+        if (rc < 0) {
+            DIE("Submission ring indexes are corrupted\n");
+        }
+    
+        if (!stop && loop_ring_consumer_idle(&rings->submitRing)) {
+            ringWait(check->submitBell[0]);
+            loop_ring_consumer_busy(&rings->submitRing);
+        }
+    }
+}
+
+
+static void* ringHelperThread(void* arg)
+{
+    ringHelper((struct RingCheck*) arg);
+    return NULL;
+}
+
+
+// Driver side: keep the ring full of requests until time runs out, then send stop request and take everything back
+// @return      Requests completed
+static uint64_t ringDriver(struct RingCheck* check, double seconds)
+{
+    struct LoopSharedRings* rings = &check->rings;
+    uint64_t deadline = loop_clock_ns() + (uint64_t) (seconds * 1e9);
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+    int stopped = 0;
+    
+    while (!stopped || (completed < submitted)) {
+        uint32_t slot;
+        int rc;
+    
+        while (!stopped && (submitted - completed < kLoopRingDepth) && loop_ring_produce_begin(&rings->submitRing, kLoopRingDepth, &slot)) {
+            struct UserIORequest* request = &rings->submitQueue[slot];
+    
+            memset(request, 0, sizeof(*request));
+            request->offset     = submitted;
+            request->nblocks    = 1;
+            request->priv       = submitted ^ kRingCookie;
+            request->direction  = kLoopIODirection_Read;
+    
+            // Clock is cheap next to a doorbell, check it every time so that the run ends on time
+            if (loop_clock_ns() >= deadline) {
+                request->direction = kLoopIODirection_Flush;
+                stopped = 1;
+            }
+    
+            submitted++;
+            if (loop_ring_produce_commit(&rings->submitRing)) {
+                check->submitDoorbells++;
+                ringDoorbell(check->submitBell[1]);
+            }
+        }
+    
+        loop_ring_consumer_busy(&rings->completeRing);
+    
+        uint64_t taken = 0;
+        while (0 < (rc = loop_ring_consume_begin(&rings->completeRing, kLoopRingDepth, &slot))) {
+            struct UserIORequest request = rings->completeQueue[slot];
+            loop_ring_consume_commit(&rings->completeRing);
+    
+            if ((request.priv != (completed ^ kRingCookie)) || (request.result != (IOReturn) (completed & 0x7fffffff))) {
+                DIE("Ring completed request 0x%llx, expected %llu\n", (unsigned long long) request.priv, (unsigned long long) completed);
+            }
+    
+            completed++;
+            taken++;
+        }
+    
+        if (rc < 0) {
+            DIE("Completion ring indexes are corrupted\n");
+        }
+    
+        // Sleep only when there is nothing to submit either
+        int blocked = stopped || (submitted - completed >= kLoopRingDepth);
+        if (!taken && blocked && (completed < submitted) && loop_ring_consumer_idle(&rings->completeRing)) {
+            ringWait(check->completeBell[0]);
+        }
+    }
+    
+    return completed;
+}
+
+
+static void checkRing(const struct CheckOptions* options)
+{
+    struct RingCheck* check = (struct RingCheck*) mmap(NULL, sizeof(*check), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (check == MAP_FAILED) {
+        DIE("Could not allocate shared rings: %s\n", strerror(errno));
+    }
+    
+    memset(check, 0, sizeof(*check));
+    loop_ring_init(&check->rings.submitRing);
+    loop_ring_init(&check->rings.completeRing);
+    
+    if (pipe(check->submitBell) || pipe(check->completeBell)) {
+        DIE("Could not create doorbells: %s\n", strerror(errno));
+    }
+    
+    uint64_t start = loop_clock_ns();
+    uint64_t completed;
+    
+    if (options->processes) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            DIE("Could not fork: %s\n", strerror(errno));
+        }
+    
+        if (!pid) {
+            ringHelper(check);
+            exit(EXIT_SUCCESS);
+        }
+    
+        int status;
+        completed = ringDriver(check, options->seconds);
+        if ((pid != waitpid(pid, &status, 0)) || !WIFEXITED(status) || (WEXITSTATUS(status) != EXIT_SUCCESS)) {
+            DIE("Ring helper process failed\n");
+        }
+    } else {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ringHelperThread, check)) {
+            DIE("Could not start ring helper thread\n");
+        }
+    
+        completed = ringDriver(check, options->seconds);
+        pthread_join(thread, NULL);
+    }
+    
+    double elapsed = (loop_clock_ns() - start) / 1e9;
+    
+    printf("%-8s %-12s %14.0f  %llu requests, %.2f submit and %.2f completion doorbells per 1000\n", "ring",
+           (options->processes ? "processes" : "threads"), completed / elapsed, (unsigned long long) completed,
+           check->submitDoorbells * 1000.0 / completed, check->completeDoorbells * 1000.0 / completed);
+    
+    close(check->submitBell[0]);
+    close(check->submitBell[1]);
+    close(check->completeBell[0]);
+    close(check->completeBell[1]);
+    munmap(check, sizeof(*check));
+}
+
+
+// Pool shared by contending threads with the owner of every page of pool memory
+struct PoolCheck {
+    struct LoopPool         pool;
+    volatile uint32_t*      owners;         // Thread index + 1 or 0 for a free page
+    uint64_t                deadline;
+    pthread_t               threads[kCheckMaxThreads];
+    uint64_t                pairs[kCheckMaxThreads];
+    uint64_t                full[kCheckMaxThreads];
+};
+
+
+struct PoolThread {
+    struct PoolCheck*       check;
+    unsigned                index;
+};
+
+
+// @return      Size class an offset handed out by the pool belongs to
+static const struct LoopPoolClass* poolClass(const struct LoopPool* pool, uint64_t offset)
+{
+    int i;
+    
+    for (i = 0; i < kLoopPoolClasses; ++i) {
+        const struct LoopPoolClass* cls = &pool->classes[i];
+        if (cls->count && (offset >= cls->base) && (offset < cls->base + cls->count * cls->chunkSize)) {
+            if ((offset - cls->base) % cls->chunkSize) {
+                DIE("Pool offset %llu is not at a chunk start\n", (unsigned long long) offset);
+            }
+    
+            return cls;
+        }
+    }
+    
+    DIE("Pool offset %llu is outside of all size classes\n", (unsigned long long) offset);
+}
+
+
+// Mark every page of a chunk with its new owner, owner 0 gives them back
+static void poolClaim(const struct LoopPool* pool, volatile uint32_t* owners, uint64_t offset, uint32_t from, uint32_t to)
+{
+    uint64_t chunkSize = poolClass(pool, offset)->chunkSize;
+    uint64_t page;
+    
+    for (page = offset / kLoopPoolMinChunkSize; page < (offset + chunkSize) / kLoopPoolMinChunkSize; ++page) {
+        if (!__sync_bool_compare_and_swap(&owners[page], from, to)) {
+            DIE("Pool page %llu belongs to %u, expected %u\n", (unsigned long long) page, owners[page], from);
+        }
+    }
+}
+
+
+// Carve up a pool, exhaust it and give everything back, dies on the first chunk in a wrong place
+static void poolCheckLayout(struct LoopPool* pool, uint64_t size, uint64_t maxChunkSize)
+{
+    static uint64_t offsets[kLoopPoolClasses * kLoopPoolMaxChunks];
+    uint32_t* owners = (uint32_t*) calloc(size / kLoopPoolMinChunkSize, sizeof(uint32_t));
+    uint64_t end = 0;
+    uint64_t offset;
+    uint32_t total = 0;
+    uint32_t n = 0;
+    uint32_t i;
+    
+    loop_pool_init(pool, size, maxChunkSize);
+    
+    // Classes follow each other, grow and stay inside the pool
+    for (i = 0; i < kLoopPoolClasses; ++i) {
+        const struct LoopPoolClass* cls = &pool->classes[i];
+        if (!cls->count) {
+            continue;
+        }
+    
+        if ((cls->base != end) || (cls->chunkSize % kLoopPoolMinChunkSize) || (cls->chunkSize > maxChunkSize)) {
+            DIE("Pool of %llu bytes has a bad size class %u\n", (unsigned long long) size, i);
+        }
+    
+        end += cls->count * cls->chunkSize;
+        total += cls->count;
+    }
+    
+    if (end > size) {
+        DIE("Pool of %llu bytes hands out %llu bytes\n", (unsigned long long) size, (unsigned long long) end);
+    }
+    
+    if ((size >= maxChunkSize) && (pool->maxChunkSize != maxChunkSize)) {
+        DIE("Pool of %llu bytes cannot take a %llu bytes request\n", (unsigned long long) size, (unsigned long long) maxChunkSize);
+    }
+    
+    if (loop_pool_alloc(pool, pool->maxChunkSize + 1, &offset)) {
+        DIE("Pool of %llu bytes took a request larger than its largest chunk\n", (unsigned long long) size);
+    }
+    
+    // Smallest requests fill every class, smallest first, without two chunks over the same page
+    while (loop_pool_alloc(pool, 1, &offset)) {
+        const struct LoopPoolClass* cls = poolClass(pool, offset);
+        if (n && (cls->chunkSize < poolClass(pool, offsets[n - 1])->chunkSize)) {
+            DIE("Pool went back to a smaller class after a larger one\n");
+        }
+    
+        poolClaim(pool, owners, offset, 0, 1);
+        offsets[n++] = offset;
+    }
+    
+    if (n != total) {
+        DIE("Pool of %llu bytes handed out %u of %u chunks\n", (unsigned long long) size, n, total);
+    }
+    
+    // Chunk given back is the one handed out next
+    for (i = 0; i < n; i += 1 + n / 16) {
+        uint64_t chunkSize = poolClass(pool, offsets[i])->chunkSize;
+    
+        poolClaim(pool, owners, offsets[i], 1, 0);
+        loop_pool_free(pool, offsets[i]);
+        if (!loop_pool_alloc(pool, chunkSize, &offset) || (offset != offsets[i])) {
+            DIE("Pool did not reuse chunk %llu\n", (unsigned long long) offsets[i]);
+        }
+    
+        poolClaim(pool, owners, offset, 0, 1);
+    }
+    
+    for (i = 0; i < n; ++i) {
+        poolClaim(pool, owners, offsets[i], 1, 0);
+        loop_pool_free(pool, offsets[i]);
+    }
+    
+    // Everything is back, largest request fits again
+    if (!loop_pool_alloc(pool, pool->maxChunkSize, &offset)) {
+        DIE("Pool of %llu bytes lost chunks\n", (unsigned long long) size);
+    }
+    
+    loop_pool_free(pool, offset);
+    free(owners);
+}
+
+
+static void* poolThread(void* arg)
+{
+    struct PoolThread* thread = (struct PoolThread*) arg;
+    struct PoolCheck* check = thread->check;
+    uint64_t held[kPoolHeld];
+    unsigned seed = thread->index + 1;
+    unsigned nheld = 0;
+    uint64_t n;
+    
+    for (n = 0; (n % 256) || (loop_clock_ns() < check->deadline); ++n) {
+        // Sizes spread over all classes, small ones more often
+        uint64_t nbytes = 1 + rand_r(&seed) % ((uint64_t) kLoopPoolMinChunkSize << (2 * (rand_r(&seed) % kLoopPoolClasses)));
+        uint64_t offset;
+    
+        if (nbytes > check->pool.maxChunkSize) {
+            nbytes = check->pool.maxChunkSize;
+        }
+    
+        if (loop_pool_alloc(&check->pool, nbytes, &offset)) {
+            if (poolClass(&check->pool, offset)->chunkSize < nbytes) {
+                DIE("Pool chunk at %llu is smaller than %llu bytes\n", (unsigned long long) offset, (unsigned long long) nbytes);
+            }
+    
+            poolClaim(&check->pool, check->owners, offset, 0, thread->index + 1);
+            held[nheld++] = offset;
+        } else {
+            check->full[thread->index]++;
+        }
+    
+        if ((nheld == kPoolHeld) || (nheld && !(rand_r(&seed) % 2))) {
+            unsigned victim = rand_r(&seed) % nheld;
+    
+            poolClaim(&check->pool, check->owners, held[victim], thread->index + 1, 0);
+            loop_pool_free(&check->pool, held[victim]);
+            held[victim] = held[--nheld];
+            check->pairs[thread->index]++;
+        }
+    }
+    
+    while (nheld) {
+        --nheld;
+        poolClaim(&check->pool, check->owners, held[nheld], thread->index + 1, 0);
+        loop_pool_free(&check->pool, held[nheld]);
+    }
+    
+    return NULL;
+}
+
+
+static void checkPool(const struct CheckOptions* options)
+{
+    static const uint64_t sizes[] = { 10, 16, 48, 64, 256, 1024 };
+    static struct PoolCheck check;
+    struct PoolThread threads[kCheckMaxThreads];
+    unsigned nthreads = (options->threads < kCheckMaxThreads) ? options->threads : kCheckMaxThreads;
+    uint64_t pairs = 0;
+    uint64_t full = 0;
+    unsigned i;
+    
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        poolCheckLayout(&check.pool, sizes[i] * 1024 * 1024, kLoopMaxBufferSize);
+    }
+    
+    poolCheckLayout(&check.pool, 1024 * 1024, 64 * 1024);
+    
+    // Contend over the default pool
+    memset(&check, 0, sizeof(check));
+    loop_pool_init(&check.pool, kLoopDefaultPoolSize, kLoopMaxBufferSize);
+    check.owners = (volatile uint32_t*) calloc(kLoopDefaultPoolSize / kLoopPoolMinChunkSize, sizeof(uint32_t));
+    
+    uint64_t start = loop_clock_ns();
+    check.deadline = start + (uint64_t) (options->seconds * 1e9);
+    
+    for (i = 0; i < nthreads; ++i) {
+        threads[i].check = &check;
+        threads[i].index = i;
+        if (pthread_create(&check.threads[i], NULL, poolThread, &threads[i])) {
+            DIE("Could not start pool check thread\n");
+        }
+    }
+    
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(check.threads[i], NULL);
+        pairs += check.pairs[i];
+        full += check.full[i];
+    }
+    
+    double elapsed = (loop_clock_ns() - start) / 1e9;
+    
+    // Every page has to be free again
+    for (i = 0; i < kLoopDefaultPoolSize / kLoopPoolMinChunkSize; ++i) {
+        if (check.owners[i]) {
+            DIE("Pool page %u is still held by %u\n", i, check.owners[i]);
+        }
+    }
+    
+    printf("%-8s %2u %-9s %14.0f  %llu alloc and free pairs, %.2f%% allocs found pool full\n", "pool", nthreads, "threads",
+           pairs / elapsed, (unsigned long long) pairs, full * 100.0 / (pairs + full));
+    
+    free((void*) check.owners);
+}
+
+
+// Tag table shared by contending threads with the owner of every tag
+struct TagsCheck {
+    struct LoopTagTable     tags;
+    volatile uint32_t       owners[kLoopMaxTags];   // Thread index + 1 or 0 for a free tag
+    uint64_t                deadline;
+    pthread_t               threads[kCheckMaxThreads];
+    uint64_t                pairs[kCheckMaxThreads];
+    uint64_t                full[kCheckMaxThreads];
+};
+
+
+struct TagsThread {
+    struct TagsCheck*       check;
+    unsigned                index;
+};
+
+
+// Fill a table up, release and reuse tags, dies on the first tag or handle that is wrong
+static void tagsCheckDepth(struct LoopTagTable* tags, uint32_t depth)
+{
+    static uint64_t handles[kLoopMaxTags];
+    static uint8_t taken[kLoopMaxTags];
+    uint32_t usable = (depth < kLoopMaxTags) ? depth : kLoopMaxTags;
+    uint32_t i;
+    int32_t tag;
+    
+    loop_tags_init(tags, depth);
+    memset(taken, 0, sizeof(taken));
+    
+    for (i = 0; i < usable; ++i) {
+        tag = loop_tags_alloc(tags);
+        if ((tag < 0) || (tag >= (int32_t) usable) || taken[tag]) {
+            DIE("Table of %u tags handed out tag %d\n", depth, tag);
+        }
+    
+        taken[tag] = 1;
+        handles[tag] = loop_tags_handle(tags, (uint32_t) tag);
+    }
+    
+    if (loop_tags_alloc(tags) >= 0) {
+        DIE("Table of %u tags handed out more than that\n", depth);
+    }
+    
+    // Handles of held tags are good, ones past the table or with another generation are not
+    for (i = 0; i < usable; ++i) {
+        if ((loop_tags_lookup(tags, handles[i]) != (int32_t) i) || (loop_tags_lookup(tags, handles[i] + (1ull << 32)) >= 0)) {
+            DIE("Table of %u tags did not check handle 0x%llx\n", depth, (unsigned long long) handles[i]);
+        }
+    }
+    
+    if ((loop_tags_lookup(tags, usable) >= 0) || (loop_tags_lookup(tags, 0xffffffffull) >= 0)) {
+        DIE("Table of %u tags took a handle past its end\n", depth);
+    }
+    
+    // Released tag is the one handed out next, its old handle stays stale
+    for (i = 0; i < usable; i += 1 + usable / 16) {
+        uint64_t old = handles[i];
+    
+        loop_tags_free(tags, i);
+        if (loop_tags_lookup(tags, old) >= 0) {
+            DIE("Handle 0x%llx survived its tag\n", (unsigned long long) old);
+        }
+    
+        tag = loop_tags_alloc(tags);
+        handles[i] = loop_tags_handle(tags, i);
+        if ((tag != (int32_t) i) || (handles[i] == old) || (loop_tags_lookup(tags, old) >= 0) || (loop_tags_lookup(tags, handles[i]) != tag)) {
+            DIE("Table of %u tags did not reuse tag %u\n", depth, i);
+        }
+    }
+    
+    for (i = 0; i < usable; ++i) {
+        loop_tags_free(tags, i);
+        if (loop_tags_lookup(tags, handles[i]) >= 0) {
+            DIE("Handle 0x%llx survived its tag\n", (unsigned long long) handles[i]);
+        }
+    }
+}
+
+
+static void* tagsThread(void* arg)
+{
+    struct TagsThread* thread = (struct TagsThread*) arg;
+    struct TagsCheck* check = thread->check;
+    struct LoopTagTable* tags = &check->tags;
+    uint64_t held[kTagsHeld];
+    unsigned seed = thread->index + 1;
+    unsigned nheld = 0;
+    uint64_t n;
+    
+    for (n = 0; (n % 256) || (loop_clock_ns() < check->deadline); ++n) {
+        int32_t tag = loop_tags_alloc(tags);
+        if (tag >= 0) {
+            if (!__sync_bool_compare_and_swap(&check->owners[tag], 0, thread->index + 1)) {
+                DIE("Tag %d handed out while held by %u\n", tag, check->owners[tag]);
+            }
+    
+            held[nheld++] = loop_tags_handle(tags, (uint32_t) tag);
+        } else {
+            check->full[thread->index]++;
+        }
+    
+        if ((nheld == kTagsHeld) || (nheld && !(rand_r(&seed) % 2))) {
+            unsigned victim = rand_r(&seed) % nheld;
+            uint64_t handle = held[victim];
+    
+            tag = loop_tags_lookup(tags, handle);
+            if ((tag < 0) || (check->owners[tag] != thread->index + 1)) {
+                DIE("Handle 0x%llx went stale while held\n", (unsigned long long) handle);
+            }
+    
+            check->owners[tag] = 0;
+            loop_tags_free(tags, (uint32_t) tag);
+    
+            // Somebody else may have the tag already, never with the same handle
+            if (loop_tags_lookup(tags, handle) >= 0) {
+                DIE("Handle 0x%llx survived its tag\n", (unsigned long long) handle);
+            }
+    
+            held[victim] = held[--nheld];
+            check->pairs[thread->index]++;
+        }
+    }
+    
+    while (nheld) {
+        int32_t tag = loop_tags_lookup(tags, held[--nheld]);
+        check->owners[tag] = 0;
+        loop_tags_free(tags, (uint32_t) tag);
+    }
+    
+    return NULL;
+}
+
+
+static void checkTags(const struct CheckOptions* options)
+{
+    static const uint32_t depths[] = { 1, 63, 64, 65, kLoopRequestDepth, kLoopMaxTags, kLoopMaxTags + 1 };
+    static struct TagsCheck check;
+    struct TagsThread threads[kCheckMaxThreads];
+    unsigned nthreads = (options->threads < kCheckMaxThreads) ? options->threads : kCheckMaxThreads;
+    uint64_t pairs = 0;
+    uint64_t full = 0;
+    unsigned i;
+    
+    for (i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i) {
+        tagsCheckDepth(&check.tags, depths[i]);
+    }
+    
+    // Contend over a table as deep as the driver one
+    memset(&check, 0, sizeof(check));
+    loop_tags_init(&check.tags, kLoopRequestDepth);
+    
+    uint64_t start = loop_clock_ns();
+    check.deadline = start + (uint64_t) (options->seconds * 1e9);
+    
+    for (i = 0; i < nthreads; ++i) {
+        threads[i].check = &check;
+        threads[i].index = i;
+        if (pthread_create(&check.threads[i], NULL, tagsThread, &threads[i])) {
+            DIE("Could not start tags check thread\n");
+        }
+    }
+    
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(check.threads[i], NULL);
+        pairs += check.pairs[i];
+        full += check.full[i];
+    }
+    
+    double elapsed = (loop_clock_ns() - start) / 1e9;
+    
+    // Every tag has to be free again
+    for (i = 0; i < kLoopRequestDepth; ++i) {
+        if (loop_tags_alloc(&check.tags) < 0) {
+            DIE("Tag table lost tags\n");
+        }
+    }
+    
+    printf("%-8s %2u %-9s %14.0f  %llu alloc and free pairs, %.2f%% allocs found table full\n", "tags", nthreads, "threads",
+           pairs / elapsed, (unsigned long long) pairs, full * 100.0 / (pairs + full));
+}
+
+
+// Request going through merge window, cookie is its index
+struct MergeRequest {
+    uint64_t                time;           // Arrival nsec
+    uint64_t                block;
+    uint64_t                nblks;
+    uint32_t                direction;      // kLoopIODirection_XXX, flush empties window
+    uint32_t                dispatched;
+};
+
+
+struct MergeCheck {
+    struct LoopMergeQueue   queue;
+    struct MergeRequest*    requests;
+    uint64_t                count;
+    uint64_t                runs;           // Runs dispatched
+    uint64_t                merged;         // Requests dispatched
+    uint64_t                held;           // Total nsec requests spent in window
+    uint64_t                maxHeld;
+};
+
+
+// xorshift64*, same as loopsim
+static uint64_t nextRandom(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+
+// dispatchRun, dies if run is not what driver can send to helper as one request
+static void mergeDispatch(struct MergeCheck* check, const struct LoopMergeRun* run, uint64_t now)
+{
+    const struct LoopMergeQueue* q = &check->queue;
+    uint64_t block = run->block;
+    uint32_t i;
+    
+    if (!run->nparts || (run->nparts > kLoopMergeMaxParts) || ((run->nparts > 1) && (run->nblks > q->maxBlocks))) {
+        DIE("Merged run of %u parts and %llu blocks is too large\n", run->nparts, (unsigned long long) run->nblks);
+    }
+    
+    for (i = 0; i < run->nparts; ++i) {
+        const struct LoopMergePart* part = &run->parts[i];
+        if (part->cookie >= check->count) {
+            DIE("Merged run has bogus cookie %llu\n", (unsigned long long) part->cookie);
+        }
+    
+        struct MergeRequest* request = &check->requests[part->cookie];
+        if (request->dispatched || (request->direction != run->direction) || (request->block != part->block) ||
+            (request->nblks != part->nblks) || (part->block != block)) {
+            DIE("Merged run at block %llu has a wrong part %u for request %llu\n", (unsigned long long) run->block, i,
+                (unsigned long long) part->cookie);
+        }
+    
+        if (now - request->time > q->delay) {
+            DIE("Request %llu was held %llu nsec, more than %llu\n", (unsigned long long) part->cookie,
+                (unsigned long long) (now - request->time), (unsigned long long) q->delay);
+        }
+    
+        request->dispatched = 1;
+        check->held += now - request->time;
+        if (now - request->time > check->maxHeld) {
+            check->maxHeld = now - request->time;
+        }
+    
+        block += part->nblks;
+    }
+    
+    if (block != run->block + run->nblks) {
+        DIE("Merged run at block %llu is not contiguous\n", (unsigned long long) run->block);
+    }
+    
+    check->runs++;
+    check->merged += run->nparts;
+}
+
+
+// Feed requests to the window in arrival order, timer goes off at the earliest deadline like sMergeTimeout
+static void mergeRun(struct MergeCheck* check, const struct CheckOptions* options, const char* name)
+{
+    struct LoopMergeRun run;
+    uint64_t deadline;
+    uint64_t i;
+    
+    loop_merge_init(&check->queue, kLoopMaxBufferSize / kMergeBlockSize, (uint64_t) options->mergeDelay * 1000);
+    check->runs = check->merged = check->held = check->maxHeld = 0;
+    
+    uint64_t start = loop_clock_ns();
+    
+    for (i = 0; i < check->count; ++i) {
+        struct MergeRequest* request = &check->requests[i];
+    
+        while (loop_merge_next_deadline(&check->queue, &deadline) && (deadline <= request->time)) {
+            while (loop_merge_expire(&check->queue, deadline, &run)) {
+                mergeDispatch(check, &run, deadline);
+            }
+        }
+    
+        if (request->direction == kLoopIODirection_Flush) {
+            while (loop_merge_flush(&check->queue, &run)) {
+                mergeDispatch(check, &run, request->time);
+            }
+    
+            request->dispatched = 1;
+            continue;
+        }
+    
+        if (loop_merge_add(&check->queue, request->direction, request->block, request->nblks, i, request->time, &run)) {
+            mergeDispatch(check, &run, request->time);
+        }
+    }
+    
+    while (loop_merge_next_deadline(&check->queue, &deadline)) {
+        while (loop_merge_expire(&check->queue, deadline, &run)) {
+            mergeDispatch(check, &run, deadline);
+        }
+    }
+    
+    double elapsed = (loop_clock_ns() - start) / 1e9;
+    
+    for (i = 0; i < check->count; ++i) {
+        if (!check->requests[i].dispatched) {
+            DIE("Request %llu never left merge window\n", (unsigned long long) i);
+        }
+    }
+    
+    if ((check->queue.dispatches != check->runs) || (check->queue.requests != check->merged)) {
+        DIE("Merge window counted %llu requests in %llu runs, %llu in %llu were dispatched\n",
+            (unsigned long long) check->queue.requests, (unsigned long long) check->queue.dispatches,
+            (unsigned long long) check->merged, (unsigned long long) check->runs);
+    }
+    
+    printf("%-8s %-12s %14.0f  %llu requests in %llu runs, %.2f requests per run, held usec mean %.1f max %.1f\n", "merge", name,
+           check->merged / elapsed, (unsigned long long) check->merged, (unsigned long long) check->runs,
+           (double) check->merged / check->runs, check->held / 1e3 / check->merged, check->maxHeld / 1e3);
+}
+
+
+// Requests in submit order from a trace, writes and reads merge, flushes empty the window
+static void mergeLoadTrace(struct MergeCheck* check, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        DIE("Could not open trace %s: %s\n", path, strerror(errno));
+    }
+    
+    struct LoopTraceHeader header;
+    if ((1 != fread(&header, sizeof(header), 1, file)) || (header.magic != kLoopTraceMagic) ||
+        (header.version != kLoopTraceVersion) || (header.recordSize != sizeof(struct LoopTraceRecord))) {
+        DIE("%s is not a supported trace file\n", path);
+    }
+    
+    struct LoopTraceRecord record;
+    uint64_t allocated = 0;
+    check->count = 0;
+    
+    while (1 == fread(&record, sizeof(record), 1, file)) {
+        if ((record.op != kLoopEngineOp_Read) && (record.op != kLoopEngineOp_Write) && (record.op != kLoopEngineOp_Flush)) {
+            continue;
+        }
+    
+        if (check->count == allocated) {
+            allocated = allocated ? allocated * 2 : 4096;
+            check->requests = (struct MergeRequest*) realloc(check->requests, allocated * sizeof(*check->requests));
+            if (!check->requests) {
+                DIE("Could not allocate trace requests\n");
+            }
+        }
+    
+        struct MergeRequest* request = &check->requests[check->count++];
+        request->time       = record.time;
+        request->block      = record.offset / header.blockSize;
+        request->nblks      = record.nbytes / header.blockSize;
+        request->direction  = (record.op == kLoopEngineOp_Read) ? kLoopIODirection_Read :
+                              (record.op == kLoopEngineOp_Write) ? kLoopIODirection_Write : kLoopIODirection_Flush;
+        request->dispatched = 0;
+    }
+    
+    fclose(file);
+    
+    // Trace is written in completion order, insertion sort is fine for roughly sorted records
+    uint64_t i;
+    for (i = 1; i < check->count; ++i) {
+        struct MergeRequest request = check->requests[i];
+        uint64_t j = i;
+        while (j && (check->requests[j - 1].time > request.time)) {
+            check->requests[j] = check->requests[j - 1];
+            j--;
+        }
+        check->requests[j] = request;
+    }
+}
+
+
+static void checkMerge(const struct CheckOptions* options)
+{
+    static const char* const streams[] = { "seq", "reverse", "interleaved", "readwrite", "random", "slow" };
+    struct MergeCheck check;
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    unsigned s;
+    uint64_t i;
+    
+    memset(&check, 0, sizeof(check));
+    check.count = kMergeRequests;
+    check.requests = (struct MergeRequest*) calloc(kMergeRequests, sizeof(*check.requests));
+    if (!check.requests) {
+        DIE("Could not allocate merge requests\n");
+    }
+    
+    // 4K requests every kMergeGap nsec
+    for (s = 0; s < sizeof(streams) / sizeof(streams[0]); ++s) {
+        uint64_t nblks = 4096 / kMergeBlockSize;
+    
+        for (i = 0; i < kMergeRequests; ++i) {
+            struct MergeRequest* request = &check.requests[i];
+            uint64_t index = i;
+    
+            request->time       = i * kMergeGap;
+            request->nblks      = nblks;
+            request->direction  = kLoopIODirection_Read;
+            request->dispatched = 0;
+    
+            switch (s) {
+            case 1:
+                index = kMergeRequests - 1 - i;
+                break;
+            case 2:
+                index = (i % 2) ? (kMergeDeviceBlocks / nblks / 2 + i / 2) : (i / 2);
+                break;
+            case 3:
+                index = i / 2;
+                request->direction = (i % 2) ? kLoopIODirection_Write : kLoopIODirection_Read;
+                break;
+            case 4:
+                index = nextRandom(&state) % (kMergeDeviceBlocks / nblks);
+                break;
+            case 5:
+                request->time = i * ((uint64_t) options->mergeDelay * 1000 * 2 + 1);
+                break;
+            }
+    
+            request->block = index * nblks;
+        }
+    
+        mergeRun(&check, options, streams[s]);
+    }
+    
+    free(check.requests);
+    
+    if (options->traceFile) {
+        memset(&check, 0, sizeof(check));
+        mergeLoadTrace(&check, options->traceFile);
+        if (!check.count) {
+            DIE("Trace %s has no requests\n", options->traceFile);
+        }
+    
+        mergeRun(&check, options, "trace");
+        free(check.requests);
+    }
+}
+
+
+// Statistics recorded by contending threads with what every thread recorded
+struct StatsCheck {
+    struct LoopStats        stats;
+    int                     shared;         // Everybody records into shard 0
+    uint64_t                deadline;
+    pthread_t               threads[kCheckMaxThreads];
+    struct LoopStatSummary  recorded[kCheckMaxThreads][kLoopStatDirections];   // Ops, bytes, latency sum in mean, max
+};
+
+
+struct StatsThread {
+    struct StatsCheck*      check;
+    unsigned                index;
+};
+
+
+// @return      Nsec of cpu all threads of the process used so far, threads sharing a cpu do not count twice
+static double cpuTime(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+}
+
+
+// Value has to land in a bucket whose range holds it and is not much wider than the value
+static void statsCheckValue(uint64_t value)
+{
+    uint32_t bucket = loop_hist_bucket(value);
+    uint64_t max = loop_hist_bucket_max(bucket);
+    
+    if (value >= (1ull << kLoopHistMaxBits)) {
+        if (bucket != kLoopHistBuckets - 1) {
+            DIE("Value %llu is past the histogram and was not clamped\n", (unsigned long long) value);
+        }
+        return;
+    }
+    
+    if ((bucket >= kLoopHistBuckets) || (value > max) || (bucket && (value <= loop_hist_bucket_max(bucket - 1)))) {
+        DIE("Value %llu went to bucket %u of up to %llu\n", (unsigned long long) value, bucket, (unsigned long long) max);
+    }
+    
+    if ((max - value) * kLoopHistSubBuckets > value) {
+        DIE("Value %llu went to bucket %u of up to %llu, more than 1/%u off\n", (unsigned long long) value, bucket,
+            (unsigned long long) max, kLoopHistSubBuckets);
+    }
+}
+
+
+// Percentile has to be at least the real one and no more than 1/8 above it
+static void statsCheckPercentile(const char* name, uint64_t value, uint64_t exact)
+{
+    if ((value < exact) || ((value - exact) * kLoopHistSubBuckets > exact)) {
+        DIE("%s came out %llu instead of %llu\n", name, (unsigned long long) value, (unsigned long long) exact);
+    }
+}
+
+
+static void* statsThread(void* arg)
+{
+    struct StatsThread* thread = (struct StatsThread*) arg;
+    struct StatsCheck* check = thread->check;
+    struct LoopStatSummary* recorded = check->recorded[thread->index];
+    uint64_t state = 0x9e3779b97f4a7c15ull ^ thread->index;
+    uint32_t shard = check->shared ? 0 : thread->index;
+    uint64_t n;
+    
+    for (n = 0; (n % 256) || (loop_clock_ns() < check->deadline); ++n) {
+        uint32_t direction = (uint32_t) (n % kLoopStatDirections);
+        uint64_t latency = nextRandom(&state) % 10000000;
+        uint64_t bytes = (direction < kLoopIODirection_Flush) ? 4096 : 0;
+    
+        loop_stats_record(&check->stats, shard, direction, bytes, latency);
+    
+        recorded[direction].ops++;
+        recorded[direction].bytes += bytes;
+        recorded[direction].mean += latency;
+        if (latency > recorded[direction].max) {
+            recorded[direction].max = latency;
+        }
+    }
+    
+    return NULL;
+}
+
+
+static void checkStats(const struct CheckOptions* options)
+{
+    static struct StatsCheck check;
+    struct StatsThread threads[kCheckMaxThreads];
+    struct LoopStatSummary summary;
+    unsigned nthreads = (options->threads < kCheckMaxThreads) ? options->threads : kCheckMaxThreads;
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    uint64_t value;
+    unsigned i, j;
+    
+    // Every small value, both sides of every power of two and random values at every scale
+    for (value = 0; value < 65536; ++value) {
+        statsCheckValue(value);
+    }
+    
+    for (i = 1; i < 64; ++i) {
+        statsCheckValue((1ull << i) - 1);
+        statsCheckValue(1ull << i);
+        statsCheckValue((1ull << i) + 1);
+    }
+    
+    for (i = 0; i < 1000000; ++i) {
+        statsCheckValue(nextRandom(&state) >> (nextRandom(&state) % 64));
+    }
+    
+    for (i = 1; i < kLoopHistBuckets; ++i) {
+        if (loop_hist_bucket_max(i) <= loop_hist_bucket_max(i - 1)) {
+            DIE("Histogram bucket %u does not follow bucket %u\n", i, i - 1);
+        }
+    }
+    
+    // Latencies of 1 to 100000 usec, each once, spread over shards
+    loop_stats_init(&check.stats);
+    for (i = 1; i <= 100000; ++i) {
+        loop_stats_record(&check.stats, i, kLoopIODirection_Read, 512, i * 1000ull);
+    }
+    
+    loop_stats_summarize(&check.stats, kLoopIODirection_Read, &summary);
+    if ((summary.ops != 100000) || (summary.bytes != 512 * 100000ull) || (summary.max != 100000000) || (summary.mean != 50000500)) {
+        DIE("Uniform latencies summed up to %llu ops, %llu bytes, mean %llu, max %llu\n", (unsigned long long) summary.ops,
+            (unsigned long long) summary.bytes, (unsigned long long) summary.mean, (unsigned long long) summary.max);
+    }
+    
+    statsCheckPercentile("p50", summary.p50, 50000000);
+    statsCheckPercentile("p90", summary.p90, 90000000);
+    statsCheckPercentile("p99", summary.p99, 99000000);
+    statsCheckPercentile("p99.9", summary.p999, 99900000);
+    
+    loop_stats_summarize(&check.stats, kLoopIODirection_Write, &summary);
+    if (summary.ops || summary.max || summary.p50 || summary.p999) {
+        DIE("Direction without requests has a summary\n");
+    }
+    
+    // Threads with shards of their own, then all of them on one shard
+    for (check.shared = 0; check.shared < 2; ++check.shared) {
+        uint64_t records = 0;
+    
+        loop_stats_init(&check.stats);
+        memset(check.recorded, 0, sizeof(check.recorded));
+    
+        uint64_t start = loop_clock_ns();
+        double cpu = cpuTime();
+        check.deadline = start + (uint64_t) (options->seconds / 2 * 1e9);
+    
+        for (i = 0; i < nthreads; ++i) {
+            threads[i].check = &check;
+            threads[i].index = i;
+            if (pthread_create(&check.threads[i], NULL, statsThread, &threads[i])) {
+                DIE("Could not start stats check thread\n");
+            }
+        }
+    
+        for (i = 0; i < nthreads; ++i) {
+            pthread_join(check.threads[i], NULL);
+        }
+    
+        double elapsed = (loop_clock_ns() - start) / 1e9;
+    
+        for (j = 0; j < kLoopStatDirections; ++j) {
+            struct LoopStatSummary expected;
+            memset(&expected, 0, sizeof(expected));
+    
+            for (i = 0; i < nthreads; ++i) {
+                expected.ops += check.recorded[i][j].ops;
+                expected.bytes += check.recorded[i][j].bytes;
+                expected.mean += check.recorded[i][j].mean;
+                if (check.recorded[i][j].max > expected.max) {
+                    expected.max = check.recorded[i][j].max;
+                }
+            }
+    
+            loop_stats_summarize(&check.stats, j, &summary);
+            if ((summary.ops != expected.ops) || (summary.bytes != expected.bytes) || (summary.max != expected.max) ||
+                (summary.mean != (expected.ops ? expected.mean / expected.ops : 0)) || (summary.p999 > summary.max)) {
+                DIE("Direction %u summed up to %llu ops and %llu bytes, %llu and %llu were recorded\n", j,
+                    (unsigned long long) summary.ops, (unsigned long long) summary.bytes,
+                    (unsigned long long) expected.ops, (unsigned long long) expected.bytes);
+            }
+    
+            records += expected.ops;
+        }
+    
+        printf("%-8s %2u %-9s %14.0f  %llu records, %.1f cpu nsec per record\n", "stats", nthreads,
+               (check.shared ? "shared" : "sharded"), records / elapsed, (unsigned long long) records,
+               (cpuTime() - cpu) / records);
+    }
+}
+
+
+static const struct {
+    const char*             name;
+    void                    (*run)(const struct CheckOptions* options);
+} gChecks[] = {
+    { "ring",   checkRing },
+    { "pool",   checkPool },
+    { "tags",   checkTags },
+    { "merge",  checkMerge },
+    { "stats",  checkStats },
+};
+
+
+static void usage(void)
+{
+    unsigned i;
+    
+    printf("Usage: loopcheck [-d seconds] [-t threads] [-P] [-m usec] [-f trace] check...\n");
+    printf("    -d seconds  Run time per check, default %u\n", kCheckDefaultSeconds);
+    printf("    -t threads  Threads contending in checks that have them, default %u\n", kCheckDefaultThreads);
+    printf("    -P          Run ring peers in separate processes instead of threads\n");
+    printf("    -m usec     Merge window delay, default %u\n", kCheckDefaultMergeDelay);
+    printf("    -f trace    Replay trace recorded with -T through merge window too\n");
+    printf("Checks:");
+    for (i = 0; i < sizeof(gChecks) / sizeof(gChecks[0]); ++i) {
+        printf(" %s", gChecks[i].name);
+    }
+    printf("\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    struct CheckOptions options;
+    unsigned i;
+    int opt;
+    
+    memset(&options, 0, sizeof(options));
+    options.seconds = kCheckDefaultSeconds;
+    options.threads = kCheckDefaultThreads;
+    options.mergeDelay = kCheckDefaultMergeDelay;
+    
+    while (-1 != (opt = getopt(argc, argv, "d:t:Pm:f:"))) {
+        switch (opt) {
+        case 'd':
+            options.seconds = strtod(optarg, NULL);
+            if (options.seconds <= 0) {
+                DIE("Invalid run time\n");
+            }
+            break;
+    
+        case 't':
+            options.threads = (unsigned) strtoul(optarg, NULL, 10);
+            if (!options.threads) {
+                DIE("Invalid number of threads\n");
+            }
+            break;
+    
+        case 'P':
+            options.processes = 1;
+            break;
+    
+        case 'm':
+            options.mergeDelay = (unsigned) strtoul(optarg, NULL, 10);
+            if (!options.mergeDelay) {
+                DIE("Invalid merge delay\n");
+            }
+            break;
+    
+        case 'f':
+            options.traceFile = optarg;
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    if (optind == argc) {
+        usage();
+        DIE("Please specify checks to run\n");
+    }
+    
+    for (; optind < argc; ++optind) {
+        for (i = 0; i < sizeof(gChecks) / sizeof(gChecks[0]); ++i) {
+            if (!strcmp(argv[optind], gChecks[i].name)) {
+                break;
+            }
+        }
+    
+        if (i == sizeof(gChecks) / sizeof(gChecks[0])) {
+            usage();
+            DIE("Unknown check %s\n", argv[optind]);
+        }
+    
+        gChecks[i].run(&options);
+        fflush(stdout);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,427 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Serve simulated loop devices with the helper core
+//  loophelper [-r] [-p poolsize] [-t threads] [-q depth] [-e engine] [-S] [-D] [-b batch] [-w usec] [-c cache] [-B blocksize] [-k chunk] [-G writes] [-H] [-T trace] socket file...
+//
+//  Does what losetup does, only against loopsim listening on a unix socket instead of the kext, see simipc.h.
+//  Every file is attached over a connection of its own, like every kext device has a user client of its own.
+//  Runs anywhere the engines do, which makes it the thing to put under perf, valgrind or sanitizers.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "kext/loopctl.h"
+#include "helper.h"
+#include "engine.h"
+#include "clock.h"
+#include "simipc.h"
+
+
+enum {
+    kLoopStatsInterval      = 1,                // Seconds between helper statistics updates sent to driver
+};
+
+
+static volatile int gTerminate = 0;
+
+
+// Simulated device served by us
+struct SimDevice {
+    const char*             file;
+    int                     sock;
+    struct LoopHelper*      helper;
+    struct LoopSharedRings* rings;
+    uint64_t                ringsSize;
+    void*                   pool;
+    uint64_t                poolSize;
+    int                     mappedPool;     // Pool mapping is ours, devices sharing a pool use the first one
+    int                     terminated;
+};
+
+
+// Driver ioctls are posted without waiting, driver hangs up on us if it does not like them
+static void driverCtl(void* driver, uint64_t ctl, const void* data, size_t size)
+{
+    int sock = *(int*) driver;
+    int error = sim_send(sock, kSimMsg_Call, (uint32_t) ctl, 0, 0, data, size, -1);
+    if (error) {
+        DIE("Driver ioctl 0x%llx failed: %s\n", (unsigned long long) ctl, strerror(error));
+    }
+}
+
+
+// Synchronous call, IOConnectCallMethod with structure input
+static IOReturn driverCall(int sock, uint32_t ctl, const void* data, size_t size)
+{
+    struct SimMessage reply;
+    int error = sim_send(sock, kSimMsg_Call, ctl, 0, 0, data, size, -1);
+    if (!error) {
+        error = sim_recv(sock, &reply, NULL, NULL);
+    }
+    
+    if (error) {
+        DIE("Driver call 0x%x failed: %s\n", ctl, strerror(error));
+    }
+    
+    if (reply.type != kSimMsg_Reply) {
+        DIE("Unexpected driver message %u while waiting for reply\n", reply.type);
+    }
+    
+    return reply.result;
+}
+
+
+// IOConnectMapMemory64 stand-in
+static void* mapMemory(int sock, uint32_t type, uint64_t* size)
+{
+    struct SimMessage reply;
+    int fd = -1;
+    int error = sim_send(sock, kSimMsg_Map, type, 0, 0, NULL, 0, -1);
+    if (!error) {
+        error = sim_recv(sock, &reply, NULL, &fd);
+    }
+    
+    if (error) {
+        DIE("Driver memory map failed: %s\n", strerror(error));
+    }
+    
+    if ((reply.type != kSimMsg_Reply) || (reply.result != kIOReturnSuccess) || (fd < 0)) {
+        DIE("Failed mapping driver memory %u: 0x%x\n", type, reply.result);
+    }
+    
+    void* p = mmap(NULL, reply.arg, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        DIE("Could not map %llu bytes of driver memory: %s\n", (unsigned long long) reply.arg, strerror(errno));
+    }
+    
+    close(fd);
+    *size = reply.arg;
+    return p;
+}
+
+
+// Attach device for a file and start serving it
+// @param shared    Device whose pool mapping to use if pool is shared, NULL to map pool.
+static void attachDevice(struct SimDevice* device, const char* path, struct LoopAttachCtl* ctl, struct LoopHelperGroup* group,
+                         const struct LoopHelperOptions* options, const struct SimDevice* shared)
+{
+    uint64_t size;
+    if (0 != helper_device_size(device->file, &size)) {
+        DIE("Could not get size of file \"%s\"\n", device->file);
+    }
+    
+    uint64_t nblocks = size / options->blockSize;
+    if (size & (options->blockSize - 1)) {
+        fprintf(stderr, "Warning: file size %llu is not a multiple of the loop device block size. Will truncate down to %llu\n",
+                (unsigned long long) size, (unsigned long long) (nblocks * options->blockSize));
+    }
+    
+    
+    // Simulated driver plays both controller and the new device driver on every connection
+    device->sock = sim_connect(path);
+    if (device->sock < 0) {
+        DIE("Could not connect to simulated driver at %s: %s\n", path, strerror(errno));
+    }
+    
+    ctl->size = nblocks;
+    
+    IOReturn error = driverCall(device->sock, kLoopCTL_Attach, ctl, sizeof(*ctl));
+    if (error) {
+        DIE("Failed attaching new loop device for file %s: 0x%x\n", device->file, error);
+    }
+    
+    device->helper = helper_create(group, device->file, options, driverCtl, &device->sock);
+    
+    device->rings = (struct LoopSharedRings*) mapMemory(device->sock, kLoopDriverMemory_Rings, &device->ringsSize);
+    
+    // Mapping shared pool again would only cost address space and page tables
+    if (shared) {
+        device->pool = shared->pool;
+        device->poolSize = shared->poolSize;
+        device->mappedPool = 0;
+    } else {
+        device->pool = mapMemory(device->sock, kLoopDriverMemory_Pool, &device->poolSize);
+        device->mappedPool = 1;
+    }
+    
+    if (device->ringsSize < sizeof(struct LoopSharedRings)) {
+        DIE("Request rings mapping is too small: %llu\n", (unsigned long long) device->ringsSize);
+    }
+    
+    helper_set_memory(device->helper, device->rings, device->pool, device->poolSize);
+    device->terminated = 0;
+}
+
+
+// Handle one driver message
+// @return      0 once device terminated.
+static int handleMessage(struct SimDevice* device, uint8_t* data)
+{
+    struct SimMessage msg;
+    int err = sim_recv(device->sock, &msg, data, NULL);
+    if (err == ENOTCONN) {
+        printf("Driver went away\n");
+        return 0;
+    }
+    
+    if (err) {
+        DIE("Could not receive driver message: %s\n", strerror(err));
+    }
+    
+    if (msg.type != kSimMsg_Notify) {
+        DIE("Unexpected driver message %u\n", msg.type);
+    }
+    
+    if (msg.id == kLoopUserTerminateNotification) {
+        printf("Request loop terminated for file %s\n", device->file);
+        return 0;
+    }
+    
+    if (msg.id == kLoopUserRingNotification) {
+        // Submission ring doorbell
+        helper_drain_submissions(device->helper);
+    } else if ((msg.id == kLoopUserIONotification) && (msg.size == sizeof(struct UserIORequest))) {
+        // Request did not fit into submission ring and was sent inline
+        helper_submit(device->helper, (const struct UserIORequest*) data);
+    } else {
+        DIE("Invalid driver notification %u\n", msg.id);
+    }
+    
+    return 1;
+}
+
+
+static void sighandler(int signo)
+{
+    gTerminate = 1;
+}
+
+
+static void usage(void)
+{
+    printf("Usage: loophelper [-r] [-p poolsize] [-t threads] [-q depth] [-e engine] [-S] [-D] [-b batch] [-w usec] [-c cache] [-B blocksize] [-k chunk] [-G writes] [-H] [-T trace] socket file...\n");
+    printf("    -r          Attach read only\n");
+    printf("    -p size     Shared request buffer pool size in megabytes, one pool for all devices\n");
+    printf("    -t threads  Number of request worker threads shared by all devices, default %u\n", kLoopDefaultThreads);
+    printf("    -q depth    Max number of requests queued to engine per device, default %u\n", kLoopDefaultQueueDepth);
+    printf("    -e engine   Backing store engine: %s\n", engine_names());
+    printf("    -S          Use kernel submission polling if engine supports it\n");
+    printf("    -D          Direct io, keep backing file out of host page cache\n");
+    printf("    -b batch    Max completions handed to driver at once, 1 to %u, default %u\n", kLoopMaxCompleteBatch, kLoopDefaultCompleteBatch);
+    printf("    -w usec     Max time a completion waits for its batch to fill up, default %u\n", kLoopDefaultCompleteDelay);
+    printf("    -c cache    Write-back cache dirty limit in megabytes, default 0 (no cache)\n");
+    printf("    -B size     Device logical block size in bytes, power of two from %u to %u, default %u\n", kLoopMinBlockSize, kLoopMaxBlockSize, kLoopBlockSize);
+    printf("    -k chunk    Split larger requests into chunks of this many kilobytes running in parallel, default %u, 0 disables\n", kLoopDefaultChunkSize / 1024);
+    printf("    -G writes   Most FUA writes sharing one backing store flush, default 0 (no limit), 1 disables group commit\n");
+    printf("    -H          Read backing file holes too instead of zero filling them from its extent map\n");
+    printf("    -T trace    Record completed requests into a binary trace file, see loopreplay\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    int opt;
+    struct LoopAttachCtl ctl;
+    struct LoopHelperOptions options;
+    
+    memset(&ctl, 0, sizeof(ctl));
+    helper_default_options(&options);
+    options.quiet = 1;
+    
+    while (-1 != (opt = getopt(argc, argv, "rp:t:q:e:SDb:w:c:B:k:G:HT:"))) {
+        switch (opt) {
+        case 'r':
+            options.readonly = 1;
+            break;
+    
+        case 'p':
+            ctl.poolsize = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+    
+        case 't':
+            options.nthreads = (unsigned) strtoul(optarg, NULL, 10);
+            if (!options.nthreads) {
+                DIE("Invalid number of threads\n");
+            }
+            break;
+    
+        case 'q':
+            options.depth = (unsigned) strtoul(optarg, NULL, 10);
+            if (!options.depth) {
+                DIE("Invalid queue depth\n");
+            }
+            break;
+    
+        case 'e':
+            options.engine = optarg;
+            break;
+    
+        case 'S':
+            options.engineFlags |= kLoopEngineFlag_SQPoll;
+            break;
+    
+        case 'D':
+            options.engineFlags |= kLoopEngineFlag_Direct;
+            break;
+    
+        case 'b':
+            options.batchSize = (unsigned) strtoul(optarg, NULL, 10);
+            if (!options.batchSize || (options.batchSize > kLoopMaxCompleteBatch)) {
+                DIE("Invalid completion batch size\n");
+            }
+            break;
+    
+        case 'w':
+            options.batchDelay = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+    
+        case 'c':
+            options.cacheSize = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+    
+        case 'B':
+            options.blockSize = (uint32_t) strtoul(optarg, NULL, 10);
+            if (!loop_block_size_valid(options.blockSize)) {
+                DIE("Invalid block size, must be a power of two from %u to %u\n", kLoopMinBlockSize, kLoopMaxBlockSize);
+            }
+            break;
+    
+        case 'k':
+            options.chunkSize = strtoull(optarg, NULL, 10) * 1024;
+            break;
+    
+        case 'G':
+            options.commitGroup = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+    
+        case 'H':
+            options.sparse = 0;
+            break;
+    
+        case 'T':
+            options.traceFile = optarg;
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    if (options.chunkSize % options.blockSize) {
+        DIE("Chunk size must be a multiple of block size\n");
+    }
+    
+    if (argc - optind < 2) {
+        usage();
+        DIE("Please specify socket and file names\n");
+    }
+    
+    const char* path = argv[optind];
+    unsigned count = (unsigned) (argc - optind - 1);
+    
+    struct SimDevice* devices = (struct SimDevice*) calloc(count, sizeof(struct SimDevice));
+    struct pollfd* pfds = (struct pollfd*) calloc(count, sizeof(struct pollfd));
+    if (!devices || !pfds) {
+        DIE("Could not allocate devices\n");
+    }
+    
+    ctl.readonly = options.readonly;
+    ctl.pid = getpid();
+    ctl.blocksize = options.blockSize;
+    ctl.writecache = options.readonly ? 0 : options.cacheSize;
+    ctl.sharedpool = (count > 1);
+    
+    // Devices share worker threads and completion flusher
+    struct LoopHelperGroup* group = helper_group_create(&options, count);
+    unsigned i;
+    
+    for (i = 0; i < count; ++i) {
+        devices[i].file = argv[optind + 1 + i];
+        attachDevice(&devices[i], path, &ctl, group, &options, ((i && ctl.sharedpool) ? &devices[0] : NULL));
+    }
+    
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+    signal(SIGPIPE, SIG_IGN);
+    
+    
+    // Request loop, what CFRunLoop does for losetup
+    uint64_t nextStats = loop_clock_ns() + kLoopStatsInterval * 1000000000ull;
+    unsigned running = count;
+    static uint8_t data[kSimMaxData];
+    
+    while (!gTerminate && running) {
+        uint64_t now = loop_clock_ns();
+        if (now >= nextStats) {
+            for (i = 0; i < count; ++i) {
+                if (!devices[i].terminated) {
+                    struct LoopHelperStatsCtl stats;
+                    helper_get_stats(devices[i].helper, &stats);
+                    driverCtl(&devices[i].sock, kLoopDriverCTL_Stats, &stats, sizeof(stats));
+                }
+            }
+    
+            nextStats = now + kLoopStatsInterval * 1000000000ull;
+            continue;
+        }
+    
+        // Terminated devices stay in the set with a negative fd, poll skips them
+        for (i = 0; i < count; ++i) {
+            pfds[i].fd = devices[i].terminated ? -1 : devices[i].sock;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+    
+        int rc = poll(pfds, count, (int) ((nextStats - now) / 1000000 + 1));
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DIE("poll failed: %s\n", strerror(errno));
+        }
+    
+        for (i = 0; (rc > 0) && (i < count); ++i) {
+            if (!pfds[i].revents) {
+                continue;
+            }
+    
+            rc--;
+            if (!handleMessage(&devices[i], data)) {
+                devices[i].terminated = 1;
+                running--;
+            }
+        }
+    }
+    
+    
+    // Clean up resources after request loop terminated
+    for (i = 0; i < count; ++i) {
+        helper_destroy(devices[i].helper);
+    
+        if (devices[i].mappedPool) {
+            munmap(devices[i].pool, devices[i].poolSize);
+        }
+        munmap(devices[i].rings, devices[i].ringsSize);
+        close(devices[i].sock);
+    }
+    
+    helper_group_destroy(group);
+    
+    free(pfds);
+    free(devices);
+    
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,583 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Create and inspect copy-on-write overlay, compressed and deduplicated images
+//  loopimg create [-c cluster] [-s size] base overlay
+//  loopimg pack [-c chunk] file image
+//  loopimg store [-c chunk] -s size store
+//  loopimg dedup [-s size] store image [file]
+//  loopimg drop image
+//  loopimg info image
+//  loopimg export [-e engine] image file
+//
+//  Overlay images attach like raw files with losetup, see overlay.h. Creating one only writes its header and
+//  makes room for its first level table, whatever the base image size. Packed images, see packed.h, attach
+//  read only. Deduplicated images, see dedup.h, live on a chunk store; dedup creates one, importing a raw
+//  file into it if given one, and drop gives its chunks back to the store before removing it. Export writes
+//  the device an image makes into a new raw file, reading it through the same engine stack helper does.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "engine.h"
+#include "overlay.h"
+#include "packed.h"
+#include "dedup.h"
+
+
+#define DIE(msg, args...) { fprintf(stderr, msg, ## args); exit(EXIT_FAILURE); }
+
+
+enum {
+    kImgExportChunk         = 1024 * 1024,  // Export read size
+    kImgBufferAlign         = 4096,
+    kImgDecoders            = 4,            // Export decoder threads
+};
+
+
+static void usage(void)
+{
+    printf("Usage: loopimg create [-c cluster] [-s size] base overlay\n");
+    printf("       loopimg pack [-c chunk] file image\n");
+    printf("       loopimg store [-c chunk] -s size store\n");
+    printf("       loopimg dedup [-s size] store image [file]\n");
+    printf("       loopimg drop image\n");
+    printf("       loopimg info image\n");
+    printf("       loopimg export [-e engine] image file\n");
+    printf("    -c cluster  Cluster size in kilobytes, power of two from %u to %u, default %u\n",
+           1 << (kLoopOverlayMinClusterBits - 10), 1 << (kLoopOverlayMaxClusterBits - 10), 1 << (kLoopOverlayDefaultClusterBits - 10));
+    printf("    -c chunk    Packed image or store chunk size in kilobytes, power of two from %u to %u, default %u\n",
+           1 << (kLoopPackedMinChunkBits - 10), 1 << (kLoopPackedMaxChunkBits - 10), 1 << (kLoopPackedDefaultChunkBits - 10));
+    printf("    -s size     Device size in megabytes, default base image or imported file size,\n");
+    printf("                or store capacity in megabytes of distinct chunks\n");
+    printf("    -e engine   Overlay image engine: %s\n", engine_names());
+}
+
+
+// Directory part of path, resolved
+static int directory(const char* file, char* dir)
+{
+    char buffer[PATH_MAX];
+    const char* slash = strrchr(file, '/');
+    
+    snprintf(buffer, sizeof(buffer), "%.*s", slash ? (int) (slash - file) + 1 : 1, slash ? file : ".");
+    return realpath(buffer, dir) ? 0 : errno;
+}
+
+
+// Header keeps base path relative to overlay, base next to it is stored by name so both can move together
+static const char* basePath(const char* base, const char* file, char* path)
+{
+    char baseDir[PATH_MAX];
+    char fileDir[PATH_MAX];
+    
+    if ((base[0] == '/') || directory(base, baseDir) || directory(file, fileDir)) {
+        return base;
+    }
+    
+    if (!strcmp(baseDir, fileDir)) {
+        const char* slash = strrchr(base, '/');
+        return slash ? slash + 1 : base;
+    }
+    
+    return realpath(base, path) ? path : base;
+}
+
+
+// Size in kilobytes as log2 of bytes
+static uint32_t sizeBits(const char* arg, uint32_t minBits, uint32_t maxBits)
+{
+    unsigned long kb = strtoul(arg, NULL, 10);
+    uint32_t bits;
+    
+    for (bits = minBits; bits <= maxBits; ++bits) {
+        if (((unsigned long) 1 << (bits - 10)) == kb) {
+            break;
+        }
+    }
+    
+    return bits;
+}
+
+
+static int createImage(int argc, char** argv)
+{
+    uint32_t clusterBits = kLoopOverlayDefaultClusterBits;
+    uint64_t size = 0;
+    int opt;
+    
+    while (-1 != (opt = getopt(argc, argv, "c:s:"))) {
+        switch (opt) {
+        case 'c':
+            clusterBits = sizeBits(optarg, kLoopOverlayMinClusterBits, kLoopOverlayMaxClusterBits);
+            if (clusterBits > kLoopOverlayMaxClusterBits) {
+                DIE("Invalid cluster size\n");
+            }
+            break;
+    
+        case 's':
+            size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            if (!size) {
+                DIE("Invalid device size\n");
+            }
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    if (argc - optind != 2) {
+        usage();
+        DIE("Please specify base image and overlay file names\n");
+    }
+    
+    const char* base = argv[optind];
+    const char* file = argv[optind + 1];
+    char path[PATH_MAX];
+    
+    int error = overlay_create(file, basePath(base, file, path), size, clusterBits);
+    if (error) {
+        DIE("Could not create overlay \"%s\" of \"%s\": %s\n", file, base, strerror(error));
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+
+static int packImage(int argc, char** argv)
+{
+    uint32_t chunkBits = kLoopPackedDefaultChunkBits;
+    struct LoopPackedInfo info;
+    int opt;
+    
+    while (-1 != (opt = getopt(argc, argv, "c:"))) {
+        switch (opt) {
+        case 'c':
+            chunkBits = sizeBits(optarg, kLoopPackedMinChunkBits, kLoopPackedMaxChunkBits);
+            if (chunkBits > kLoopPackedMaxChunkBits) {
+                DIE("Invalid chunk size\n");
+            }
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    if (argc - optind != 2) {
+        usage();
+        DIE("Please specify raw and packed file names\n");
+    }
+    
+    const char* raw = argv[optind];
+    const char* file = argv[optind + 1];
+    
+    int error = packed_create(file, raw, chunkBits);
+    if (!error) {
+        int found = packed_probe(file, &info);
+        error = (found == 1) ? 0 : (found < 0) ? errno : EINVAL;
+    }
+    if (error) {
+        DIE("Could not pack \"%s\" into \"%s\": %s\n", raw, file, strerror(error));
+    }
+    
+    printf("Packed %llu bytes into %llu, %.1f%%\n", (unsigned long long) info.size, (unsigned long long) info.fileSize,
+           100.0 * info.fileSize / info.size);
+    return EXIT_SUCCESS;
+}
+
+
+// Run io through an image engine stack, dying on failure
+static void imageIO(struct LoopEngine* engine, uint32_t op, void* buffer, uint64_t nbytes, uint64_t offset)
+{
+    struct LoopEngineIO io;
+    
+    memset(&io, 0, sizeof(io));
+    io.op       = op;
+    io.buffer   = buffer;
+    io.nbytes   = nbytes;
+    io.offset   = offset;
+    
+    int error = engine_rw(engine, &io);
+    if (error) {
+        DIE("Image io failed at offset %llu: %s\n", (unsigned long long) offset, strerror(error));
+    }
+}
+
+
+static int createStore(int argc, char** argv)
+{
+    uint32_t chunkBits = kLoopDedupDefaultChunkBits;
+    uint64_t size = 0;
+    int opt;
+    
+    while (-1 != (opt = getopt(argc, argv, "c:s:"))) {
+        switch (opt) {
+        case 'c':
+            chunkBits = sizeBits(optarg, kLoopDedupMinChunkBits, kLoopDedupMaxChunkBits);
+            if (chunkBits > kLoopDedupMaxChunkBits) {
+                DIE("Invalid chunk size\n");
+            }
+            break;
+    
+        case 's':
+            size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    if (argc - optind != 1) {
+        usage();
+        DIE("Please specify store file name\n");
+    }
+    
+    uint64_t nslots = size >> chunkBits;
+    if (!nslots || (nslots > kLoopDedupMaxSlots)) {
+        DIE("Invalid store size, it takes 1 to %u chunks\n", kLoopDedupMaxSlots);
+    }
+    
+    const char* file = argv[optind];
+    
+    int error = dedup_store_create(file, chunkBits, (uint32_t) nslots);
+    if (error) {
+        DIE("Could not create chunk store \"%s\": %s\n", file, strerror(error));
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+
+static int createDedup(int argc, char** argv)
+{
+    uint64_t size = 0;
+    uint8_t* buffer;
+    struct stat st;
+    int opt;
+    
+    while (-1 != (opt = getopt(argc, argv, "s:"))) {
+        switch (opt) {
+        case 's':
+            size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            if (!size) {
+                DIE("Invalid device size\n");
+            }
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    if ((argc - optind != 2) && (argc - optind != 3)) {
+        usage();
+        DIE("Please specify store and image file names\n");
+    }
+    
+    const char* store = argv[optind];
+    const char* file = argv[optind + 1];
+    const char* raw = (argc - optind == 3) ? argv[optind + 2] : NULL;
+    char path[PATH_MAX];
+    int fd = -1;
+    
+    if (raw) {
+        fd = open(raw, O_RDONLY);
+        if ((fd < 0) || (0 != fstat(fd, &st))) {
+            DIE("Could not open \"%s\": %s\n", raw, strerror(errno));
+        }
+    
+        size = size ? size : (uint64_t) st.st_size;
+    }
+    
+    if (!size) {
+        usage();
+        DIE("Please specify device size or file to import\n");
+    }
+    
+    int error = dedup_create(file, basePath(store, file, path), size);
+    if (error) {
+        DIE("Could not create deduplicated image \"%s\" on \"%s\": %s\n", file, store, strerror(error));
+    }
+    
+    if (!raw) {
+        return EXIT_SUCCESS;
+    }
+    
+    struct LoopEngine* lower = engine_open(NULL, file, 0, 1, 1);
+    struct LoopEngine* engine = lower ? dedup_open(lower, NULL, 1) : NULL;
+    if (!engine) {
+        DIE("Could not open deduplicated image \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    if (posix_memalign((void**) &buffer, kImgBufferAlign, kImgExportChunk)) {
+        DIE("Could not allocate import buffer\n");
+    }
+    
+    // Past the end of a shorter file device stays zero
+    uint64_t offset;
+    uint64_t end = ((uint64_t) st.st_size < size) ? (uint64_t) st.st_size : size;
+    for (offset = 0; offset < end; offset += kImgExportChunk) {
+        uint64_t nbytes = (end - offset < kImgExportChunk) ? end - offset : kImgExportChunk;
+    
+        error = engine_pread(fd, buffer, nbytes, offset);
+        if (error) {
+            DIE("Could not read \"%s\" at offset %llu: %s\n", raw, (unsigned long long) offset, strerror(error));
+        }
+    
+        imageIO(engine, kLoopEngineOp_Write, buffer, nbytes, offset);
+    }
+    
+    imageIO(engine, kLoopEngineOp_Flush, NULL, 0, 0);
+    
+    free(buffer);
+    close(fd);
+    engine_close(engine);
+    return EXIT_SUCCESS;
+}
+
+
+// Discarding the whole device drops every reference image holds
+static int dropDedup(int argc, char** argv)
+{
+    if (argc - optind != 1) {
+        usage();
+        DIE("Please specify image file name\n");
+    }
+    
+    const char* file = argv[optind];
+    
+    int found = dedup_probe(file, NULL);
+    if (found <= 0) {
+        DIE("\"%s\" is not a deduplicated image: %s\n", file, (found < 0) ? strerror(errno) : "no image header");
+    }
+    
+    struct LoopEngine* lower = engine_open(NULL, file, 0, 1, 1);
+    struct LoopEngine* engine = lower ? dedup_open(lower, NULL, 1) : NULL;
+    if (!engine) {
+        DIE("Could not open deduplicated image \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    imageIO(engine, kLoopEngineOp_Discard, NULL, engine->size, 0);
+    imageIO(engine, kLoopEngineOp_Flush, NULL, 0, 0);
+    engine_close(engine);
+    
+    if (0 != unlink(file)) {
+        DIE("Could not remove \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+
+static int printDedupInfo(const char* file)
+{
+    struct LoopDedupStoreInfo storeInfo;
+    struct LoopDedupInfo info;
+    
+    int found = dedup_probe(file, &info);
+    if (found > 0) {
+        printf("store: %s\n", info.store);
+        printf("size: %llu\n", (unsigned long long) info.size);
+        printf("chunk: %u\n", info.chunkSize);
+        return EXIT_SUCCESS;
+    }
+    
+    found = (found < 0) ? found : dedup_store_probe(file, &storeInfo);
+    if (found <= 0) {
+        DIE("\"%s\" is not an image or chunk store: %s\n", file, (found < 0) ? strerror(errno) : "no image header");
+    }
+    
+    printf("chunk: %u\n", storeInfo.chunkSize);
+    printf("slots: %u\n", storeInfo.nslots);
+    printf("used: %u\n", storeInfo.used);
+    printf("references: %llu\n", (unsigned long long) storeInfo.references);
+    printf("ratio: %.2f\n", storeInfo.used ? (double) storeInfo.references / storeInfo.used : 0.0);
+    return EXIT_SUCCESS;
+}
+
+
+static int printPackedInfo(const char* file)
+{
+    struct LoopPackedInfo info;
+    
+    int found = packed_probe(file, &info);
+    if (found < 0) {
+        DIE("Could not read \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    if (!found) {
+        return printDedupInfo(file);
+    }
+    
+    printf("size: %llu\n", (unsigned long long) info.size);
+    printf("chunk: %u\n", info.chunkSize);
+    printf("chunks: %llu\n", (unsigned long long) info.nchunks);
+    printf("packed: %llu\n", (unsigned long long) info.fileSize);
+    return EXIT_SUCCESS;
+}
+
+
+static int printInfo(int argc, char** argv)
+{
+    struct LoopOverlayInfo info;
+    uint64_t allocated;
+    uint64_t zeroed;
+    
+    if (argc - optind != 1) {
+        usage();
+        DIE("Please specify image file name\n");
+    }
+    
+    const char* file = argv[optind];
+    
+    int found = overlay_probe(file, &info);
+    if (found < 0) {
+        DIE("Could not read \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    if (!found) {
+        return printPackedInfo(file);
+    }
+    
+    int error = overlay_usage(file, &allocated, &zeroed);
+    if (error) {
+        DIE("Could not read overlay tables of \"%s\": %s\n", file, strerror(error));
+    }
+    
+    printf("base: %s\n", info.base);
+    printf("size: %llu\n", (unsigned long long) info.size);
+    printf("cluster: %u\n", info.clusterSize);
+    printf("allocated: %llu\n", (unsigned long long) allocated);
+    printf("zeroed: %llu\n", (unsigned long long) zeroed);
+    return EXIT_SUCCESS;
+}
+
+
+static int exportImage(int argc, char** argv)
+{
+    const char* name = NULL;
+    uint8_t* buffer;
+    int opt;
+    
+    while (-1 != (opt = getopt(argc, argv, "e:"))) {
+        switch (opt) {
+        case 'e':
+            name = optarg;
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    if (argc - optind != 2) {
+        usage();
+        DIE("Please specify image and raw file names\n");
+    }
+    
+    const char* file = argv[optind];
+    const char* raw = argv[optind + 1];
+    
+    int overlay = overlay_probe(file, NULL);
+    int packed = overlay ? 0 : packed_probe(file, NULL);
+    int dedup = (overlay || packed) ? 0 : dedup_probe(file, NULL);
+    if ((overlay < 0) || (packed < 0) || (dedup < 0)) {
+        DIE("Could not read \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    if (!overlay && !packed && !dedup) {
+        DIE("\"%s\" is not an overlay, packed or deduplicated image\n", file);
+    }
+    
+    struct LoopEngine* lower = engine_open(name, file, kLoopEngineFlag_ReadOnly, 1, 1);
+    if (!lower) {
+        DIE("Could not open \"%s\" with %s engine: %s\n", file, (name ? name : "default"), strerror(errno));
+    }
+    
+    // Whole export buffer worth of chunks is decompressed at once
+    struct LoopEngine* engine = overlay ? overlay_open(lower, NULL, 1) :
+                                packed ? packed_open(lower, NULL, kImgDecoders, 1) : dedup_open(lower, NULL, 1);
+    if (!engine) {
+        DIE("Could not open image \"%s\": %s\n", file, strerror(errno));
+    }
+    
+    int fd = open(raw, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        DIE("Could not create \"%s\": %s\n", raw, strerror(errno));
+    }
+    
+    if (posix_memalign((void**) &buffer, kImgBufferAlign, kImgExportChunk)) {
+        DIE("Could not allocate export buffer\n");
+    }
+    
+    uint64_t offset;
+    for (offset = 0; offset < engine->size; offset += kImgExportChunk) {
+        struct LoopEngineIO io;
+        memset(&io, 0, sizeof(io));
+        io.op       = kLoopEngineOp_Read;
+        io.buffer   = buffer;
+        io.nbytes   = (engine->size - offset < kImgExportChunk) ? engine->size - offset : kImgExportChunk;
+        io.offset   = offset;
+    
+        int error = engine_rw(engine, &io);
+        if (!error) {
+            error = engine_pwrite(fd, buffer, io.nbytes, offset);
+        }
+        if (error) {
+            DIE("Export failed at offset %llu: %s\n", (unsigned long long) offset, strerror(error));
+        }
+    }
+    
+    free(buffer);
+    close(fd);
+    engine_close(engine);
+    return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        usage();
+        DIE("Please specify command\n");
+    }
+    
+    // Options follow the command
+    optind = 2;
+    
+    if (!strcmp(argv[1], "create")) {
+        return createImage(argc, argv);
+    } else if (!strcmp(argv[1], "pack")) {
+        return packImage(argc, argv);
+    } else if (!strcmp(argv[1], "store")) {
+        return createStore(argc, argv);
+    } else if (!strcmp(argv[1], "dedup")) {
+        return createDedup(argc, argv);
+    } else if (!strcmp(argv[1], "drop")) {
+        return dropDedup(argc, argv);
+    } else if (!strcmp(argv[1], "info")) {
+        return printInfo(argc, argv);
+    } else if (!strcmp(argv[1], "export")) {
+        return exportImage(argc, argv);
+    }
+    
+    usage();
+    DIE("Invalid command %s\n", argv[1]);
+}
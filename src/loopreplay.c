@@ -0,0 +1,369 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Replay request trace recorded with losetup -T against a backing file
+//  loopreplay [-e engine] [-t threads] [-q depth] [-f] [-r] trace file
+//
+//  Requests are issued at their original times relative to trace start, or back to back with -f.
+//  Either way no more than queue depth requests are in flight, a request that is due while queue is full waits.
+//  Writes put junk into the file, use -r to replay reads only or point it at a scratch copy.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "kext/loopstats.h"
+#include "engine.h"
+#include "clock.h"
+#include "trace.h"
+
+
+#define DIE(msg, args...) { fprintf(stderr, msg, ## args); exit(EXIT_FAILURE); }
+
+
+enum {
+    kReplayDefaultThreads   = 4,            // Default number of engine worker threads
+    kReplayDefaultDepth     = 32,           // Default max requests in flight
+    kReplayBufferAlign      = 4096,         // Request buffer alignment
+};
+
+
+struct ReplayContext;
+
+// Request slot, one per allowed request in flight
+struct ReplaySlot {
+    struct LoopEngineIO     io;
+    struct ReplayContext*   context;
+    uint64_t                start;          // Issue time
+    uint32_t                index;          // Slot number, spreads stats over shards
+    struct ReplaySlot*      next;           // Free list link
+};
+
+
+struct ReplayContext {
+    struct LoopEngine*      engine;
+    pthread_mutex_t         lock;           // Protects free list
+    pthread_cond_t          freeCond;       // Signaled when a slot is returned
+    struct ReplaySlot*      freeList;
+    unsigned                nfree;
+    struct LoopStats        replayed;       // Latency of replayed requests
+    volatile uint64_t       errors;         // Replayed requests that failed
+};
+
+
+static struct LoopTraceRecord* readTrace(const char* path, uint64_t* count)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        DIE("Could not open trace %s: %s\n", path, strerror(errno));
+    }
+    
+    struct LoopTraceHeader header;
+    if (1 != fread(&header, sizeof(header), 1, file)) {
+        DIE("Could not read trace header\n");
+    }
+    
+    if ((header.magic != kLoopTraceMagic) || (header.version != kLoopTraceVersion) || (header.recordSize != sizeof(struct LoopTraceRecord))) {
+        DIE("%s is not a supported trace file\n", path);
+    }
+    
+    if (fseek(file, 0, SEEK_END)) {
+        DIE("Could not seek in trace: %s\n", strerror(errno));
+    }
+    
+    long size = ftell(file);
+    *count = (uint64_t) (size - (long) sizeof(header)) / sizeof(struct LoopTraceRecord);
+    fseek(file, sizeof(header), SEEK_SET);
+    
+    struct LoopTraceRecord* records = (struct LoopTraceRecord*) malloc((*count ? *count : 1) * sizeof(*records));
+    if (!records) {
+        DIE("Could not allocate %llu trace records\n", (unsigned long long) *count);
+    }
+    
+    if (*count != fread(records, sizeof(*records), *count, file)) {
+        DIE("Could not read trace records\n");
+    }
+    
+    fclose(file);
+    return records;
+}
+
+
+// Trace is written in completion order, replay goes in submit order
+static int compareRecords(const void* a, const void* b)
+{
+    uint64_t ta = ((const struct LoopTraceRecord*) a)->time;
+    uint64_t tb = ((const struct LoopTraceRecord*) b)->time;
+    return (ta < tb) ? -1 : (ta > tb);
+}
+
+
+// Called by engine once replayed request completes, on any thread
+static void replayDone(struct LoopEngineIO* io)
+{
+    struct ReplaySlot* slot = (struct ReplaySlot*) io->priv;
+    struct ReplayContext* context = slot->context;
+    uint64_t now = loop_clock_ns();
+    
+    if (io->error) {
+        __sync_fetch_and_add(&context->errors, 1);
+    }
+    
+    loop_stats_record(&context->replayed, slot->index, io->op, (io->error ? 0 : io->nbytes), now - slot->start);
+    
+    pthread_mutex_lock(&context->lock);
+    slot->next = context->freeList;
+    context->freeList = slot;
+    context->nfree++;
+    pthread_cond_signal(&context->freeCond);
+    pthread_mutex_unlock(&context->lock);
+}
+
+
+static struct ReplaySlot* takeSlot(struct ReplayContext* context)
+{
+    pthread_mutex_lock(&context->lock);
+    while (!context->freeList) {
+        pthread_cond_wait(&context->freeCond, &context->lock);
+    }
+    
+    struct ReplaySlot* slot = context->freeList;
+    context->freeList = slot->next;
+    context->nfree--;
+    pthread_mutex_unlock(&context->lock);
+    
+    return slot;
+}
+
+
+static void sleepUntil(uint64_t deadline)
+{
+    uint64_t now;
+    
+    while ((now = loop_clock_ns()) < deadline) {
+        struct timespec ts;
+        ts.tv_sec = (time_t) ((deadline - now) / 1000000000ull);
+        ts.tv_nsec = (long) ((deadline - now) % 1000000000ull);
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+static void printStats(const char* title, const struct LoopStats* stats)
+{
+    static const char* const ops[] = { "read", "write", "flush", "discard" };
+    struct LoopStatSummary summary;
+    uint32_t i;
+    
+    for (i = 0; i < kLoopStatDirections; ++i) {
+        loop_stats_summarize(stats, i, &summary);
+        if (!summary.ops) {
+            continue;
+        }
+    
+        printf("%s %s: %llu requests, %llu bytes, latency usec mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+               title, ops[i], (unsigned long long) summary.ops, (unsigned long long) summary.bytes, summary.mean / 1000.0,
+               summary.p50 / 1000.0, summary.p90 / 1000.0, summary.p99 / 1000.0, summary.p999 / 1000.0, summary.max / 1000.0);
+    }
+}
+
+
+static void usage(void)
+{
+    printf("Usage: loopreplay [-e engine] [-t threads] [-q depth] [-f] [-r] trace file\n");
+    printf("    -e engine   Backing store engine: %s\n", engine_names());
+    printf("    -t threads  Number of engine worker threads, default %u\n", kReplayDefaultThreads);
+    printf("    -q depth    Max requests in flight, default %u\n", kReplayDefaultDepth);
+    printf("    -f          Issue requests as fast as possible instead of at their original times\n");
+    printf("    -r          Replay reads only, file is opened read only\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    const char* engineName = NULL;
+    unsigned nthreads = kReplayDefaultThreads;
+    unsigned depth = kReplayDefaultDepth;
+    int fast = 0;
+    int readonly = 0;
+    int opt;
+    uint64_t i;
+    
+    while (-1 != (opt = getopt(argc, argv, "e:t:q:fr"))) {
+        switch (opt) {
+        case 'e':
+            engineName = optarg;
+            break;
+    
+        case 't':
+            nthreads = (unsigned) strtoul(optarg, NULL, 10);
+            if (!nthreads) {
+                DIE("Invalid number of threads\n");
+            }
+            break;
+    
+        case 'q':
+            depth = (unsigned) strtoul(optarg, NULL, 10);
+            if (!depth) {
+                DIE("Invalid queue depth\n");
+            }
+            break;
+    
+        case 'f':
+            fast = 1;
+            break;
+    
+        case 'r':
+            readonly = 1;
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    if (argc - optind != 2) {
+        usage();
+        DIE("Please specify trace and file names\n");
+    }
+    
+    const char* traceFile = argv[optind];
+    const char* file = argv[optind + 1];
+    
+    
+    // Load trace and see what it takes to replay it
+    uint64_t count;
+    struct LoopTraceRecord* records = readTrace(traceFile, &count);
+    qsort(records, count, sizeof(*records), compareRecords);
+    
+    struct LoopStats* recorded = NULL;
+    struct ReplayContext* context = NULL;
+    if (posix_memalign((void**) &recorded, 64, sizeof(*recorded)) || posix_memalign((void**) &context, 64, sizeof(*context))) {
+        DIE("Could not allocate statistics\n");
+    }
+    
+    loop_stats_init(recorded);
+    
+    uint64_t maxBytes = kReplayBufferAlign;
+    for (i = 0; i < count; ++i) {
+        if (records[i].op > kLoopEngineOp_Discard) {
+            DIE("Trace record %llu has invalid op %u\n", (unsigned long long) i, records[i].op);
+        }
+    
+        // Flushes and discards carry no data
+        if ((records[i].op <= kLoopEngineOp_Write) && (records[i].nbytes > maxBytes)) {
+            maxBytes = records[i].nbytes;
+        }
+    
+        loop_stats_record(recorded, 0, records[i].op, (records[i].error ? 0 : records[i].nbytes), records[i].latency);
+    }
+    
+    
+    // Open backing file and request slots
+    struct LoopEngine* engine = engine_open(engineName, file, (readonly ? kLoopEngineFlag_ReadOnly : 0), nthreads, depth);
+    if (!engine) {
+        DIE("Could not open %s with %s engine: %s\n", file, (engineName ? engineName : "default"), strerror(errno));
+    }
+    
+    memset(context, 0, sizeof(*context));
+    context->engine = engine;
+    pthread_mutex_init(&context->lock, NULL);
+    pthread_cond_init(&context->freeCond, NULL);
+    loop_stats_init(&context->replayed);
+    
+    struct ReplaySlot* slots = (struct ReplaySlot*) calloc(depth, sizeof(*slots));
+    uint8_t* buffers = NULL;
+    maxBytes = (maxBytes + kReplayBufferAlign - 1) & ~((uint64_t) kReplayBufferAlign - 1);
+    if (!slots || posix_memalign((void**) &buffers, kReplayBufferAlign, depth * maxBytes)) {
+        DIE("Could not allocate %u request buffers of %llu bytes\n", depth, (unsigned long long) maxBytes);
+    }
+    
+    memset(buffers, 0xa5, depth * maxBytes);
+    engine_register_memory(engine, buffers, depth * maxBytes);
+    
+    for (i = 0; i < depth; ++i) {
+        slots[i].context = context;
+        slots[i].index = (uint32_t) i;
+        slots[i].io.buffer = buffers + i * maxBytes;
+        slots[i].next = context->freeList;
+        context->freeList = &slots[i];
+    }
+    context->nfree = depth;
+    
+    
+    // Replay
+    uint64_t skipped = 0;
+    uint64_t late = 0;
+    uint64_t start = loop_clock_ns();
+    
+    for (i = 0; i < count; ++i) {
+        const struct LoopTraceRecord* record = &records[i];
+    
+        if (readonly && (record->op != kLoopEngineOp_Read)) {
+            skipped++;
+            continue;
+        }
+    
+        struct ReplaySlot* slot = takeSlot(context);
+    
+        if (!fast) {
+            uint64_t due = start + record->time;
+            if (loop_clock_ns() > due + 1000000) {
+                late++;
+            }
+            sleepUntil(due);
+        }
+    
+        void* buffer = slot->io.buffer;
+        memset(&slot->io, 0, sizeof(slot->io));
+        slot->io.op     = record->op;
+        slot->io.buffer = buffer;
+        slot->io.nbytes = record->nbytes;
+        slot->io.offset = record->offset;
+        slot->io.done   = replayDone;
+        slot->io.priv   = slot;
+        slot->start     = loop_clock_ns();
+    
+        struct LoopEngineIO* io = &slot->io;
+        engine_submit(engine, &io, 1);
+    }
+    
+    pthread_mutex_lock(&context->lock);
+    while (context->nfree != depth) {
+        pthread_cond_wait(&context->freeCond, &context->lock);
+    }
+    pthread_mutex_unlock(&context->lock);
+    
+    uint64_t elapsed = loop_clock_ns() - start;
+    
+    
+    // Report
+    engine_close(engine);
+    
+    uint64_t replayed = count - skipped;
+    double seconds = elapsed / 1e9;
+    
+    printf("Replayed %llu of %llu requests in %.3f sec, %.0f requests/sec, %llu failed, %llu more than 1 msec late\n",
+           (unsigned long long) replayed, (unsigned long long) count, seconds, (seconds > 0 ? replayed / seconds : 0.0),
+           (unsigned long long) context->errors, (unsigned long long) late);
+    printStats("Recorded", recorded);
+    printStats("Replayed", &context->replayed);
+    
+    pthread_cond_destroy(&context->freeCond);
+    pthread_mutex_destroy(&context->lock);
+    free(buffers);
+    free(slots);
+    free(context);
+    free(recorded);
+    free(records);
+    
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Benchmark zero block scan kernels helper runs over write data
+//  loopscan [-s size] [-d seconds]
+//
+//  Every kernel this cpu can run scans a zero buffer, which it has to read through, and a buffer of junk,
+//  which it gives up on right away, over and over for the given time. Zero scan throughput is what
+//  zero fills cost helper, junk scan rate is what every other write costs it.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "zero.h"
+#include "clock.h"
+
+
+#define DIE(msg, args...) { fprintf(stderr, msg, ## args); exit(EXIT_FAILURE); }
+
+
+enum {
+    kScanDefaultSize    = 4096,         // Default buffer size, file system block helper scans writes in
+    kScanDefaultSeconds = 1,            // Default run time per kernel and buffer
+    kScanAlign          = 4096,
+};
+
+
+// @return      Scans per second
+static double runKernel(const struct LoopZeroKernel* kernel, const uint8_t* buffer, uint64_t size, int expected, double seconds)
+{
+    uint64_t deadline = loop_clock_ns() + (uint64_t) (seconds * 1e9);
+    uint64_t scans = 0;
+    uint64_t start = loop_clock_ns();
+    uint64_t now;
+    unsigned i;
+    
+    // Clock is read once per round, it costs more than scanning a small buffer
+    do {
+        for (i = 0; i < 1024; ++i) {
+            if (kernel->check(buffer, size) != expected) {
+                DIE("Kernel %s got buffer wrong\n", kernel->name);
+            }
+        }
+        scans += i;
+        now = loop_clock_ns();
+    } while (now < deadline);
+    
+    return scans / ((now - start) / 1e9);
+}
+
+
+static void usage(void)
+{
+    printf("Usage: loopscan [-s size] [-d seconds]\n");
+    printf("    -s size     Buffer size in bytes, default %u\n", kScanDefaultSize);
+    printf("    -d seconds  Run time per kernel and buffer, default %u\n", kScanDefaultSeconds);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint64_t size = kScanDefaultSize;
+    double seconds = kScanDefaultSeconds;
+    unsigned count;
+    unsigned i;
+    int opt;
+    
+    while (-1 != (opt = getopt(argc, argv, "s:d:"))) {
+        switch (opt) {
+        case 's':
+            size = strtoull(optarg, NULL, 10);
+            if (!size) {
+                DIE("Invalid buffer size\n");
+            }
+            break;
+    
+        case 'd':
+            seconds = strtod(optarg, NULL);
+            if (seconds <= 0) {
+                DIE("Invalid run time\n");
+            }
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    uint8_t* zeroes;
+    uint8_t* junk;
+    if (posix_memalign((void**) &zeroes, kScanAlign, size) || posix_memalign((void**) &junk, kScanAlign, size)) {
+        DIE("Could not allocate %llu byte buffers\n", (unsigned long long) size);
+    }
+    
+    memset(zeroes, 0, size);
+    for (i = 0; i < size; ++i) {
+        junk[i] = (uint8_t) (i * 131 + 7) | 1;
+    }
+    
+    const struct LoopZeroKernel* kernels = zero_kernels(&count);
+    
+    printf("%8s %12s %14s %14s\n", "kernel", "size", "zero_gbps", "junk_mscans");
+    
+    for (i = 0; i < count; ++i) {
+        double zeroRate = runKernel(&kernels[i], zeroes, size, 1, seconds);
+        double junkRate = runKernel(&kernels[i], junk, size, 0, seconds);
+    
+        printf("%8s %12llu %14.2f %14.2f\n", kernels[i].name, (unsigned long long) size, zeroRate * size / 1e9, junkRate / 1e6);
+    }
+    
+    free(zeroes);
+    free(junk);
+    return 0;
+}
@@ -0,0 +1,1029 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  User space stand-in for org_acme_LoopDriver
+//  loopsim [-p pattern] [-r readpct] [-s size] [-q depth] [-d seconds] [-n ops] [-F writes] [-u pct] [-z] [-V] [-K flushes] [-N devices] socket
+//
+//  Waits for loophelper to attach on a unix socket and then plays the kext for it over the loopctl.h protocol:
+//  validates LoopAttachCtl like the controller does, sets up shared rings and buffer pool like helperProcessAttached,
+//  creates requests from a synthetic workload like createRequest does for IOStorage callers and takes them back like
+//  completeRequest. Once the workload is done it sends terminate notification and waits for helper to detach.
+//  Transport is described in simipc.h.
+//
+//  With several devices every one of them gets a helper connection and runs the workload of its own at the same time.
+//  Devices attached with sharedpool by the same helper share one buffer pool, like controller hands out shared pools.
+//  Helper is the process on the other end of the connection, never the pid it puts into the attach request.
+//  Helper resident memory, thread count and open files are sampled before devices are terminated, which is what
+//  multi-device scaling is judged by, see loopscale.sh.
+//
+//  Write data is copied into pool buffers and read data out of them just as the driver bounces it, so the numbers
+//  include everything but the kernel. Writes put junk into the helper backing file, or zeroes with -z, discards punch
+//  holes in it.
+//
+//  With -V writes put a pattern derived from the device offset of every 8 byte word into the backing file instead and
+//  every read has to return that pattern. Pattern does not depend on request size or block size, so the device has to
+//  be filled with it first, by a sequential write pass of any size, then any workload can be verified against it.
+//
+//  With -K the helper is killed once the given number of cache flushes completed during a sequential verified write
+//  pass. Every flush covers the writes completed from the start of the device when it was issued, how many bytes the
+//  last completed flush covered is printed. A fresh helper has to read all of them back, see loopcrash.sh.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <dirent.h>
+
+#include "kext/loopctl.h"
+#include "kext/looptags.h"
+#include "kext/looppool.h"
+#include "clock.h"
+#include "simipc.h"
+
+
+#define DIE(msg, args...) { fprintf(stderr, msg, ## args); exit(EXIT_FAILURE); }
+
+
+enum {
+    kSimDefaultSize         = 4096,         // Default request size in bytes
+    kSimDefaultDepth        = 32,           // Default requests in flight
+    kSimDefaultSeconds      = 10,           // Default run time
+    kSimPageSize            = 4096,
+    kSimPoolWaitUsec        = 1000,         // Pool may be shared, frees by other devices do not wake us up
+};
+
+#define kSimVerifySeed      0x6c6f6f7076657269ull   // Mixed into verify pattern so that zeroes never pass
+
+
+// Request in flight, indexed by tag like LoopIO
+struct SimIO {
+    uint64_t                start;          // Creation time
+    uint64_t                offset;         // Device offset in bytes
+    uint64_t                covered;        // Flush: sequential writes done from the start when it was issued, in bytes
+    uint64_t                buffer;         // Pool offset
+    uint64_t                nbytes;
+    uint32_t                direction;
+};
+
+
+// Buffer pool, maybe shared by several devices
+struct SimPool {
+    int                     pid;            // Helper the pool belongs to
+    unsigned                users;          // Devices using the pool
+    uint8_t*                memory;
+    int                     fd;
+    uint64_t                size;
+    struct LoopPool         allocator;
+};
+
+
+// Synthetic workload every device runs
+struct SimWorkload {
+    int                     random;
+    unsigned                readPct;
+    uint64_t                size;           // Request size in bytes
+    unsigned                depth;          // Requests in flight per device
+    unsigned                seconds;
+    uint64_t                maxOps;         // Requests per device, 0 to run for seconds
+    uint64_t                flushEvery;     // Writes between cache flushes, 0 for no flushes
+    unsigned                discardPct;     // Percentage of writes sent as discards instead
+    int                     zeroes;         // Write zero blocks instead of junk
+    int                     verify;         // Write offset pattern and check that reads return it
+    uint64_t                killAfter;      // Kill helper once this many flushes completed, 0 never
+    const uint8_t*          writeData;      // Caller buffer writes are copied in from
+};
+
+
+struct SimDriver {
+    unsigned                index;          // Device number
+    int                     sock;
+    int                     pid;            // Helper process
+    uint32_t                blockSize;
+    uint64_t                nblocks;        // Device size
+    int                     readonly;
+
+    struct LoopSharedRings* rings;
+    int                     ringsFd;
+    struct SimPool*         pool;
+
+    struct LoopTagTable     tags;
+    struct SimIO            ios[kLoopRequestDepth];
+    uint8_t*                readData;       // Caller buffer reads are copied out to
+    const struct SimWorkload* workload;
+
+    pthread_mutex_t         submitLock;     // Serializes producers into submission ring
+    pthread_mutex_t         waitLock;       // Protects inflight and detached, wakes up request creator
+    pthread_cond_t          waitCond;
+    unsigned                inflight;
+    int                     detached;       // Helper hung up
+    pthread_t               reader;
+    pthread_t               creator;        // Runs workload
+
+    uint64_t                inlined;        // Requests sent inline because submission ring was full
+    uint64_t                doorbells;      // Submission doorbells rung
+    uint64_t                poolWaits;      // Requests that waited for pool memory
+    uint64_t                completeCalls;  // Completion ioctls and doorbells from helper
+    uint64_t                completions;
+    uint64_t                errors;         // Requests helper failed
+    uint64_t                invalid;        // Completions with stale or bogus handles
+    uint64_t                mismatches;     // Reads that did not return verify pattern
+    uint8_t*                written;        // Sequential writes done, by request index, when killing helper
+    uint64_t                writtenPrefix;  // Sequential writes done from the start, protected by waitLock
+    uint64_t                flushes;        // Flushes completed
+    uint64_t                flushed;        // Bytes from the start the last completed flush covered
+    int                     killed;         // Helper was killed after killAfter flushes, protected by waitLock
+    int                     haveHelperStats;
+    struct LoopHelperStatsCtl helperStats;  // Last statistics helper reported
+    struct LoopStats*       stats;          // Create to complete latency, shared by all devices
+    double                  elapsed;        // Workload run time
+    uint8_t                 data[kSimMaxData];  // Helper message payload
+};
+
+
+// Verify pattern of nbytes at device offset
+static void fillPattern(uint8_t* buffer, uint64_t offset, uint64_t nbytes)
+{
+    uint64_t* words = (uint64_t*) buffer;
+    uint64_t i;
+    
+    for (i = 0; i < nbytes / sizeof(uint64_t); ++i) {
+        words[i] = (offset + i * sizeof(uint64_t)) ^ kSimVerifySeed;
+    }
+}
+
+
+// @return      Device offset of the first word that does not match verify pattern or UINT64_MAX
+static uint64_t checkPattern(const uint8_t* buffer, uint64_t offset, uint64_t nbytes)
+{
+    const uint64_t* words = (const uint64_t*) buffer;
+    uint64_t i;
+    
+    for (i = 0; i < nbytes / sizeof(uint64_t); ++i) {
+        if (words[i] != ((offset + i * sizeof(uint64_t)) ^ kSimVerifySeed)) {
+            return offset + i * sizeof(uint64_t);
+        }
+    }
+    
+    return UINT64_MAX;
+}
+
+
+static void sendNotification(struct SimDriver* driver, uint32_t msgid, const struct UserIORequest* data)
+{
+    int error = sim_send(driver->sock, kSimMsg_Notify, msgid, 0, 0, data, (data ? sizeof(*data) : 0), -1);
+    if (!error || (msgid == kLoopUserTerminateNotification)) {
+        return;
+    }
+    
+    // Request posted just before we killed the helper, reader thread sees it detach
+    pthread_mutex_lock(&driver->waitLock);
+    int killed = driver->killed;
+    pthread_mutex_unlock(&driver->waitLock);
+    
+    if (!killed) {
+        DIE("Could not notify helper: %s\n", strerror(error));
+    }
+}
+
+
+static void postRequest(struct SimDriver* driver, const struct UserIORequest* request)
+{
+    uint32_t slot;
+    
+    pthread_mutex_lock(&driver->submitLock);
+    
+    if (loop_ring_produce_begin(&driver->rings->submitRing, kLoopRingDepth, &slot)) {
+        driver->rings->submitQueue[slot] = *request;
+        if (loop_ring_produce_commit(&driver->rings->submitRing)) {
+            driver->doorbells++;
+            sendNotification(driver, kLoopUserRingNotification, NULL);
+        }
+    } else {
+        driver->inlined++;
+        sendNotification(driver, kLoopUserIONotification, request);
+    }
+    
+    pthread_mutex_unlock(&driver->submitLock);
+}
+
+
+// Called on reader thread only
+static void completeRequest(struct SimDriver* driver, const struct UserIORequest* request)
+{
+    // Handle comes from another process, do not trust it
+    int32_t tag = loop_tags_lookup(&driver->tags, request->priv);
+    if (tag < 0) {
+        driver->invalid++;
+        return;
+    }
+    
+    struct SimIO* io = &driver->ios[tag];
+    uint64_t nbytes = io->nbytes;
+    
+    driver->completions++;
+    if (request->result != kIOReturnSuccess) {
+        driver->errors++;
+        nbytes = 0;
+    } else if (io->direction == kLoopIODirection_Read) {
+        memcpy(driver->readData, driver->pool->memory + io->buffer, io->nbytes);
+    
+        uint64_t bad = driver->workload->verify ? checkPattern(driver->readData, io->offset, io->nbytes) : UINT64_MAX;
+        if (bad != UINT64_MAX) {
+            if (!driver->mismatches) {
+                fprintf(stderr, "Device %u read of %llu bytes at %llu returned wrong data at %llu\n", driver->index,
+                        (unsigned long long) io->nbytes, (unsigned long long) io->offset, (unsigned long long) bad);
+            }
+            driver->mismatches++;
+        }
+    }
+    
+    loop_stats_record(driver->stats, driver->index, io->direction, nbytes, loop_clock_ns() - io->start);
+    
+    if ((io->direction != kLoopIODirection_Flush) && (io->direction != kLoopIODirection_Discard)) {
+        loop_pool_free(&driver->pool->allocator, io->buffer);
+    }
+    
+    // Flush makes durable whatever was done before it was issued, helper dies after the last one it is allowed
+    int last = 0;
+    if (driver->written && (request->result == kIOReturnSuccess) && (io->direction == kLoopIODirection_Flush)) {
+        driver->flushes++;
+        if (io->covered > driver->flushed) {
+            driver->flushed = io->covered;
+        }
+    
+        last = (driver->flushes == driver->workload->killAfter);
+    }
+    
+    uint64_t index = io->offset / driver->workload->size;
+    int written = driver->written && (request->result == kIOReturnSuccess) && (io->direction == kLoopIODirection_Write);
+    loop_tags_free(&driver->tags, (uint32_t) tag);
+    
+    pthread_mutex_lock(&driver->waitLock);
+    if (last) {
+        // Creator stops posting before helper is gone
+        driver->killed = 1;
+    }
+    
+    if (written) {
+        driver->written[index] = 1;
+        while ((driver->writtenPrefix < driver->nblocks * driver->blockSize / driver->workload->size) &&
+               driver->written[driver->writtenPrefix]) {
+            driver->writtenPrefix++;
+        }
+    }
+    
+    driver->inflight--;
+    pthread_cond_signal(&driver->waitCond);
+    pthread_mutex_unlock(&driver->waitLock);
+    
+    if (last) {
+        kill(driver->pid, SIGKILL);
+    }
+}
+
+
+static void drainCompletions(struct SimDriver* driver)
+{
+    struct LoopRing* ring = &driver->rings->completeRing;
+    loop_ring_consumer_busy(ring);
+    
+    do {
+        uint32_t slot;
+        int rc;
+    
+        while (0 < (rc = loop_ring_consume_begin(ring, kLoopRingDepth, &slot))) {
+            // Take a private copy, helper is free to scribble over the shared entry
+            struct UserIORequest request = driver->rings->completeQueue[slot];
+            loop_ring_consume_commit(ring);
+    
+            completeRequest(driver, &request);
+        }
+    
+        if (rc < 0) {
+            fprintf(stderr, "Completion ring indexes are corrupted\n");
+            break;
+        }
+    
+    } while (!loop_ring_consumer_idle(ring));
+}
+
+
+// clientMemoryForType, pool is shared memory of every device sharing it
+// @return      0 or errno.
+static int mapMemory(struct SimDriver* driver, uint32_t type)
+{
+    if (type == kLoopDriverMemory_Rings) {
+        return sim_send(driver->sock, kSimMsg_Reply, type, kIOReturnSuccess, sizeof(struct LoopSharedRings), NULL, 0, driver->ringsFd);
+    }
+    
+    if (type == kLoopDriverMemory_Pool) {
+        return sim_send(driver->sock, kSimMsg_Reply, type, kIOReturnSuccess, driver->pool->size, NULL, 0, driver->pool->fd);
+    }
+    
+    return sim_send(driver->sock, kSimMsg_Reply, type, kIOReturnBadArgument, 0, NULL, 0, -1);
+}
+
+
+// Driver client ioctls, what sIOCTL does
+static void* readerThread(void* arg)
+{
+    struct SimDriver* driver = (struct SimDriver*) arg;
+    uint8_t* data = driver->data;
+    struct SimMessage msg;
+    int error;
+    
+    while (0 == (error = sim_recv(driver->sock, &msg, data, NULL))) {
+        // Helper may map memory any time, it does not map a shared pool it has mapped for another device already
+        if (msg.type == kSimMsg_Map) {
+            error = mapMemory(driver, msg.id);
+            if (error) {
+                break;
+            }
+            continue;
+        }
+    
+        if (msg.type != kSimMsg_Call) {
+            fprintf(stderr, "Unexpected helper message %u\n", msg.type);
+            break;
+        }
+    
+        const struct UserIORequest* requests = (const struct UserIORequest*) data;
+        uint32_t count = msg.size / sizeof(*requests);
+        uint32_t i;
+    
+        switch (msg.id) {
+        case kLoopDriverCTL_Complete:
+        case kLoopDriverCTL_CompleteBatch:
+            if (!count || (msg.size % sizeof(*requests)) || (count > kLoopMaxCompleteBatch) ||
+                ((msg.id == kLoopDriverCTL_Complete) && (count != 1))) {
+                fprintf(stderr, "Invalid completion size %u\n", msg.size);
+                error = EINVAL;
+                break;
+            }
+    
+            driver->completeCalls++;
+            for (i = 0; i < count; ++i) {
+                completeRequest(driver, &requests[i]);
+            }
+            break;
+    
+        case kLoopDriverCTL_Doorbell:
+            driver->completeCalls++;
+            drainCompletions(driver);
+            break;
+    
+        case kLoopDriverCTL_Stats:
+            if (msg.size != sizeof(driver->helperStats)) {
+                fprintf(stderr, "Invalid helper stats size %u\n", msg.size);
+                error = EINVAL;
+                break;
+            }
+    
+            memcpy(&driver->helperStats, data, sizeof(driver->helperStats));
+            driver->haveHelperStats = 1;
+            break;
+    
+        default:
+            fprintf(stderr, "Unknown helper ioctl 0x%x\n", msg.id);
+            error = EINVAL;
+        }
+    
+        if (error) {
+            break;
+        }
+    }
+    
+    if (error && (error != ENOTCONN)) {
+        fprintf(stderr, "Dropping helper connection: %s\n", strerror(error));
+    }
+    
+    // Helper detached, whatever is still in flight is never going to complete
+    shutdown(driver->sock, SHUT_RDWR);
+    
+    pthread_mutex_lock(&driver->waitLock);
+    driver->detached = 1;
+    pthread_cond_broadcast(&driver->waitCond);
+    pthread_mutex_unlock(&driver->waitLock);
+    
+    return NULL;
+}
+
+
+// Shared pool of a helper pid or a new pool
+static struct SimPool* getPool(struct SimPool** shared, unsigned count, int pid, uint64_t size, int sharedpool)
+{
+    unsigned i;
+    
+    if (sharedpool) {
+        for (i = 0; i < count; ++i) {
+            if (shared[i] && (shared[i]->pid == pid)) {
+                shared[i]->users++;
+                return shared[i];
+            }
+        }
+    }
+    
+    struct SimPool* pool = (struct SimPool*) calloc(1, sizeof(*pool));
+    if (!pool) {
+        DIE("Could not allocate pool\n");
+    }
+    
+    pool->pid = sharedpool ? pid : -1;
+    pool->users = 1;
+    pool->size = size;
+    pool->memory = (uint8_t*) sim_shm_create(size, &pool->fd);
+    if (!pool->memory) {
+        DIE("Could not allocate shared memory: %s\n", strerror(errno));
+    }
+    
+    loop_pool_init(&pool->allocator, size, kLoopMaxBufferSize);
+    
+    for (i = 0; i < count; ++i) {
+        if (!shared[i]) {
+            shared[i] = pool;
+            break;
+        }
+    }
+    
+    return pool;
+}
+
+
+static void putPool(struct SimPool* pool)
+{
+    if (--pool->users) {
+        return;
+    }
+    
+    munmap(pool->memory, pool->size);
+    close(pool->fd);
+    free(pool);
+}
+
+
+// Controller attach and helperProcessAttached rolled into one, called before reader thread starts
+// @param pools     Pools created so far, one slot per device.
+static void attachHelper(struct SimDriver* driver, struct SimPool** pools, unsigned count)
+{
+    uint8_t* data = driver->data;
+    struct SimMessage msg;
+    int error;
+    int mapped = 0;
+    
+    error = sim_recv(driver->sock, &msg, data, NULL);
+    if (error || (msg.type != kSimMsg_Call) || (msg.id != kLoopCTL_Attach) || (msg.size != sizeof(struct LoopAttachCtl))) {
+        DIE("Helper did not attach properly\n");
+    }
+    
+    struct LoopAttachCtl ctl;
+    memcpy(&ctl, data, sizeof(ctl));
+    
+    IOReturn result = kIOReturnSuccess;
+    if (ctl.blocksize && !loop_block_size_valid(ctl.blocksize)) {
+        fprintf(stderr, "Invalid block size %u\n", ctl.blocksize);
+        result = kIOReturnBadArgument;
+    } else if (!ctl.size || (ctl.poolsize > kLoopMaxPoolSize)) {
+        fprintf(stderr, "Invalid device size %llu or pool size %llu\n", (unsigned long long) ctl.size, (unsigned long long) ctl.poolsize);
+        result = kIOReturnBadArgument;
+    }
+    
+    sim_send(driver->sock, kSimMsg_Reply, kLoopCTL_Attach, result, 0, NULL, 0, -1);
+    if (result != kIOReturnSuccess) {
+        DIE("Rejected helper attach: 0x%x\n", result);
+    }
+    
+    // Controller keys shared pools on the attaching task, a helper naming another pid must not get its pool
+    int pid = sim_peer_pid(driver->sock);
+    if (pid < 0) {
+        DIE("Could not get helper pid: %s\n", strerror(errno));
+    }
+    
+    uint64_t poolSize   = ctl.poolsize ? ctl.poolsize : kLoopDefaultPoolSize;
+    poolSize            = (poolSize + kSimPageSize - 1) & ~((uint64_t) kSimPageSize - 1);
+    
+    driver->pid         = pid;
+    driver->blockSize   = ctl.blocksize ? ctl.blocksize : kLoopBlockSize;
+    driver->nblocks     = ctl.size;
+    driver->readonly    = ctl.readonly;
+    
+    // Shared rings and pool have to be ready before requests start coming in
+    driver->rings = (struct LoopSharedRings*) sim_shm_create(sizeof(struct LoopSharedRings), &driver->ringsFd);
+    if (!driver->rings) {
+        DIE("Could not allocate shared memory: %s\n", strerror(errno));
+    }
+    
+    driver->pool = getPool(pools, count, pid, poolSize, ctl.sharedpool);
+    
+    printf("Helper pid %d attached device %u: %llu blocks of %u bytes%s, %llu bytes buffer pool%s\n", pid, driver->index,
+           (unsigned long long) driver->nblocks, driver->blockSize, (driver->readonly ? ", read only" : ""),
+           (unsigned long long) driver->pool->size, (driver->pool->users > 1 ? " shared" : ""));
+    
+    memset(driver->rings, 0, sizeof(*driver->rings));
+    loop_ring_init(&driver->rings->submitRing);
+    loop_ring_init(&driver->rings->completeRing);
+    loop_tags_init(&driver->tags, kLoopRequestDepth);
+    
+    // Helper maps rings and a pool it does not have yet right after attach
+    int needed = (driver->pool->users > 1) ? 1 : 3;
+    while ((mapped & needed) != needed) {
+        error = sim_recv(driver->sock, &msg, data, NULL);
+        if (error || (msg.type != kSimMsg_Map)) {
+            DIE("Helper did not map shared memory\n");
+        }
+    
+        error = mapMemory(driver, msg.id);
+        mapped |= (msg.id == kLoopDriverMemory_Rings) ? 1 : (msg.id == kLoopDriverMemory_Pool) ? 2 : 0;
+    
+        if (error) {
+            DIE("Could not reply to helper: %s\n", strerror(error));
+        }
+    }
+}
+
+
+// xorshift64*, plenty for picking offsets
+static uint64_t nextRandom(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+
+// createRequest for one synthetic request
+// @return      0 if helper detached or was killed
+static int createRequest(struct SimDriver* driver, uint32_t direction, uint64_t block, uint64_t nblocks)
+{
+    uint64_t nbytes = nblocks * driver->blockSize;
+    uint64_t buffer = 0;
+    int nodata = (direction == kLoopIODirection_Flush) || (direction == kLoopIODirection_Discard);
+    int32_t tag;
+    
+    // Depth is never above tag table size, a free tag and pool memory show up once something completes
+    uint64_t covered = 0;
+    pthread_mutex_lock(&driver->waitLock);
+    for (;;) {
+        if (driver->detached || driver->killed) {
+            pthread_mutex_unlock(&driver->waitLock);
+            return 0;
+        }
+    
+        tag = loop_tags_alloc(&driver->tags);
+        if (tag < 0) {
+            pthread_cond_wait(&driver->waitCond, &driver->waitLock);
+            continue;
+        }
+    
+        if (nodata || loop_pool_alloc(&driver->pool->allocator, nbytes, &buffer)) {
+            break;
+        }
+    
+        loop_tags_free(&driver->tags, (uint32_t) tag);
+        driver->poolWaits++;
+    
+        struct timeval now;
+        struct timespec deadline;
+        gettimeofday(&now, NULL);
+        uint64_t nsec = (uint64_t) now.tv_usec * 1000 + kSimPoolWaitUsec * 1000ull;
+        deadline.tv_sec = now.tv_sec + (time_t) (nsec / 1000000000);
+        deadline.tv_nsec = (long) (nsec % 1000000000);
+        pthread_cond_timedwait(&driver->waitCond, &driver->waitLock, &deadline);
+    }
+    
+    driver->inflight++;
+    covered = driver->writtenPrefix * driver->workload->size;
+    pthread_mutex_unlock(&driver->waitLock);
+    
+    struct SimIO* io = &driver->ios[tag];
+    io->start       = loop_clock_ns();
+    io->offset      = block * driver->blockSize;
+    io->covered     = covered;
+    io->buffer      = buffer;
+    io->nbytes      = (direction == kLoopIODirection_Flush) ? 0 : nbytes;
+    io->direction   = direction;
+    
+    if ((direction == kLoopIODirection_Write) && driver->workload->verify) {
+        fillPattern(driver->pool->memory + buffer, io->offset, nbytes);
+    } else if (direction == kLoopIODirection_Write) {
+        memcpy(driver->pool->memory + buffer, driver->workload->writeData, nbytes);
+    }
+    
+    struct UserIORequest request;
+    memset(&request, 0, sizeof(request));
+    request.offset      = (direction == kLoopIODirection_Flush) ? 0 : block;
+    request.nblocks     = (direction == kLoopIODirection_Flush) ? 0 : nblocks;
+    request.buffer      = buffer;
+    request.direction   = direction;
+    request.priv        = loop_tags_handle(&driver->tags, (uint32_t) tag);
+    
+    postRequest(driver, &request);
+    return 1;
+}
+
+
+// Keep depth requests in flight until time or request budget runs out, one thread per device
+static void* creatorThread(void* arg)
+{
+    struct SimDriver* driver = (struct SimDriver*) arg;
+    const struct SimWorkload* workload = driver->workload;
+    uint64_t nblocks = workload->size / driver->blockSize;
+    uint64_t nrequests = driver->nblocks / nblocks;
+    
+    uint64_t state = 0x9e3779b97f4a7c15ull ^ ((uint64_t) getpid() << 16) ^ driver->index;
+    uint64_t next = 0;
+    uint64_t issued = 0;
+    uint64_t writes = 0;
+    uint64_t start = loop_clock_ns();
+    uint64_t deadline = start + (uint64_t) workload->seconds * 1000000000ull;
+    int attached = 1;
+    
+    while (attached && (workload->maxOps ? (issued < workload->maxOps) : (loop_clock_ns() < deadline))) {
+        pthread_mutex_lock(&driver->waitLock);
+        while ((driver->inflight >= workload->depth) && !driver->detached && !driver->killed) {
+            pthread_cond_wait(&driver->waitCond, &driver->waitLock);
+        }
+        pthread_mutex_unlock(&driver->waitLock);
+    
+        uint64_t index = workload->random ? nextRandom(&state) % nrequests : next++ % nrequests;
+        uint32_t direction = (nextRandom(&state) % 100 < workload->readPct) ? kLoopIODirection_Read : kLoopIODirection_Write;
+        if (driver->readonly) {
+            direction = kLoopIODirection_Read;
+        } else if ((direction == kLoopIODirection_Write) && (nextRandom(&state) % 100 < workload->discardPct)) {
+            direction = kLoopIODirection_Discard;
+        }
+    
+        attached = createRequest(driver, direction, index * nblocks, nblocks);
+        issued++;
+    
+        if (attached && (direction == kLoopIODirection_Write) && workload->flushEvery && (++writes % workload->flushEvery == 0)) {
+            attached = createRequest(driver, kLoopIODirection_Flush, 0, 0);
+        }
+    }
+    
+    pthread_mutex_lock(&driver->waitLock);
+    while (driver->inflight && !driver->detached) {
+        pthread_cond_wait(&driver->waitCond, &driver->waitLock);
+    }
+    pthread_mutex_unlock(&driver->waitLock);
+    
+    driver->elapsed = (loop_clock_ns() - start) / 1e9;
+    return NULL;
+}
+
+
+// Resident memory, threads and open files of helper process while it still serves all devices
+static void printHelperUsage(int pid, unsigned ndevices)
+{
+#ifdef __linux__
+    char path[64];
+    char line[256];
+    unsigned long long rss = 0;
+    unsigned long long hwm = 0;
+    unsigned threads = 0;
+    unsigned fds = 0;
+    
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return;
+    }
+    
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "VmRSS: %llu", &rss);
+        sscanf(line, "VmHWM: %llu", &hwm);
+        sscanf(line, "Threads: %u", &threads);
+    }
+    fclose(f);
+    
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR* dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return;
+    }
+    
+    struct dirent* entry;
+    while (NULL != (entry = readdir(dir))) {
+        fds += (entry->d_name[0] != '.');
+    }
+    closedir(dir);
+    
+    printf("Helper pid %d serving %u devices: %llu kB resident, %llu kB peak, %u threads, %u open files\n", pid, ndevices,
+           rss, hwm, threads, fds);
+#endif
+}
+
+
+static void printStats(const char* title, const struct LoopStatSummary* summary, double seconds)
+{
+    static const char* const ops[kLoopStatDirections] = { "read", "write", "flush", "discard" };
+    uint32_t i;
+    
+    for (i = 0; i < kLoopStatDirections; ++i) {
+        const struct LoopStatSummary* s = &summary[i];
+        if (!s->ops) {
+            continue;
+        }
+    
+        printf("%s %s: %llu requests, %.0f requests/sec, %.1f MB/sec, latency usec mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+               title, ops[i], (unsigned long long) s->ops, (seconds > 0 ? s->ops / seconds : 0.0),
+               (seconds > 0 ? s->bytes / seconds / 1e6 : 0.0), s->mean / 1000.0, s->p50 / 1000.0, s->p90 / 1000.0,
+               s->p99 / 1000.0, s->p999 / 1000.0, s->max / 1000.0);
+    }
+}
+
+
+static void usage(void)
+{
+    printf("Usage: loopsim [-p pattern] [-r readpct] [-s size] [-q depth] [-d seconds] [-n ops] [-F writes] [-u pct] [-z] [-V] [-N devices] socket\n");
+    printf("    -p pattern  seq or rand, default rand\n");
+    printf("    -r readpct  Percentage of reads, rest are writes, default 100\n");
+    printf("    -s size     Request size in bytes, multiple of device block size, default %u\n", kSimDefaultSize);
+    printf("    -q depth    Requests kept in flight per device, 1 to %u, default %u\n", kLoopRequestDepth, kSimDefaultDepth);
+    printf("    -d seconds  Run time, default %u\n", kSimDefaultSeconds);
+    printf("    -n ops      Stop after this many requests per device instead\n");
+    printf("    -F writes   Issue a cache flush after every this many writes, default 0 (never)\n");
+    printf("    -u pct      Percentage of writes issued as discards, default 0\n");
+    printf("    -z          Write zeroes\n");
+    printf("    -V          Write offset pattern and fail unless reads return it, device has to be written with -V first\n");
+    printf("    -K flushes  Kill helper once this many flushes completed, sequential -V writes with -F only\n");
+    printf("    -N devices  Number of helper connections to accept, default 1\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    struct SimWorkload workload;
+    unsigned ndevices = 1;
+    int opt;
+    
+    memset(&workload, 0, sizeof(workload));
+    workload.random = 1;
+    workload.readPct = 100;
+    workload.size = kSimDefaultSize;
+    workload.depth = kSimDefaultDepth;
+    workload.seconds = kSimDefaultSeconds;
+    
+    while (-1 != (opt = getopt(argc, argv, "p:r:s:q:d:n:F:u:zVK:N:"))) {
+        switch (opt) {
+        case 'p':
+            if (!strcmp(optarg, "seq")) {
+                workload.random = 0;
+            } else if (!strcmp(optarg, "rand")) {
+                workload.random = 1;
+            } else {
+                DIE("Invalid pattern %s\n", optarg);
+            }
+            break;
+    
+        case 'r':
+            workload.readPct = (unsigned) strtoul(optarg, NULL, 10);
+            if (workload.readPct > 100) {
+                DIE("Invalid read percentage\n");
+            }
+            break;
+    
+        case 's':
+            workload.size = strtoull(optarg, NULL, 10);
+            if (!workload.size || (workload.size > kLoopMaxBufferSize)) {
+                DIE("Invalid request size, must be up to %u\n", kLoopMaxBufferSize);
+            }
+            break;
+    
+        case 'q':
+            workload.depth = (unsigned) strtoul(optarg, NULL, 10);
+            if (!workload.depth || (workload.depth > kLoopRequestDepth)) {
+                DIE("Invalid queue depth\n");
+            }
+            break;
+    
+        case 'd':
+            workload.seconds = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+    
+        case 'n':
+            workload.maxOps = strtoull(optarg, NULL, 10);
+            break;
+    
+        case 'F':
+            workload.flushEvery = strtoull(optarg, NULL, 10);
+            break;
+    
+        case 'u':
+            workload.discardPct = (unsigned) strtoul(optarg, NULL, 10);
+            if (workload.discardPct > 100) {
+                DIE("Invalid discard percentage\n");
+            }
+            break;
+    
+        case 'z':
+            workload.zeroes = 1;
+            break;
+    
+        case 'V':
+            workload.verify = 1;
+            break;
+    
+        case 'K':
+            workload.killAfter = strtoull(optarg, NULL, 10);
+            break;
+    
+        case 'N':
+            ndevices = (unsigned) strtoul(optarg, NULL, 10);
+            if (!ndevices) {
+                DIE("Invalid number of devices\n");
+            }
+            break;
+    
+        default:
+            usage();
+            DIE("Invalid option\n");
+        }
+    }
+    
+    if (argc - optind != 1) {
+        usage();
+        DIE("Please specify socket name\n");
+    }
+    
+    if (workload.verify && (workload.zeroes || workload.discardPct)) {
+        DIE("Verify pattern cannot be mixed with zeroes or discards\n");
+    }
+    
+    if (workload.killAfter && (!workload.verify || !workload.flushEvery || workload.random || workload.readPct || (ndevices != 1))) {
+        DIE("Killing helper needs sequential verified writes with flushes on one device\n");
+    }
+    
+    const char* path = argv[optind];
+    
+    uint8_t* writeData;
+    struct LoopStats* stats;
+    struct SimDriver** drivers = (struct SimDriver**) calloc(ndevices, sizeof(*drivers));
+    struct SimPool** pools = (struct SimPool**) calloc(ndevices, sizeof(*pools));
+    if (!drivers || !pools || posix_memalign((void**) &stats, 64, sizeof(*stats)) ||
+        posix_memalign((void**) &writeData, kSimPageSize, kLoopMaxBufferSize)) {
+        DIE("Could not allocate driver\n");
+    }
+    
+    memset(writeData, (workload.zeroes ? 0 : 0xa5), kLoopMaxBufferSize);
+    workload.writeData = writeData;
+    loop_stats_init(stats);
+    signal(SIGPIPE, SIG_IGN);
+    
+    
+    // Wait for helper, it attaches devices one after another
+    int listener = sim_listen(path);
+    if (listener < 0) {
+        DIE("Could not listen on %s: %s\n", path, strerror(errno));
+    }
+    
+    printf("Waiting for helper on %s\n", path);
+    
+    unsigned i;
+    for (i = 0; i < ndevices; ++i) {
+        struct SimDriver* driver = (struct SimDriver*) calloc(1, sizeof(*driver));
+        if (!driver || posix_memalign((void**) &driver->readData, kSimPageSize, kLoopMaxBufferSize)) {
+            DIE("Could not allocate driver\n");
+        }
+    
+        driver->index = i;
+        driver->stats = stats;
+        driver->workload = &workload;
+        pthread_mutex_init(&driver->submitLock, NULL);
+        pthread_mutex_init(&driver->waitLock, NULL);
+        pthread_cond_init(&driver->waitCond, NULL);
+        drivers[i] = driver;
+    
+        driver->sock = accept(listener, NULL, NULL);
+        if (driver->sock < 0) {
+            DIE("Could not accept helper connection: %s\n", strerror(errno));
+        }
+    
+        attachHelper(driver, pools, ndevices);
+    
+        if (workload.size % driver->blockSize) {
+            DIE("Request size must be a multiple of device block size %u\n", driver->blockSize);
+        }
+    
+        if (driver->nblocks < workload.size / driver->blockSize) {
+            DIE("Device is smaller than one request\n");
+        }
+    
+        if (driver->readonly && (workload.readPct != 100)) {
+            fprintf(stderr, "Warning: device %u is read only, issuing reads only\n", i);
+        }
+    
+        if (workload.killAfter) {
+            driver->written = (uint8_t*) calloc(driver->nblocks * driver->blockSize / workload.size, 1);
+            if (!driver->written) {
+                DIE("Could not allocate driver\n");
+            }
+        }
+    }
+    
+    close(listener);
+    unlink(path);
+    
+    
+    // Devices run their workloads at the same time
+    for (i = 0; i < ndevices; ++i) {
+        if (pthread_create(&drivers[i]->reader, NULL, readerThread, drivers[i]) ||
+            pthread_create(&drivers[i]->creator, NULL, creatorThread, drivers[i])) {
+            DIE("Could not start device %u threads\n", i);
+        }
+    }
+    
+    double elapsed = 0;
+    for (i = 0; i < ndevices; ++i) {
+        pthread_join(drivers[i]->creator, NULL);
+        if (drivers[i]->elapsed > elapsed) {
+            elapsed = drivers[i]->elapsed;
+        }
+    }
+    
+    if (!drivers[0]->killed) {
+        printHelperUsage(drivers[0]->pid, ndevices);
+    }
+    
+    
+    // Terminate devices and wait for helper to go away
+    for (i = 0; i < ndevices; ++i) {
+        sendNotification(drivers[i], kLoopUserTerminateNotification, NULL);
+    }
+    
+    int rc = EXIT_SUCCESS;
+    for (i = 0; i < ndevices; ++i) {
+        struct SimDriver* driver = drivers[i];
+        pthread_join(driver->reader, NULL);
+    
+        if (driver->inflight && !driver->killed) {
+            fprintf(stderr, "Helper detached device %u with %u requests in flight\n", i, driver->inflight);
+        }
+    
+        if (driver->killed) {
+            printf("Killed helper pid %d after %llu flushes, %llu bytes flushed\n", driver->pid,
+                   (unsigned long long) driver->flushes, (unsigned long long) driver->flushed);
+        }
+    
+        printf("Device %u completed %llu requests in %.3f sec, %llu failed, %llu invalid handles, %llu wrong data, %llu inlined, "
+               "%llu doorbells, %llu pool waits, %.1f requests per completion call\n",
+               i, (unsigned long long) driver->completions, driver->elapsed, (unsigned long long) driver->errors,
+               (unsigned long long) driver->invalid, (unsigned long long) driver->mismatches, (unsigned long long) driver->inlined,
+               (unsigned long long) driver->doorbells, (unsigned long long) driver->poolWaits,
+               (driver->completeCalls ? (double) driver->completions / driver->completeCalls : 0.0));
+    
+        if (driver->haveHelperStats) {
+            char title[64];
+            snprintf(title, sizeof(title), "Helper reported device %u", i);
+            printStats(title, driver->helperStats.io, driver->elapsed);
+        }
+    
+        if (driver->errors || driver->invalid || driver->mismatches) {
+            rc = EXIT_FAILURE;
+        }
+    }
+    
+    struct LoopStatSummary summary[kLoopStatDirections];
+    for (i = 0; i < kLoopStatDirections; ++i) {
+        loop_stats_summarize(stats, i, &summary[i]);
+    }
+    
+    printStats("Driver", summary, elapsed);
+    
+    for (i = 0; i < ndevices; ++i) {
+        struct SimDriver* driver = drivers[i];
+        close(driver->sock);
+        munmap(driver->rings, sizeof(*driver->rings));
+        close(driver->ringsFd);
+        putPool(driver->pool);
+    
+        pthread_cond_destroy(&driver->waitCond);
+        pthread_mutex_destroy(&driver->waitLock);
+        pthread_mutex_destroy(&driver->submitLock);
+    
+        free(driver->written);
+        free(driver->readData);
+        free(driver);
+    }
+    
+    free(writeData);
+    free(stats);
+    free(pools);
+    free(drivers);
+    
+    return rc;
+}
@@ -2,7 +2,9 @@
 //  Copyright (c) 2012 ACME, Inc. All rights reserved.
 //
 //  Utility to setup new loop devices
-//  losetup [-r] file
+//  losetup [-r] [-z] [-p poolsize] [-t threads] [-q depth] [-e engine] [-S] [-D] [-b batch] [-w usec] [-m usec] [-c cache] [-B blocksize] [-k chunk] [-G writes] [-H] [-T trace] file...
+//
+//  Every file gets a device of its own, all of them served by this process with shared worker threads and buffer pool.
 //
 
 #include <stdio.h>
@@ -13,6 +15,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -20,9 +23,14 @@
 #include <CoreFoundation/CoreFoundation.h>
 
 #include "kext/loopctl.h"
+#include "helper.h"
+#include "engine.h"
+#include "packed.h"
 
 
-#define DIE(msg, args...) { fprintf(stderr, msg, ## args); exit(EXIT_FAILURE); }
+enum {
+    kLoopStatsInterval      = 1,                // Seconds between helper statistics updates sent to driver
+};
 
 
 static io_connect_t open_controller(void)
@@ -84,20 +92,41 @@ static IOReturn controller_ctl(int ctlcode, void* data_in, size_t insize, void*
 }
 
 
-static int loop_attach(uint64_t nblocks, int ro)
+static int loop_attach(struct LoopAttachCtl* ctl)
 {
-    struct LoopAttachCtl ctl;
-    ctl.readonly = ro;
-    ctl.size = nblocks;
-    ctl.pid = getpid();
+    ctl->pid = getpid();
+    return controller_ctl(kLoopCTL_Attach, ctl, sizeof(*ctl), NULL, 0);
+}
+
+
+// Devices we attached so far, new device is the one with our pid not found here
+struct LoopDeviceWait {
+    io_service_t            service;
+    const uint64_t*         claimed;        // Registry entry ids of devices taken already
+    unsigned                nclaimed;
+};
+
+
+static int isClaimed(const struct LoopDeviceWait* wait, io_service_t service)
+{
+    uint64_t id = 0;
+    unsigned i;
     
-    return controller_ctl(kLoopCTL_Attach, &ctl, sizeof(ctl), NULL, 0);
+    IORegistryEntryGetRegistryEntryID(service, &id);
+    for (i = 0; i < wait->nclaimed; ++i) {
+        if (wait->claimed[i] == id) {
+            return 1;
+        }
+    }
+    
+    return 0;
 }
 
 
 static void onDeviceAdded(void* refCon, io_iterator_t iter) 
 { 
-    io_service_t* service = (io_service_t*) refCon;
+    struct LoopDeviceWait* wait = (struct LoopDeviceWait*) refCon;
+    io_service_t* service = &wait->service;
     while ((*service = IOIteratorNext(iter)) != 0) { 
         CFNumberRef pid_prop = (CFNumberRef) IORegistryEntryCreateCFProperty(*service, CFSTR(kLoopDriverPIDKey), kCFAllocatorDefault, 0);
         if (!pid_prop) {
@@ -106,7 +135,7 @@ static void onDeviceAdded(void* refCon, io_iterator_t iter)
         
         int pid;
         CFNumberGetValue(pid_prop, kCFNumberIntType, &pid);
-        if (pid == getpid()) {
+        if ((pid == getpid()) && !isClaimed(wait, *service)) {
             printf("Found device object for pid %d\n", pid);
             CFRunLoopStop(CFRunLoopGetCurrent());
             return;
@@ -132,7 +161,7 @@ static void onDeviceRemoved(void* refCon, io_iterator_t iter)
 }
 
 
-static io_service_t waitForLoopDevice(void)
+static io_service_t waitForLoopDevice(const uint64_t* claimed, unsigned nclaimed)
 {
     CFDictionaryRef matchingDict = IOServiceMatching(kLoopDriverMatchKey); 
     IONotificationPortRef notificationPort = IONotificationPortCreate(kIOMasterPortDefault); 
@@ -141,46 +170,104 @@ static io_service_t waitForLoopDevice(void)
     CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, kCFRunLoopDefaultMode); 
     
     io_iterator_t iter;
-    io_service_t service;
-
-    kern_return_t kr = IOServiceAddMatchingNotification(notificationPort, kIOFirstMatchNotification, matchingDict, onDeviceAdded, &service, &iter); 
+    struct LoopDeviceWait wait;
+    wait.service = IO_OBJECT_NULL;
+    wait.claimed = claimed;
+    wait.nclaimed = nclaimed;
+    
+    kern_return_t kr = IOServiceAddMatchingNotification(notificationPort, kIOFirstMatchNotification, matchingDict, onDeviceAdded, &wait, &iter); 
     if (KERN_SUCCESS != kr) {
         DIE("Could not add loop device notification\n");
     }
-
-    onDeviceAdded(&service, iter);
-    if (!service) {
+    
+    onDeviceAdded(&wait, iter);
+    if (!wait.service) {
         CFRunLoopRun();
     }
     
     IONotificationPortDestroy(notificationPort); 
     IOObjectRelease(iter); 
     
-    return service; 
+    return wait.service; 
 }
 
 
 static int gTerminate = 0;
 
 
+// Driver connection, helper core issues driver ioctls through it
+static void driverCtl(void* driver, uint64_t ctl, const void* data, size_t size)
+{
+    io_connect_t conn = (io_connect_t) (uintptr_t) driver;
+    int rc = IOConnectCallMethod(conn, 
+                                 kLoopCTL_Magic, 
+                                 &ctl, 1, 
+                                 data, size, 
+                                 NULL, NULL, 
+                                 NULL, NULL);
+    
+    if (KERN_SUCCESS != rc) {
+        DIE("Driver ioctl 0x%llx failed with 0x%x\n", ctl, rc);
+    }
+}
+
+
 struct LoopContext {
-    const char*     file;
-    int             fd;
-    int             readonly;
-    io_connect_t    deviceConn;
-    io_object_t     notification;
+    const char*             file;
+    io_service_t            driver;
+    io_connect_t            deviceConn;
+    struct LoopHelper*      helper;
+    CFMachPortRef           port;
+    mach_vm_address_t       ringsAddress;
+    mach_vm_size_t          ringsSize;
+    mach_vm_address_t       poolAddress;
+    mach_vm_size_t          poolSize;
+    int                     mappedPool;     // Pool mapping is ours, devices sharing a pool use the first one
+    int                     terminated;     // Driver sent terminate notification
+    unsigned*               running;        // Devices not terminated yet, shared by all contexts
+};
+
+
+// Devices served by this process
+struct LoopContextList {
+    struct LoopContext*     contexts;
+    unsigned                count;
 };
 
 
+// Hand helper latency summaries over to drivers which publish them in IORegistry
+static void statsTimerCallback(CFRunLoopTimerRef timer, void* info)
+{
+    struct LoopContextList* list = (struct LoopContextList*) info;
+    struct LoopHelperStatsCtl ctl;
+    unsigned i;
+    
+    for (i = 0; i < list->count; ++i) {
+        struct LoopContext* context = &list->contexts[i];
+        if (context->terminated) {
+            continue;
+        }
+    
+        helper_get_stats(context->helper, &ctl);
+        driverCtl((void*) (uintptr_t) context->deviceConn, kLoopDriverCTL_Stats, &ctl, sizeof(ctl));
+    }
+}
+
+
 static void requestPortCallback(CFMachPortRef port, void *msg, CFIndex size, void *info)
 {
     struct UserRequestNotification* request = (struct UserRequestNotification*) msg;
     struct LoopContext* context = (struct LoopContext*) info;
     
     if (request->header.msgh_id == kLoopUserTerminateNotification) {
-        // Driver terminates?
-        printf("Request loop terminated\n");
-        CFRunLoopStop(CFRunLoopGetCurrent());
+        // Driver terminates? Keep serving the rest of devices.
+        printf("Request loop terminated for file %s\n", context->file);
+        if (!context->terminated) {
+            context->terminated = 1;
+            if (--*context->running == 0) {
+                CFRunLoopStop(CFRunLoopGetCurrent());
+            }
+        }
         return;
     } else if (gTerminate) {
         // We are terminating?
@@ -188,74 +275,31 @@ static void requestPortCallback(CFMachPortRef port, void *msg, CFIndex size, voi
         CFRunLoopStop(CFRunLoopGetCurrent());
         return;
     }
-        
     
-    void* buffer        = (void*) request->data.buffer;
-    size_t nbytes       = (size_t) request->data.nblocks * kLoopBlockSize;
-    off_t offset        = request->data.offset * kLoopBlockSize;
-
-    printf("New %s request arrived: file %s, offset %llu, size %lu, buffer %p\n", 
-           (request->data.direction == kLoopIODirection_Read ? "read" : "write"),
-           context->file, offset, nbytes, buffer);
-
-    if (request->data.direction == kLoopIODirection_Read) {
-        
-        if (nbytes != pread(context->fd, buffer, nbytes, offset)) {
-            DIE("Could not read %lu bytes from file %s at offset %llu\n", nbytes, context->file, offset);
-        }
-        
+    if (request->header.msgh_id == kLoopUserRingNotification) {
+        // Submission ring doorbell
+        helper_drain_submissions(context->helper);
     } else {
-        
-        assert(!context->readonly);
-        
-        if (nbytes != pwrite(context->fd, buffer, nbytes, offset)) {
-            DIE("Could not write %lu bytes from file %s at offset %llu\n", nbytes, context->file, offset);
-        }
-        
-    }
-    
-    // Send result to driver
-    uint64_t ctl = kLoopDriverCTL_Complete;
-    request->data.result = kIOReturnSuccess;
-    
-    int rc = IOConnectCallMethod(context->deviceConn, 
-                                 kLoopCTL_Magic, 
-                                 &ctl, 1, 
-                                 &request->data, sizeof(request->data), 
-                                 NULL, NULL, 
-                                 NULL, NULL);
-    
-    if (KERN_SUCCESS != rc) {
-        DIE("Complete request failed with 0x%x\n", rc);
+        // Request did not fit into submission ring and was sent inline
+        helper_submit(context->helper, &request->data);
     }
 }
 
 
-static void beginRequestQueue(io_service_t driver, const char* file, int readonly)
+// Open driver connection, start helper for it and map shared memory
+// @param shared    Context whose pool mapping to use if pool is shared, NULL to map pool.
+static void beginDevice(struct LoopContext* ctx, struct LoopHelperGroup* group, const struct LoopHelperOptions* options,
+                        const struct LoopContext* shared)
 {
     // Open driver
-    io_connect_t driverConn;
-    kern_return_t error = IOServiceOpen(driver, mach_task_self(), 0, &driverConn);
+    kern_return_t error = IOServiceOpen(ctx->driver, mach_task_self(), 0, &ctx->deviceConn);
     if (KERN_SUCCESS != error) {
         DIE("Failed opening loop driver: 0x%x\n", error);
     }
-
     
-    // Create port context
-    struct LoopContext* ctx = (struct LoopContext*) malloc(sizeof(struct LoopContext));
-    if (!ctx) {
-        DIE("Could not allocate context structure\n");
-    }
     
-    int fd = open(file, (readonly ? O_RDONLY : O_RDWR));
-    if (fd < 0) {
-        DIE("Could not open file\n");
-    }
-    
-    ctx->file       = file;
-    ctx->fd         = fd;
-    ctx->readonly   = readonly;
-    ctx->deviceConn = driverConn;
+    // Helper core opens backing store, threads come from the group
+    ctx->helper = helper_create(group, ctx->file, options, driverCtl, (void*) (uintptr_t) ctx->deviceConn);
     
     
     // Setup notification port
@@ -265,33 +309,116 @@ static void beginRequestQueue(io_service_t driver, const char* file, int readonl
     portContext.retain          = NULL; 
     portContext.release         = NULL; 
     portContext.copyDescription = NULL; 
-
-    CFMachPortRef notificationPort = CFMachPortCreate(kCFAllocatorDefault, requestPortCallback, &portContext, NULL); 
-    if (!notificationPort) {
+    
+    ctx->port = CFMachPortCreate(kCFAllocatorDefault, requestPortCallback, &portContext, NULL); 
+    if (!ctx->port) {
         DIE("Could not create mach notification port\n");
     }
     
-    CFRunLoopSourceRef runLoopSource = CFMachPortCreateRunLoopSource(kCFAllocatorDefault, notificationPort, 0); 
+    CFRunLoopSourceRef runLoopSource = CFMachPortCreateRunLoopSource(kCFAllocatorDefault, ctx->port, 0); 
     CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, kCFRunLoopDefaultMode); 
+    CFRelease(runLoopSource);
     
     
     // Set driver notification port
-    error = IOConnectSetNotificationPort(driverConn, 0, CFMachPortGetPort(notificationPort), 0); 
+    error = IOConnectSetNotificationPort(ctx->deviceConn, 0, CFMachPortGetPort(ctx->port), 0); 
     if (KERN_SUCCESS != error) {
         DIE("Failed setting driver notification port: 0x%x\n", error);
     }
     
     
-    // Begin request loop
+    // Map shared request rings, driver allocates them once notification port is set
+    ctx->ringsAddress = 0;
+    ctx->ringsSize = 0;
+    error = IOConnectMapMemory64(ctx->deviceConn, kLoopDriverMemory_Rings, mach_task_self(), &ctx->ringsAddress, &ctx->ringsSize, kIOMapAnywhere);
+    if (KERN_SUCCESS != error) {
+        DIE("Failed mapping request rings: 0x%x\n", error);
+    }
+    
+    if (ctx->ringsSize < sizeof(struct LoopSharedRings)) {
+        DIE("Request rings mapping is too small: %llu\n", ctx->ringsSize);
+    }
+    
+    
+    // Map request buffer pool, driver sends us offsets into it. Shared pool is mapped once for all devices.
+    ctx->poolAddress = 0;
+    ctx->poolSize = 0;
+    ctx->mappedPool = !shared;
+    if (shared) {
+        ctx->poolAddress = shared->poolAddress;
+        ctx->poolSize = shared->poolSize;
+    } else {
+        error = IOConnectMapMemory64(ctx->deviceConn, kLoopDriverMemory_Pool, mach_task_self(), &ctx->poolAddress, &ctx->poolSize, kIOMapAnywhere);
+        if (KERN_SUCCESS != error) {
+            DIE("Failed mapping request buffer pool: 0x%x\n", error);
+        }
+    }
+    
+    helper_set_memory(ctx->helper, (struct LoopSharedRings*) (uintptr_t) ctx->ringsAddress, (void*) (uintptr_t) ctx->poolAddress, ctx->poolSize);
+}
+
+
+static void endDevice(struct LoopContext* ctx)
+{
+    helper_destroy(ctx->helper);
+    
+    CFMachPortInvalidate(ctx->port);
+    CFRelease(ctx->port);
+    
+    if (ctx->mappedPool) {
+        IOConnectUnmapMemory64(ctx->deviceConn, kLoopDriverMemory_Pool, mach_task_self(), ctx->poolAddress);
+    }
+    IOConnectUnmapMemory64(ctx->deviceConn, kLoopDriverMemory_Rings, mach_task_self(), ctx->ringsAddress);
+    IOServiceClose(ctx->deviceConn);
+    IOObjectRelease(ctx->driver);
+}
+
+
+// @param sharedpool    Devices were attached with a shared buffer pool.
+static void beginRequestQueue(struct LoopContext* contexts, unsigned count, const struct LoopHelperOptions* options, int sharedpool)
+{
+    struct LoopHelperGroup* group = helper_group_create(options, count);
+    unsigned running = count;
+    unsigned i;
+    
+    for (i = 0; i < count; ++i) {
+        contexts[i].terminated = 0;
+        contexts[i].running = &running;
+        beginDevice(&contexts[i], group, options, ((i && sharedpool) ? &contexts[0] : NULL));
+    }
+    
+    
+    // Publish statistics periodically while serving requests
+    struct LoopContextList list;
+    list.contexts = contexts;
+    list.count = count;
+    
+    CFRunLoopTimerContext timerContext;
+    memset(&timerContext, 0, sizeof(timerContext));
+    timerContext.info = &list;
+    
+    CFRunLoopTimerRef statsTimer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + kLoopStatsInterval, kLoopStatsInterval,
+                                                        0, 0, statsTimerCallback, &timerContext);
+    if (statsTimer) {
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), statsTimer, kCFRunLoopDefaultMode);
+    }
+    
+    
+    // Begin request loop, runs until every device terminated or we were asked to quit
     CFRunLoopRun();
     
+    if (statsTimer) {
+        CFRunLoopTimerInvalidate(statsTimer);
+        CFRelease(statsTimer);
+    }
+    
     
     // Clean up resources after request loop terminated
-    IOServiceClose(driverConn);
-    IOObjectRelease(driver);
+    for (i = 0; i < count; ++i) {
+        endDevice(&contexts[i]);
+    }
     
-    close(ctx->fd);
-    free(ctx);
+    helper_group_destroy(group);
 }
 
 
@@ -302,19 +429,116 @@ static void sighandler(int signo)
 
 static void usage(void) 
 {
-    printf("Usage: losetup [-r] file\n");
+    printf("Usage: losetup [-r] [-z] [-p poolsize] [-t threads] [-q depth] [-e engine] [-S] [-D] [-b batch] [-w usec] [-m usec] [-c cache] [-B blocksize] [-k chunk] [-G writes] [-H] [-T trace] file...\n");
+    printf("    -r          Attach read only\n");
+    printf("    -z          Map large aligned request buffers directly instead of copying\n");
+    printf("    -p size     Shared request buffer pool size in megabytes, one pool for all devices\n");
+    printf("    -t threads  Number of request worker threads shared by all devices, default %u\n", kLoopDefaultThreads);
+    printf("    -q depth    Max number of requests queued to engine per device, default %u\n", kLoopDefaultQueueDepth);
+    printf("    -e engine   Backing store engine: %s\n", engine_names());
+    printf("    -S          Use kernel submission polling if engine supports it\n");
+    printf("    -D          Direct io, keep backing file out of host page cache\n");
+    printf("    -b batch    Max completions handed to driver at once, 1 to %u, default %u\n", kLoopMaxCompleteBatch, kLoopDefaultCompleteBatch);
+    printf("    -w usec     Max time a completion waits for its batch to fill up, default %u\n", kLoopDefaultCompleteDelay);
+    printf("    -m usec     Hold requests in driver for up to usec to merge adjacent ones, default 0 (disabled)\n");
+    printf("    -c cache    Write-back cache dirty limit in megabytes, default 0 (no cache)\n");
+    printf("    -B size     Device logical block size in bytes, power of two from %u to %u, default %u\n", kLoopMinBlockSize, kLoopMaxBlockSize, kLoopBlockSize);
+    printf("    -k chunk    Split larger requests into chunks of this many kilobytes running in parallel, default %u, 0 disables\n", kLoopDefaultChunkSize / 1024);
+    printf("    -G writes   Most FUA writes sharing one backing store flush, default 0 (no limit), 1 disables group commit\n");
+    printf("    -H          Read backing file holes too instead of zero filling them from its extent map\n");
+    printf("    -T trace    Record completed requests into a binary trace file, see loopreplay\n");
 }
 
 
 int main(int argc, char** argv)
 {
-    int ro = 0;
-    char opt;
+    int opt;
+    struct LoopAttachCtl ctl;
+    struct LoopHelperOptions options;
     
-    while (-1 != (opt = getopt(argc, argv, "r:"))) {
+    memset(&ctl, 0, sizeof(ctl));
+    helper_default_options(&options);
+    
+    while (-1 != (opt = getopt(argc, argv, "rzp:t:q:e:SDb:w:m:c:B:k:G:HT:"))) {
         switch (opt) {
         case 'r': 
-            ro = 1; 
+            options.readonly = 1; 
+            break;
+            
+        case 'z':
+            ctl.zerocopy = 1;
+            break;
+            
+        case 'p':
+            ctl.poolsize = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+            
+        case 't':
+            options.nthreads = (unsigned) strtoul(optarg, NULL, 10);
+            if (!options.nthreads) {
+                DIE("Invalid number of threads\n");
+            }
+            break;
+            
+        case 'q':
+            options.depth = (unsigned) strtoul(optarg, NULL, 10);
+            if (!options.depth) {
+                DIE("Invalid queue depth\n");
+            }
+            break;
+            
+        case 'e':
+            options.engine = optarg;
+            break;
+            
+        case 'S':
+            options.engineFlags |= kLoopEngineFlag_SQPoll;
+            break;
+            
+        case 'D':
+            options.engineFlags |= kLoopEngineFlag_Direct;
+            break;
+            
+        case 'b':
+            options.batchSize = (unsigned) strtoul(optarg, NULL, 10);
+            if (!options.batchSize || (options.batchSize > kLoopMaxCompleteBatch)) {
+                DIE("Invalid completion batch size\n");
+            }
+            break;
+            
+        case 'w':
+            options.batchDelay = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+            
+        case 'm':
+            ctl.mergedelay = (int) strtoul(optarg, NULL, 10);
+            break;
+            
+        case 'c':
+            options.cacheSize = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+            
+        case 'B':
+            options.blockSize = (uint32_t) strtoul(optarg, NULL, 10);
+            if (!loop_block_size_valid(options.blockSize)) {
+                DIE("Invalid block size, must be a power of two from %u to %u\n", kLoopMinBlockSize, kLoopMaxBlockSize);
+            }
+            break;
+            
+        case 'k':
+            options.chunkSize = strtoull(optarg, NULL, 10) * 1024;
+            break;
+            
+        case 'G':
+            options.commitGroup = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+            
+        case 'H':
+            options.sparse = 0;
+            break;
+            
+        case 'T':
+            options.traceFile = optarg;
             break;
                 
         default: 
@@ -323,53 +547,87 @@ int main(int argc, char** argv)
         }
     }
     
-    const char* file = argv[optind];
-    if (!file) {
+    if (options.chunkSize % options.blockSize) {
+        DIE("Chunk size must be a multiple of block size\n");
+    }
+    
+    if (optind >= argc) {
         DIE("Please specify file name\n");
     }
     
-    int error = access(file, F_OK|R_OK);
-    if (error) {
-        DIE("File \"%s\" does not exist or cannot be read by you\n", file);
+    unsigned count = (unsigned) (argc - optind);
+    struct LoopContext* contexts = (struct LoopContext*) calloc(count, sizeof(struct LoopContext));
+    uint64_t* claimed = (uint64_t*) calloc(count, sizeof(uint64_t));
+    if (!contexts || !claimed) {
+        DIE("Could not allocate device contexts\n");
     }
     
-    if (!ro) {
-        error = access(file, W_OK);
+    // One pool for all devices, otherwise every device pins a pool of its own
+    ctl.sharedpool = (count > 1);
+    
+    unsigned i;
+    for (i = 0; i < count; ++i) {
+        const char* file = argv[optind + i];
+    
+        int error = access(file, F_OK|R_OK);
         if (error) {
-            DIE("You cannot write to file \"%s\", please try again with -r option\n", file);
+            DIE("File \"%s\" does not exist or cannot be read by you\n", file);
         }
-    }
-
-    struct stat st;
-    if (0 != stat(file, &st)) {
-        DIE("stat on file \"%s\" failed\n", file);
-    }
-
-    uint64_t nblocks = st.st_size / kLoopBlockSize;
-    if (st.st_size & (kLoopBlockSize - 1)) {
-        fprintf(stderr, "Warning: file size %llu is not a multiple of the loop device block size. Will truncate down to %llu\n", 
-                st.st_size, nblocks * kLoopBlockSize);
-    }
     
- 
-    // Send controller command and wait for our new loop driver
-    error = loop_attach(nblocks, ro);
-    if (error) {
-        DIE("Failed attaching new loop device: 0x%x\n", error);
-    }
+        if (!options.readonly) {
+            error = access(file, W_OK);
+            if (error) {
+                DIE("You cannot write to file \"%s\", please try again with -r option\n", file);
+            }
+    
+            if (packed_probe(file, NULL) > 0) {
+                DIE("File \"%s\" is a compressed image, please try again with -r option\n", file);
+            }
+        }
+    
+        uint64_t size;
+        if (0 != helper_device_size(file, &size)) {
+            DIE("Could not get size of file \"%s\"\n", file);
+        }
+    
+        uint64_t nblocks = size / options.blockSize;
+        if (size & (options.blockSize - 1)) {
+            fprintf(stderr, "Warning: file size %llu is not a multiple of the loop device block size. Will truncate down to %llu\n", 
+                    size, nblocks * options.blockSize);
+        }
     
-    io_service_t driver = waitForLoopDevice();
-    if (!driver) {
-        DIE("Could not wait for new loop device\n");
+    
+        // Send controller command and wait for our new loop driver
+        ctl.size = nblocks;
+        ctl.readonly = options.readonly;
+        ctl.blocksize = options.blockSize;
+        ctl.writecache = options.readonly ? 0 : options.cacheSize;
+    
+        error = loop_attach(&ctl);
+        if (error) {
+            DIE("Failed attaching new loop device for file %s: 0x%x\n", file, error);
+        }
+    
+        io_service_t driver = waitForLoopDevice(claimed, i);
+        if (!driver) {
+            DIE("Could not wait for new loop device\n");
+        }
+    
+        IORegistryEntryGetRegistryEntryID(driver, &claimed[i]);
+        contexts[i].file = file;
+        contexts[i].driver = driver;
     }
     
-    // Create a request port and start servicing
+    // Create request ports and start servicing
     signal(SIGKILL, sighandler);
     signal(SIGTERM, sighandler);
     signal(SIGSTOP, sighandler);
     signal(SIGQUIT, sighandler);
     
-    beginRequestQueue(driver, file, ro);
+    beginRequestQueue(contexts, count, &options, ctl.sharedpool);
+    
+    free(claimed);
+    free(contexts);
     
     return EXIT_SUCCESS;
 }
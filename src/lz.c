@@ -0,0 +1,226 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+#include <string.h>
+#include <errno.h>
+
+#include "lz.h"
+
+
+enum {
+    kLZHashBits     = 14,           // Hash table of last positions, 64K on stack
+    kLZMinMatch     = 4,
+    kLZMaxOffset    = 65535,
+    kLZLastLiterals = 5,            // Block always ends with this many literals
+    kLZMatchLimit   = 12,           // No match starts closer than this to block end
+    kLZSkipShift    = 6,            // Search steps up by one every 64 bytes without a match
+    kLZWildCopy     = 16,           // Decompressor copies in steps of this much where both buffers have room
+};
+
+
+static uint32_t read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - kLZHashBits);
+}
+
+
+// Length above 15 nibble continues in bytes of 255 and a last smaller one
+static uint8_t* putLength(uint8_t* op, uint64_t length)
+{
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    
+    *op++ = (uint8_t) length;
+    return op;
+}
+
+
+// @return      Output end or NULL if sequence does not fit
+static uint8_t* putSequence(uint8_t* op, uint8_t* oend, const uint8_t* literals, uint64_t nliterals, uint64_t offset, uint64_t match)
+{
+    // Worst case: token, length bytes, literals, offset, match length bytes
+    if ((uint64_t) (oend - op) < 1 + nliterals / 255 + 1 + nliterals + 2 + match / 255 + 1) {
+        return NULL;
+    }
+    
+    uint8_t* token = op++;
+    *token = (uint8_t) (((nliterals < 15) ? nliterals : 15) << 4);
+    if (nliterals >= 15) {
+        op = putLength(op, nliterals - 15);
+    }
+    
+    memcpy(op, literals, nliterals);
+    op += nliterals;
+    
+    // Last sequence has literals only
+    if (offset) {
+        *op++ = (uint8_t) offset;
+        *op++ = (uint8_t) (offset >> 8);
+    
+        match -= kLZMinMatch;
+        *token |= (uint8_t) ((match < 15) ? match : 15);
+        if (match >= 15) {
+            op = putLength(op, match - 15);
+        }
+    }
+    
+    return op;
+}
+
+
+uint64_t lz_compress(const void* src, uint64_t nbytes, void* dst, uint64_t capacity)
+{
+    const uint8_t* base = (const uint8_t*) src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* end = base + nbytes;
+    uint8_t* op = (uint8_t*) dst;
+    uint8_t* oend = op + capacity;
+    uint32_t table[1 << kLZHashBits];
+    
+    memset(table, 0, sizeof(table));
+    
+    if (nbytes > kLZMatchLimit) {
+        const uint8_t* limit = end - kLZMatchLimit;
+        const uint8_t* matchEnd = end - kLZLastLiterals;
+    
+        while (ip < limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash32(seq);
+            const uint8_t* ref = base + table[h];
+            table[h] = (uint32_t) (ip - base);
+    
+            if ((ref >= ip) || (ip - ref > kLZMaxOffset) || (read32(ref) != seq)) {
+                ip += 1 + ((ip - anchor) >> kLZSkipShift);
+                continue;
+            }
+    
+            const uint8_t* mp = ip + kLZMinMatch;
+            const uint8_t* rp = ref + kLZMinMatch;
+            while ((mp < matchEnd) && (*mp == *rp)) {
+                mp++;
+                rp++;
+            }
+    
+            op = putSequence(op, oend, anchor, (uint64_t) (ip - anchor), (uint64_t) (ip - ref), (uint64_t) (mp - ip));
+            if (!op) {
+                return 0;
+            }
+    
+            ip = mp;
+            anchor = ip;
+    
+            // Position right before the next search helps runs
+            if (ip - 2 > base) {
+                table[hash32(read32(ip - 2))] = (uint32_t) (ip - 2 - base);
+            }
+        }
+    }
+    
+    op = putSequence(op, oend, anchor, (uint64_t) (end - anchor), 0, 0);
+    return op ? (uint64_t) (op - (uint8_t*) dst) : 0;
+}
+
+
+// @return      Length or UINT64_MAX if input ends in the middle of it
+static uint64_t getLength(const uint8_t** ip, const uint8_t* iend, uint64_t length)
+{
+    uint8_t b;
+    
+    if (length != 15) {
+        return length;
+    }
+    
+    do {
+        if (*ip >= iend) {
+            return UINT64_MAX;
+        }
+        b = *(*ip)++;
+        length += b;
+    } while (b == 255);
+    
+    return length;
+}
+
+
+int lz_decompress(const void* src, uint64_t nbytes, void* dst, uint64_t size)
+{
+    const uint8_t* ip = (const uint8_t*) src;
+    const uint8_t* iend = ip + nbytes;
+    uint8_t* op = (uint8_t*) dst;
+    uint8_t* oend = op + size;
+    
+    while (ip < iend) {
+        uint8_t token = *ip++;
+    
+        uint64_t nliterals = getLength(&ip, iend, token >> 4);
+        if ((nliterals > (uint64_t) (iend - ip)) || (nliterals > (uint64_t) (oend - op))) {
+            return EINVAL;
+        }
+    
+        // Short literal runs are most of them, one fixed size copy does and whatever it writes past them gets overwritten
+        if ((nliterals <= kLZWildCopy) && (iend - ip >= kLZWildCopy) && (oend - op >= kLZWildCopy)) {
+            memcpy(op, ip, kLZWildCopy);
+        } else {
+            memcpy(op, ip, nliterals);
+        }
+        op += nliterals;
+        ip += nliterals;
+    
+        if (ip == iend) {
+            break;
+        }
+    
+        if (iend - ip < 2) {
+            return EINVAL;
+        }
+    
+        uint64_t offset = ip[0] | ((uint64_t) ip[1] << 8);
+        ip += 2;
+    
+        uint64_t match = getLength(&ip, iend, token & 15);
+        if ((match == UINT64_MAX) || !offset || (offset > (uint64_t) (op - (uint8_t*) dst)) ||
+            (match + kLZMinMatch > (uint64_t) (oend - op))) {
+            return EINVAL;
+        }
+    
+        match += kLZMinMatch;
+    
+        // Overlapping match repeats the last offset bytes, copies no longer than offset do that in order
+        const uint8_t* ref = op - offset;
+        uint64_t room = (uint64_t) (oend - op);
+        uint64_t i;
+        if (offset == 1) {
+            memset(op, *ref, match);
+        } else if ((offset >= kLZWildCopy) && (room >= match + kLZWildCopy)) {
+            for (i = 0; i < match; i += kLZWildCopy) {
+                memcpy(op + i, ref + i, kLZWildCopy);
+            }
+        } else if ((offset >= 8) && (room >= match + 8)) {
+            for (i = 0; i < match; i += 8) {
+                memcpy(op + i, ref + i, 8);
+            }
+        } else if (offset >= match) {
+            memcpy(op, ref, match);
+        } else {
+            for (i = 0; i < match; ++i) {
+                op[i] = ref[i];
+            }
+        }
+    
+        op += match;
+    }
+    
+    return (op == oend) ? 0 : EINVAL;
+}
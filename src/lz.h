@@ -0,0 +1,31 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Byte oriented LZ77 codec for compressed images.
+//
+//  Blocks use LZ4 block layout: sequences of a token, literals, 16-bit match offset and match length,
+//  with the last sequence literals only. Compressor is greedy with a single hash probe, which is what makes
+//  it fast rather than good. Decompressor checks every length and offset against both buffers, so a broken
+//  image gives an error and never a read out of bounds.
+//
+
+#ifndef LOOP_LZ_H
+#define LOOP_LZ_H
+
+#include <stdint.h>
+
+
+/**
+ * Compress a block.
+ * @param capacity  Size of dst.
+ * @return          Compressed size, or 0 if it would not fit into capacity.
+ */
+uint64_t lz_compress(const void* src, uint64_t nbytes, void* dst, uint64_t capacity);
+
+/**
+ * Decompress a block, which has to decompress to exactly size bytes.
+ * @return          0 or EINVAL for broken data.
+ */
+int lz_decompress(const void* src, uint64_t nbytes, void* dst, uint64_t size);
+
+#endif
@@ -0,0 +1,891 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "overlay.h"
+
+
+enum {
+    kOverlayHeaderBytes     = 4096,             // Header and base path, read at once, minimum cluster size
+    kOverlayCacheBytes      = 8 * 1024 * 1024,  // L2 table cache size
+    kOverlayMinCacheTables  = 4,
+    kOverlayAlign           = 4096,             // Metadata and copy buffer alignment, for direct io
+};
+
+enum {
+    kOverlayRun_Delta       = 0,                // Clusters copied into delta file, one after another
+    kOverlayRun_Base        = 1,                // Clusters still in base image
+    kOverlayRun_Zero        = 2,                // Discarded clusters
+};
+
+
+// Cached L2 table
+struct OverlayTable {
+    uint64_t*               entries;
+    uint32_t                index;          // L1 index
+    int                     valid;
+    int                     dirty;          // Changed since it was last written
+    uint64_t                used;           // Last use tick
+};
+
+
+struct Overlay {
+    int                     baseFd;         // Base image, read through page cache so devices sharing it share its pages
+    uint64_t                baseSize;
+    uint64_t                size;           // Device size
+    uint32_t                clusterBits;
+    uint64_t                clusterSize;
+    uint32_t                l2Bits;         // log2 of entries per L2 table
+
+    pthread_mutex_t         allocLock;      // Serializes table updates: copies, discards and flushes
+    pthread_mutex_t         lock;           // Protects everything below
+    uint64_t*               l1;
+    uint32_t                l1Entries;
+    uint64_t                l1Offset;
+    uint64_t                l1Bytes;        // L1 size in the file, whole clusters
+    int                     l1Dirty;
+    int32_t*                slots;          // Cache slot by L1 index or -1
+    struct OverlayTable*    tables;
+    uint32_t                ntables;
+    uint64_t                tick;
+    uint64_t                end;            // Delta file end, where next cluster goes
+
+    uint64_t                hits;           // Table lookups found in cache
+    uint64_t                misses;         // Tables read or created
+    uint64_t                writebacks;     // Dirty tables written to make room
+    uint64_t                copied;         // Clusters copied on write
+    uint64_t                allocated;      // Clusters appended to delta file
+    uint64_t                discarded;      // Clusters marked zero
+};
+
+
+static int deltaIO(struct LoopEngine* engine, uint32_t op, void* buffer, uint64_t nbytes, uint64_t offset)
+{
+    struct LoopEngineIO io;
+    
+    memset(&io, 0, sizeof(io));
+    io.op       = op;
+    io.buffer   = buffer;
+    io.nbytes   = nbytes;
+    io.offset   = offset;
+    
+    // Already on a worker thread, see overlay_open
+    return engine->lower->ops->rw(engine->lower, &io);
+}
+
+
+// Read from base image, past its end device reads zeroes
+static int baseRead(struct Overlay* ov, uint8_t* buffer, uint64_t nbytes, uint64_t offset)
+{
+    uint64_t n = (offset >= ov->baseSize) ? 0 : ov->baseSize - offset;
+    if (n > nbytes) {
+        n = nbytes;
+    }
+    
+    memset(buffer + n, 0, nbytes - n);
+    return n ? engine_pread(ov->baseFd, buffer, n, offset) : 0;
+}
+
+
+static uint64_t entryOffset(const struct Overlay* ov, uint64_t entry)
+{
+    return entry & ~(ov->clusterSize - 1);
+}
+
+
+static int entryRun(const struct Overlay* ov, uint64_t entry)
+{
+    if (entry & kLoopOverlay_Zero) {
+        return kOverlayRun_Zero;
+    }
+    
+    return entryOffset(ov, entry) ? kOverlayRun_Delta : kOverlayRun_Base;
+}
+
+
+// Find L2 table in cache, reading or creating it if needed. Lock is held.
+// Dirty table evicted to make room is written only after data, which its entries point to, is flushed.
+// @param create    Create table L1 does not point to yet.
+// @return          Table, or NULL if there is none, or NULL with error set.
+static struct OverlayTable* getTable(struct LoopEngine* engine, struct Overlay* ov, uint32_t index, int create, int* error)
+{
+    struct OverlayTable* table;
+    uint32_t i;
+    
+    *error = 0;
+    
+    if (ov->slots[index] >= 0) {
+        table = &ov->tables[ov->slots[index]];
+        table->used = ++ov->tick;
+        ov->hits++;
+        return table;
+    }
+    
+    if (!ov->l1[index] && !create) {
+        return NULL;
+    }
+    
+    // Least recently used slot, a free one if there is any
+    for (i = 0, table = NULL; i < ov->ntables; ++i) {
+        if (!ov->tables[i].valid) {
+            table = &ov->tables[i];
+            break;
+        }
+    
+        if (!table || (ov->tables[i].used < table->used)) {
+            table = &ov->tables[i];
+        }
+    }
+    
+    if (table->valid) {
+        if (table->dirty) {
+            *error = deltaIO(engine, kLoopEngineOp_Flush, NULL, 0, 0);
+            if (!*error) {
+                *error = deltaIO(engine, kLoopEngineOp_Write, table->entries, ov->clusterSize, ov->l1[table->index]);
+            }
+            if (*error) {
+                return NULL;
+            }
+    
+            table->dirty = 0;
+            ov->writebacks++;
+        }
+    
+        ov->slots[table->index] = -1;
+        table->valid = 0;
+    }
+    
+    if (ov->l1[index]) {
+        *error = deltaIO(engine, kLoopEngineOp_Read, table->entries, ov->clusterSize, ov->l1[index]);
+        if (*error) {
+            return NULL;
+        }
+    } else {
+        // New table is written once it is evicted or flushed, L1 pointing to it only after that
+        memset(table->entries, 0, ov->clusterSize);
+        ov->l1[index] = ov->end;
+        ov->l1Dirty = 1;
+        ov->end += ov->clusterSize;
+        table->dirty = 1;
+    }
+    
+    table->index = index;
+    table->valid = 1;
+    table->used = ++ov->tick;
+    ov->slots[index] = (int32_t) (table - ov->tables);
+    ov->misses++;
+    return table;
+}
+
+
+static int getEntry(struct LoopEngine* engine, struct Overlay* ov, uint64_t cluster, uint64_t* entry)
+{
+    uint64_t mask = ((uint64_t) 1 << ov->l2Bits) - 1;
+    int error;
+    
+    pthread_mutex_lock(&ov->lock);
+    struct OverlayTable* table = getTable(engine, ov, (uint32_t) (cluster >> ov->l2Bits), 0, &error);
+    *entry = table ? table->entries[cluster & mask] : 0;
+    pthread_mutex_unlock(&ov->lock);
+    
+    return error;
+}
+
+
+// Alloc lock is held
+static int setEntry(struct LoopEngine* engine, struct Overlay* ov, uint64_t cluster, uint64_t entry)
+{
+    uint64_t mask = ((uint64_t) 1 << ov->l2Bits) - 1;
+    int error;
+    
+    pthread_mutex_lock(&ov->lock);
+    struct OverlayTable* table = getTable(engine, ov, (uint32_t) (cluster >> ov->l2Bits), 1, &error);
+    if (table) {
+        table->entries[cluster & mask] = entry;
+        table->dirty = 1;
+    }
+    pthread_mutex_unlock(&ov->lock);
+    
+    return error;
+}
+
+
+// Find how far a run of clusters of the same kind goes from offset, reads and writes handle it at once
+// @param entry     Entry of the cluster offset is in.
+// @return          Run end, at most end.
+static uint64_t runEnd(struct LoopEngine* engine, struct Overlay* ov, uint64_t entry, uint64_t offset, uint64_t end, int* error)
+{
+    uint64_t first = offset >> ov->clusterBits;
+    uint64_t next = (first + 1) << ov->clusterBits;
+    int kind = entryRun(ov, entry);
+    
+    while (next < end) {
+        uint64_t e;
+        *error = getEntry(engine, ov, next >> ov->clusterBits, &e);
+        if (*error || (entryRun(ov, e) != kind)) {
+            break;
+        }
+    
+        // Delta clusters have to follow one another in the file too
+        if ((kind == kOverlayRun_Delta) && (entryOffset(ov, e) != entryOffset(ov, entry) + (next - (first << ov->clusterBits)))) {
+            break;
+        }
+    
+        next += ov->clusterSize;
+    }
+    
+    return (next < end) ? next : end;
+}
+
+
+static int overlayRead(struct LoopEngine* engine, struct Overlay* ov, struct LoopEngineIO* io)
+{
+    uint8_t* buffer = (uint8_t*) io->buffer;
+    uint64_t offset = io->offset;
+    uint64_t end = io->offset + io->nbytes;
+    uint64_t entry;
+    int error = 0;
+    
+    while (!error && (offset < end)) {
+        error = getEntry(engine, ov, offset >> ov->clusterBits, &entry);
+        if (error) {
+            break;
+        }
+    
+        uint64_t to = runEnd(engine, ov, entry, offset, end, &error);
+        if (error) {
+            break;
+        }
+    
+        uint8_t* p = buffer + (offset - io->offset);
+    
+        switch (entryRun(ov, entry)) {
+        case kOverlayRun_Delta:
+            error = deltaIO(engine, kLoopEngineOp_Read, p, to - offset, entryOffset(ov, entry) + (offset & (ov->clusterSize - 1)));
+            break;
+    
+        case kOverlayRun_Base:
+            error = baseRead(ov, p, to - offset, offset);
+            break;
+    
+        default:
+            memset(p, 0, to - offset);
+            break;
+        }
+    
+        offset = to;
+    }
+    
+    return error;
+}
+
+
+// Write part of a cluster that is not in delta file yet. Rest of the cluster comes from base,
+// or is zero for discarded clusters, which keep their place in delta file.
+static int copyOnWrite(struct LoopEngine* engine, struct Overlay* ov, const uint8_t* data, uint64_t offset, uint64_t nbytes)
+{
+    uint64_t cluster = offset >> ov->clusterBits;
+    uint64_t start = cluster << ov->clusterBits;
+    uint8_t* copy = NULL;
+    uint64_t entry;
+    
+    pthread_mutex_lock(&ov->allocLock);
+    
+    // Cluster may have been copied while we waited
+    int error = getEntry(engine, ov, cluster, &entry);
+    if (error) {
+        goto ERROR_OUT;
+    }
+    
+    if (entryRun(ov, entry) == kOverlayRun_Delta) {
+        error = deltaIO(engine, kLoopEngineOp_Write, (void*) data, nbytes, entryOffset(ov, entry) + (offset - start));
+        goto ERROR_OUT;
+    }
+    
+    if (posix_memalign((void**) &copy, kOverlayAlign, ov->clusterSize)) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    if (nbytes < ov->clusterSize) {
+        if (entry & kLoopOverlay_Zero) {
+            memset(copy, 0, ov->clusterSize);
+        } else {
+            error = baseRead(ov, copy, ov->clusterSize, start);
+            if (error) {
+                goto ERROR_OUT;
+            }
+            ov->copied++;
+        }
+    }
+    
+    memcpy(copy + (offset - start), data, nbytes);
+    
+    uint64_t target = entryOffset(ov, entry);
+    if (!target) {
+        pthread_mutex_lock(&ov->lock);
+        target = ov->end;
+        ov->end += ov->clusterSize;
+        ov->allocated++;
+        pthread_mutex_unlock(&ov->lock);
+    }
+    
+    error = deltaIO(engine, kLoopEngineOp_Write, copy, ov->clusterSize, target);
+    if (!error) {
+        error = setEntry(engine, ov, cluster, target);
+    }
+    
+ERROR_OUT:
+    
+    pthread_mutex_unlock(&ov->allocLock);
+    free(copy);
+    return error;
+}
+
+
+static int overlayWrite(struct LoopEngine* engine, struct Overlay* ov, struct LoopEngineIO* io)
+{
+    const uint8_t* buffer = (const uint8_t*) io->buffer;
+    uint64_t offset = io->offset;
+    uint64_t end = io->offset + io->nbytes;
+    uint64_t entry;
+    int error = 0;
+    
+    while (!error && (offset < end)) {
+        error = getEntry(engine, ov, offset >> ov->clusterBits, &entry);
+        if (error) {
+            break;
+        }
+    
+        const uint8_t* p = buffer + (offset - io->offset);
+        uint64_t to;
+    
+        if (entryRun(ov, entry) == kOverlayRun_Delta) {
+            to = runEnd(engine, ov, entry, offset, end, &error);
+            if (error) {
+                break;
+            }
+    
+            error = deltaIO(engine, kLoopEngineOp_Write, (void*) p, to - offset, entryOffset(ov, entry) + (offset & (ov->clusterSize - 1)));
+        } else {
+            to = ((offset >> ov->clusterBits) + 1) << ov->clusterBits;
+            to = (to < end) ? to : end;
+            error = copyOnWrite(engine, ov, p, offset, to - offset);
+        }
+    
+        offset = to;
+    }
+    
+    return error;
+}
+
+
+// Only whole clusters are discarded, parts of clusters keep reading what they did
+static int overlayDiscard(struct LoopEngine* engine, struct Overlay* ov, struct LoopEngineIO* io)
+{
+    uint64_t first = (io->offset + ov->clusterSize - 1) >> ov->clusterBits;
+    uint64_t last = (io->offset + io->nbytes) >> ov->clusterBits;
+    uint64_t cluster;
+    uint64_t entry;
+    int error = 0;
+    
+    for (cluster = first; !error && (cluster < last); ++cluster) {
+        pthread_mutex_lock(&ov->allocLock);
+    
+        error = getEntry(engine, ov, cluster, &entry);
+        uint64_t target = entryOffset(ov, entry);
+    
+        // Clusters past base image that were never written read zeroes already
+        if (!error && !(entry & kLoopOverlay_Zero) && (target || ((cluster << ov->clusterBits) < ov->baseSize))) {
+            error = setEntry(engine, ov, cluster, target | kLoopOverlay_Zero);
+            ov->discarded++;
+    
+            // Cluster reads zeroes whether its copy goes away or not
+            if (!error && target) {
+                error = deltaIO(engine, kLoopEngineOp_Discard, NULL, ov->clusterSize, target);
+                if ((error == ENOTSUP) || (error == EOPNOTSUPP)) {
+                    error = 0;
+                }
+            }
+        }
+    
+        pthread_mutex_unlock(&ov->allocLock);
+    }
+    
+    return error;
+}
+
+
+// Data goes to disk first, then tables pointing to it and then L1 pointing to new tables
+static int overlayFlush(struct LoopEngine* engine, struct Overlay* ov)
+{
+    uint32_t i;
+    int written = 0;
+    
+    pthread_mutex_lock(&ov->allocLock);
+    
+    int error = deltaIO(engine, kLoopEngineOp_Flush, NULL, 0, 0);
+    
+    pthread_mutex_lock(&ov->lock);
+    
+    for (i = 0; !error && (i < ov->ntables); ++i) {
+        struct OverlayTable* table = &ov->tables[i];
+        if (table->valid && table->dirty) {
+            error = deltaIO(engine, kLoopEngineOp_Write, table->entries, ov->clusterSize, ov->l1[table->index]);
+            table->dirty = error ? 1 : 0;
+            written = 1;
+        }
+    }
+    
+    if (!error && ov->l1Dirty) {
+        error = deltaIO(engine, kLoopEngineOp_Flush, NULL, 0, 0);
+        if (!error) {
+            error = deltaIO(engine, kLoopEngineOp_Write, ov->l1, ov->l1Bytes, ov->l1Offset);
+        }
+        ov->l1Dirty = error ? 1 : 0;
+        written = 1;
+    }
+    
+    pthread_mutex_unlock(&ov->lock);
+    
+    if (!error && written) {
+        error = deltaIO(engine, kLoopEngineOp_Flush, NULL, 0, 0);
+    }
+    
+    pthread_mutex_unlock(&ov->allocLock);
+    return error;
+}
+
+
+static int overlayRW(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    struct Overlay* ov = (struct Overlay*) engine->priv;
+    
+    if ((io->op != kLoopEngineOp_Flush) && ((io->offset > ov->size) || (io->nbytes > ov->size - io->offset))) {
+        return EINVAL;
+    }
+    
+    if ((io->op != kLoopEngineOp_Read) && (engine->flags & kLoopEngineFlag_ReadOnly)) {
+        return (io->op == kLoopEngineOp_Flush) ? 0 : EROFS;
+    }
+    
+    switch (io->op) {
+    case kLoopEngineOp_Read:
+        return overlayRead(engine, ov, io);
+    
+    case kLoopEngineOp_Write:
+        return overlayWrite(engine, ov, io);
+    
+    case kLoopEngineOp_Flush:
+        return overlayFlush(engine, ov);
+    
+    case kLoopEngineOp_Discard:
+        return overlayDiscard(engine, ov, io);
+    
+    default:
+        return EINVAL;
+    }
+}
+
+
+// Check header read from the start of a file
+// @param fileSize  Size of the file, L1 has to fit.
+// @return          1 for valid overlay header, 0 for other files, -1 with errno set for broken one.
+static int parseHeader(const uint8_t* buffer, uint64_t nbytes, uint64_t fileSize, struct LoopOverlayHeader* header)
+{
+    if (nbytes < sizeof(*header)) {
+        return 0;
+    }
+    
+    memcpy(header, buffer, sizeof(*header));
+    if (header->magic != kLoopOverlayMagic) {
+        return 0;
+    }
+    
+    uint64_t clusterSize = (uint64_t) 1 << header->clusterBits;
+    uint64_t tableSpan = clusterSize * (clusterSize / sizeof(uint64_t));
+    
+    if ((header->version != kLoopOverlayVersion) ||
+        (header->clusterBits < kLoopOverlayMinClusterBits) || (header->clusterBits > kLoopOverlayMaxClusterBits) ||
+        (header->baseLength >= kOverlayHeaderBytes - sizeof(*header)) || (header->baseLength >= PATH_MAX) ||
+        (header->baseLength > nbytes - sizeof(*header)) ||
+        (header->l1Entries != (header->size + tableSpan - 1) / tableSpan) ||
+        !header->l1Offset || (header->l1Offset & (clusterSize - 1)) ||
+        (header->l1Offset + (uint64_t) header->l1Entries * sizeof(uint64_t) > fileSize)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    return 1;
+}
+
+
+static void infoFromHeader(const struct LoopOverlayHeader* header, const uint8_t* buffer, struct LoopOverlayInfo* info)
+{
+    info->size = header->size;
+    info->clusterSize = (uint32_t) 1 << header->clusterBits;
+    memcpy(info->base, buffer + sizeof(*header), header->baseLength);
+    info->base[header->baseLength] = 0;
+}
+
+
+// Relative base path is relative to the directory overlay is in
+static void resolveBase(const char* file, const char* base, char* path)
+{
+    const char* slash = strrchr(file, '/');
+    
+    if ((base[0] == '/') || !slash) {
+        snprintf(path, PATH_MAX, "%s", base);
+    } else {
+        snprintf(path, PATH_MAX, "%.*s/%s", (int) (slash - file), file, base);
+    }
+}
+
+
+static int overlayOpen(struct LoopEngine* engine)
+{
+    struct LoopEngine* lower = engine->lower;
+    struct LoopOverlayHeader header;
+    struct LoopOverlayInfo info;
+    char path[PATH_MAX];
+    struct stat st;
+    uint8_t* buffer = NULL;
+    uint32_t i;
+    int error;
+    
+    // Mapping has the size file had when it was opened
+    if (!(engine->flags & kLoopEngineFlag_ReadOnly) && !strcmp(lower->ops->name, "mmap")) {
+        return ENOTSUP;
+    }
+    
+    struct Overlay* ov = (struct Overlay*) calloc(1, sizeof(*ov));
+    if (!ov) {
+        return ENOMEM;
+    }
+    
+    ov->baseFd = -1;
+    pthread_mutex_init(&ov->allocLock, NULL);
+    pthread_mutex_init(&ov->lock, NULL);
+    
+    if (posix_memalign((void**) &buffer, kOverlayAlign, kOverlayHeaderBytes)) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    error = (lower->size < kOverlayHeaderBytes) ? EINVAL : deltaIO(engine, kLoopEngineOp_Read, buffer, kOverlayHeaderBytes, 0);
+    if (error) {
+        goto ERROR_OUT;
+    }
+    
+    if (1 != parseHeader(buffer, kOverlayHeaderBytes, lower->size, &header)) {
+        error = EINVAL;
+        goto ERROR_OUT;
+    }
+    
+    infoFromHeader(&header, buffer, &info);
+    
+    ov->size        = header.size;
+    ov->clusterBits = header.clusterBits;
+    ov->clusterSize = (uint64_t) 1 << header.clusterBits;
+    ov->l2Bits      = header.clusterBits - 3;
+    ov->l1Entries   = header.l1Entries;
+    ov->l1Offset    = header.l1Offset;
+    ov->l1Bytes     = ((uint64_t) header.l1Entries * sizeof(uint64_t) + ov->clusterSize - 1) & ~(ov->clusterSize - 1);
+    ov->end         = (lower->size + ov->clusterSize - 1) & ~(ov->clusterSize - 1);
+    
+    if (ov->end < ov->l1Offset + ov->l1Bytes) {
+        ov->end = ov->l1Offset + ov->l1Bytes;
+    }
+    
+    resolveBase(engine->file, info.base, path);
+    ov->baseFd = open(path, O_RDONLY);
+    if ((ov->baseFd < 0) || (0 != fstat(ov->baseFd, &st))) {
+        error = errno;
+        goto ERROR_OUT;
+    }
+    
+    ov->baseSize = (uint64_t) st.st_size;
+    
+    // Whole L1 stays in memory, it is what attach reads
+    ov->ntables = kOverlayCacheBytes / ov->clusterSize;
+    if (ov->ntables > ov->l1Entries) {
+        ov->ntables = ov->l1Entries;
+    }
+    if (ov->ntables < kOverlayMinCacheTables) {
+        ov->ntables = kOverlayMinCacheTables;
+    }
+    
+    ov->slots = (int32_t*) malloc(ov->l1Entries * sizeof(*ov->slots));
+    ov->tables = (struct OverlayTable*) calloc(ov->ntables, sizeof(*ov->tables));
+    if (!ov->slots || !ov->tables || posix_memalign((void**) &ov->l1, kOverlayAlign, ov->l1Bytes)) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    for (i = 0; i < ov->l1Entries; ++i) {
+        ov->slots[i] = -1;
+    }
+    
+    for (i = 0; i < ov->ntables; ++i) {
+        if (posix_memalign((void**) &ov->tables[i].entries, kOverlayAlign, ov->clusterSize)) {
+            error = ENOMEM;
+            goto ERROR_OUT;
+        }
+    }
+    
+    error = deltaIO(engine, kLoopEngineOp_Read, ov->l1, ov->l1Bytes, ov->l1Offset);
+    if (error) {
+        goto ERROR_OUT;
+    }
+    
+    free(buffer);
+    engine->size = ov->size;
+    engine->priv = ov;
+    return 0;
+    
+ERROR_OUT:
+    
+    if (ov->tables) {
+        for (i = 0; i < ov->ntables; ++i) {
+            free(ov->tables[i].entries);
+        }
+    }
+    
+    if (ov->baseFd >= 0) {
+        close(ov->baseFd);
+    }
+    
+    pthread_mutex_destroy(&ov->lock);
+    pthread_mutex_destroy(&ov->allocLock);
+    free(ov->tables);
+    free(ov->slots);
+    free(ov->l1);
+    free(ov);
+    free(buffer);
+    return error;
+}
+
+
+static void overlayClose(struct LoopEngine* engine)
+{
+    struct Overlay* ov = (struct Overlay*) engine->priv;
+    uint32_t i;
+    
+    if (!(engine->flags & kLoopEngineFlag_ReadOnly)) {
+        int error = overlayFlush(engine, ov);
+        if (error) {
+            fprintf(stderr, "Could not write overlay tables: %s\n", strerror(error));
+        }
+    }
+    
+    printf("Overlay: %llu clusters copied from base, %llu appended, %llu discarded, "
+           "%u cached tables, %llu hits, %llu misses, %llu written back\n",
+           (unsigned long long) ov->copied, (unsigned long long) ov->allocated, (unsigned long long) ov->discarded,
+           ov->ntables, (unsigned long long) ov->hits, (unsigned long long) ov->misses, (unsigned long long) ov->writebacks);
+    
+    for (i = 0; i < ov->ntables; ++i) {
+        free(ov->tables[i].entries);
+    }
+    
+    close(ov->baseFd);
+    pthread_mutex_destroy(&ov->lock);
+    pthread_mutex_destroy(&ov->allocLock);
+    free(ov->tables);
+    free(ov->slots);
+    free(ov->l1);
+    free(ov);
+}
+
+
+static const struct LoopEngineOps gOverlayEngineOps = {
+    .name       = "overlay",
+    .open       = overlayOpen,
+    .close      = overlayClose,
+    .rw         = overlayRW,
+};
+
+
+struct LoopEngine* overlay_open(struct LoopEngine* lower, struct LoopWorkQueue* workers, unsigned depth)
+{
+    return workers ? engine_stack_shared(&gOverlayEngineOps, lower, workers, depth, NULL) :
+                     engine_stack(&gOverlayEngineOps, lower, 1, depth, NULL);
+}
+
+
+int overlay_probe(const char* file, struct LoopOverlayInfo* info)
+{
+    struct LoopOverlayHeader header;
+    uint8_t buffer[kOverlayHeaderBytes];
+    struct stat st;
+    
+    int fd = open(file, O_RDONLY);
+    if ((fd < 0) || (0 != fstat(fd, &st))) {
+        int error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        errno = error;
+        return -1;
+    }
+    
+    ssize_t rc = pread(fd, buffer, sizeof(buffer), 0);
+    int error = errno;
+    close(fd);
+    
+    if (rc < 0) {
+        errno = error;
+        return -1;
+    }
+    
+    int found = parseHeader(buffer, (uint64_t) rc, (uint64_t) st.st_size, &header);
+    if ((found == 1) && info) {
+        infoFromHeader(&header, buffer, info);
+    }
+    
+    return found;
+}
+
+
+int overlay_usage(const char* file, uint64_t* allocated, uint64_t* zeroed)
+{
+    struct LoopOverlayHeader header;
+    uint8_t buffer[kOverlayHeaderBytes];
+    uint64_t* l1 = NULL;
+    uint64_t* table = NULL;
+    struct stat st;
+    uint32_t i, j;
+    int error = 0;
+    
+    *allocated = 0;
+    *zeroed = 0;
+    
+    int fd = open(file, O_RDONLY);
+    if ((fd < 0) || (0 != fstat(fd, &st))) {
+        error = errno;
+        goto ERROR_OUT;
+    }
+    
+    ssize_t rc = pread(fd, buffer, sizeof(buffer), 0);
+    if ((rc < 0) || (1 != parseHeader(buffer, (uint64_t) rc, (uint64_t) st.st_size, &header))) {
+        error = (rc < 0) ? errno : EINVAL;
+        goto ERROR_OUT;
+    }
+    
+    uint64_t clusterSize = (uint64_t) 1 << header.clusterBits;
+    uint32_t nentries = (uint32_t) (clusterSize / sizeof(uint64_t));
+    
+    l1 = (uint64_t*) malloc(header.l1Entries * sizeof(*l1));
+    table = (uint64_t*) malloc(clusterSize);
+    if (!l1 || !table) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    error = engine_pread(fd, l1, header.l1Entries * sizeof(*l1), header.l1Offset);
+    
+    for (i = 0; !error && (i < header.l1Entries); ++i) {
+        if (!l1[i]) {
+            continue;
+        }
+    
+        error = engine_pread(fd, table, clusterSize, l1[i]);
+        for (j = 0; !error && (j < nentries); ++j) {
+            if (table[j] & kLoopOverlay_Zero) {
+                (*zeroed)++;
+            } else if (table[j]) {
+                (*allocated)++;
+            }
+        }
+    }
+    
+ERROR_OUT:
+    
+    if (fd >= 0) {
+        close(fd);
+    }
+    
+    free(table);
+    free(l1);
+    return error;
+}
+
+
+int overlay_create(const char* file, const char* base, uint64_t size, uint32_t clusterBits)
+{
+    struct LoopOverlayHeader header;
+    char path[PATH_MAX];
+    struct stat st;
+    uint8_t* buffer = NULL;
+    int error = 0;
+    
+    size_t baseLength = strlen(base);
+    if ((clusterBits < kLoopOverlayMinClusterBits) || (clusterBits > kLoopOverlayMaxClusterBits) ||
+        (baseLength >= kOverlayHeaderBytes - sizeof(header)) || (baseLength >= PATH_MAX)) {
+        return EINVAL;
+    }
+    
+    // Base has to be found from where overlay is
+    resolveBase(file, base, path);
+    if (0 != stat(path, &st)) {
+        return errno;
+    }
+    
+    uint64_t clusterSize = (uint64_t) 1 << clusterBits;
+    uint64_t tableSpan = clusterSize * (clusterSize / sizeof(uint64_t));
+    
+    memset(&header, 0, sizeof(header));
+    header.magic        = kLoopOverlayMagic;
+    header.version      = kLoopOverlayVersion;
+    header.clusterBits  = clusterBits;
+    header.size         = size ? size : (uint64_t) st.st_size;
+    header.l1Offset     = clusterSize;
+    header.l1Entries    = (uint32_t) ((header.size + tableSpan - 1) / tableSpan);
+    header.baseLength   = (uint32_t) baseLength;
+    
+    if (!header.size || ((header.size + tableSpan - 1) / tableSpan > UINT32_MAX)) {
+        return EINVAL;
+    }
+    
+    uint64_t l1Bytes = ((uint64_t) header.l1Entries * sizeof(uint64_t) + clusterSize - 1) & ~(clusterSize - 1);
+    
+    buffer = (uint8_t*) calloc(1, clusterSize);
+    if (!buffer) {
+        return ENOMEM;
+    }
+    
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), base, baseLength);
+    
+    int fd = open(file, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        free(buffer);
+        return errno;
+    }
+    
+    // Empty L1 is a hole
+    error = engine_pwrite(fd, buffer, clusterSize, 0);
+    if (!error && (0 != ftruncate(fd, (off_t) (header.l1Offset + l1Bytes)))) {
+        error = errno;
+    }
+    if (!error) {
+        error = engine_fdatasync(fd);
+    }
+    
+    close(fd);
+    free(buffer);
+    
+    if (error) {
+        unlink(file);
+    }
+    
+    return error;
+}
@@ -0,0 +1,95 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Copy-on-write overlay images.
+//
+//  Overlay image is a delta file on top of a read-only raw base image, so that many devices can run off one
+//  golden image without copying it. Device is cut into clusters, a two level table maps every cluster either to
+//  a cluster of the delta file or to the same place in the base. First write to a cluster copies it from the
+//  base into a new cluster appended to the delta file, later ios go straight to the copy. Discarded clusters
+//  are marked zero and their copies punched out. Attach reads header and first level table only.
+//
+//  On disk, in host byte order:
+//      cluster 0       LoopOverlayHeader, then base image path, relative ones are relative to the overlay
+//      l1Offset        L1 table, offsets of L2 tables or 0, as many clusters as it takes
+//      elsewhere       L2 tables of cluster size, offsets of data clusters or 0 with kLoopOverlay_Zero flag,
+//                      and data clusters in the order they were first written
+//
+//  L2 tables are kept in a cache of limited size. Table updates are written only once data they point to
+//  has been flushed, on flush, on close or when a dirty table is evicted, so a crash never leaves a table
+//  pointing to data that did not make it to disk. Writes that were not flushed may be lost, as with raw files.
+//
+
+#ifndef LOOP_OVERLAY_H
+#define LOOP_OVERLAY_H
+
+#include <stdint.h>
+#include <limits.h>
+
+#include "engine.h"
+
+
+#define kLoopOverlayMagic   0x31574f43504f4f4cull   // "LOOPCOW1"
+
+enum {
+    kLoopOverlayVersion         = 1,
+    kLoopOverlayMinClusterBits  = 12,           // 4K
+    kLoopOverlayMaxClusterBits  = 21,           // 2M
+    kLoopOverlayDefaultClusterBits = 16,        // 64K, one L2 table maps 512M
+    kLoopOverlay_Zero           = 0x1,          // L2 entry flag, cluster reads as zeroes, offset if any is kept for reuse
+};
+
+
+struct LoopOverlayHeader {
+    uint64_t            magic;          // kLoopOverlayMagic
+    uint32_t            version;        // kLoopOverlayVersion
+    uint32_t            clusterBits;    // log2 of cluster size
+    uint64_t            size;           // Device size in bytes
+    uint64_t            l1Offset;       // L1 table offset in bytes, cluster aligned
+    uint32_t            l1Entries;      // Number of L2 tables device needs
+    uint32_t            baseLength;     // Length of base path following header, no terminating zero
+    uint64_t            reserved[3];
+};
+
+
+// What overlay_probe finds out about an image
+struct LoopOverlayInfo {
+    uint64_t            size;           // Device size in bytes
+    uint32_t            clusterSize;
+    char                base[PATH_MAX]; // Base image path as stored in header
+};
+
+
+/**
+ * Create overlay image on top of a base image.
+ * @param size      Device size in bytes, 0 for base image size. Past base image size device reads zeroes.
+ * @param clusterBits   log2 of cluster size, kLoopOverlayMinClusterBits to kLoopOverlayMaxClusterBits.
+ * @return          0 or errno. Existing file is not overwritten.
+ */
+int overlay_create(const char* file, const char* base, uint64_t size, uint32_t clusterBits);
+
+/**
+ * Check if file is an overlay image.
+ * @param info      Filled in for overlay images, may be NULL.
+ * @return          1 for overlay image, 0 for any other file, -1 with errno set if file cannot be read or header is bad.
+ */
+int overlay_probe(const char* file, struct LoopOverlayInfo* info);
+
+/**
+ * Count clusters overlay image holds. Image must not be in use.
+ * @param allocated Set to number of clusters copied into delta file.
+ * @param zeroed    Set to number of clusters marked zero.
+ * @return          0 or errno.
+ */
+int overlay_usage(const char* file, uint64_t* allocated, uint64_t* zeroed);
+
+/**
+ * Stack overlay on top of the engine of its delta file, opening the base image it names.
+ * Delta file ios run synchronously on overlay workers, lower engine needs no workers of its own.
+ * @param lower     Engine of overlay image file, owned by overlay engine from now on. Mapped engines cannot grow the file.
+ * @param workers   Shared worker pool, or NULL for a worker thread of its own.
+ * @return          Overlay engine sized like the device, or NULL with errno set, lower engine is left open on failure.
+ */
+struct LoopEngine* overlay_open(struct LoopEngine* lower, struct LoopWorkQueue* workers, unsigned depth);
+
+#endif
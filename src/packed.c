@@ -0,0 +1,729 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "packed.h"
+#include "lz.h"
+#include "zero.h"
+#include "workq.h"
+
+
+enum {
+    kPackedCacheBytes       = 64 * 1024 * 1024, // Decompressed chunk cache size
+    kPackedReadaheadBytes   = 2 * 1024 * 1024,  // How far ahead of sequential reads chunks are decompressed
+    kPackedMinReadahead     = 2,                // Chunks, whatever their size
+    kPackedMaxBatch         = 16,               // Chunks a read pins in cache at once
+    kPackedStreams          = 16,               // Sequential read streams followed at once
+    kPackedAlign            = 4096,
+};
+
+enum {
+    kPackedChunk_Free       = 0,
+    kPackedChunk_Loading    = 1,                // Being decompressed, wait for it
+    kPackedChunk_Ready      = 2,
+};
+
+
+// Cached decompressed chunk
+struct PackedChunk {
+    uint8_t*                data;
+    uint64_t                index;          // Chunk number
+    int                     state;          // kPackedChunk_XXX
+    int                     error;          // Decompression error, chunk is dropped once nobody holds it
+    uint32_t                pins;           // Reads copying out of it, it cannot be evicted
+    uint64_t                used;           // Last use tick
+};
+
+
+// Decoder work item
+struct PackedJob {
+    struct LoopEngine*      engine;
+    struct PackedChunk*     chunk;
+};
+
+
+struct Packed {
+    uint64_t                size;           // Device size
+    uint32_t                chunkBits;
+    uint64_t                chunkSize;
+    uint64_t                nchunks;
+    uint64_t*               index;          // nchunks + 1 image offsets
+    uint32_t                readahead;      // Chunks decompressed ahead of sequential reads
+    struct LoopWorkQueue*   decoders;
+    uint8_t*                memory;         // Cache buffers
+
+    pthread_mutex_t         lock;           // Protects everything below
+    pthread_cond_t          cond;           // Chunk got loaded or unpinned
+    struct PackedChunk*     chunks;
+    uint32_t                nslots;
+    int32_t*                slots;          // Cache slot by chunk number or -1
+    uint64_t                tick;
+    uint64_t                streams[kPackedStreams]; // Where recent reads ended, sequential ones start there
+    uint32_t                nextStream;     // Stream slot replaced by the next read that is not sequential
+
+    uint64_t                hits;           // Chunks reads found decompressed
+    uint64_t                waits;          // Chunks reads found being decompressed ahead of them
+    uint64_t                misses;         // Chunks reads had to have decompressed
+    uint64_t                decoded;        // Chunks decompressed
+    uint64_t                prefetched;     // Chunks decompressed ahead of sequential reads
+    uint64_t                packedBytes;    // Image bytes read
+};
+
+
+static int imageRead(struct LoopEngine* engine, void* buffer, uint64_t nbytes, uint64_t offset)
+{
+    struct LoopEngineIO io;
+    
+    memset(&io, 0, sizeof(io));
+    io.op       = kLoopEngineOp_Read;
+    io.buffer   = buffer;
+    io.nbytes   = nbytes;
+    io.offset   = offset;
+    
+    // Already on a worker or decoder thread, see packed_open
+    return engine->lower->ops->rw(engine->lower, &io);
+}
+
+
+// Uncompressed chunk size, last one may be short
+static uint64_t chunkLength(const struct Packed* pk, uint64_t i)
+{
+    uint64_t start = i << pk->chunkBits;
+    return (pk->size - start < pk->chunkSize) ? pk->size - start : pk->chunkSize;
+}
+
+
+static int decodeChunk(struct LoopEngine* engine, struct Packed* pk, uint64_t i, uint8_t* data)
+{
+    uint64_t offset = pk->index[i];
+    uint64_t nbytes = pk->index[i + 1] - offset;
+    uint64_t length = chunkLength(pk, i);
+    uint8_t* packed;
+    
+    // Chunks that did not compress are stored as they are
+    if (nbytes == length) {
+        return imageRead(engine, data, nbytes, offset);
+    }
+    
+    packed = (uint8_t*) malloc(nbytes);
+    if (!packed) {
+        return ENOMEM;
+    }
+    
+    int error = imageRead(engine, packed, nbytes, offset);
+    if (!error) {
+        error = lz_decompress(packed, nbytes, data, length);
+    }
+    
+    free(packed);
+    return error;
+}
+
+
+// Lock is held
+static void dropChunk(struct Packed* pk, struct PackedChunk* chunk)
+{
+    pk->slots[chunk->index] = -1;
+    chunk->state = kPackedChunk_Free;
+}
+
+
+static void loadChunk(struct LoopEngine* engine, struct Packed* pk, struct PackedChunk* chunk)
+{
+    int error = decodeChunk(engine, pk, chunk->index, chunk->data);
+    
+    pthread_mutex_lock(&pk->lock);
+    chunk->error = error;
+    chunk->state = kPackedChunk_Ready;
+    pk->decoded++;
+    pk->packedBytes += pk->index[chunk->index + 1] - pk->index[chunk->index];
+    if (error && !chunk->pins) {
+        dropChunk(pk, chunk);
+    }
+    pthread_cond_broadcast(&pk->cond);
+    pthread_mutex_unlock(&pk->lock);
+}
+
+
+static void decodeWorker(void* item, void* arg)
+{
+    struct PackedJob* job = (struct PackedJob*) item;
+    loadChunk(job->engine, (struct Packed*) job->engine->priv, job->chunk);
+}
+
+
+// Find chunk in cache or take least recently used slot for it. Lock is held.
+// @param pin       Pin chunk for a read, read ahead leaves new chunks unpinned.
+// @param load      Set if caller has to load chunk.
+// @return          Chunk, or NULL if every slot is pinned or loading.
+static struct PackedChunk* claimChunk(struct Packed* pk, uint64_t i, int pin, int* load)
+{
+    struct PackedChunk* chunk;
+    uint32_t s;
+    
+    *load = 0;
+    
+    if (pk->slots[i] >= 0) {
+        chunk = &pk->chunks[pk->slots[i]];
+        chunk->pins += pin;
+        chunk->used = ++pk->tick;
+        if (pin && (chunk->state == kPackedChunk_Ready)) {
+            pk->hits++;
+        } else if (pin) {
+            pk->waits++;
+        }
+        return chunk;
+    }
+    
+    for (s = 0, chunk = NULL; s < pk->nslots; ++s) {
+        struct PackedChunk* c = &pk->chunks[s];
+        if (c->state == kPackedChunk_Free) {
+            chunk = c;
+            break;
+        }
+    
+        if ((c->state == kPackedChunk_Ready) && !c->pins && (!chunk || (c->used < chunk->used))) {
+            chunk = c;
+        }
+    }
+    
+    if (!chunk) {
+        return NULL;
+    }
+    
+    if (chunk->state != kPackedChunk_Free) {
+        dropChunk(pk, chunk);
+    }
+    
+    chunk->index = i;
+    chunk->state = kPackedChunk_Loading;
+    chunk->error = 0;
+    chunk->pins = pin;
+    chunk->used = ++pk->tick;
+    pk->slots[i] = (int32_t) (chunk - pk->chunks);
+    pk->misses += pin;
+    *load = 1;
+    return chunk;
+}
+
+
+// Read is sequential if it starts where one of the last reads ended. Ends are noted as reads start, so that
+// pieces of a large read split and running in parallel follow each other too.
+static int followStream(struct Packed* pk, const struct LoopEngineIO* io)
+{
+    unsigned s;
+    
+    pthread_mutex_lock(&pk->lock);
+    
+    for (s = 0; s < kPackedStreams; ++s) {
+        if (pk->streams[s] == io->offset) {
+            break;
+        }
+    }
+    
+    int sequential = (s < kPackedStreams);
+    if (!sequential) {
+        s = pk->nextStream;
+        pk->nextStream = (pk->nextStream + 1) % kPackedStreams;
+    }
+    
+    pk->streams[s] = io->offset + io->nbytes;
+    pthread_mutex_unlock(&pk->lock);
+    return sequential;
+}
+
+
+// Sequential reads get chunks after them decompressed before they are asked for
+static void readAhead(struct LoopEngine* engine, struct Packed* pk, const struct LoopEngineIO* io)
+{
+    struct PackedJob jobs[kPackedMaxBatch];
+    uint64_t next = ((io->offset + io->nbytes - 1) >> pk->chunkBits) + 1;
+    unsigned count = 0;
+    unsigned n;
+    uint64_t i;
+    int load;
+    
+    pthread_mutex_lock(&pk->lock);
+    
+    for (i = next; (i < next + pk->readahead) && (i < pk->nchunks) && (count < kPackedMaxBatch); ++i) {
+        // Zero chunks are never cached
+        if (pk->index[i + 1] == pk->index[i]) {
+            continue;
+        }
+    
+        struct PackedChunk* chunk = claimChunk(pk, i, 0, &load);
+        if (!chunk) {
+            break;
+        }
+    
+        if (load) {
+            jobs[count].engine = engine;
+            jobs[count].chunk = chunk;
+            count++;
+            pk->prefetched++;
+        }
+    }
+    
+    pthread_mutex_unlock(&pk->lock);
+    
+    for (n = 0; n < count; ++n) {
+        workq_submit(pk->decoders, &jobs[n]);
+    }
+}
+
+
+static int packedRead(struct LoopEngine* engine, struct Packed* pk, struct LoopEngineIO* io)
+{
+    struct PackedChunk* batch[kPackedMaxBatch];
+    int load[kPackedMaxBatch];
+    uint8_t* buffer = (uint8_t*) io->buffer;
+    uint64_t offset = io->offset;
+    uint64_t end = io->offset + io->nbytes;
+    unsigned i;
+    int error = 0;
+    
+    int sequential = followStream(pk, io);
+    
+    while (offset < end) {
+        uint64_t first = offset >> pk->chunkBits;
+        uint64_t last = (end - 1) >> pk->chunkBits;
+        unsigned count = (last - first + 1 < kPackedMaxBatch) ? (unsigned) (last - first + 1) : kPackedMaxBatch;
+        int local = -1;
+    
+        // Pin all chunks first so that the missing ones are decompressed at the same time
+        pthread_mutex_lock(&pk->lock);
+        for (i = 0; i < count; ++i) {
+            batch[i] = NULL;
+            load[i] = 0;
+            if (pk->index[first + i + 1] == pk->index[first + i]) {
+                continue;
+            }
+    
+            while (!(batch[i] = claimChunk(pk, first + i, 1, &load[i]))) {
+                pthread_cond_wait(&pk->cond, &pk->lock);
+            }
+        }
+        pthread_mutex_unlock(&pk->lock);
+    
+        // One missing chunk is decompressed right here, the rest on decoder threads
+        for (i = 0; i < count; ++i) {
+            if (!load[i]) {
+                continue;
+            }
+    
+            if (local < 0) {
+                local = (int) i;
+            } else {
+                struct PackedJob job = { engine, batch[i] };
+                workq_submit(pk->decoders, &job);
+            }
+        }
+    
+        if (local >= 0) {
+            loadChunk(engine, pk, batch[local]);
+        }
+    
+        for (i = 0; i < count; ++i) {
+            uint64_t start = (first + i) << pk->chunkBits;
+            uint64_t from = (offset > start) ? offset : start;
+            uint64_t to = (end < start + pk->chunkSize) ? end : start + pk->chunkSize;
+            uint8_t* p = buffer + (from - io->offset);
+    
+            if (!batch[i]) {
+                memset(p, 0, to - from);
+                continue;
+            }
+    
+            pthread_mutex_lock(&pk->lock);
+            while (batch[i]->state == kPackedChunk_Loading) {
+                pthread_cond_wait(&pk->cond, &pk->lock);
+            }
+            int chunkError = batch[i]->error;
+            pthread_mutex_unlock(&pk->lock);
+    
+            if (chunkError) {
+                error = error ? error : chunkError;
+            } else {
+                memcpy(p, batch[i]->data + (from - start), to - from);
+            }
+        }
+    
+        pthread_mutex_lock(&pk->lock);
+        for (i = 0; i < count; ++i) {
+            if (batch[i] && !--batch[i]->pins && batch[i]->error) {
+                dropChunk(pk, batch[i]);
+            }
+        }
+        pthread_cond_broadcast(&pk->cond);
+        pthread_mutex_unlock(&pk->lock);
+    
+        offset = (first + count) << pk->chunkBits;
+    }
+    
+    if (!error && sequential) {
+        readAhead(engine, pk, io);
+    }
+    
+    return error;
+}
+
+
+static int packedRW(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    struct Packed* pk = (struct Packed*) engine->priv;
+    
+    switch (io->op) {
+    case kLoopEngineOp_Read:
+        if ((io->offset > pk->size) || (io->nbytes > pk->size - io->offset)) {
+            return EINVAL;
+        }
+        return io->nbytes ? packedRead(engine, pk, io) : 0;
+    
+    case kLoopEngineOp_Flush:
+        return 0;
+    
+    case kLoopEngineOp_Write:
+    case kLoopEngineOp_Discard:
+        return EROFS;
+    
+    default:
+        return EINVAL;
+    }
+}
+
+
+// Check header read from the start of a file
+// @return          1 for valid packed image header, 0 for other files, -1 with errno set for broken one.
+static int parseHeader(const uint8_t* buffer, uint64_t nbytes, uint64_t fileSize, struct LoopPackedHeader* header)
+{
+    if (nbytes < sizeof(*header)) {
+        return 0;
+    }
+    
+    memcpy(header, buffer, sizeof(*header));
+    if (header->magic != kLoopPackedMagic) {
+        return 0;
+    }
+    
+    uint64_t chunkSize = (uint64_t) 1 << header->chunkBits;
+    uint64_t nchunks = (header->size + chunkSize - 1) / chunkSize;
+    
+    if ((header->version != kLoopPackedVersion) || (header->codec != kLoopPackedCodec_LZ) ||
+        (header->chunkBits < kLoopPackedMinChunkBits) || (header->chunkBits > kLoopPackedMaxChunkBits) ||
+        !header->size || (nchunks > INT32_MAX) || (header->indexOffset < kLoopPackedDataOffset) ||
+        (header->indexOffset > fileSize) || ((nchunks + 1) * sizeof(uint64_t) > fileSize - header->indexOffset)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    return 1;
+}
+
+
+static int packedOpen(struct LoopEngine* engine)
+{
+    struct LoopEngine* lower = engine->lower;
+    unsigned decoders = *(const unsigned*) engine->priv;
+    struct LoopPackedHeader header;
+    uint8_t* buffer = NULL;
+    uint64_t i;
+    int error;
+    
+    struct Packed* pk = (struct Packed*) calloc(1, sizeof(*pk));
+    if (!pk) {
+        return ENOMEM;
+    }
+    
+    pthread_mutex_init(&pk->lock, NULL);
+    pthread_cond_init(&pk->cond, NULL);
+    
+    if (posix_memalign((void**) &buffer, kPackedAlign, kLoopPackedDataOffset)) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    error = (lower->size < kLoopPackedDataOffset) ? EINVAL : imageRead(engine, buffer, kLoopPackedDataOffset, 0);
+    if (error) {
+        goto ERROR_OUT;
+    }
+    
+    if (1 != parseHeader(buffer, kLoopPackedDataOffset, lower->size, &header)) {
+        error = EINVAL;
+        goto ERROR_OUT;
+    }
+    
+    pk->size        = header.size;
+    pk->chunkBits   = header.chunkBits;
+    pk->chunkSize   = (uint64_t) 1 << header.chunkBits;
+    pk->nchunks     = (header.size + pk->chunkSize - 1) >> header.chunkBits;
+    pk->readahead   = kPackedReadaheadBytes >> header.chunkBits;
+    if (pk->readahead < kPackedMinReadahead) {
+        pk->readahead = kPackedMinReadahead;
+    }
+    
+    pk->index = (uint64_t*) malloc((pk->nchunks + 1) * sizeof(*pk->index));
+    if (!pk->index) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    error = imageRead(engine, pk->index, (pk->nchunks + 1) * sizeof(*pk->index), header.indexOffset);
+    if (error) {
+        goto ERROR_OUT;
+    }
+    
+    // Broken index must not send reads anywhere but chunk data
+    if (pk->index[0] != kLoopPackedDataOffset) {
+        error = EINVAL;
+        goto ERROR_OUT;
+    }
+    
+    for (i = 0; i < pk->nchunks; ++i) {
+        if ((pk->index[i + 1] < pk->index[i]) || (pk->index[i + 1] - pk->index[i] > chunkLength(pk, i))) {
+            error = EINVAL;
+            goto ERROR_OUT;
+        }
+    }
+    
+    if (pk->index[pk->nchunks] > header.indexOffset) {
+        error = EINVAL;
+        goto ERROR_OUT;
+    }
+    
+    // Every read running at once may pin a full batch, read ahead takes slots on top of that
+    pk->nslots = kPackedCacheBytes >> pk->chunkBits;
+    if (pk->nslots < (decoders + 1) * kPackedMaxBatch + pk->readahead) {
+        pk->nslots = (decoders + 1) * kPackedMaxBatch + pk->readahead;
+    }
+    
+    pk->chunks = (struct PackedChunk*) calloc(pk->nslots, sizeof(*pk->chunks));
+    pk->slots = (int32_t*) malloc(pk->nchunks * sizeof(*pk->slots));
+    if (!pk->chunks || !pk->slots || posix_memalign((void**) &pk->memory, kPackedAlign, pk->nslots * pk->chunkSize)) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    for (i = 0; i < pk->nslots; ++i) {
+        pk->chunks[i].data = pk->memory + i * pk->chunkSize;
+    }
+    
+    for (i = 0; i < pk->nchunks; ++i) {
+        pk->slots[i] = -1;
+    }
+    
+    pk->decoders = workq_create(decoders, pk->nslots, sizeof(struct PackedJob), decodeWorker, NULL);
+    if (!pk->decoders) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    free(buffer);
+    engine->size = pk->size;
+    engine->priv = pk;
+    return 0;
+    
+ERROR_OUT:
+    
+    pthread_cond_destroy(&pk->cond);
+    pthread_mutex_destroy(&pk->lock);
+    free(pk->memory);
+    free(pk->slots);
+    free(pk->chunks);
+    free(pk->index);
+    free(pk);
+    free(buffer);
+    return error;
+}
+
+
+static void packedClose(struct LoopEngine* engine)
+{
+    struct Packed* pk = (struct Packed*) engine->priv;
+    
+    // Read ahead may still be running
+    workq_destroy(pk->decoders);
+    
+    uint64_t lookups = pk->hits + pk->waits + pk->misses;
+    printf("Packed image: %llu chunks decompressed, %llu of them ahead of reads, %llu hits, %llu read ahead hits, "
+           "%llu misses, %.1f%% hit rate, %llu image bytes read\n",
+           (unsigned long long) pk->decoded, (unsigned long long) pk->prefetched, (unsigned long long) pk->hits,
+           (unsigned long long) pk->waits, (unsigned long long) pk->misses,
+           (lookups ? 100.0 * (pk->hits + pk->waits) / lookups : 0.0), (unsigned long long) pk->packedBytes);
+    
+    pthread_cond_destroy(&pk->cond);
+    pthread_mutex_destroy(&pk->lock);
+    free(pk->memory);
+    free(pk->slots);
+    free(pk->chunks);
+    free(pk->index);
+    free(pk);
+}
+
+
+static const struct LoopEngineOps gPackedEngineOps = {
+    .name       = "packed",
+    .open       = packedOpen,
+    .close      = packedClose,
+    .rw         = packedRW,
+};
+
+
+struct LoopEngine* packed_open(struct LoopEngine* lower, struct LoopWorkQueue* workers, unsigned decoders, unsigned depth)
+{
+    if (!(lower->flags & kLoopEngineFlag_ReadOnly)) {
+        errno = EROFS;
+        return NULL;
+    }
+    
+    return workers ? engine_stack_shared(&gPackedEngineOps, lower, workers, depth, &decoders) :
+                     engine_stack(&gPackedEngineOps, lower, 1, depth, &decoders);
+}
+
+
+int packed_probe(const char* file, struct LoopPackedInfo* info)
+{
+    struct LoopPackedHeader header;
+    uint8_t buffer[sizeof(header)];
+    struct stat st;
+    
+    int fd = open(file, O_RDONLY);
+    if ((fd < 0) || (0 != fstat(fd, &st))) {
+        int error = errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        errno = error;
+        return -1;
+    }
+    
+    ssize_t rc = pread(fd, buffer, sizeof(buffer), 0);
+    int error = errno;
+    close(fd);
+    
+    if (rc < 0) {
+        errno = error;
+        return -1;
+    }
+    
+    int found = parseHeader(buffer, (uint64_t) rc, (uint64_t) st.st_size, &header);
+    if ((found == 1) && info) {
+        info->size = header.size;
+        info->chunkSize = (uint32_t) 1 << header.chunkBits;
+        info->nchunks = (header.size + info->chunkSize - 1) / info->chunkSize;
+        info->fileSize = (uint64_t) st.st_size;
+    }
+    
+    return found;
+}
+
+
+int packed_create(const char* file, const char* raw, uint32_t chunkBits)
+{
+    struct LoopPackedHeader header;
+    uint64_t* index = NULL;
+    uint8_t* data = NULL;
+    uint8_t* packed = NULL;
+    struct stat st;
+    int fd = -1;
+    uint64_t i;
+    int error = 0;
+    
+    if ((chunkBits < kLoopPackedMinChunkBits) || (chunkBits > kLoopPackedMaxChunkBits)) {
+        return EINVAL;
+    }
+    
+    int in = open(raw, O_RDONLY);
+    if ((in < 0) || (0 != fstat(in, &st))) {
+        error = errno;
+        goto ERROR_OUT;
+    }
+    
+    uint64_t chunkSize = (uint64_t) 1 << chunkBits;
+    uint64_t size = (uint64_t) st.st_size;
+    uint64_t nchunks = (size + chunkSize - 1) >> chunkBits;
+    if (!size || (nchunks > INT32_MAX)) {
+        error = EINVAL;
+        goto ERROR_OUT;
+    }
+    
+    index = (uint64_t*) malloc((nchunks + 1) * sizeof(*index));
+    data = (uint8_t*) malloc(chunkSize);
+    packed = (uint8_t*) malloc(chunkSize);
+    if (!index || !data || !packed) {
+        error = ENOMEM;
+        goto ERROR_OUT;
+    }
+    
+    fd = open(file, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        error = errno;
+        goto ERROR_OUT;
+    }
+    
+    // Header goes last, image is not valid until it is all there
+    uint64_t offset = kLoopPackedDataOffset;
+    for (i = 0; !error && (i < nchunks); ++i) {
+        uint64_t length = (size - (i << chunkBits) < chunkSize) ? size - (i << chunkBits) : chunkSize;
+    
+        index[i] = offset;
+        error = engine_pread(in, data, length, i << chunkBits);
+        if (error || zero_check(data, length)) {
+            continue;
+        }
+    
+        // Compressed chunk has to be smaller than the chunk, which is how reads tell the two apart
+        uint64_t nbytes = lz_compress(data, length, packed, length - 1);
+        error = nbytes ? engine_pwrite(fd, packed, nbytes, offset) : engine_pwrite(fd, data, length, offset);
+        offset += nbytes ? nbytes : length;
+    }
+    
+    index[nchunks] = offset;
+    
+    memset(&header, 0, sizeof(header));
+    header.magic        = kLoopPackedMagic;
+    header.version      = kLoopPackedVersion;
+    header.chunkBits    = chunkBits;
+    header.codec        = kLoopPackedCodec_LZ;
+    header.size         = size;
+    header.indexOffset  = offset;
+    
+    if (!error) {
+        error = engine_pwrite(fd, index, (nchunks + 1) * sizeof(*index), offset);
+    }
+    if (!error) {
+        error = engine_fdatasync(fd);
+    }
+    if (!error) {
+        error = engine_pwrite(fd, &header, sizeof(header), 0);
+    }
+    if (!error) {
+        error = engine_fdatasync(fd);
+    }
+    
+ERROR_OUT:
+    
+    if (fd >= 0) {
+        close(fd);
+        if (error) {
+            unlink(file);
+        }
+    }
+    
+    if (in >= 0) {
+        close(in);
+    }
+    
+    free(packed);
+    free(data);
+    free(index);
+    return error;
+}
@@ -0,0 +1,86 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Compressed read-only images.
+//
+//  Packed image is a raw image cut into chunks of fixed size, every one compressed on its own with the codec
+//  in lz.h, so that any chunk can be read without the ones before it. Chunks that do not compress are stored
+//  as they are, all-zero chunks take no space at all. Offset index after the chunks says where every one
+//  starts. Helper serves packed images directly, attached read only.
+//
+//  On disk, in host byte order:
+//      0                       LoopPackedHeader
+//      kLoopPackedDataOffset   chunks, one after another
+//      indexOffset             nchunks + 1 offsets, chunk i takes from entry i to entry i + 1: nothing for zero
+//                              chunks, its full size for chunks stored as they are, anything between for compressed
+//
+//  Decompressed chunks are kept in a cache. Reads missing several chunks have them decompressed in parallel
+//  on a pool of decoder threads, sequential reads get the chunks that follow decompressed ahead of them.
+//
+
+#ifndef LOOP_PACKED_H
+#define LOOP_PACKED_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+#define kLoopPackedMagic    0x314b4150504f4f4cull   // "LOOPPAK1"
+
+enum {
+    kLoopPackedVersion          = 1,
+    kLoopPackedCodec_LZ         = 1,            // lz.h
+    kLoopPackedMinChunkBits     = 12,           // 4K
+    kLoopPackedMaxChunkBits     = 20,           // 1M
+    kLoopPackedDefaultChunkBits = 16,           // 64K
+    kLoopPackedDataOffset       = 4096,
+};
+
+
+struct LoopPackedHeader {
+    uint64_t            magic;          // kLoopPackedMagic
+    uint32_t            version;        // kLoopPackedVersion
+    uint32_t            chunkBits;      // log2 of uncompressed chunk size
+    uint32_t            codec;          // kLoopPackedCodec_XXX
+    uint32_t            reserved0;
+    uint64_t            size;           // Device size in bytes, last chunk may be short
+    uint64_t            indexOffset;    // Offset index position
+    uint64_t            reserved[3];
+};
+
+
+// What packed_probe finds out about an image
+struct LoopPackedInfo {
+    uint64_t            size;           // Device size in bytes
+    uint32_t            chunkSize;
+    uint64_t            nchunks;
+    uint64_t            fileSize;       // Packed image size
+};
+
+
+/**
+ * Pack a raw image.
+ * @param chunkBits log2 of chunk size, kLoopPackedMinChunkBits to kLoopPackedMaxChunkBits.
+ * @return          0 or errno. Existing file is not overwritten.
+ */
+int packed_create(const char* file, const char* raw, uint32_t chunkBits);
+
+/**
+ * Check if file is a packed image.
+ * @param info      Filled in for packed images, may be NULL.
+ * @return          1 for packed image, 0 for any other file, -1 with errno set if file cannot be read or header is bad.
+ */
+int packed_probe(const char* file, struct LoopPackedInfo* info);
+
+/**
+ * Stack decompression on top of the engine of a packed image file. Reads only.
+ * Image file ios run synchronously on packed engine and decoder threads, lower engine needs no workers of its own.
+ * @param lower     Engine of packed image file opened read only, owned by packed engine from now on.
+ * @param workers   Shared worker pool, or NULL for a worker thread of its own.
+ * @param decoders  Number of decoder threads.
+ * @return          Packed engine sized like the device, or NULL with errno set, lower engine is left open on failure.
+ */
+struct LoopEngine* packed_open(struct LoopEngine* lower, struct LoopWorkQueue* workers, unsigned decoders, unsigned depth);
+
+#endif
@@ -0,0 +1,316 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+// struct ucred on Linux
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+#include "simipc.h"
+
+
+// Messages from different threads must not interleave on a stream, one lock for all sockets is plenty
+static pthread_mutex_t sSendLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int socketAddress(const char* path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+
+int sim_listen(const char* path)
+{
+    struct sockaddr_un addr;
+    if (socketAddress(path, &addr)) {
+        return -1;
+    }
+    
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    
+    unlink(path);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) || listen(sock, 1)) {
+        int error = errno;
+        close(sock);
+        errno = error;
+        return -1;
+    }
+    
+    return sock;
+}
+
+
+int sim_connect(const char* path)
+{
+    struct sockaddr_un addr;
+    if (socketAddress(path, &addr)) {
+        return -1;
+    }
+    
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr))) {
+        int error = errno;
+        close(sock);
+        errno = error;
+        return -1;
+    }
+    
+    return sock;
+}
+
+
+int sim_peer_pid(int sock)
+{
+#ifdef __APPLE__
+    pid_t pid;
+    socklen_t len = sizeof(pid);
+    if (getsockopt(sock, SOL_LOCAL, LOCAL_PEERPID, &pid, &len)) {
+        return -1;
+    }
+    
+    return (int) pid;
+#else
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+        return -1;
+    }
+    
+    return (int) cred.pid;
+#endif
+}
+
+
+static int writeAll(int sock, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    
+    while (size) {
+        ssize_t rc = send(sock, p, size, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+    
+        p += rc;
+        size -= (size_t) rc;
+    }
+    
+    return 0;
+}
+
+
+static int readAll(int sock, void* data, size_t size)
+{
+    uint8_t* p = (uint8_t*) data;
+    
+    while (size) {
+        ssize_t rc = recv(sock, p, size, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+    
+        if (rc == 0) {
+            return ENOTCONN;
+        }
+    
+        p += rc;
+        size -= (size_t) rc;
+    }
+    
+    return 0;
+}
+
+
+int sim_send(int sock, uint32_t type, uint32_t id, int32_t result, uint64_t arg, const void* data, size_t size, int passfd)
+{
+    struct SimMessage msg;
+    
+    if (size > kSimMaxData) {
+        return EMSGSIZE;
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.type    = type;
+    msg.id      = id;
+    msg.result  = result;
+    msg.size    = (uint32_t) size;
+    msg.arg     = arg;
+    
+    pthread_mutex_lock(&sSendLock);
+    
+    int error = 0;
+    if (passfd >= 0) {
+        // Descriptor rides along with the header
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov;
+        struct msghdr hdr;
+    
+        memset(control, 0, sizeof(control));
+        memset(&hdr, 0, sizeof(hdr));
+        iov.iov_base        = &msg;
+        iov.iov_len         = sizeof(msg);
+        hdr.msg_iov         = &iov;
+        hdr.msg_iovlen      = 1;
+        hdr.msg_control     = control;
+        hdr.msg_controllen  = sizeof(control);
+    
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level    = SOL_SOCKET;
+        cmsg->cmsg_type     = SCM_RIGHTS;
+        cmsg->cmsg_len      = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+    
+        // Header is tiny, a short write here would mean something is badly broken
+        ssize_t rc = sendmsg(sock, &hdr, 0);
+        if (rc != (ssize_t) sizeof(msg)) {
+            error = (rc < 0) ? errno : EIO;
+        }
+    } else {
+        error = writeAll(sock, &msg, sizeof(msg));
+    }
+    
+    if (!error && size) {
+        error = writeAll(sock, data, size);
+    }
+    
+    pthread_mutex_unlock(&sSendLock);
+    return error;
+}
+
+
+int sim_recv(int sock, struct SimMessage* msg, void* data, int* passfd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr hdr;
+    ssize_t rc;
+    
+    if (passfd) {
+        *passfd = -1;
+    }
+    
+    memset(&hdr, 0, sizeof(hdr));
+    iov.iov_base        = msg;
+    iov.iov_len         = sizeof(*msg);
+    hdr.msg_iov         = &iov;
+    hdr.msg_iovlen      = 1;
+    hdr.msg_control     = control;
+    hdr.msg_controllen  = sizeof(control);
+    
+    do {
+        rc = recvmsg(sock, &hdr, 0);
+    } while ((rc < 0) && (errno == EINTR));
+    
+    if (rc < 0) {
+        return errno;
+    }
+    
+    if (rc == 0) {
+        return ENOTCONN;
+    }
+    
+    struct cmsghdr* cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            if (passfd) {
+                *passfd = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    
+    // Rest of the header may come in separately on a stream
+    int error = readAll(sock, (uint8_t*) msg + rc, sizeof(*msg) - (size_t) rc);
+    if (error) {
+        return error;
+    }
+    
+    if (msg->size > kSimMaxData) {
+        return EMSGSIZE;
+    }
+    
+    if (msg->size && !data) {
+        return EPROTO;
+    }
+    
+    return msg->size ? readAll(sock, data, msg->size) : 0;
+}
+
+
+void* sim_shm_create(uint64_t size, int* fd)
+{
+    char name[64];
+    int shm = -1;
+    unsigned i;
+    
+    // Name is only needed to get a descriptor, it is unlinked right away
+    for (i = 0; (shm < 0) && (i < 100); ++i) {
+        snprintf(name, sizeof(name), "/loopsim.%d.%u", (int) getpid(), i);
+        shm = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if ((shm < 0) && (errno != EEXIST)) {
+            return NULL;
+        }
+    }
+    
+    if (shm < 0) {
+        return NULL;
+    }
+    
+    shm_unlink(name);
+    
+    if (ftruncate(shm, (off_t) size)) {
+        int error = errno;
+        close(shm);
+        errno = error;
+        return NULL;
+    }
+    
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+    if (p == MAP_FAILED) {
+        int error = errno;
+        close(shm);
+        errno = error;
+        return NULL;
+    }
+    
+    *fd = shm;
+    return p;
+}
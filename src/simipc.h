@@ -0,0 +1,86 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Local IPC transport between a simulated loop driver and a helper process.
+//
+//  Stands in for the IOKit and mach pieces of the loopctl.h protocol so that loopsim can play org_acme_LoopDriver
+//  for the real helper core in a separate process. Both sides exchange SimMessages over a unix stream socket:
+//
+//      helper -> driver    kSimMsg_Call    IOConnectCallMethod, id is kLoopCTL_XXX / kLoopDriverCTL_XXX, data is structure input
+//      helper -> driver    kSimMsg_Map     IOConnectMapMemory64, id is kLoopDriverMemory_XXX
+//      driver -> helper    kSimMsg_Reply   IOReturn of Attach or Map, a mapped memory reply carries a shared memory fd
+//      driver -> helper    kSimMsg_Notify  mach notification, id is kLoopUserXXXNotification, data is UserIORequest if any
+//
+//  Only attach and map calls are answered. Completions, doorbells and stats are posted without waiting, driver
+//  drops the connection if helper sends garbage. Shared rings and buffer pool are POSIX shared memory passed as fds.
+//
+
+#ifndef LOOP_SIMIPC_H
+#define LOOP_SIMIPC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+enum {
+    kSimMsg_Call            = 1,
+    kSimMsg_Map             = 2,
+    kSimMsg_Reply           = 3,
+    kSimMsg_Notify          = 4,
+};
+
+enum {
+    kSimMaxData             = 64 * 1024,    // Largest message payload, fits a full completion batch
+};
+
+
+struct SimMessage {
+    uint32_t                type;           // kSimMsg_XXX
+    uint32_t                id;             // Ctl code, memory type or notification id
+    int32_t                 result;         // IOReturn for replies
+    uint32_t                size;           // Payload bytes following the header
+    uint64_t                arg;            // Mapped memory size for map replies
+};
+
+
+/**
+ * Listen on a unix socket path, removing a stale socket first.
+ * @return      Listening socket or -1 with errno set.
+ */
+int sim_listen(const char* path);
+
+/**
+ * Connect to a unix socket path.
+ * @return      Connected socket or -1 with errno set.
+ */
+int sim_connect(const char* path);
+
+/**
+ * Get pid of the process on the other end of a connected socket, as the kernel saw it connect.
+ * @return      Peer pid or -1 with errno set.
+ */
+int sim_peer_pid(int sock);
+
+/**
+ * Send a message, optionally passing a file descriptor along. Safe to call from several threads at once.
+ * @param passfd    Descriptor to pass or -1.
+ * @return          0 or errno.
+ */
+int sim_send(int sock, uint32_t type, uint32_t id, int32_t result, uint64_t arg, const void* data, size_t size, int passfd);
+
+/**
+ * Receive a message. Only one thread may receive on a socket.
+ * @param data      Receives payload, kSimMaxData bytes, or NULL if no payload is expected.
+ * @param passfd    Receives passed descriptor or -1, may be NULL if none is expected.
+ * @return          0, ENOTCONN on orderly shutdown or errno.
+ */
+int sim_recv(int sock, struct SimMessage* msg, void* data, int* passfd);
+
+/**
+ * Create anonymous shared memory.
+ * @param fd        Receives descriptor to pass to the peer.
+ * @return          Mapping or NULL with errno set.
+ */
+void* sim_shm_create(uint64_t size, int* fd);
+
+#endif
@@ -0,0 +1,879 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+// SEEK_DATA and SEEK_HOLE on Linux
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "sparse.h"
+#include "zero.h"
+
+
+enum {
+    kSparseMaxExtents   = 1024 * 1024,  // Files more fragmented than this are not worth mapping
+    kSparseMaxPieces    = 64,           // Reads crossing more holes than this read everything
+    kSparseSubmitBatch  = 64,           // Ios handed to lower engine at once
+    kSparseMinZeroRun   = 64 * 1024,    // Shorter zero runs over data are written, holes that small only fragment file
+};
+
+enum {
+    kSparseMap_Unknown  = 0,            // Not built yet, or scan raced a write
+    kSparseMap_Valid    = 1,
+    kSparseMap_Off      = 2,            // File cannot be mapped, everything is passed through
+};
+
+
+// Range of backing file that may hold data
+struct SparseExtent {
+    uint64_t                start;
+    uint64_t                end;
+};
+
+
+// Extents sorted by offset, neither overlapping nor touching
+struct SparseExtents {
+    struct SparseExtent*    items;
+    uint32_t                count;
+    uint32_t                capacity;
+};
+
+
+struct Sparse {
+    int                     fd;         // Backing file opened for SEEK_DATA and SEEK_HOLE only
+    uint64_t                size;       // Mapped size, ios reaching past it are passed through
+    uint64_t                granule;    // File system block size, written ranges are rounded out to it
+
+    pthread_mutex_t         lock;       // Protects everything below
+    int                     state;      // kSparseMap_XXX
+    int                     error;      // Why map is off
+    int                     building;   // A reader is scanning file without lock
+    struct SparseExtents    map;
+    uint64_t                writes;     // Writes submitted so far, scans and discards that raced one are thrown away
+    uint32_t                writing;    // Writes in flight
+
+    uint64_t                builds;     // Maps built
+    uint64_t                holeReads;  // Reads zero filled without backing store
+    uint64_t                pieceReads; // Reads crossing holes, only data was read
+    uint64_t                holeBytes;  // Bytes zero filled instead of read
+
+    volatile int            noPunch;    // File system cannot punch holes, zero runs over data are written
+    uint64_t                zeroWrites; // Writes with zero runs cut out
+    uint64_t                zeroSkipped;    // Zero bytes left out over holes
+    uint64_t                zeroPunched;    // Zero bytes punched instead of written
+};
+
+
+// Write or discard passed down in place of original io, so that map hears about its completion
+struct SparseUpdate {
+    struct LoopEngineIO     io;
+    struct LoopEngineIO*    parent;
+    struct Sparse*          sparse;
+    uint64_t                writes;     // Writes submitted before discard
+    int                     alone;      // No write was in flight when discard was submitted
+};
+
+
+// Read crossing holes or write with zero runs and its pieces, allocated in one piece
+struct SparsePieces {
+    struct LoopEngineIO*    parent;
+    struct Sparse*          sparse;
+    struct LoopEngine*      lower;
+    volatile uint32_t       remaining;  // Pieces not completed yet
+    volatile int            error;      // First piece error
+    unsigned                count;
+    uint64_t                writes;     // Writes submitted up to this write
+    int                     alone;      // No other write was in flight when this write was submitted
+    struct LoopEngineIO     pieces[];
+};
+
+
+// Part of a write with zero runs
+struct SparsePlan {
+    uint64_t                start;
+    uint64_t                end;
+    uint32_t                op;         // Write or Discard
+};
+
+
+// Ios collected for lower engine
+struct SparseBatch {
+    struct LoopEngine*      lower;
+    struct LoopEngineIO*    ios[kSparseSubmitBatch];
+    unsigned                count;
+};
+
+
+static void batchAdd(struct SparseBatch* batch, struct LoopEngineIO* io)
+{
+    if (batch->count == kSparseSubmitBatch) {
+        engine_submit(batch->lower, batch->ios, batch->count);
+        batch->count = 0;
+    }
+    
+    batch->ios[batch->count++] = io;
+}
+
+
+static int reserveExtents(struct SparseExtents* map, uint32_t count)
+{
+    if (count <= map->capacity) {
+        return 1;
+    }
+    
+    if (count > kSparseMaxExtents) {
+        return 0;
+    }
+    
+    uint32_t capacity = map->capacity ? map->capacity * 2 : 64;
+    if (capacity > kSparseMaxExtents) {
+        capacity = kSparseMaxExtents;
+    }
+    
+    struct SparseExtent* items = (struct SparseExtent*) realloc(map->items, capacity * sizeof(*items));
+    if (!items) {
+        return 0;
+    }
+    
+    map->items = items;
+    map->capacity = capacity;
+    return 1;
+}
+
+
+// @return      Index of first extent ending after offset, or count
+static uint32_t firstEndingAfter(const struct SparseExtents* map, uint64_t offset)
+{
+    uint32_t lo = 0;
+    uint32_t hi = map->count;
+    
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (map->items[mid].end > offset) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    
+    return lo;
+}
+
+
+// Mark range as data, extents it overlaps or touches are merged with it
+// @return      0 if map ran out of room and cannot cover range any more
+static int addRange(struct SparseExtents* map, uint64_t start, uint64_t end)
+{
+    // Extent touching range at its start ends exactly at start
+    uint32_t first = firstEndingAfter(map, start ? start - 1 : 0);
+    uint32_t last = first;
+    
+    while ((last < map->count) && (map->items[last].start <= end)) {
+        last++;
+    }
+    
+    if (first == last) {
+        if (!reserveExtents(map, map->count + 1)) {
+            return 0;
+        }
+    
+        memmove(&map->items[first + 1], &map->items[first], (map->count - first) * sizeof(map->items[0]));
+        map->items[first].start = start;
+        map->items[first].end = end;
+        map->count++;
+        return 1;
+    }
+    
+    struct SparseExtent* merged = &map->items[first];
+    if (merged->start > start) {
+        merged->start = start;
+    }
+    if (map->items[last - 1].end > end) {
+        end = map->items[last - 1].end;
+    }
+    merged->end = end;
+    
+    memmove(&map->items[first + 1], &map->items[last], (map->count - last) * sizeof(map->items[0]));
+    map->count -= last - first - 1;
+    return 1;
+}
+
+
+// Mark range as hole, extent it falls into is split when there is room for it
+static void removeRange(struct SparseExtents* map, uint64_t start, uint64_t end)
+{
+    uint32_t first = firstEndingAfter(map, start);
+    
+    if ((first < map->count) && (map->items[first].start < start) && (map->items[first].end > end)) {
+        // Leaving it as data is still correct
+        if (!reserveExtents(map, map->count + 1)) {
+            return;
+        }
+    
+        memmove(&map->items[first + 2], &map->items[first + 1], (map->count - first - 1) * sizeof(map->items[0]));
+        map->items[first + 1].start = end;
+        map->items[first + 1].end = map->items[first].end;
+        map->items[first].end = start;
+        map->count++;
+        return;
+    }
+    
+    if ((first < map->count) && (map->items[first].start < start)) {
+        map->items[first].end = start;
+        first++;
+    }
+    
+    uint32_t last = first;
+    while ((last < map->count) && (map->items[last].end <= end)) {
+        last++;
+    }
+    
+    if ((last < map->count) && (map->items[last].start < end)) {
+        map->items[last].start = end;
+    }
+    
+    memmove(&map->items[first], &map->items[last], (map->count - last) * sizeof(map->items[0]));
+    map->count -= last - first;
+}
+
+
+static int scanExtents(int fd, uint64_t size, struct SparseExtents* map)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    uint64_t offset = 0;
+    
+    while (offset < size) {
+        off_t data = lseek(fd, (off_t) offset, SEEK_DATA);
+        if (data < 0) {
+            // No more data past offset
+            return (errno == ENXIO) ? 0 : errno;
+        }
+    
+        if ((uint64_t) data >= size) {
+            break;
+        }
+    
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            return errno;
+        }
+    
+        if (!reserveExtents(map, map->count + 1)) {
+            return EFBIG;
+        }
+    
+        offset = ((uint64_t) hole < size) ? (uint64_t) hole : size;
+        map->items[map->count].start = (uint64_t) data;
+        map->items[map->count].end = offset;
+        map->count++;
+    }
+    
+    return 0;
+#else
+    return ENOTSUP;
+#endif
+}
+
+
+// Scan file for data extents, called with lock held and no writes in flight. Lock is dropped meanwhile.
+static void buildMap(struct Sparse* sparse)
+{
+    struct SparseExtents scan = { NULL, 0, 0 };
+    uint64_t writes = sparse->writes;
+    
+    sparse->building = 1;
+    pthread_mutex_unlock(&sparse->lock);
+    
+    int error = scanExtents(sparse->fd, sparse->size, &scan);
+    
+    pthread_mutex_lock(&sparse->lock);
+    sparse->building = 0;
+    
+    if (error) {
+        sparse->state = kSparseMap_Off;
+        sparse->error = error;
+        free(scan.items);
+        return;
+    }
+    
+    // Scan may have missed blocks of a write started meanwhile, a later read tries again
+    if (writes != sparse->writes) {
+        free(scan.items);
+        return;
+    }
+    
+    free(sparse->map.items);
+    sparse->map = scan;
+    sparse->state = kSparseMap_Valid;
+    sparse->builds++;
+}
+
+
+// Mark written range as data rounded out to whole blocks, called with lock held
+static void mapWrite(struct Sparse* sparse, uint64_t offset, uint64_t nbytes)
+{
+    uint64_t start = offset & ~(sparse->granule - 1);
+    uint64_t end = (offset + nbytes + sparse->granule - 1) & ~(sparse->granule - 1);
+    
+    if ((sparse->state == kSparseMap_Valid) && !addRange(&sparse->map, start, end)) {
+        sparse->state = kSparseMap_Off;
+        sparse->error = EFBIG;
+    }
+}
+
+
+// Find data pieces of a read range.
+// @return      Number of pieces, or -1 if read should be passed through as is
+static int mapRead(struct Sparse* sparse, uint64_t start, uint64_t end, struct SparseExtent* pieces)
+{
+    int count = 0;
+    
+    pthread_mutex_lock(&sparse->lock);
+    
+    if ((sparse->state == kSparseMap_Unknown) && !sparse->building && !sparse->writing) {
+        buildMap(sparse);
+    }
+    
+    if ((sparse->state != kSparseMap_Valid) || (end > sparse->size)) {
+        pthread_mutex_unlock(&sparse->lock);
+        return -1;
+    }
+    
+    uint64_t covered = 0;
+    uint32_t i;
+    for (i = firstEndingAfter(&sparse->map, start); (i < sparse->map.count) && (sparse->map.items[i].start < end); ++i) {
+        if (count == kSparseMaxPieces) {
+            pthread_mutex_unlock(&sparse->lock);
+            return -1;
+        }
+    
+        pieces[count].start = (sparse->map.items[i].start > start) ? sparse->map.items[i].start : start;
+        pieces[count].end = (sparse->map.items[i].end < end) ? sparse->map.items[i].end : end;
+        covered += pieces[count].end - pieces[count].start;
+        count++;
+    }
+    
+    if (!count) {
+        sparse->holeReads++;
+    } else if (covered < end - start) {
+        sparse->pieceReads++;
+    }
+    sparse->holeBytes += (end - start) - covered;
+    
+    pthread_mutex_unlock(&sparse->lock);
+    return count;
+}
+
+
+// Write with zero runs is done, take punched runs out of map unless another write raced it
+static void zeroWriteDone(struct Sparse* sparse, struct SparsePieces* split)
+{
+    unsigned i;
+    
+    pthread_mutex_lock(&sparse->lock);
+    
+    if (split->alone && (split->writes == sparse->writes) && (sparse->writing == 1) && (sparse->state == kSparseMap_Valid)) {
+        for (i = 0; i < split->count; ++i) {
+            struct LoopEngineIO* piece = &split->pieces[i];
+            if ((piece->op == kLoopEngineOp_Discard) && !piece->error) {
+                removeRange(&sparse->map, piece->offset, piece->offset + piece->nbytes);
+            }
+        }
+    }
+    sparse->writing--;
+    
+    pthread_mutex_unlock(&sparse->lock);
+}
+
+
+// Called by lower engine for every piece, on any thread
+static void pieceDone(struct LoopEngineIO* io)
+{
+    struct SparsePieces* split = (struct SparsePieces*) io->priv;
+    
+    // Zero run could not be punched, write its zeroes after all. Lower engine is a backing store,
+    // its synchronous rw runs right here instead of waiting for a worker.
+    if ((io->op == kLoopEngineOp_Discard) && ((io->error == ENOTSUP) || (io->error == EOPNOTSUPP))) {
+        split->sparse->noPunch = 1;
+        io->op = kLoopEngineOp_Write;
+        io->error = split->lower->ops->rw(split->lower, io);
+    }
+    
+    if (io->error) {
+        __sync_bool_compare_and_swap(&split->error, 0, io->error);
+    }
+    
+    if (0 != __sync_sub_and_fetch(&split->remaining, 1)) {
+        return;
+    }
+    
+    struct LoopEngineIO* parent = split->parent;
+    if (parent->op == kLoopEngineOp_Write) {
+        zeroWriteDone(split->sparse, split);
+    }
+    
+    parent->error = split->error;
+    free(split);
+    parent->done(parent);
+}
+
+
+static void sparseRead(struct Sparse* sparse, struct LoopEngineIO* io, struct SparseBatch* batch)
+{
+    struct SparseExtent pieces[kSparseMaxPieces];
+    uint64_t end = io->offset + io->nbytes;
+    int count = io->nbytes ? mapRead(sparse, io->offset, end, pieces) : -1;
+    int i;
+    
+    if ((count < 0) || ((count == 1) && (pieces[0].start == io->offset) && (pieces[0].end == end))) {
+        batchAdd(batch, io);
+        return;
+    }
+    
+    uint8_t* buffer = (uint8_t*) io->buffer;
+    
+    if (!count) {
+        memset(buffer, 0, (size_t) io->nbytes);
+        io->error = 0;
+        io->done(io);
+        return;
+    }
+    
+    struct SparsePieces* read = (struct SparsePieces*) malloc(sizeof(*read) + count * sizeof(struct LoopEngineIO));
+    if (!read) {
+        // Reading holes as well is still correct
+        batchAdd(batch, io);
+        return;
+    }
+    
+    read->parent    = io;
+    read->sparse    = sparse;
+    read->lower     = batch->lower;
+    read->remaining = (uint32_t) count;
+    read->error     = 0;
+    read->count     = (unsigned) count;
+    
+    uint64_t offset = io->offset;
+    for (i = 0; i < count; ++i) {
+        struct LoopEngineIO* piece = &read->pieces[i];
+    
+        memset(buffer + (offset - io->offset), 0, (size_t) (pieces[i].start - offset));
+        offset = pieces[i].end;
+    
+        memset(piece, 0, sizeof(*piece));
+        piece->op       = io->op;
+        piece->flags    = io->flags;
+        piece->buffer   = buffer + (pieces[i].start - io->offset);
+        piece->nbytes   = pieces[i].end - pieces[i].start;
+        piece->offset   = pieces[i].start;
+        piece->done     = pieceDone;
+        piece->priv     = read;
+    }
+    memset(buffer + (offset - io->offset), 0, (size_t) (end - offset));
+    
+    // Pieces may complete and free read before we are done with it
+    struct LoopEngineIO* first = read->pieces;
+    for (i = 0; i < count; ++i) {
+        batchAdd(batch, &first[i]);
+    }
+}
+
+
+// Find runs of whole zero file system blocks in write data
+// @return      Number of runs, up to max
+static int zeroRuns(struct Sparse* sparse, const struct LoopEngineIO* io, struct SparseExtent* runs, int max)
+{
+    uint64_t granule = sparse->granule;
+    uint64_t offset = (io->offset + granule - 1) & ~(granule - 1);
+    uint64_t end = (io->offset + io->nbytes) & ~(granule - 1);
+    const uint8_t* buffer = (const uint8_t*) io->buffer;
+    int count = 0;
+    
+    for (; offset < end; offset += granule) {
+        if (!zero_check(buffer + (offset - io->offset), granule)) {
+            continue;
+        }
+    
+        if (count && (runs[count - 1].end == offset)) {
+            runs[count - 1].end += granule;
+            continue;
+        }
+    
+        // Rest of the write goes down as it is
+        if (count == max) {
+            break;
+        }
+    
+        runs[count].start = offset;
+        runs[count].end = offset + granule;
+        count++;
+    }
+    
+    return count;
+}
+
+
+// @return      0 if plan has no room for another piece
+static int planPiece(struct SparsePlan* plan, int* count, uint32_t op, uint64_t start, uint64_t end)
+{
+    if (start >= end) {
+        return 1;
+    }
+    
+    if (*count && (plan[*count - 1].op == op) && (plan[*count - 1].end == start)) {
+        plan[*count - 1].end = end;
+        return 1;
+    }
+    
+    if (*count == kSparseMaxPieces) {
+        return 0;
+    }
+    
+    plan[*count].start = start;
+    plan[*count].end = end;
+    plan[*count].op = op;
+    (*count)++;
+    return 1;
+}
+
+
+static int planZeroes(struct Sparse* sparse, struct SparsePlan* plan, int* count, uint64_t start, uint64_t end)
+{
+    int punch = !sparse->noPunch && (end - start >= kSparseMinZeroRun);
+    return planPiece(plan, count, (punch ? kLoopEngineOp_Discard : kLoopEngineOp_Write), start, end);
+}
+
+
+// Cut write into pieces to write and zero runs to punch, zero runs over holes are left out. Called with lock held.
+// @return      Number of pieces, or -1 if write should go down as is
+static int planWrite(struct Sparse* sparse, const struct LoopEngineIO* io, const struct SparseExtent* runs, int nruns,
+                     struct SparsePlan* plan)
+{
+    uint64_t offset = io->offset;
+    uint64_t end = io->offset + io->nbytes;
+    int count = 0;
+    int ok = 1;
+    int i;
+    
+    if (end > sparse->size) {
+        return -1;
+    }
+    
+    for (i = 0; ok && (i < nruns); ++i) {
+        ok = planPiece(plan, &count, kLoopEngineOp_Write, offset, runs[i].start);
+        offset = runs[i].end;
+    
+        if (sparse->state != kSparseMap_Valid) {
+            ok = ok && planZeroes(sparse, plan, &count, runs[i].start, runs[i].end);
+            continue;
+        }
+    
+        uint32_t e;
+        for (e = firstEndingAfter(&sparse->map, runs[i].start);
+             ok && (e < sparse->map.count) && (sparse->map.items[e].start < runs[i].end); ++e) {
+            uint64_t start = (sparse->map.items[e].start > runs[i].start) ? sparse->map.items[e].start : runs[i].start;
+            uint64_t stop = (sparse->map.items[e].end < runs[i].end) ? sparse->map.items[e].end : runs[i].end;
+            ok = planZeroes(sparse, plan, &count, start, stop);
+        }
+    }
+    
+    ok = ok && planPiece(plan, &count, kLoopEngineOp_Write, offset, end);
+    
+    if (!ok || ((count == 1) && (plan[0].op == kLoopEngineOp_Write) && (plan[0].start == io->offset) && (plan[0].end == end))) {
+        return -1;
+    }
+    
+    return count;
+}
+
+
+// Write holding zero blocks goes down in pieces: longer zero runs over data are punched, zero runs over holes
+// are not written at all.
+// @return      Nonzero if write was taken care of
+static int sparseZeroWrite(struct Sparse* sparse, struct LoopEngineIO* io, struct SparseBatch* batch)
+{
+    struct SparseExtent runs[kSparseMaxPieces];
+    struct SparsePlan plan[kSparseMaxPieces];
+    int i;
+    
+    int nruns = zeroRuns(sparse, io, runs, kSparseMaxPieces);
+    if (!nruns) {
+        return 0;
+    }
+    
+    struct SparsePieces* split = (struct SparsePieces*) malloc(sizeof(*split) + kSparseMaxPieces * sizeof(struct LoopEngineIO));
+    if (!split) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&sparse->lock);
+    
+    int count = planWrite(sparse, io, runs, nruns, plan);
+    if (count < 0) {
+        pthread_mutex_unlock(&sparse->lock);
+        free(split);
+        return 0;
+    }
+    
+    uint64_t planned = 0;
+    for (i = 0; i < count; ++i) {
+        if (plan[i].op == kLoopEngineOp_Write) {
+            mapWrite(sparse, plan[i].start, plan[i].end - plan[i].start);
+        } else {
+            sparse->zeroPunched += plan[i].end - plan[i].start;
+        }
+        planned += plan[i].end - plan[i].start;
+    }
+    
+    sparse->zeroWrites++;
+    sparse->zeroSkipped += io->nbytes - planned;
+    
+    if (count) {
+        sparse->writes++;
+        split->writes = sparse->writes;
+        split->alone = !sparse->writing;
+        sparse->writing++;
+    }
+    
+    pthread_mutex_unlock(&sparse->lock);
+    
+    if (!count) {
+        free(split);
+        io->error = 0;
+        io->done(io);
+        return 1;
+    }
+    
+    split->parent       = io;
+    split->sparse       = sparse;
+    split->lower        = batch->lower;
+    split->remaining    = (uint32_t) count;
+    split->error        = 0;
+    split->count        = (unsigned) count;
+    
+    for (i = 0; i < count; ++i) {
+        struct LoopEngineIO* piece = &split->pieces[i];
+    
+        // Punched runs keep their zeroes in buffer in case they have to be written after all
+        memset(piece, 0, sizeof(*piece));
+        piece->op       = plan[i].op;
+        piece->flags    = io->flags;
+        piece->buffer   = (uint8_t*) io->buffer + (plan[i].start - io->offset);
+        piece->nbytes   = plan[i].end - plan[i].start;
+        piece->offset   = plan[i].start;
+        piece->done     = pieceDone;
+        piece->priv     = split;
+    }
+    
+    // Pieces may complete and free split before we are done with it
+    struct LoopEngineIO* first = split->pieces;
+    for (i = 0; i < count; ++i) {
+        batchAdd(batch, &first[i]);
+    }
+    
+    return 1;
+}
+
+
+// Called by lower engine once write or discard is done, on any thread
+static void updateDone(struct LoopEngineIO* io)
+{
+    struct SparseUpdate* update = (struct SparseUpdate*) io->priv;
+    struct Sparse* sparse = update->sparse;
+    struct LoopEngineIO* parent = update->parent;
+    
+    pthread_mutex_lock(&sparse->lock);
+    
+    if (io->op == kLoopEngineOp_Write) {
+        sparse->writing--;
+    } else if (!io->error && update->alone && !sparse->writing && (update->writes == sparse->writes) &&
+               (sparse->state == kSparseMap_Valid)) {
+        // Partial blocks at the edges read back as zeroes but keep their blocks, leave them mapped
+        uint64_t start = (io->offset + sparse->granule - 1) & ~(sparse->granule - 1);
+        uint64_t end = (io->offset + io->nbytes) & ~(sparse->granule - 1);
+        if (start < end) {
+            removeRange(&sparse->map, start, end);
+        }
+    }
+    
+    pthread_mutex_unlock(&sparse->lock);
+    
+    parent->error = io->error;
+    free(update);
+    parent->done(parent);
+}
+
+
+static void sparseUpdate(struct Sparse* sparse, struct LoopEngineIO* io, struct SparseBatch* batch)
+{
+    if ((io->op == kLoopEngineOp_Write) && sparseZeroWrite(sparse, io, batch)) {
+        return;
+    }
+    
+    struct SparseUpdate* update = (struct SparseUpdate*) malloc(sizeof(*update));
+    
+    pthread_mutex_lock(&sparse->lock);
+    
+    if (io->op == kLoopEngineOp_Write) {
+        sparse->writes++;
+        if (update) {
+            sparse->writing++;
+        } else {
+            // Scan could miss this write without hearing about its completion
+            sparse->state = kSparseMap_Off;
+            sparse->error = ENOMEM;
+        }
+    
+        mapWrite(sparse, io->offset, io->nbytes);
+    } else if (update) {
+        update->writes = sparse->writes;
+        update->alone = !sparse->writing;
+    }
+    
+    pthread_mutex_unlock(&sparse->lock);
+    
+    if (!update) {
+        batchAdd(batch, io);
+        return;
+    }
+    
+    update->io          = *io;
+    update->io.done     = updateDone;
+    update->io.priv     = update;
+    update->parent      = io;
+    update->sparse      = sparse;
+    
+    batchAdd(batch, &update->io);
+}
+
+
+static void sparseSubmit(struct LoopEngine* engine, struct LoopEngineIO** ios, unsigned count)
+{
+    struct Sparse* sparse = (struct Sparse*) engine->priv;
+    struct SparseBatch batch;
+    unsigned i;
+    
+    batch.lower = engine->lower;
+    batch.count = 0;
+    
+    for (i = 0; i < count; ++i) {
+        switch (ios[i]->op) {
+        case kLoopEngineOp_Read:
+            sparseRead(sparse, ios[i], &batch);
+            break;
+    
+        case kLoopEngineOp_Write:
+        case kLoopEngineOp_Discard:
+            sparseUpdate(sparse, ios[i], &batch);
+            break;
+    
+        default:
+            batchAdd(&batch, ios[i]);
+            break;
+        }
+    }
+    
+    if (batch.count) {
+        engine_submit(engine->lower, batch.ios, batch.count);
+    }
+}
+
+
+static int sparseRW(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    // Not reached through engine_rw, it goes through submit
+    return engine_rw(engine->lower, io);
+}
+
+
+static int sparseOpen(struct LoopEngine* engine)
+{
+    struct stat st;
+    
+    struct Sparse* sparse = (struct Sparse*) calloc(1, sizeof(*sparse));
+    if (!sparse) {
+        return ENOMEM;
+    }
+    
+    sparse->fd = open(engine->file, O_RDONLY);
+    if ((sparse->fd < 0) || (0 != fstat(sparse->fd, &st))) {
+        int error = errno;
+        if (sparse->fd >= 0) {
+            close(sparse->fd);
+        }
+        free(sparse);
+        return error;
+    }
+    
+    // Holes are reported in file system blocks
+    sparse->granule = (uint64_t) st.st_blksize;
+    if ((sparse->granule < 512) || (sparse->granule & (sparse->granule - 1))) {
+        sparse->granule = 512;
+    }
+    
+    sparse->size = engine->lower->size;
+    sparse->state = kSparseMap_Unknown;
+    pthread_mutex_init(&sparse->lock, NULL);
+    
+    engine->size = engine->lower->size;
+    engine->priv = sparse;
+    return 0;
+}
+
+
+static void sparseClose(struct LoopEngine* engine)
+{
+    struct Sparse* sparse = (struct Sparse*) engine->priv;
+    
+    if (sparse->state == kSparseMap_Off) {
+        printf("Hole map: not used, %s\n", strerror(sparse->error));
+    } else {
+        printf("Hole map: %u data extents, built %llu times, %llu reads zero filled, %llu reads around holes, %llu hole bytes not read\n",
+               sparse->map.count, (unsigned long long) sparse->builds, (unsigned long long) sparse->holeReads,
+               (unsigned long long) sparse->pieceReads, (unsigned long long) sparse->holeBytes);
+    }
+    
+    if (sparse->zeroWrites) {
+        printf("Zero writes: %llu writes with zero runs, %llu bytes left out over holes, %llu bytes punched%s\n",
+               (unsigned long long) sparse->zeroWrites, (unsigned long long) sparse->zeroSkipped,
+               (unsigned long long) sparse->zeroPunched, (sparse->noPunch ? ", file system cannot punch holes" : ""));
+    }
+    
+    pthread_mutex_destroy(&sparse->lock);
+    close(sparse->fd);
+    free(sparse->map.items);
+    free(sparse);
+}
+
+
+static int sparseRegisterMemory(struct LoopEngine* engine, void* base, uint64_t size)
+{
+    // Pieces point into original buffers
+    return engine_register_memory(engine->lower, base, size);
+}
+
+
+static const struct LoopEngineOps gSparseEngineOps = {
+    .name               = "sparse",
+    .open               = sparseOpen,
+    .close              = sparseClose,
+    .rw                 = sparseRW,
+    .submit             = sparseSubmit,
+    .register_memory    = sparseRegisterMemory,
+};
+
+
+struct LoopEngine* sparse_open(struct LoopEngine* lower)
+{
+    return engine_stack(&gSparseEngineOps, lower, 0, lower->depth, NULL);
+}
@@ -0,0 +1,35 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Sparse backing file engine.
+//
+//  Stacks on top of a backing store engine and keeps a map of data extents of the backing file, found with
+//  SEEK_DATA and SEEK_HOLE once the first read comes in. Reads entirely inside holes are zero filled without
+//  going to backing store at all, reads crossing holes only read the data extents and zero fill the rest.
+//
+//  Map never has to be exact, only cover all data in the file: writes add their range to it before they are
+//  passed down, discards take theirs out once they are done and no write raced them. Map is not built while
+//  writes are in flight, file would not show their blocks yet.
+//
+//  Writes are scanned for runs of zero blocks, see zero.h, like file system formatting and zero fills write.
+//  Zero runs over holes are not written at all, longer ones over data are punched instead of written.
+//
+//  Files too fragmented to map and file systems that cannot report holes are passed through as is.
+//
+
+#ifndef LOOP_SPARSE_H
+#define LOOP_SPARSE_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+/**
+ * Stack hole map on top of an engine.
+ * @param lower     Backing store engine, owned by sparse engine from now on.
+ * @return          Sparse engine or NULL with errno set, lower engine is left open on failure.
+ */
+struct LoopEngine* sparse_open(struct LoopEngine* lower);
+
+#endif
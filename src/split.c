@@ -0,0 +1,205 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "split.h"
+
+
+struct Split {
+    uint64_t                chunk;      // Chunk size
+    volatile uint64_t       splits;     // Ios that were split
+    volatile uint64_t       chunks;     // Chunks they were split into
+};
+
+
+// Original io and its chunks, allocated in one piece
+struct SplitIO {
+    struct LoopEngineIO*    parent;
+    volatile uint32_t       remaining;  // Chunks not completed yet
+    volatile int            error;      // First chunk error
+    unsigned                count;
+    struct LoopEngineIO     chunks[];
+};
+
+
+// Called by lower engine for every chunk, on any thread
+static void chunkDone(struct LoopEngineIO* io)
+{
+    struct SplitIO* split = (struct SplitIO*) io->priv;
+    
+    if (io->error) {
+        __sync_bool_compare_and_swap(&split->error, 0, io->error);
+    }
+    
+    if (0 != __sync_sub_and_fetch(&split->remaining, 1)) {
+        return;
+    }
+    
+    struct LoopEngineIO* parent = split->parent;
+    parent->error = split->error;
+    free(split);
+    parent->done(parent);
+}
+
+
+// Cut io into chunks
+// @return      New split io or NULL if io does not need splitting or there is no memory for it
+static struct SplitIO* splitIO(struct Split* state, struct LoopEngineIO* io)
+{
+    uint64_t chunk = state->chunk;
+    
+    // Only data ios, flushes have no range and discards are a single call whatever their size
+    if (((io->op != kLoopEngineOp_Read) && (io->op != kLoopEngineOp_Write)) || (io->nbytes <= chunk)) {
+        return NULL;
+    }
+    
+    uint64_t first = io->offset / chunk;
+    uint64_t last = (io->offset + io->nbytes - 1) / chunk;
+    unsigned count = (unsigned) (last - first + 1);
+    
+    struct SplitIO* split = (struct SplitIO*) malloc(sizeof(*split) + count * sizeof(struct LoopEngineIO));
+    if (!split) {
+        // Still correct, just not parallel
+        return NULL;
+    }
+    
+    split->parent       = io;
+    split->remaining    = count;
+    split->error        = 0;
+    split->count        = count;
+    
+    uint64_t offset = io->offset;
+    uint64_t end = io->offset + io->nbytes;
+    uint8_t* buffer = (uint8_t*) io->buffer;
+    unsigned i;
+    
+    for (i = 0; i < count; ++i) {
+        struct LoopEngineIO* child = &split->chunks[i];
+        uint64_t next = (offset / chunk + 1) * chunk;
+        if (next > end) {
+            next = end;
+        }
+        
+        memset(child, 0, sizeof(*child));
+        child->op       = io->op;
+        child->flags    = io->flags;
+        child->buffer   = buffer;
+        child->nbytes   = next - offset;
+        child->offset   = offset;
+        child->done     = chunkDone;
+        child->priv     = split;
+        
+        buffer += child->nbytes;
+        offset = next;
+    }
+    
+    __sync_add_and_fetch(&state->splits, 1);
+    __sync_add_and_fetch(&state->chunks, count);
+    
+    return split;
+}
+
+
+static void splitSubmit(struct LoopEngine* engine, struct LoopEngineIO** ios, unsigned count)
+{
+    struct Split* state = (struct Split*) engine->priv;
+    struct LoopEngineIO* batch[64];
+    unsigned nbatch = 0;
+    unsigned i, j;
+    
+    for (i = 0; i < count; ++i) {
+        struct SplitIO* split = splitIO(state, ios[i]);
+        
+        if (!split) {
+            if (nbatch == sizeof(batch) / sizeof(batch[0])) {
+                engine_submit(engine->lower, batch, nbatch);
+                nbatch = 0;
+            }
+            batch[nbatch++] = ios[i];
+            continue;
+        }
+        
+        // Chunks may complete and free split before we are done with it, take count first
+        unsigned nchunks = split->count;
+        struct LoopEngineIO* chunks = split->chunks;
+        
+        for (j = 0; j < nchunks; ++j) {
+            if (nbatch == sizeof(batch) / sizeof(batch[0])) {
+                engine_submit(engine->lower, batch, nbatch);
+                nbatch = 0;
+            }
+            batch[nbatch++] = &chunks[j];
+        }
+    }
+    
+    if (nbatch) {
+        engine_submit(engine->lower, batch, nbatch);
+    }
+}
+
+
+static int splitRW(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    // Not reached through engine_rw, it goes through submit
+    return engine_rw(engine->lower, io);
+}
+
+
+static int splitOpen(struct LoopEngine* engine)
+{
+    uint64_t chunk = *(uint64_t*) engine->priv;
+    
+    if (!chunk) {
+        return EINVAL;
+    }
+    
+    struct Split* state = (struct Split*) calloc(1, sizeof(*state));
+    if (!state) {
+        return ENOMEM;
+    }
+    
+    state->chunk = chunk;
+    
+    engine->size = engine->lower->size;
+    engine->priv = state;
+    return 0;
+}
+
+
+static void splitClose(struct LoopEngine* engine)
+{
+    struct Split* state = (struct Split*) engine->priv;
+    
+    printf("Request splitter: %llu requests split into %llu chunks of up to %llu bytes\n",
+           (unsigned long long) state->splits, (unsigned long long) state->chunks, (unsigned long long) state->chunk);
+    
+    free(state);
+}
+
+
+static int splitRegisterMemory(struct LoopEngine* engine, void* base, uint64_t size)
+{
+    // Chunks point into original buffers
+    return engine_register_memory(engine->lower, base, size);
+}
+
+
+static const struct LoopEngineOps gSplitEngineOps = {
+    .name               = "split",
+    .open               = splitOpen,
+    .close              = splitClose,
+    .rw                 = splitRW,
+    .submit             = splitSubmit,
+    .register_memory    = splitRegisterMemory,
+};
+
+
+struct LoopEngine* split_open(struct LoopEngine* lower, uint64_t chunk)
+{
+    return engine_stack(&gSplitEngineOps, lower, 0, lower->depth, &chunk);
+}
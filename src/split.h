@@ -0,0 +1,30 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Large request splitting engine.
+//
+//  Stacks on top of another engine and cuts reads and writes larger than chunk size into chunks aligned to
+//  chunk size in the backing store. All chunks are submitted to the lower engine at once so they run on
+//  as many workers or device queues as it has. Original io completes when its last chunk does, with
+//  the error of the first chunk that failed.
+//
+//  Flushes and small ios are passed through as is.
+//
+
+#ifndef LOOP_SPLIT_H
+#define LOOP_SPLIT_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+/**
+ * Stack request splitter on top of an engine.
+ * @param lower     Engine chunks are submitted to, owned by splitter from now on.
+ * @param chunk     Chunk size in bytes, multiple of device block size.
+ * @return          Splitter engine or NULL with errno set, lower engine is left open on failure.
+ */
+struct LoopEngine* split_open(struct LoopEngine* lower, uint64_t chunk);
+
+#endif
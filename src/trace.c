@@ -0,0 +1,227 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+
+enum {
+    kTraceWriteBatch        = 1024,         // Records written to file at once
+    kTraceIdleSleep         = 10 * 1000,    // Usec writer sleeps when ring is empty
+};
+
+
+// Ring slot. Sequence tells whose turn it is: producer of position pos owns it when seq == pos,
+// consumer of position pos owns it when seq == pos + 1.
+struct TraceSlot {
+    volatile uint64_t       seq;
+    struct LoopTraceRecord  record;
+};
+
+
+struct LoopTracer {
+    FILE*                   file;
+    uint64_t                start;          // Trace start time
+    struct TraceSlot*       slots;
+    uint64_t                mask;           // Ring depth - 1
+    volatile uint64_t       tail;           // Next position to produce, shared by producers
+    uint8_t                 pad[64];
+    uint64_t                head;           // Next position to consume, writer thread only
+    volatile uint64_t       dropped;        // Records lost because ring was full
+    uint64_t                written;        // Records written to file
+    int                     error;          // First file write error
+    pthread_t               writer;
+    volatile int            stop;
+    struct LoopTraceRecord  batch[kTraceWriteBatch];
+};
+
+
+void trace_record(struct LoopTracer* tracer, uint16_t op, uint16_t flags, uint64_t offset, uint32_t nbytes, int error,
+                  uint64_t start, uint64_t end)
+{
+    uint64_t pos = tracer->tail;
+    struct TraceSlot* slot;
+    
+    for (;;) {
+        slot = &tracer->slots[pos & tracer->mask];
+        int64_t diff = (int64_t) (slot->seq - pos);
+    
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&tracer->tail, pos, pos + 1)) {
+                break;
+            }
+            pos = tracer->tail;
+        } else if (diff < 0) {
+            // Writer has not consumed this slot from the previous lap yet
+            __sync_fetch_and_add(&tracer->dropped, 1);
+            return;
+        } else {
+            // Somebody else took this position
+            pos = tracer->tail;
+        }
+    }
+    
+    uint64_t latency = end - start;
+    
+    slot->record.time       = start - tracer->start;
+    slot->record.offset     = offset;
+    slot->record.nbytes     = nbytes;
+    slot->record.latency    = (latency > UINT32_MAX) ? UINT32_MAX : (uint32_t) latency;
+    slot->record.op         = op;
+    slot->record.flags      = flags;
+    slot->record.error      = error;
+    
+    __sync_synchronize();
+    slot->seq = pos + 1;
+}
+
+
+// Move up to a batch of records out of the ring
+// @return      Number of records taken
+static unsigned consume(struct LoopTracer* tracer)
+{
+    unsigned count = 0;
+    
+    while (count < kTraceWriteBatch) {
+        struct TraceSlot* slot = &tracer->slots[tracer->head & tracer->mask];
+        if (slot->seq != tracer->head + 1) {
+            break;
+        }
+    
+        __sync_synchronize();
+        tracer->batch[count++] = slot->record;
+        __sync_synchronize();
+    
+        // Hand slot over to producer of the next lap
+        slot->seq = tracer->head + tracer->mask + 1;
+        tracer->head++;
+    }
+    
+    return count;
+}
+
+
+static void writeBatch(struct LoopTracer* tracer, unsigned count)
+{
+    if (!count || tracer->error) {
+        return;
+    }
+    
+    if (count != fwrite(tracer->batch, sizeof(tracer->batch[0]), count, tracer->file)) {
+        tracer->error = errno ? errno : EIO;
+        fprintf(stderr, "Could not write trace: %s\n", strerror(tracer->error));
+        return;
+    }
+    
+    tracer->written += count;
+}
+
+
+static void* writerThread(void* arg)
+{
+    struct LoopTracer* tracer = (struct LoopTracer*) arg;
+    
+    while (!tracer->stop) {
+        unsigned count = consume(tracer);
+        writeBatch(tracer, count);
+    
+        if (count < kTraceWriteBatch) {
+            usleep(kTraceIdleSleep);
+        }
+    }
+    
+    return NULL;
+}
+
+
+struct LoopTracer* trace_open(const char* path, unsigned depth, uint32_t blockSize, uint64_t start)
+{
+    uint64_t i;
+    uint64_t ndepth = 1;
+    
+    while (ndepth < depth) {
+        ndepth <<= 1;
+    }
+    
+    struct LoopTracer* tracer = (struct LoopTracer*) calloc(1, sizeof(*tracer));
+    if (!tracer) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    tracer->slots = (struct TraceSlot*) calloc(ndepth, sizeof(*tracer->slots));
+    if (!tracer->slots) {
+        free(tracer);
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    for (i = 0; i < ndepth; ++i) {
+        tracer->slots[i].seq = i;
+    }
+    
+    tracer->mask    = ndepth - 1;
+    tracer->start   = start;
+    
+    tracer->file = fopen(path, "wb");
+    if (!tracer->file) {
+        int error = errno;
+        free(tracer->slots);
+        free(tracer);
+        errno = error;
+        return NULL;
+    }
+    
+    struct LoopTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic        = kLoopTraceMagic;
+    header.version      = kLoopTraceVersion;
+    header.recordSize   = sizeof(struct LoopTraceRecord);
+    header.blockSize    = blockSize;
+    
+    int error = 0;
+    if (1 != fwrite(&header, sizeof(header), 1, tracer->file)) {
+        error = errno ? errno : EIO;
+    } else if (pthread_create(&tracer->writer, NULL, writerThread, tracer)) {
+        error = EAGAIN;
+    }
+    
+    if (error) {
+        fclose(tracer->file);
+        free(tracer->slots);
+        free(tracer);
+        errno = error;
+        return NULL;
+    }
+    
+    return tracer;
+}
+
+
+void trace_close(struct LoopTracer* tracer)
+{
+    unsigned count;
+    
+    tracer->stop = 1;
+    pthread_join(tracer->writer, NULL);
+    
+    while (0 != (count = consume(tracer))) {
+        writeBatch(tracer, count);
+    }
+    
+    if (fclose(tracer->file) && !tracer->error) {
+        fprintf(stderr, "Could not write trace: %s\n", strerror(errno));
+    }
+    
+    printf("Trace: %llu records written, %llu dropped\n", (unsigned long long) tracer->written, (unsigned long long) tracer->dropped);
+    
+    free(tracer->slots);
+    free(tracer);
+}
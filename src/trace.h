@@ -0,0 +1,72 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Binary request trace.
+//
+//  Completed requests are recorded into a bounded lock-free ring from whatever thread completes them and
+//  a writer thread drains the ring into a trace file. Recording never blocks and never allocates, if writer
+//  falls behind records are dropped and counted instead of slowing io down.
+//
+//  Trace file is a LoopTraceHeader followed by LoopTraceRecords in completion order, both in host byte order.
+//  Records are only roughly ordered by submit time, readers that care have to sort them.
+//
+
+#ifndef LOOP_TRACE_H
+#define LOOP_TRACE_H
+
+#include <stdint.h>
+
+
+#define kLoopTraceMagic         0x31435254504f4f4cull       // "LOOPTRC1"
+
+enum {
+    kLoopTraceVersion       = 1,
+    kLoopTraceDefaultDepth  = 64 * 1024,    // Default ring depth in records
+};
+
+
+struct LoopTraceHeader {
+    uint64_t                magic;          // kLoopTraceMagic
+    uint32_t                version;        // kLoopTraceVersion
+    uint32_t                recordSize;     // sizeof(struct LoopTraceRecord)
+    uint32_t                blockSize;      // Device block size
+    uint32_t                reserved;
+};
+
+
+struct LoopTraceRecord {
+    uint64_t                time;           // Submit time in nsec since trace start
+    uint64_t                offset;         // Byte offset in backing store
+    uint32_t                nbytes;         // Request size
+    uint32_t                latency;        // Submit to complete nsec, saturated at UINT32_MAX
+    uint16_t                op;             // kLoopEngineOp_XXX
+    uint16_t                flags;          // kLoopIOFlag_XXX as sent by driver
+    int32_t                 error;          // 0 or errno
+};
+
+
+struct LoopTracer;
+
+
+/**
+ * Create trace file and start writer thread.
+ * @param depth     Ring depth in records, rounded up to a power of 2.
+ * @param start     Trace start time, record times are relative to it, see clock.h.
+ * @return          New tracer or NULL with errno set.
+ */
+struct LoopTracer* trace_open(const char* path, unsigned depth, uint32_t blockSize, uint64_t start);
+
+/**
+ * Record completed request. Lock-free, may be called from any thread.
+ * @param start     Submit time in clock.h units.
+ * @param end       Completion time in clock.h units.
+ */
+void trace_record(struct LoopTracer* tracer, uint16_t op, uint16_t flags, uint64_t offset, uint32_t nbytes, int error,
+                  uint64_t start, uint64_t end);
+
+/**
+ * Stop writer thread and flush everything recorded so far. No records may be added concurrently.
+ */
+void trace_close(struct LoopTracer* tracer);
+
+#endif
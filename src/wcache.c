@@ -0,0 +1,661 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "wcache.h"
+
+
+enum {
+    kWCachePageSize         = 4096,                                 // Cache unit
+    kWCacheSectorSize       = 512,                                  // Dirty tracking unit
+    kWCacheSectors          = kWCachePageSize / kWCacheSectorSize,  // Sectors in a page, fit into 8 bit mask
+    kWCacheBatchPages       = 256,                                  // Pages written back at once
+    kWCacheInterval         = 5,                                    // Seconds dirty data may stay in cache when idle
+};
+
+
+struct WCachePage {
+    uint64_t                index;      // Page number in backing store
+    uint8_t                 dirty;      // Sectors not written back yet
+    uint8_t                 valid;      // Sectors holding data, dirty or being written back
+    struct WCachePage*      next;       // Hash chain or free list
+    uint8_t*                data;
+};
+
+
+struct WCache {
+    pthread_mutex_t         lock;           // Protects pages, hash and counters
+    pthread_cond_t          spaceCond;      // Signaled when pages are freed
+    pthread_cond_t          flushCond;      // Wakes up flusher thread
+    pthread_rwlock_t        evictLock;      // Readers overlaying pages hold it shared, freeing pages takes it exclusive
+    pthread_mutex_t         writebackLock;  // Serializes writebacks so older data never lands after newer
+    
+    uint8_t*                memory;         // Page data
+    struct WCachePage*      pages;
+    uint32_t                npages;
+    struct WCachePage*      freeList;
+    uint32_t                nfree;
+    struct WCachePage**     buckets;        // Page hash, npages buckets
+    uint32_t                ndirty;         // Pages with dirty sectors
+    uint32_t                highWater;      // Flusher kicks in at this many dirty pages
+    int                     error;          // Last writeback error, reported by next flush
+    
+    struct WCachePage**     batch;          // Writeback scratch, npages entries
+    uint8_t*                staging;        // Writeback data copy, kWCacheBatchPages pages
+    uint8_t                 masks[kWCacheBatchPages];
+    
+    pthread_t               flusher;
+    int                     stop;
+    
+    uint64_t                writes;         // Writes absorbed
+    uint64_t                writebacks;     // Writes issued to backing store
+    uint64_t                writebackBytes; // Bytes written back
+    uint64_t                flushes;        // Flush requests
+    uint64_t                discards;       // Discard requests
+    uint64_t                discardedBytes; // Dirty bytes dropped by discards instead of being written back
+};
+
+
+static struct WCachePage* lookupPage(struct WCache* cache, uint64_t index)
+{
+    struct WCachePage* page = cache->buckets[index % cache->npages];
+    while (page && page->index != index) {
+        page = page->next;
+    }
+    
+    return page;
+}
+
+
+static void removePage(struct WCache* cache, struct WCachePage* page)
+{
+    struct WCachePage** link = &cache->buckets[page->index % cache->npages];
+    while (*link != page) {
+        link = &(*link)->next;
+    }
+    
+    *link = page->next;
+    
+    page->valid = 0;
+    page->next = cache->freeList;
+    cache->freeList = page;
+    cache->nfree++;
+}
+
+
+static int comparePages(const void* a, const void* b)
+{
+    uint64_t ia = (*(struct WCachePage* const*) a)->index;
+    uint64_t ib = (*(struct WCachePage* const*) b)->index;
+    return (ia < ib) ? -1 : (ia > ib);
+}
+
+
+static int writeRun(struct LoopEngine* engine, struct WCache* cache, uint64_t offset, uint8_t* data, uint64_t nbytes)
+{
+    struct LoopEngineIO io;
+    
+    memset(&io, 0, sizeof(io));
+    io.op       = kLoopEngineOp_Write;
+    io.buffer   = data;
+    io.nbytes   = nbytes;
+    io.offset   = offset;
+    
+    int error = engine_rw(engine->lower, &io);
+    if (!error) {
+        cache->writebacks++;
+        cache->writebackBytes += nbytes;
+    }
+    
+    return error;
+}
+
+
+// Write out dirty sectors of staged pages, adjacent sectors go out as a single write
+static int writeStaged(struct LoopEngine* engine, struct WCache* cache, struct WCachePage** batch, uint32_t count)
+{
+    uint64_t start = 0;
+    uint64_t nbytes = 0;
+    uint8_t* data = NULL;
+    uint32_t i, s;
+    int error;
+    
+    for (i = 0; i < count; ++i) {
+        for (s = 0; s < kWCacheSectors; ++s) {
+            if (!(cache->masks[i] & (1 << s))) {
+                continue;
+            }
+    
+            uint64_t offset = batch[i]->index * kWCachePageSize + s * kWCacheSectorSize;
+            uint8_t* p = cache->staging + i * kWCachePageSize + s * kWCacheSectorSize;
+    
+            if (nbytes && (start + nbytes == offset) && (data + nbytes == p)) {
+                nbytes += kWCacheSectorSize;
+                continue;
+            }
+    
+            if (nbytes && (0 != (error = writeRun(engine, cache, start, data, nbytes)))) {
+                return error;
+            }
+    
+            start = offset;
+            data = p;
+            nbytes = kWCacheSectorSize;
+        }
+    }
+    
+    return nbytes ? writeRun(engine, cache, start, data, nbytes) : 0;
+}
+
+
+/**
+ * Write back dirty pages in [first, last] page range.
+ * Only data dirty at the time of the call is guaranteed to be written back.
+ */
+static int writeback(struct LoopEngine* engine, uint64_t first, uint64_t last)
+{
+    struct WCache* cache = (struct WCache*) engine->priv;
+    uint32_t count = 0;
+    uint32_t done, i;
+    uint64_t index;
+    int error = 0;
+    
+    pthread_mutex_lock(&cache->writebackLock);
+    pthread_mutex_lock(&cache->lock);
+    
+    if (last - first < cache->npages) {
+        for (index = first; index <= last; ++index) {
+            struct WCachePage* page = lookupPage(cache, index);
+            if (page && page->dirty) {
+                cache->batch[count++] = page;
+            }
+        }
+    } else {
+        for (i = 0; i < cache->npages; ++i) {
+            struct WCachePage* page = &cache->pages[i];
+            if (page->dirty && (page->index >= first) && (page->index <= last)) {
+                cache->batch[count++] = page;
+            }
+        }
+    
+        qsort(cache->batch, count, sizeof(*cache->batch), comparePages);
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    
+    // Pages can only be freed by writeback, so batch stays valid while we hold writeback lock
+    for (done = 0; done < count; ) {
+        uint32_t n = count - done;
+        if (n > kWCacheBatchPages) {
+            n = kWCacheBatchPages;
+        }
+    
+        struct WCachePage** batch = cache->batch + done;
+    
+        // Take a stable copy, writers are free to dirty pages again while we write
+        pthread_mutex_lock(&cache->lock);
+        for (i = 0; i < n; ++i) {
+            memcpy(cache->staging + i * kWCachePageSize, batch[i]->data, kWCachePageSize);
+            cache->masks[i] = batch[i]->dirty;
+            if (batch[i]->dirty) {
+                batch[i]->dirty = 0;
+                cache->ndirty--;
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+    
+        error = writeStaged(engine, cache, batch, n);
+    
+        if (error) {
+            // Put dirty state back so data is retried later
+            pthread_mutex_lock(&cache->lock);
+            for (i = 0; i < n; ++i) {
+                if (cache->masks[i]) {
+                    if (!batch[i]->dirty) {
+                        cache->ndirty++;
+                    }
+                    batch[i]->dirty |= cache->masks[i];
+                }
+            }
+            cache->error = error;
+            pthread_mutex_unlock(&cache->lock);
+            break;
+        }
+    
+        // Free pages nobody dirtied again, readers must not be looking at them
+        pthread_rwlock_wrlock(&cache->evictLock);
+        pthread_mutex_lock(&cache->lock);
+        for (i = 0; i < n; ++i) {
+            if (!batch[i]->dirty) {
+                removePage(cache, batch[i]);
+            }
+        }
+        pthread_cond_broadcast(&cache->spaceCond);
+        pthread_mutex_unlock(&cache->lock);
+        pthread_rwlock_unlock(&cache->evictLock);
+    
+        done += n;
+    }
+    
+    pthread_mutex_unlock(&cache->writebackLock);
+    return error;
+}
+
+
+static void* flusherThread(void* arg)
+{
+    struct LoopEngine* engine = (struct LoopEngine*) arg;
+    struct WCache* cache = (struct WCache*) engine->priv;
+    
+    pthread_mutex_lock(&cache->lock);
+    
+    while (!cache->stop) {
+        struct timeval now;
+        struct timespec deadline;
+    
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec + kWCacheInterval;
+        deadline.tv_nsec = now.tv_usec * 1000;
+    
+        int rc = 0;
+        while (!cache->stop && (cache->ndirty < cache->highWater) && (rc != ETIMEDOUT)) {
+            rc = pthread_cond_timedwait(&cache->flushCond, &cache->lock, &deadline);
+        }
+    
+        if (cache->stop || !cache->ndirty) {
+            continue;
+        }
+    
+        pthread_mutex_unlock(&cache->lock);
+    
+        int error = writeback(engine, 0, UINT64_MAX);
+        if (error) {
+            fprintf(stderr, "Write cache writeback failed: %s\n", strerror(error));
+        }
+    
+        pthread_mutex_lock(&cache->lock);
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+
+static int cacheWrite(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    struct WCache* cache = (struct WCache*) engine->priv;
+    const uint8_t* data = (const uint8_t*) io->buffer;
+    uint64_t offset = io->offset;
+    uint64_t nbytes = io->nbytes;
+    
+    if ((offset % kWCacheSectorSize) || (nbytes % kWCacheSectorSize)) {
+        return EINVAL;
+    }
+    
+    while (nbytes) {
+        uint64_t index = offset / kWCachePageSize;
+        uint32_t pageOffset = (uint32_t) (offset % kWCachePageSize);
+        uint32_t chunk = kWCachePageSize - pageOffset;
+        if (chunk > nbytes) {
+            chunk = (uint32_t) nbytes;
+        }
+    
+        uint8_t mask = (uint8_t) (((1 << (chunk / kWCacheSectorSize)) - 1) << (pageOffset / kWCacheSectorSize));
+    
+        pthread_mutex_lock(&cache->lock);
+    
+        struct WCachePage* page = lookupPage(cache, index);
+        while (!page) {
+            if (cache->freeList) {
+                page = cache->freeList;
+                cache->freeList = page->next;
+                cache->nfree--;
+    
+                page->index = index;
+                page->dirty = 0;
+                page->valid = 0;
+                page->next = cache->buckets[index % cache->npages];
+                cache->buckets[index % cache->npages] = page;
+                break;
+            }
+    
+            if (cache->error) {
+                // Writeback is failing, cache will not drain
+                int error = cache->error;
+                pthread_mutex_unlock(&cache->lock);
+                return error;
+            }
+    
+            // Cache is full of dirty data, wait for flusher to make room
+            pthread_cond_signal(&cache->flushCond);
+            pthread_cond_wait(&cache->spaceCond, &cache->lock);
+    
+            // Somebody else may have cached this page meanwhile
+            page = lookupPage(cache, index);
+        }
+    
+        memcpy(page->data + pageOffset, data, chunk);
+        page->valid |= mask;
+        if (!page->dirty) {
+            cache->ndirty++;
+        }
+        page->dirty |= mask;
+    
+        if (cache->ndirty >= cache->highWater) {
+            pthread_cond_signal(&cache->flushCond);
+        }
+    
+        pthread_mutex_unlock(&cache->lock);
+    
+        data += chunk;
+        offset += chunk;
+        nbytes -= chunk;
+    }
+    
+    pthread_mutex_lock(&cache->lock);
+    cache->writes++;
+    pthread_mutex_unlock(&cache->lock);
+    
+    if (io->flags & kLoopEngineIOFlag_WriteThrough) {
+        return writeback(engine, io->offset / kWCachePageSize, (io->offset + io->nbytes - 1) / kWCachePageSize);
+    }
+    
+    return 0;
+}
+
+
+static int cacheRead(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    struct WCache* cache = (struct WCache*) engine->priv;
+    uint8_t* data = (uint8_t*) io->buffer;
+    uint64_t offset = io->offset;
+    uint64_t nbytes = io->nbytes;
+    
+    // Pages we overlay must not be freed until we are done, otherwise we could miss data being written back
+    pthread_rwlock_rdlock(&cache->evictLock);
+    
+    int error = engine_rw(engine->lower, io);
+    if (error) {
+        pthread_rwlock_unlock(&cache->evictLock);
+        return error;
+    }
+    
+    pthread_mutex_lock(&cache->lock);
+    
+    while (nbytes && (cache->nfree < cache->npages)) {
+        uint64_t index = offset / kWCachePageSize;
+        uint32_t pageOffset = (uint32_t) (offset % kWCachePageSize);
+        uint32_t chunk = kWCachePageSize - pageOffset;
+        if (chunk > nbytes) {
+            chunk = (uint32_t) nbytes;
+        }
+    
+        struct WCachePage* page = lookupPage(cache, index);
+        if (page && page->valid) {
+            uint32_t s;
+            for (s = pageOffset / kWCacheSectorSize; s < (pageOffset + chunk) / kWCacheSectorSize; ++s) {
+                if (page->valid & (1 << s)) {
+                    memcpy(data + s * kWCacheSectorSize - pageOffset, page->data + s * kWCacheSectorSize, kWCacheSectorSize);
+                }
+            }
+        }
+    
+        data += chunk;
+        offset += chunk;
+        nbytes -= chunk;
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    pthread_rwlock_unlock(&cache->evictLock);
+    return 0;
+}
+
+
+static int cacheFlush(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    struct WCache* cache = (struct WCache*) engine->priv;
+    
+    pthread_mutex_lock(&cache->lock);
+    cache->flushes++;
+    cache->error = 0;
+    pthread_mutex_unlock(&cache->lock);
+    
+    // Backing store flush is only meaningful once everything we hold made it there
+    int error = writeback(engine, 0, UINT64_MAX);
+    if (error) {
+        return error;
+    }
+    
+    return engine_rw(engine->lower, io);
+}
+
+
+// Sectors of a page covered by byte range, partial sectors are left alone
+static uint8_t sectorMask(uint64_t index, uint64_t offset, uint64_t end)
+{
+    uint64_t pageStart = index * kWCachePageSize;
+    uint64_t start = (offset > pageStart) ? offset - pageStart : 0;
+    uint64_t stop = (end < pageStart + kWCachePageSize) ? end - pageStart : kWCachePageSize;
+    uint32_t first = (uint32_t) ((start + kWCacheSectorSize - 1) / kWCacheSectorSize);
+    uint32_t last = (uint32_t) (stop / kWCacheSectorSize);
+    
+    return (first < last) ? (uint8_t) (((1 << (last - first)) - 1) << first) : 0;
+}
+
+
+static void discardPage(struct WCache* cache, struct WCachePage* page, uint8_t mask)
+{
+    uint8_t dropped = page->dirty & mask;
+    
+    if (dropped) {
+        page->dirty &= ~mask;
+        if (!page->dirty) {
+            cache->ndirty--;
+        }
+        cache->discardedBytes += __builtin_popcount(dropped) * kWCacheSectorSize;
+    }
+    
+    page->valid &= ~mask;
+    if (!page->valid) {
+        removePage(cache, page);
+    }
+}
+
+
+static int cacheDiscard(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    struct WCache* cache = (struct WCache*) engine->priv;
+    uint64_t end = io->offset + io->nbytes;
+    uint64_t first = io->offset / kWCachePageSize;
+    uint64_t last = end / kWCachePageSize;
+    uint64_t index;
+    uint32_t i;
+    
+    // Dirty data in range must neither land over the hole later nor be read back.
+    // Holding writeback lock keeps copies already staged for writeback from landing after the discard.
+    pthread_mutex_lock(&cache->writebackLock);
+    pthread_rwlock_wrlock(&cache->evictLock);
+    pthread_mutex_lock(&cache->lock);
+    
+    cache->discards++;
+    
+    if (last - first < cache->npages) {
+        for (index = first; index <= last; ++index) {
+            struct WCachePage* page = lookupPage(cache, index);
+            uint8_t mask = sectorMask(index, io->offset, end);
+            if (page && mask) {
+                discardPage(cache, page, mask);
+            }
+        }
+    } else {
+        for (i = 0; i < cache->npages; ++i) {
+            struct WCachePage* page = &cache->pages[i];
+            if (page->valid && (page->index >= first) && (page->index <= last)) {
+                uint8_t mask = sectorMask(page->index, io->offset, end);
+                if (mask) {
+                    discardPage(cache, page, mask);
+                }
+            }
+        }
+    }
+    
+    pthread_cond_broadcast(&cache->spaceCond);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_rwlock_unlock(&cache->evictLock);
+    
+    int error = engine_rw(engine->lower, io);
+    
+    pthread_mutex_unlock(&cache->writebackLock);
+    return error;
+}
+
+
+static int cacheRW(struct LoopEngine* engine, struct LoopEngineIO* io)
+{
+    switch (io->op) {
+    case kLoopEngineOp_Read:
+        return cacheRead(engine, io);
+    
+    case kLoopEngineOp_Write:
+        return cacheWrite(engine, io);
+    
+    case kLoopEngineOp_Flush:
+        return cacheFlush(engine, io);
+    
+    case kLoopEngineOp_Discard:
+        return cacheDiscard(engine, io);
+    
+    default:
+        return EINVAL;
+    }
+}
+
+
+static void cacheFree(struct WCache* cache)
+{
+    free(cache->staging);
+    free(cache->batch);
+    free(cache->buckets);
+    free(cache->pages);
+    free(cache->memory);
+    free(cache);
+}
+
+
+static int cacheOpen(struct LoopEngine* engine)
+{
+    uint64_t limit = *(uint64_t*) engine->priv;
+    uint32_t i;
+    
+    struct WCache* cache = (struct WCache*) calloc(1, sizeof(*cache));
+    if (!cache) {
+        return ENOMEM;
+    }
+    
+    if (limit < kWCacheBatchPages * kWCachePageSize) {
+        limit = kWCacheBatchPages * kWCachePageSize;
+    }
+    
+    cache->npages   = (uint32_t) (limit / kWCachePageSize);
+    cache->highWater = cache->npages / 2;
+    cache->pages    = (struct WCachePage*) calloc(cache->npages, sizeof(*cache->pages));
+    cache->buckets  = (struct WCachePage**) calloc(cache->npages, sizeof(*cache->buckets));
+    cache->batch    = (struct WCachePage**) calloc(cache->npages, sizeof(*cache->batch));
+    
+    // Page aligned so that write back can go straight to a direct io backing file
+    int aligned = !posix_memalign((void**) &cache->memory, kWCachePageSize, (size_t) cache->npages * kWCachePageSize) &&
+                  !posix_memalign((void**) &cache->staging, kWCachePageSize, kWCacheBatchPages * kWCachePageSize);
+    
+    if (!aligned || !cache->pages || !cache->buckets || !cache->batch) {
+        cacheFree(cache);
+        return ENOMEM;
+    }
+    
+    for (i = 0; i < cache->npages; ++i) {
+        cache->pages[i].data = cache->memory + (size_t) i * kWCachePageSize;
+        cache->pages[i].next = cache->freeList;
+        cache->freeList = &cache->pages[i];
+    }
+    cache->nfree = cache->npages;
+    
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->spaceCond, NULL);
+    pthread_cond_init(&cache->flushCond, NULL);
+    pthread_rwlock_init(&cache->evictLock, NULL);
+    pthread_mutex_init(&cache->writebackLock, NULL);
+    
+    engine->size = engine->lower->size;
+    engine->priv = cache;
+    
+    if (pthread_create(&cache->flusher, NULL, flusherThread, engine)) {
+        cacheFree(cache);
+        return EAGAIN;
+    }
+    
+    return 0;
+}
+
+
+static void cacheClose(struct LoopEngine* engine)
+{
+    struct WCache* cache = (struct WCache*) engine->priv;
+    
+    pthread_mutex_lock(&cache->lock);
+    cache->stop = 1;
+    pthread_cond_signal(&cache->flushCond);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_join(cache->flusher, NULL);
+    
+    int error = writeback(engine, 0, UINT64_MAX);
+    if (error) {
+        fprintf(stderr, "Could not write back cached data: %s\n", strerror(error));
+    }
+    
+    printf("Write cache: %llu writes absorbed, %llu bytes written back in %llu writes, %llu flushes, "
+           "%llu discards dropped %llu dirty bytes\n",
+           (unsigned long long) cache->writes, (unsigned long long) cache->writebackBytes,
+           (unsigned long long) cache->writebacks, (unsigned long long) cache->flushes,
+           (unsigned long long) cache->discards, (unsigned long long) cache->discardedBytes);
+    
+    pthread_mutex_destroy(&cache->writebackLock);
+    pthread_rwlock_destroy(&cache->evictLock);
+    pthread_cond_destroy(&cache->flushCond);
+    pthread_cond_destroy(&cache->spaceCond);
+    pthread_mutex_destroy(&cache->lock);
+    cacheFree(cache);
+}
+
+
+static int cacheRegisterMemory(struct LoopEngine* engine, void* base, uint64_t size)
+{
+    // Reads go straight into request buffers
+    return engine_register_memory(engine->lower, base, size);
+}
+
+
+static const struct LoopEngineOps gWriteCacheEngineOps = {
+    .name               = "wcache",
+    .open               = cacheOpen,
+    .close              = cacheClose,
+    .rw                 = cacheRW,
+    .register_memory    = cacheRegisterMemory,
+};
+
+
+struct LoopEngine* wcache_open(struct LoopEngine* lower, uint64_t limit, unsigned nthreads, unsigned depth)
+{
+    return engine_stack(&gWriteCacheEngineOps, lower, nthreads, depth, &limit);
+}
+
+
+struct LoopEngine* wcache_open_shared(struct LoopEngine* lower, uint64_t limit, struct LoopWorkQueue* workers, unsigned depth)
+{
+    return engine_stack_shared(&gWriteCacheEngineOps, lower, workers, depth, &limit);
+}
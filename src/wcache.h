@@ -0,0 +1,37 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Write-back cache engine.
+//
+//  Stacks on top of a backing store engine and absorbs writes in memory in page sized units, coalescing
+//  overwrites of the same data. Dirty pages are written back in block order with adjacent pages merged
+//  into single writes once dirty limit is approached, periodically, on flush and on close.
+//  Reads go to backing store and get dirty data overlaid on top.
+//
+//  Writes flagged with kLoopEngineIOFlag_WriteThrough are written back before they complete.
+//  Flush writes back all dirty data and only then flushes backing store.
+//
+
+#ifndef LOOP_WCACHE_H
+#define LOOP_WCACHE_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+/**
+ * Stack write-back cache on top of an engine.
+ * @param lower     Backing store engine, owned by cache from now on.
+ * @param limit     Max dirty data in bytes.
+ * @return          Cache engine or NULL with errno set, lower engine is left open on failure.
+ */
+struct LoopEngine* wcache_open(struct LoopEngine* lower, uint64_t limit, unsigned nthreads, unsigned depth);
+
+/**
+ * Same as wcache_open, running requests on a worker pool shared with other engines.
+ * Lower engine must have workers of its own, cache waits for its ios synchronously.
+ */
+struct LoopEngine* wcache_open_shared(struct LoopEngine* lower, uint64_t limit, struct LoopWorkQueue* workers, unsigned depth);
+
+#endif
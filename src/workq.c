@@ -0,0 +1,164 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "workq.h"
+
+
+struct LoopWorkQueue {
+    pthread_mutex_t     lock;
+    pthread_cond_t      notEmpty;
+    pthread_cond_t      notFull;
+    uint8_t*            items;          // depth * itemSize bytes circular buffer
+    size_t              itemSize;
+    unsigned            depth;
+    unsigned            head;           // Index of the oldest queued item
+    unsigned            count;          // Number of queued items
+    int                 stopping;
+    workq_fn            fn;
+    void*               arg;
+    unsigned            nthreads;
+    pthread_t*          threads;
+};
+
+
+static void* workerThread(void* arg)
+{
+    struct LoopWorkQueue* wq = (struct LoopWorkQueue*) arg;
+    void* item = malloc(wq->itemSize);
+    if (!item) {
+        abort();
+    }
+    
+    pthread_mutex_lock(&wq->lock);
+    
+    for (;;) {
+        while (!wq->count && !wq->stopping) {
+            pthread_cond_wait(&wq->notEmpty, &wq->lock);
+        }
+        
+        if (!wq->count) {
+            // Stopping and nothing left to do
+            break;
+        }
+        
+        memcpy(item, wq->items + (size_t) wq->head * wq->itemSize, wq->itemSize);
+        wq->head = (wq->head + 1) % wq->depth;
+        wq->count--;
+        
+        pthread_cond_signal(&wq->notFull);
+        pthread_mutex_unlock(&wq->lock);
+        
+        wq->fn(item, wq->arg);
+        
+        pthread_mutex_lock(&wq->lock);
+    }
+    
+    pthread_mutex_unlock(&wq->lock);
+    free(item);
+    return NULL;
+}
+
+
+struct LoopWorkQueue* workq_create(unsigned nthreads, unsigned depth, size_t itemSize, workq_fn fn, void* arg)
+{
+    unsigned i;
+    
+    if (!nthreads || !depth || !itemSize || !fn) {
+        return NULL;
+    }
+    
+    struct LoopWorkQueue* wq = (struct LoopWorkQueue*) calloc(1, sizeof(*wq));
+    if (!wq) {
+        return NULL;
+    }
+    
+    wq->items   = (uint8_t*) malloc((size_t) depth * itemSize);
+    wq->threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+    if (!wq->items || !wq->threads) {
+        free(wq->items);
+        free(wq->threads);
+        free(wq);
+        return NULL;
+    }
+    
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->notEmpty, NULL);
+    pthread_cond_init(&wq->notFull, NULL);
+    
+    wq->itemSize    = itemSize;
+    wq->depth       = depth;
+    wq->fn          = fn;
+    wq->arg         = arg;
+    
+    for (i = 0; i < nthreads; ++i) {
+        if (0 != pthread_create(&wq->threads[i], NULL, workerThread, wq)) {
+            break;
+        }
+        wq->nthreads++;
+    }
+    
+    if (wq->nthreads != nthreads) {
+        workq_destroy(wq);
+        return NULL;
+    }
+    
+    return wq;
+}
+
+
+int workq_submit(struct LoopWorkQueue* wq, const void* item)
+{
+    pthread_mutex_lock(&wq->lock);
+    
+    while ((wq->count == wq->depth) && !wq->stopping) {
+        pthread_cond_wait(&wq->notFull, &wq->lock);
+    }
+    
+    if (wq->stopping) {
+        pthread_mutex_unlock(&wq->lock);
+        return -1;
+    }
+    
+    memcpy(wq->items + (size_t) ((wq->head + wq->count) % wq->depth) * wq->itemSize, item, wq->itemSize);
+    wq->count++;
+    
+    pthread_cond_signal(&wq->notEmpty);
+    pthread_mutex_unlock(&wq->lock);
+    return 0;
+}
+
+
+void workq_destroy(struct LoopWorkQueue* wq)
+{
+    unsigned i;
+    
+    pthread_mutex_lock(&wq->lock);
+    wq->stopping = 1;
+    pthread_cond_broadcast(&wq->notEmpty);
+    pthread_cond_broadcast(&wq->notFull);
+    pthread_mutex_unlock(&wq->lock);
+    
+    for (i = 0; i < wq->nthreads; ++i) {
+        pthread_join(wq->threads[i], NULL);
+    }
+    
+    pthread_cond_destroy(&wq->notFull);
+    pthread_cond_destroy(&wq->notEmpty);
+    pthread_mutex_destroy(&wq->lock);
+    
+    free(wq->threads);
+    free(wq->items);
+    free(wq);
+}
+
+
+unsigned workq_threads(const struct LoopWorkQueue* wq)
+{
+    return wq->nthreads;
+}
@@ -0,0 +1,49 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  Bounded multi-threaded work queue used by the helper to process requests concurrently.
+//  Work items are fixed size and copied into the queue so submitting does not allocate.
+//
+
+#ifndef LOOP_WORKQ_H
+#define LOOP_WORKQ_H
+
+#include <stddef.h>
+
+
+struct LoopWorkQueue;
+
+/**
+ * Work item handler, called on one of the queue threads.
+ * @param item      Private copy of the submitted item, valid only for the duration of the call.
+ * @param arg       Queue argument as passed to workq_create.
+ */
+typedef void (*workq_fn)(void* item, void* arg);
+
+
+/**
+ * Create work queue and start its threads.
+ * @param nthreads  Number of worker threads.
+ * @param depth     Max number of queued items, submitters block when queue is full.
+ * @param itemSize  Size of a single work item in bytes.
+ * @return          New work queue or NULL on failure.
+ */
+struct LoopWorkQueue* workq_create(unsigned nthreads, unsigned depth, size_t itemSize, workq_fn fn, void* arg);
+
+/**
+ * Queue a copy of the item, blocking while queue is full.
+ * @return          0 on success, -1 if queue is being destroyed.
+ */
+int workq_submit(struct LoopWorkQueue* wq, const void* item);
+
+/**
+ * Process everything that was already queued, stop and join worker threads and free the queue.
+ */
+void workq_destroy(struct LoopWorkQueue* wq);
+
+/**
+ * Number of worker threads.
+ */
+unsigned workq_threads(const struct LoopWorkQueue* wq);
+
+#endif
@@ -0,0 +1,128 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+
+#include <string.h>
+
+#include "zero.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOOP_ZERO_X86 1
+#endif
+
+
+static int scalarCheck(const void* buffer, uint64_t nbytes)
+{
+    const uint8_t* p = (const uint8_t*) buffer;
+    uint64_t w[4];
+    
+    // Words are loaded with memcpy, compilers turn it into plain unaligned loads
+    while (nbytes >= sizeof(w)) {
+        memcpy(w, p, sizeof(w));
+        if (w[0] | w[1] | w[2] | w[3]) {
+            return 0;
+        }
+        p += sizeof(w);
+        nbytes -= sizeof(w);
+    }
+    
+    while (nbytes--) {
+        if (*p++) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+
+#ifdef LOOP_ZERO_X86
+__attribute__((target("sse2")))
+static int sse2Check(const void* buffer, uint64_t nbytes)
+{
+    const uint8_t* p = (const uint8_t*) buffer;
+    const __m128i zero = _mm_setzero_si128();
+    
+    while (nbytes >= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*) p);
+        __m128i b = _mm_loadu_si128((const __m128i*) (p + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*) (p + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*) (p + 48));
+        __m128i v = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) {
+            return 0;
+        }
+        p += 64;
+        nbytes -= 64;
+    }
+    
+    return scalarCheck(p, nbytes);
+}
+
+
+__attribute__((target("avx2")))
+static int avx2Check(const void* buffer, uint64_t nbytes)
+{
+    const uint8_t* p = (const uint8_t*) buffer;
+    
+    while (nbytes >= 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) p);
+        __m256i b = _mm256_loadu_si256((const __m256i*) (p + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*) (p + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*) (p + 96));
+        __m256i v = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(v, v)) {
+            return 0;
+        }
+        p += 128;
+        nbytes -= 128;
+    }
+    
+    return sse2Check(p, nbytes);
+}
+#endif
+
+
+static const struct LoopZeroKernel gZeroKernels[] = {
+    { "scalar", scalarCheck },
+#ifdef LOOP_ZERO_X86
+    { "sse2",   sse2Check },
+    { "avx2",   avx2Check },
+#endif
+};
+
+
+const struct LoopZeroKernel* zero_kernels(unsigned* count)
+{
+    unsigned n = 1;
+    
+#ifdef LOOP_ZERO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        n = 2;
+        if (__builtin_cpu_supports("avx2")) {
+            n = 3;
+        }
+    }
+#endif
+    
+    *count = n;
+    return gZeroKernels;
+}
+
+
+int zero_check(const void* buffer, uint64_t nbytes)
+{
+    // Same answer on every thread, racing to set it is harmless
+    static int (*volatile sCheck)(const void* buffer, uint64_t nbytes);
+    
+    int (*check)(const void*, uint64_t) = sCheck;
+    if (!check) {
+        unsigned count;
+        check = zero_kernels(&count)[count - 1].check;
+        sCheck = check;
+    }
+    
+    return check(buffer, nbytes);
+}
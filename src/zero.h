@@ -0,0 +1,34 @@
+//
+//  Copyright (c) 2012 ACME, Inc. All rights reserved.
+//
+//  All-zero buffer detection for write data.
+//
+//  Scan stops at the first nonzero byte, so ordinary data costs next to nothing and only zero blocks are read
+//  through. Vector kernels are picked by what the cpu supports: AVX2 or SSE2 on x86, plain 64-bit words elsewhere.
+//
+
+#ifndef LOOP_ZERO_H
+#define LOOP_ZERO_H
+
+#include <stdint.h>
+
+
+struct LoopZeroKernel {
+    const char*     name;
+    int             (*check)(const void* buffer, uint64_t nbytes);
+};
+
+
+/**
+ * Check if buffer is all zeroes, with the best kernel for this cpu.
+ * @return          Nonzero if every byte is zero.
+ */
+int zero_check(const void* buffer, uint64_t nbytes);
+
+/**
+ * Get kernels this cpu can run, slowest first. Last one is what zero_check uses.
+ * @param count     Set to number of kernels.
+ */
+const struct LoopZeroKernel* zero_kernels(unsigned* count);
+
+#endif